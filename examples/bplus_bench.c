@@ -0,0 +1,387 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include "bf.h"
+#include "bplus_file_funcs.h"
+#include "bplus_search.h"
+#include "record_generator.h"
+
+// Microbenchmarks behind the numbers quoted in the commit messages.
+//
+//   bp_bench [case]
+//
+// case is one of the names below, all of them if left out.
+//   kernels      search_upper_bound and search_lower_bound against the
+//                linear scans the index and leaf nodes used before, on a
+//                full 60-key index node and a 13-key leaf of a 512-byte page
+//   finds        allocations of steady-state inserts, find_into and
+//                find_view. The driver is linked with -Wl,--wrap=malloc
+//                (make bplus_bench_compile) so every malloc, calloc and
+//                realloc of the process is counted
+//   replacement  pages a hot set of lookups reads again after the whole
+//                file went through a 2 MB pool, for each replacement policy
+//   memtable     random inserts per second into a 4 KiB page file with a
+//                2 MB pool, without and with a 32 MB memtable
+//   append       blocks and inserts per second of ascending keys, which
+//                split the rightmost leaves asymmetrically and go to the
+//                rightmost leaf without a descent, next to shuffled keys
+//
+// Page reads come from bplus_stats_snapshot, so the driver is built with
+// -DBPLUS_STATS=1.
+
+#define BENCH_FILE "bench.db"
+
+static long allocations = 0;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t count, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+  allocations++;
+  return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t count, size_t size) {
+  allocations++;
+  return __real_calloc(count, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+  allocations++;
+  return __real_realloc(ptr, size);
+}
+
+static double now(void) {
+  struct timespec t;
+  clock_gettime(CLOCK_MONOTONIC, &t);
+  return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+// the index node search before the kernels, position of the child for key
+static int linear_child(const int *keys, int n, int key) {
+  int pos = 0;
+  while (pos < n && key >= keys[pos]) pos++;
+  return pos;
+}
+
+// the leaf search before the kernels, position to insert key at
+static int linear_insert_pos(const int *keys, int n, int key) {
+  int pos = 0;
+  while (pos < n && keys[pos] < key) pos++;
+  return pos;
+}
+
+typedef int (*search_fn)(const int *keys, int n, int key);
+
+// ns per search of probes random keys, summing the results so the calls
+// are not dropped
+static double time_search(search_fn search, const int *keys, int n, const int *probes, int count, long *sum) {
+  double start = now();
+  long total = 0;
+  for (int i = 0; i < count; i++) total += search(keys, n, probes[i]);
+  double ns = (now() - start) * 1e9 / count;
+  *sum = total;
+  return ns;
+}
+
+static int bench_kernels(int count) {
+  int *probes = malloc(count * sizeof(int));
+  if (probes == NULL) return 1;
+  unsigned int seed = 7919;
+  int bad = 0;
+  printf("kernel %s, %d random probes\n", search_kernel_name(), count);
+
+  const int sizes[] = {60, 13};
+  const char *names[] = {"60-key index node", "13-key leaf"};
+  const search_fn before[] = {linear_child, linear_insert_pos};
+  const search_fn after[] = {search_upper_bound, search_lower_bound};
+  for (int s = 0; s < 2; s++) {
+    int keys[64];
+    for (int i = 0; i < sizes[s]; i++) keys[i] = i * 10;
+    for (int i = 0; i < count; i++) probes[i] = rand_r(&seed) % (sizes[s] * 10 + 10) - 5;
+    long sum_before, sum_after;
+    double ns_before = time_search(before[s], keys, sizes[s], probes, count, &sum_before);
+    double ns_after = time_search(after[s], keys, sizes[s], probes, count, &sum_after);
+    // both must have found the same positions
+    if (sum_before != sum_after) bad++;
+    printf("  %-18s %6.1f ns -> %6.1f ns%s\n", names[s], ns_before, ns_after,
+           sum_before != sum_after ? "  MISMATCH" : "");
+  }
+  free(probes);
+  return bad;
+}
+
+static int bench_finds(int records) {
+  const TableSchema schema = employee_get_schema();
+  remove(BENCH_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file(&schema, BENCH_FILE) != 0 || bplus_open_file(BENCH_FILE, &file_desc, &info) != 0) {
+    fprintf(stderr, "FAIL: cannot create %s\n", BENCH_FILE);
+    return 1;
+  }
+  Record record;
+  // the first half grows the tree and the handle pool, the second half is
+  // the steady state that is counted
+  for (int i = 0; i < records / 2; i++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = i * 2;
+    bplus_record_insert(file_desc, info, &record);
+  }
+  long before = allocations;
+  for (int i = records / 2; i < records; i++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = i * 2;
+    bplus_record_insert(file_desc, info, &record);
+  }
+  long inserts = allocations - before;
+
+  int bad = 0;
+  before = allocations;
+  double start = now();
+  for (int i = 0; i < records; i++) {
+    if (bplus_record_find_into(file_desc, info, i * 2, &record) != 0) bad++;
+  }
+  double find_ns = (now() - start) * 1e9 / records;
+  long finds = allocations - before;
+
+  BPlusRecordView view;
+  before = allocations;
+  start = now();
+  for (int i = 0; i < records; i++) {
+    if (bplus_record_find_view(file_desc, info, i * 2, &view) != 0) {
+      bad++;
+      continue;
+    }
+    bplus_record_view_release(&view);
+  }
+  double view_ns = (now() - start) * 1e9 / records;
+  long views = allocations - before;
+
+  bplus_close_file(file_desc, info);
+  remove(BENCH_FILE);
+  printf("%d records\n", records);
+  printf("  insert     %ld allocations in %d calls\n", inserts, records - records / 2);
+  printf("  find_into  %ld allocations, %6.1f ns per call\n", finds, find_ns);
+  printf("  find_view  %ld allocations, %6.1f ns per call\n", views, view_ns);
+  return bad;
+}
+
+#define REPLACEMENT_RECORDS 400000
+#define REPLACEMENT_HOT 300
+
+static long page_reads(int file_desc, BPlusMeta *info) {
+  BPlusStats stats;
+  if (bplus_stats_snapshot(file_desc, info, &stats) != 0) return -1;
+  return stats.reads;
+}
+
+// pages the hot lookups read after the file was run through once, by a
+// scan (leaves hinted as sequential) or by point lookups of every key
+static long hot_rereads(PagerPolicy policy, int by_scan, int *bad) {
+  int file_desc;
+  BPlusMeta *info;
+  BPlusOpenOptions options = {0};
+  options.buffer_pool_mb = 2;
+  options.replacement = policy;
+  if (bplus_open_file_with_options(BENCH_FILE, &file_desc, &info, &options) != 0) {
+    (*bad)++;
+    return -1;
+  }
+  Record record;
+  // the hot set is read twice so every policy has taken it in
+  for (int round = 0; round < 2; round++) {
+    for (int i = 0; i < REPLACEMENT_HOT; i++) {
+      if (bplus_record_find_into(file_desc, info, i * (REPLACEMENT_RECORDS / REPLACEMENT_HOT), &record) != 0) (*bad)++;
+    }
+  }
+  if (by_scan) {
+    BPlusScan *scan = bplus_scan_open(file_desc, info, 0, REPLACEMENT_RECORDS);
+    while (scan && bplus_scan_next(scan, &record) == 0) {
+    }
+    bplus_scan_close(scan);
+  } else {
+    for (int key = 0; key < REPLACEMENT_RECORDS; key++) bplus_record_find_into(file_desc, info, key, &record);
+  }
+  long before = page_reads(file_desc, info);
+  for (int i = 0; i < REPLACEMENT_HOT; i++) {
+    if (bplus_record_find_into(file_desc, info, i * (REPLACEMENT_RECORDS / REPLACEMENT_HOT), &record) != 0) (*bad)++;
+  }
+  long reads = page_reads(file_desc, info) - before;
+  bplus_close_file(file_desc, info);
+  return before < 0 ? -1 : reads;
+}
+
+static int bench_replacement(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(BENCH_FILE);
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = 4096;
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file_with_options(&schema, BENCH_FILE, &create_options) != 0 ||
+      bplus_open_file(BENCH_FILE, &file_desc, &info) != 0) {
+    fprintf(stderr, "FAIL: cannot create %s\n", BENCH_FILE);
+    return 1;
+  }
+  Record record;
+  for (int key = 0; key < REPLACEMENT_RECORDS; key++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = key;
+    bplus_record_insert(file_desc, info, &record);
+  }
+  bplus_close_file(file_desc, info);
+
+  int bad = 0;
+  const PagerPolicy policies[] = {PAGER_POLICY_LRU, PAGER_POLICY_CLOCK, PAGER_POLICY_2Q};
+  const char *names[] = {"LRU", "CLOCK", "2Q"};
+  printf("%d records, 4 KiB pages, 2 MB pool, %d hot keys: pages read again\n", REPLACEMENT_RECORDS,
+         REPLACEMENT_HOT);
+  for (int by_scan = 1; by_scan >= 0; by_scan--) {
+    printf("  after a %-12s", by_scan ? "scan" : "lookup pass");
+    for (int i = 0; i < 3; i++) printf("  %s %ld", names[i], hot_rereads(policies[i], by_scan, &bad));
+    printf("\n");
+  }
+  remove(BENCH_FILE);
+  return bad;
+}
+
+#define MEMTABLE_RECORDS 2000000
+
+// inserts per second of MEMTABLE_RECORDS random keys, counting the close
+// that merges what is left in the memtable
+static double random_inserts(const int *keys, long memtable_bytes, int *bad) {
+  const TableSchema schema = employee_get_schema();
+  remove(BENCH_FILE);
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = 4096;
+  BPlusOpenOptions options = {0};
+  options.buffer_pool_mb = 2;
+  options.memtable_bytes = memtable_bytes;
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file_with_options(&schema, BENCH_FILE, &create_options) != 0 ||
+      bplus_open_file_with_options(BENCH_FILE, &file_desc, &info, &options) != 0) {
+    (*bad)++;
+    return 0;
+  }
+  Record record;
+  double start = now();
+  for (long i = 0; i < MEMTABLE_RECORDS; i++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = keys[i];
+    if (bplus_record_insert(file_desc, info, &record) < 0) (*bad)++;
+  }
+  if (bplus_close_file(file_desc, info) != 0) (*bad)++;
+  double rate = MEMTABLE_RECORDS / (now() - start);
+  remove(BENCH_FILE);
+  return rate;
+}
+
+static int bench_memtable(void) {
+  // the same shuffled keys for both runs
+  int *keys = malloc(MEMTABLE_RECORDS * sizeof(int));
+  if (keys == NULL) return 1;
+  unsigned int seed = 7919;
+  for (int i = 0; i < MEMTABLE_RECORDS; i++) keys[i] = i;
+  for (int i = MEMTABLE_RECORDS - 1; i > 0; i--) {
+    int j = (int)(((unsigned long)rand_r(&seed) << 16 ^ rand_r(&seed)) % (i + 1));
+    int key = keys[i];
+    keys[i] = keys[j];
+    keys[j] = key;
+  }
+  int bad = 0;
+  printf("%d random inserts, 4 KiB pages, 2 MB pool\n", MEMTABLE_RECORDS);
+  printf("  no memtable     %6.0fk inserts/s\n", random_inserts(keys, 0, &bad) / 1000);
+  printf("  32 MB memtable  %6.0fk inserts/s\n", random_inserts(keys, 32L << 20, &bad) / 1000);
+  free(keys);
+  return bad;
+}
+
+#define APPEND_RECORDS 1000000
+
+// blocks of the file after inserting keys in order, the rate through *rate
+static long insert_blocks(const int *keys, double *rate, int *bad) {
+  const TableSchema schema = employee_get_schema();
+  remove(BENCH_FILE);
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = 4096;
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file_with_options(&schema, BENCH_FILE, &create_options) != 0 ||
+      bplus_open_file(BENCH_FILE, &file_desc, &info) != 0) {
+    (*bad)++;
+    return -1;
+  }
+  Record record;
+  employee_random_record(&schema, &record);
+  double start = now();
+  for (int i = 0; i < APPEND_RECORDS; i++) {
+    record.values[0].int_value = keys[i];
+    if (bplus_record_insert(file_desc, info, &record) < 0) (*bad)++;
+  }
+  *rate = APPEND_RECORDS / (now() - start);
+  if (bplus_close_file(file_desc, info) != 0) (*bad)++;
+  struct stat st;
+  long blocks = stat(BENCH_FILE, &st) == 0 ? (long)(st.st_size / 4096) : -1;
+  remove(BENCH_FILE);
+  return blocks;
+}
+
+static int bench_append(void) {
+  int *keys = malloc(APPEND_RECORDS * sizeof(int));
+  if (keys == NULL) return 1;
+  int bad = 0;
+  double rate;
+  printf("%d inserts, 4 KiB pages\n", APPEND_RECORDS);
+  for (int i = 0; i < APPEND_RECORDS; i++) keys[i] = i;
+  long blocks = insert_blocks(keys, &rate, &bad);
+  printf("  ascending  %6ld blocks, %5.2fM inserts/s\n", blocks, rate / 1e6);
+  unsigned int seed = 7919;
+  for (int i = APPEND_RECORDS - 1; i > 0; i--) {
+    int j = (int)(((unsigned long)rand_r(&seed) << 16 ^ rand_r(&seed)) % (i + 1));
+    int key = keys[i];
+    keys[i] = keys[j];
+    keys[j] = key;
+  }
+  blocks = insert_blocks(keys, &rate, &bad);
+  printf("  shuffled   %6ld blocks, %5.2fM inserts/s\n", blocks, rate / 1e6);
+  free(keys);
+  return bad;
+}
+
+int main(int argc, char **argv) {
+  const char *only = argc > 1 ? argv[1] : NULL;
+  int bad = 0;
+  int ran = 0;
+  if (only == NULL || strcmp(only, "kernels") == 0) {
+    bad += bench_kernels(20000000);
+    ran++;
+  }
+  BF_Init(LRU);
+  if (only == NULL || strcmp(only, "finds") == 0) {
+    bad += bench_finds(100000);
+    ran++;
+  }
+  if (only == NULL || strcmp(only, "replacement") == 0) {
+    bad += bench_replacement();
+    ran++;
+  }
+  if (only == NULL || strcmp(only, "memtable") == 0) {
+    bad += bench_memtable();
+    ran++;
+  }
+  if (only == NULL || strcmp(only, "append") == 0) {
+    bad += bench_append();
+    ran++;
+  }
+  BF_Close();
+  if (ran == 0) {
+    fprintf(stderr, "usage: %s [kernels|finds|replacement|memtable|append]\n", argv[0]);
+    return 1;
+  }
+  return bad != 0;
+}
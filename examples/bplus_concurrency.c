@@ -0,0 +1,154 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "bf.h"
+#include "bplus_file_funcs.h"
+#include "record_generator.h"
+
+// Concurrency stress test for files opened with BPlusOpenOptions.concurrent.
+// Writer threads insert keys of their own and delete every fourth one again,
+// reader threads look keys up and scan ranges while they do. Afterwards the
+// file must hold exactly the keys that were not deleted, in order.
+//
+//   bp_concurrency [page_size] [writers] [readers] [records per writer] [wal]
+//
+// Build it with -fsanitize=thread (make bplus_concurrency_tsan) to check the
+// latching as well. Exits with 1 if anything was wrong.
+
+#define CONCURRENCY_FILE "concurrency.db"
+
+static int file_desc;
+static BPlusMeta *info;
+static TableSchema schema;
+static int writers = 4;
+static int readers = 4;
+static int records = 10000;
+static int writers_done = 0;
+static int failures = 0;
+
+static void fail(const char *what, int key) {
+  __atomic_fetch_add(&failures, 1, __ATOMIC_RELAXED);
+  fprintf(stderr, "FAIL: %s (key %d)\n", what, key);
+}
+
+// writer w owns the keys w, w + writers, w + 2 * writers, ...
+static int deleted(int key) {
+  return (key / writers) % 4 == 0;
+}
+
+static void *writer(void *arg) {
+  int w = (int)(long)arg;
+  Record record;
+  for (int i = 0; i < records; i++) {
+    int key = i * writers + w;
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = key;
+    if (bplus_record_insert(file_desc, info, &record) < 0) fail("insert", key);
+    if (deleted(key) && bplus_record_delete(file_desc, info, key) != 0) fail("delete", key);
+  }
+  __atomic_fetch_add(&writers_done, 1, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+static void *reader(void *arg) {
+  unsigned int seed = (unsigned int)(long)arg * 7919 + 1;
+  Record record;
+  while (__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) < writers) {
+    for (int i = 0; i < 100; i++) {
+      int key = rand_r(&seed) % (records * writers);
+      // a key is either not there yet or the record stored under it
+      if (bplus_record_find_into(file_desc, info, key, &record) == 0 && record.values[0].int_value != key) {
+        fail("lookup returned another record", key);
+      }
+    }
+    int lo = rand_r(&seed) % (records * writers);
+    BPlusScan *scan = bplus_scan_open(file_desc, info, lo, lo + 2000);
+    if (scan == NULL) {
+      fail("scan open", lo);
+      continue;
+    }
+    int last = lo - 1;
+    while (bplus_scan_next(scan, &record) == 0) {
+      int key = record.values[0].int_value;
+      if (key <= last || key > lo + 2000) fail("scan out of order", key);
+      last = key;
+    }
+    bplus_scan_close(scan);
+  }
+  return NULL;
+}
+
+// every key that was not deleted is there, nothing else, and in order
+static void check_final(void) {
+  Record record;
+  int expected = 0;
+  for (int key = 0; key < records * writers; key++) {
+    int found = bplus_record_find_into(file_desc, info, key, &record) == 0;
+    if (found != !deleted(key)) fail(found ? "deleted key found" : "key lost", key);
+    expected += !deleted(key);
+  }
+  BPlusScan *scan = bplus_scan_open(file_desc, info, 0, records * writers);
+  int count = 0;
+  int last = -1;
+  while (scan && bplus_scan_next(scan, &record) == 0) {
+    if (record.values[0].int_value <= last) fail("final scan out of order", record.values[0].int_value);
+    last = record.values[0].int_value;
+    count++;
+  }
+  bplus_scan_close(scan);
+  if (count != expected) fail("final scan count", count);
+}
+
+int main(int argc, char **argv) {
+  int page_size = argc > 1 ? atoi(argv[1]) : 0;
+  if (argc > 2) writers = atoi(argv[2]);
+  if (argc > 3) readers = atoi(argv[3]);
+  if (argc > 4) records = atoi(argv[4]);
+  int wal = argc > 5 ? atoi(argv[5]) : 0;
+  if (writers < 1 || readers < 0 || writers + readers > 64 || records < 1) {
+    fprintf(stderr, "usage: %s [page_size] [writers] [readers] [records per writer] [wal]\n", argv[0]);
+    return 1;
+  }
+
+  schema = employee_get_schema();
+  BF_Init(LRU);
+  remove(CONCURRENCY_FILE);
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = page_size;
+  BPlusOpenOptions open_options = {0};
+  open_options.concurrent = 1;
+  open_options.wal = wal;
+  if (bplus_create_file_with_options(&schema, CONCURRENCY_FILE, &create_options) != 0 ||
+      bplus_open_file_with_options(CONCURRENCY_FILE, &file_desc, &info, &open_options) != 0) {
+    fprintf(stderr, "FAIL: cannot create %s\n", CONCURRENCY_FILE);
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  pthread_t threads[64];
+  for (long i = 0; i < writers; i++) pthread_create(&threads[i], NULL, writer, (void*)i);
+  for (long i = 0; i < readers; i++) pthread_create(&threads[writers + i], NULL, reader, (void*)i);
+  for (int i = 0; i < writers + readers; i++) pthread_join(threads[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  check_final();
+  if (bplus_close_file(file_desc, info) != 0) fail("close", 0);
+  // and once more as the next open finds it
+  if (bplus_open_file(CONCURRENCY_FILE, &file_desc, &info) != 0) {
+    fail("reopen", 0);
+  } else {
+    check_final();
+    bplus_close_file(file_desc, info);
+  }
+  BF_Close();
+  remove(CONCURRENCY_FILE);
+  remove(CONCURRENCY_FILE ".wal");
+
+  printf("page %d, %d writers, %d readers, %d records each, wal %d: %.3f s, %s\n", page_size, writers, readers,
+         records, wal, (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+         failures ? "FAILED" : "ok");
+  return failures != 0;
+}
@@ -0,0 +1,271 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include "bf.h"
+#include "bplus_file_funcs.h"
+#include "bplus_wal.h"
+#include "record_generator.h"
+
+// Crash test for the write-ahead log. Every round starts from a file that
+// already holds CRASH_PREFILL records, written back by a clean close, so
+// the log does not cover every page. A child process then inserts
+// and deletes through the logged file and is killed with SIGKILL at a random
+// moment. Before the file is opened again some of the pages the log holds
+// images of are torn (half overwritten, as a write cut short by a power loss
+// leaves them) and a half written record is put at the end of the log.
+// Recovery must bring back every change the child was told is durable,
+// leave the tree ordered, and the file must stay usable afterwards.
+//
+//   bp_crash [page_size] [threads] [commit_interval_ms] [rounds] [seed]
+//
+// With a commit interval changes count as durable once bplus_sync returned.
+// Exits with 1 if any round lost or kept a change it should not have.
+
+#define CRASH_FILE "crash.db"
+#define CRASH_WAL CRASH_FILE ".wal"
+#define CRASH_ACKS "crash.acks"
+#define CRASH_KEYS 400000
+// keys CRASH_KEYS and up are put in before the child starts
+#define CRASH_PREFILL 20000
+
+static int file_desc;
+static BPlusMeta *info;
+static TableSchema schema;
+static int threads = 1;
+static int interval_ms = 0;
+static int acks_fd;
+static pthread_mutex_t acks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// an acknowledged change is key + 1 for an insert, -(key + 1) for a delete
+static void acknowledge(const int *changes, int count) {
+  pthread_mutex_lock(&acks_lock);
+  if (write(acks_fd, changes, count * sizeof(int)) != (ssize_t)(count * sizeof(int))) _exit(2);
+  pthread_mutex_unlock(&acks_lock);
+}
+
+// thread t inserts t, t + threads, ... in a scattered order and takes
+// every fifth key out again right away
+static void *writer(void *arg) {
+  int t = (int)(long)arg;
+  int pending[1024];
+  int count = 0;
+  Record record;
+  for (long i = t; i < CRASH_KEYS; i += threads) {
+    int key = (int)(i * 7919 % CRASH_KEYS);
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = key;
+    if (bplus_record_insert(file_desc, info, &record) < 0) _exit(3);
+    pending[count++] = key + 1;
+    if (key % 5 == 0) {
+      if (bplus_record_delete(file_desc, info, key) != 0) _exit(3);
+      pending[count++] = -(key + 1);
+    }
+    if (interval_ms == 0 || count >= 1000) {
+      if (interval_ms > 0 && bplus_sync(file_desc, info) != 0) _exit(3);
+      acknowledge(pending, count);
+      count = 0;
+    }
+  }
+  return NULL;
+}
+
+static void child(void) {
+  BF_Init(LRU);
+  BPlusOpenOptions options = {0};
+  options.wal = 1;
+  options.wal_commit_interval_ms = interval_ms;
+  options.concurrent = threads > 1;
+  // a small pool, so pages are written back during the run
+  options.buffer_pool_mb = 1;
+  if (bplus_open_file_with_options(CRASH_FILE, &file_desc, &info, &options) != 0) _exit(1);
+  pthread_t workers[64];
+  for (long t = 0; t < threads; t++) pthread_create(&workers[t], NULL, writer, (void*)t);
+  for (int t = 0; t < threads; t++) pthread_join(workers[t], NULL);
+  _exit(0);
+}
+
+// pages with an image in the log, as bplus_log.c writes a WAL_RECORD_PAGES
+// record: six ints of metadata and the page count, then every page as its
+// id and its bytes
+typedef struct {
+  int page_size;
+  char *logged;   // 1 for every page id with an image
+  int pages;
+} LoggedPages;
+
+#define LOG_PAGES_HEAD_INTS 6
+
+static int note_pages(void *ctx, int type, const char *data, int length) {
+  LoggedPages *logged = ctx;
+  if (type != WAL_RECORD_PAGES || length < LOG_PAGES_HEAD_INTS * (int)sizeof(int)) return 0;
+  int count;
+  memcpy(&count, data + (LOG_PAGES_HEAD_INTS - 1) * sizeof(int), sizeof(int));
+  const char *at = data + LOG_PAGES_HEAD_INTS * sizeof(int);
+  for (int i = 0; i < count && at + sizeof(int) <= data + length; i++) {
+    int id;
+    memcpy(&id, at, sizeof(int));
+    if (id >= 0 && id < logged->pages) logged->logged[id] = 1;
+    at += sizeof(int) + logged->page_size;
+  }
+  return 0;
+}
+
+// tear every other logged page of the file and leave half a record at the
+// end of the log, returns how many pages were torn
+static int tear(int page_size, unsigned int *seed) {
+  struct stat st;
+  if (stat(CRASH_FILE, &st) != 0) return 0;
+  LoggedPages logged = {page_size, NULL, (int)(st.st_size / page_size)};
+  logged.logged = calloc(logged.pages + 1, 1);
+  if (logged.logged == NULL || wal_replay(CRASH_WAL, page_size, note_pages, &logged) < 0) {
+    free(logged.logged);
+    return 0;
+  }
+  int fd = open(CRASH_FILE, O_WRONLY);
+  char *garbage = malloc(page_size / 2);
+  int torn = 0;
+  memset(garbage, 0xa5, page_size / 2);
+  for (int id = 0; id < logged.pages && fd >= 0; id++) {
+    if (!logged.logged[id] || rand_r(seed) % 2) continue;
+    if (pwrite(fd, garbage, page_size / 2, (off_t)id * page_size + page_size / 2) == page_size / 2) torn++;
+  }
+  if (fd >= 0) close(fd);
+  fd = open(CRASH_WAL, O_WRONLY | O_APPEND);
+  if (fd >= 0) {
+    if (write(fd, garbage, 37) != 37) torn = -1;
+    close(fd);
+  }
+  free(garbage);
+  free(logged.logged);
+  return torn;
+}
+
+// a file with the prefilled keys, closed cleanly
+static int prefill(int page_size) {
+  BF_Init(LRU);
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = page_size;
+  int ret = bplus_create_file_with_options(&schema, CRASH_FILE, &create_options);
+  if (ret == 0) ret = bplus_open_file(CRASH_FILE, &file_desc, &info);
+  Record record;
+  for (int i = 0; i < CRASH_PREFILL && ret == 0; i++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = CRASH_KEYS + (int)((long)i * 7919 % CRASH_PREFILL);
+    if (bplus_record_insert(file_desc, info, &record) < 0) ret = -1;
+  }
+  if (ret == 0) ret = bplus_close_file(file_desc, info);
+  BF_Close();
+  return ret;
+}
+
+// 0 unknown, 1 must be there, 2 must not be
+static signed char expected[CRASH_KEYS + CRASH_PREFILL];
+
+static int check_round(int page_size, int kill_ms, int torn) {
+  memset(expected, 0, CRASH_KEYS);
+  memset(expected + CRASH_KEYS, 1, CRASH_PREFILL);
+  FILE *acks = fopen(CRASH_ACKS, "rb");
+  int change;
+  int acknowledged = 0;
+  while (acks && fread(&change, sizeof(int), 1, acks) == 1) {
+    acknowledged++;
+    if (change > 0) expected[change - 1] = 1;
+    else expected[-change - 1] = 2;
+  }
+  if (acks) fclose(acks);
+
+  BF_Init(LRU);
+  int bad = 0;
+  if (bplus_open_file(CRASH_FILE, &file_desc, &info) != 0) {
+    printf("page %d, kill after %d ms: recovery failed\n", page_size, kill_ms);
+    BF_Close();
+    return 1;
+  }
+  Record record;
+  int found = 0;
+  for (int key = 0; key < CRASH_KEYS + CRASH_PREFILL; key++) {
+    int there = bplus_record_find_into(file_desc, info, key, &record) == 0;
+    if (there && record.values[0].int_value != key) bad++;
+    if ((expected[key] == 1 && !there) || (expected[key] == 2 && there)) bad++;
+    found += there;
+  }
+  BPlusScan *scan = bplus_scan_open(file_desc, info, 0, CRASH_KEYS + CRASH_PREFILL);
+  int scanned = 0;
+  int last = -1;
+  while (scan && bplus_scan_next(scan, &record) == 0) {
+    if (record.values[0].int_value <= last) bad++;
+    last = record.values[0].int_value;
+    scanned++;
+  }
+  bplus_scan_close(scan);
+  if (scanned != found) bad++;
+
+  // still usable: more changes, a clean close and another open
+  for (int key = CRASH_KEYS + CRASH_PREFILL; key < CRASH_KEYS + CRASH_PREFILL + 2000; key++) {
+    employee_random_record(&schema, &record);
+    record.values[0].int_value = key;
+    if (bplus_record_insert(file_desc, info, &record) < 0) bad++;
+  }
+  for (int key = 1; key < CRASH_KEYS; key += 97) bplus_record_delete(file_desc, info, key);
+  if (bplus_close_file(file_desc, info) != 0 || bplus_open_file(CRASH_FILE, &file_desc, &info) != 0) {
+    bad++;
+  } else {
+    if (bplus_record_find_into(file_desc, info, CRASH_KEYS + CRASH_PREFILL + 1999, NULL) != 0) bad++;
+    bplus_close_file(file_desc, info);
+  }
+  BF_Close();
+  printf("page %d, %d threads, interval %d ms, kill after %d ms: %d acknowledged, %d keys, %d pages torn, %s\n",
+         page_size, threads, interval_ms, kill_ms, acknowledged, found, torn, bad ? "FAILED" : "ok");
+  return bad != 0;
+}
+
+int main(int argc, char **argv) {
+  int page_size = argc > 1 ? atoi(argv[1]) : 0;
+  if (argc > 2) threads = atoi(argv[2]);
+  if (argc > 3) interval_ms = atoi(argv[3]);
+  int rounds = argc > 4 ? atoi(argv[4]) : 5;
+  unsigned int seed = argc > 5 ? (unsigned int)atoi(argv[5]) : (unsigned int)time(NULL);
+  if (threads < 1 || threads > 64 || interval_ms < 0 || rounds < 1) {
+    fprintf(stderr, "usage: %s [page_size] [threads] [commit_interval_ms] [rounds] [seed]\n", argv[0]);
+    return 1;
+  }
+  printf("seed %u\n", seed);
+  schema = employee_get_schema();
+  if (page_size == 0) page_size = BF_BLOCK_SIZE;
+
+  int failed = 0;
+  for (int round = 0; round < rounds; round++) {
+    remove(CRASH_FILE);
+    remove(CRASH_WAL);
+    remove(CRASH_ACKS);
+    if (prefill(page_size) != 0) {
+      fprintf(stderr, "FAIL: cannot create %s\n", CRASH_FILE);
+      return 1;
+    }
+
+    acks_fd = open(CRASH_ACKS, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    int kill_ms = 50 + rand_r(&seed) % 1500;
+    pid_t pid = fork();
+    if (pid == 0) {
+      child();
+    }
+    usleep(kill_ms * 1000);
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+    close(acks_fd);
+
+    int torn = tear(page_size, &seed);
+    failed += check_round(page_size, kill_ms, torn);
+  }
+  remove(CRASH_FILE);
+  remove(CRASH_WAL);
+  remove(CRASH_ACKS);
+  return failed != 0;
+}
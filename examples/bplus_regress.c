@@ -0,0 +1,779 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "bf.h"
+#include "bplus_file_funcs.h"
+#include "record_generator.h"
+
+// Regression checks for bugs that lost or misread records.
+// Every check builds its own file, prints ok or FAIL and the exit
+// status is the number of failed checks.
+
+#define REGRESS_FILE "regress.db"
+
+static int failures = 0;
+
+// mallocs to fail from now on, the build wraps malloc for it
+static int failing_mallocs = 0;
+
+void *__real_malloc(size_t size);
+
+void *__wrap_malloc(size_t size) {
+  if (failing_mallocs > 0) {
+    failing_mallocs--;
+    return NULL;
+  }
+  return __real_malloc(size);
+}
+
+static void report(const char *name, int ok) {
+  printf("%-40s %s\n", name, ok ? "ok" : "FAIL");
+  if (!ok) failures++;
+}
+
+static int insert_key(int file_desc, BPlusMeta *info, const TableSchema *schema, int key) {
+  Record record;
+  employee_random_record(schema, &record);
+  record.values[schema->key_index].int_value = key;
+  return bplus_record_insert(file_desc, info, &record);
+}
+
+// keys of the file in leaf order must be strictly ascending and all be found
+static int tree_consistent(int file_desc, BPlusMeta *info) {
+  BPlusScan *scan = bplus_scan_open(file_desc, info, -2147483647 - 1, 2147483647);
+  if (scan == NULL) return 0;
+  Record record;
+  int ok = 1;
+  int first = 1;
+  int last = 0;
+  while (bplus_scan_next(scan, &record) == 0) {
+    int key = record.values[0].int_value;
+    if (!first && key <= last) ok = 0;
+    if (bplus_record_find_into(file_desc, info, key, NULL) != 0) ok = 0;
+    first = 0;
+    last = key;
+  }
+  bplus_scan_close(scan);
+  return ok;
+}
+
+/**
+ * A delete that evens out the last two leaves moves the separator above
+ * the rightmost leaf. Appends after it must not go by the old one.
+ */
+static void check_rightmost_after_redistribute(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("rightmost leaf after redistribute", 0);
+    return;
+  }
+
+  int ok = 1;
+  for (int key = 10; key <= 240; key += 10) {
+    if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+  }
+  for (int key = 10; key <= 80; key += 10) {
+    if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+  }
+  for (int key = 15; key <= 235; key += 10) {
+    if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+  }
+  for (int key = 15; key <= 235; key += 10) {
+    if (bplus_record_find_into(file_desc, info, key, NULL) != 0) ok = 0;
+  }
+  if (!tree_consistent(file_desc, info)) ok = 0;
+
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+  report("rightmost leaf after redistribute", ok);
+}
+
+/**
+ * A key of -1 is a key like any other, record_key reports errors
+ * apart from it. Keys wider than the tree's int are refused up front.
+ */
+static void check_key_minus_one(void) {
+  const TableSchema schema = employee_get_schema();
+  Record record;
+  employee_random_record(&schema, &record);
+  record.values[schema.key_index].int_value = -1;
+  int key = 0;
+  int ok = record_key(&schema, &record, &key) == 0 && key == -1;
+
+  remove(REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file(&schema, REGRESS_FILE) != 0 || bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("key -1", 0);
+    return;
+  }
+  if (bplus_record_insert(file_desc, info, &record) < 0) ok = 0;
+  if (bplus_record_find_into(file_desc, info, -1, NULL) != 0) ok = 0;
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+
+  const AttributeSchema wide_attrs[] = {
+    {"code", TYPE_CHAR, 8},
+    {"name", TYPE_CHAR, 20}
+  };
+  TableSchema wide;
+  schema_init(&wide, wide_attrs, 2, "code");
+  record_create(&wide, &record, "abcdefgh", "x");
+  if (record_key(&wide, &record, &key) != -1) ok = 0;
+  if (bplus_create_file(&wide, REGRESS_FILE) != -1) ok = 0;
+  remove(REGRESS_FILE);
+  report("key -1", ok);
+}
+
+// records the secondary index on city returns for city, -1 if one of
+// them is of another city
+static int city_count(int file_desc, BPlusMeta *info, const char *city) {
+  FieldValue value;
+  memset(&value, 0, sizeof(value));
+  strncpy(value.string_value, city, MAX_STRING_LENGTH - 1);
+  BPlusSecondaryScan *scan = bplus_secondary_scan_open(file_desc, info, "city", &value);
+  if (scan == NULL) return -1;
+  Record record;
+  int count = 0;
+  int other = 0;
+  while (bplus_secondary_scan_next(scan, &record) == 0) {
+    if (strcmp(record.values[3].string_value, city) != 0) other = 1;
+    count++;
+  }
+  bplus_secondary_scan_close(scan);
+  return other ? -1 : count;
+}
+
+/**
+ * Values whose first 4 normalized bytes are equal share the key of the
+ * secondary index but not a posting list. Dropping the first or a later
+ * list under the key must leave the others as they were.
+ */
+static void check_secondary_same_prefix(void) {
+  static const char *cities[] = {"Athens", "Athena", "Athenai"};
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  remove(REGRESS_FILE ".city.idx");
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file(&schema, REGRESS_FILE) != 0 || bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("secondary values with one prefix", 0);
+    return;
+  }
+
+  int ok = 1;
+  Record record;
+  // half is listed by the index build, half by the inserts after it
+  for (int key = 0; key < 300; key++) {
+    if (key == 150 && bplus_create_secondary_index(file_desc, info, "city") != 0) ok = 0;
+    employee_random_record(&schema, &record);
+    record.values[schema.key_index].int_value = key;
+    strcpy(record.values[3].string_value, cities[key % 3]);
+    if (bplus_record_insert(file_desc, info, &record) < 0) ok = 0;
+  }
+  for (int i = 0; i < 3; i++) {
+    if (city_count(file_desc, info, cities[i]) != 100) ok = 0;
+  }
+  if (city_count(file_desc, info, "Athe") != 0) ok = 0;
+
+  // the build lists Athena first under the key and Athenai second
+  for (int key = 2; key < 300; key += 3) {
+    if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+  }
+  for (int key = 1; key < 300; key += 3) {
+    if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+  }
+  bplus_close_file(file_desc, info);
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("secondary values with one prefix", 0);
+    return;
+  }
+  if (city_count(file_desc, info, "Athens") != 100) ok = 0;
+  if (city_count(file_desc, info, "Athena") != 0) ok = 0;
+  if (city_count(file_desc, info, "Athenai") != 0) ok = 0;
+  employee_random_record(&schema, &record);
+  record.values[schema.key_index].int_value = 1000;
+  strcpy(record.values[3].string_value, "Athena");
+  if (bplus_record_insert(file_desc, info, &record) < 0) ok = 0;
+  if (city_count(file_desc, info, "Athena") != 1) ok = 0;
+  if (city_count(file_desc, info, "Athens") != 100) ok = 0;
+
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+  remove(REGRESS_FILE ".city.idx");
+  report("secondary values with one prefix", ok);
+}
+
+// records for bplus_bulk_load: keys (i * step) % keys for i below count
+typedef struct {
+  const TableSchema *schema;
+  int i;
+  int count;
+  int keys;
+  int step;
+} KeySource;
+
+static int key_source_next(void *ctx, Record *record) {
+  KeySource *source = ctx;
+  if (source->i == source->count) return -1;
+  employee_random_record(source->schema, record);
+  record->values[source->schema->key_index].int_value = (int)((long)source->i * source->step % source->keys);
+  source->i++;
+  return 0;
+}
+
+// records in the file, -1 if its keys are out of order or cannot be found
+static int tree_count(int file_desc, BPlusMeta *info) {
+  if (!tree_consistent(file_desc, info)) return -1;
+  BPlusScan *scan = bplus_scan_open(file_desc, info, -2147483647 - 1, 2147483647);
+  if (scan == NULL) return -1;
+  Record record;
+  int count = 0;
+  while (bplus_scan_next(scan, &record) == 0) count++;
+  bplus_scan_close(scan);
+  return count;
+}
+
+/**
+ * A bulk loaded tree holds every key once, sorted input or not, and takes
+ * inserts like any other.
+ */
+static void check_bulk_load(void) {
+  const TableSchema schema = employee_get_schema();
+  int ok = 1;
+  for (int sorted = 0; sorted <= 1; sorted++) {
+    // unsorted input lists every key twice
+    KeySource source = {&schema, 0, sorted ? 5000 : 10000, 5000, sorted ? 1 : 7919};
+    BPlusRecordIterator iterator = {key_source_next, &source, sorted};
+    remove(REGRESS_FILE);
+    int file_desc;
+    BPlusMeta *info;
+    if (bplus_bulk_load(&schema, REGRESS_FILE, &iterator, 0.7) != 0 ||
+        bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+      ok = 0;
+      continue;
+    }
+    if (tree_count(file_desc, info) != 5000) ok = 0;
+    for (int key = 5000; key < 5500; key++) {
+      if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+    }
+    if (insert_key(file_desc, info, &schema, 42) != -1) ok = 0;
+    if (tree_count(file_desc, info) != 5500) ok = 0;
+    bplus_close_file(file_desc, info);
+  }
+  remove(REGRESS_FILE);
+  report("bulk load", ok);
+}
+
+static long file_size(const char *path) {
+  struct stat st;
+  return stat(path, &st) == 0 ? (long)st.st_size : -1;
+}
+
+/**
+ * Deletes take records out whatever leaf they are in and put the blocks
+ * that empty out on the free list. Filling and emptying the tree again
+ * must reuse them instead of growing the file.
+ */
+static void check_delete_reuse(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int ok = 1;
+  long size[2];
+  for (int round = 0; round < 2; round++) {
+    int file_desc;
+    BPlusMeta *info;
+    if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+      report("delete and block reuse", 0);
+      return;
+    }
+    for (int i = 0; i < 3000; i++) {
+      if (insert_key(file_desc, info, &schema, (i * 1237) % 3000) < 0) ok = 0;
+    }
+    // odd keys first, so leaves underflow everywhere and not only at one end
+    for (int key = 1; key < 3000; key += 2) {
+      if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+    }
+    if (tree_count(file_desc, info) != 1500) ok = 0;
+    for (int key = 0; key < 3000; key += 2) {
+      if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+    }
+    if (tree_count(file_desc, info) != 0) ok = 0;
+    if (bplus_record_delete(file_desc, info, 0) != -1) ok = 0;
+    bplus_close_file(file_desc, info);
+    size[round] = file_size(REGRESS_FILE);
+  }
+  if (size[0] <= 0 || size[1] != size[0]) ok = 0;
+  remove(REGRESS_FILE);
+  report("delete and block reuse", ok);
+}
+
+/**
+ * A batch insert skips the keys already in the tree and the ones repeated
+ * in the batch, and the records it puts in are the ones it was given.
+ */
+static void check_insert_batch(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  Record *records = malloc(3000 * sizeof(Record));
+  if (records == NULL || bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    free(records);
+    report("insert batch", 0);
+    return;
+  }
+
+  int ok = 1;
+  for (int key = 1; key < 2000; key += 2) {
+    if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+  }
+  // every key below 2000 once, then a thousand of them again
+  for (int i = 0; i < 3000; i++) {
+    employee_random_record(&schema, &records[i]);
+    records[i].values[schema.key_index].int_value = i < 2000 ? (i * 1237) % 2000 : (i * 7) % 2000;
+  }
+  if (bplus_record_insert_batch(file_desc, info, records, 3000) != 1000) ok = 0;
+  if (tree_count(file_desc, info) != 2000) ok = 0;
+  for (int i = 0; i < 2000; i++) {
+    int key = records[i].values[schema.key_index].int_value;
+    Record found;
+    if (key % 2 == 0 && (bplus_record_find_into(file_desc, info, key, &found) != 0 ||
+                         strcmp(found.values[1].string_value, records[i].values[1].string_value) != 0)) {
+      ok = 0;
+    }
+  }
+
+  bplus_close_file(file_desc, info);
+  free(records);
+  remove(REGRESS_FILE);
+  report("insert batch", ok);
+}
+
+// run bplus_reorganize to the end of a pass, a few leaves per call
+static int reorganize_pass(int file_desc, BPlusMeta *info) {
+  int ret;
+  while ((ret = bplus_reorganize(file_desc, info, 0.9, 16)) == 1) {
+  }
+  return ret;
+}
+
+/**
+ * Reorganizing in short calls keeps every record. A group that was
+ * rewritten can end where the next pass starts a group, so a few passes
+ * may rewrite something, but then a pass finds every group in order and
+ * rewrites nothing. New leaves always go at the end of the file, so such
+ * a pass leaves the file as long as it was.
+ */
+static void check_reorganize(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("reorganize", 0);
+    return;
+  }
+
+  int ok = 1;
+  for (int i = 0; i < 5000; i++) {
+    if (insert_key(file_desc, info, &schema, (i * 1237) % 5000) < 0) ok = 0;
+  }
+  // libbf extends the file when it is closed, that is when its size is known
+  long size = -1;
+  int settled = 0;
+  for (int pass = 0; pass < 5 && !settled; pass++) {
+    if (reorganize_pass(file_desc, info) != 0) ok = 0;
+    if (tree_count(file_desc, info) != 5000) ok = 0;
+    bplus_close_file(file_desc, info);
+    settled = file_size(REGRESS_FILE) == size;
+    size = file_size(REGRESS_FILE);
+    if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+      report("reorganize", 0);
+      return;
+    }
+  }
+  if (!settled) ok = 0;
+
+  for (int key = 5000; key < 5100; key++) {
+    if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+  }
+  if (tree_count(file_desc, info) != 5100) ok = 0;
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+  report("reorganize", ok);
+}
+
+// pages pinned by lookups of count keys from first on, step apart,
+// -1 if one of them is found when absent says it is not there or the
+// other way round
+static long lookup_pins(int file_desc, BPlusMeta *info, int first, int step, int count, int absent) {
+  BPlusStats stats;
+  bplus_stats_reset(file_desc, info);
+  for (int i = 0; i < count; i++) {
+    int found = bplus_record_find_into(file_desc, info, first + i * step, NULL) == 0;
+    if (found == absent) return -1;
+  }
+  if (bplus_stats_snapshot(file_desc, info, &stats) != 0) return -1;
+  return stats.pins;
+}
+
+/**
+ * The Bloom filter turns away lookups of absent keys without pinning a
+ * page, after a reopen as well, and never turns away a key that is there.
+ */
+static void check_bloom_absent(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int ok = 1;
+  for (int round = 0; round < 3; round++) {
+    // the first round fills the file, the second reads the saved filter
+    // back and the last one has none
+    BPlusOpenOptions options = {0};
+    options.bloom_bits_per_key = round == 2 ? -1 : 0;
+    int file_desc;
+    BPlusMeta *info;
+    if (bplus_open_file_with_options(REGRESS_FILE, &file_desc, &info, &options) != 0) {
+      report("bloom filter absent keys", 0);
+      return;
+    }
+    for (int key = 0; round == 0 && key < 20000; key += 2) {
+      if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+    }
+    if (lookup_pins(file_desc, info, 0, 2, 10000, 0) < 10000) ok = 0;
+    long pins = lookup_pins(file_desc, info, 1, 2, 10000, 1);
+    // about 1 in 100 gets through at 10 bits per key
+    if (pins < 0 || (round < 2 && pins > 10000 / 20) || (round == 2 && pins < 10000)) ok = 0;
+    bplus_close_file(file_desc, info);
+  }
+  remove(REGRESS_FILE);
+  report("bloom filter absent keys", ok);
+}
+
+/**
+ * The counts kept in a counted file's index nodes stay right through
+ * splits and deletes: rank, select and count_range must agree with the
+ * keys that are really there.
+ */
+static void check_counted(void) {
+  const TableSchema schema = employee_get_schema();
+  BPlusCreateOptions create_options = {0};
+  create_options.counted = 1;
+  remove(REGRESS_FILE);
+  bplus_create_file_with_options(&schema, REGRESS_FILE, &create_options);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("counted rank and select", 0);
+    return;
+  }
+
+  // even keys below 10000, then every one divisible by 6 goes again
+  int ok = 1;
+  static char present[10000];
+  memset(present, 0, sizeof(present));
+  for (int i = 0; i < 5000; i++) {
+    int key = (i * 1237) % 5000 * 2;
+    if (insert_key(file_desc, info, &schema, key) < 0) ok = 0;
+    present[key] = 1;
+  }
+  for (int key = 0; key < 10000; key += 6) {
+    if (bplus_record_delete(file_desc, info, key) != 0) ok = 0;
+    present[key] = 0;
+  }
+
+  long below = 0;
+  for (int key = 0; key < 10000; key++) {
+    if (bplus_rank(file_desc, info, key) != below) ok = 0;
+    if (present[key]) {
+      Record record;
+      if (bplus_select(file_desc, info, below, &record) != 0 ||
+          record.values[schema.key_index].int_value != key) {
+        ok = 0;
+      }
+      below++;
+    }
+  }
+  if (bplus_select(file_desc, info, below, NULL) != -1) ok = 0;
+  for (int lo = 0; lo < 10000; lo += 997) {
+    int hi = lo + 2500;
+    long count = 0;
+    for (int key = lo; key <= hi && key < 10000; key++) count += present[key];
+    if (bplus_count_range(file_desc, info, lo, hi) != count) ok = 0;
+  }
+
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+  report("counted rank and select", ok);
+}
+
+/**
+ * A scan with a predicate returns the records a plain scan would keep
+ * after testing them, and a projection copies only its columns.
+ */
+static void check_scan_where(void) {
+  const TableSchema schema = employee_get_schema();
+  remove(REGRESS_FILE);
+  bplus_create_file(&schema, REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("scan with predicate and projection", 0);
+    return;
+  }
+  int ok = 1;
+  for (int i = 0; i < 3000; i++) {
+    if (insert_key(file_desc, info, &schema, (i * 1237) % 3000) < 0) ok = 0;
+  }
+
+  PredicateTerm terms[3];
+  memset(terms, 0, sizeof(terms));
+  terms[0].attr_name = "city";
+  terms[0].op = PRED_EQ;
+  strcpy(terms[0].value.string_value, "Athina");
+  terms[1].attr_name = "id";
+  terms[1].op = PRED_BETWEEN;
+  terms[1].value.int_value = 500;
+  terms[1].high.int_value = 2500;
+  terms[2].attr_name = "name";
+  terms[2].op = PRED_PREFIX;
+  strcpy(terms[2].value.string_value, "A");
+  Predicate where;
+  Projection columns;
+  const char *names[] = {"id", "name"};
+  if (predicate_compile(&where, &schema, terms, 3) != 0 || projection_compile(&columns, &schema, names, 2) != 0) {
+    ok = 0;
+  }
+
+  // what the predicate must keep, from a plain scan
+  static char wanted[3000];
+  static char names_of[3000][MAX_STRING_LENGTH];
+  memset(wanted, 0, sizeof(wanted));
+  int expected = 0;
+  Record record;
+  BPlusScan *scan = bplus_scan_open(file_desc, info, 0, 2999);
+  while (scan != NULL && bplus_scan_next(scan, &record) == 0) {
+    int key = record.values[0].int_value;
+    strcpy(names_of[key], record.values[1].string_value);
+    if (strcmp(record.values[3].string_value, "Athina") == 0 && key >= 500 && key <= 2500 &&
+        record.values[1].string_value[0] == 'A') {
+      wanted[key] = 1;
+      expected++;
+    }
+  }
+  bplus_scan_close(scan);
+
+  int returned = 0;
+  scan = bplus_scan_open_where(file_desc, info, 0, 2999, &where, &columns);
+  memset(&record, 0, sizeof(record));
+  strcpy(record.values[3].string_value, "untouched");
+  while (scan != NULL && bplus_scan_next(scan, &record) == 0) {
+    int key = record.values[0].int_value;
+    if (key < 0 || key >= 3000 || !wanted[key] || strcmp(record.values[1].string_value, names_of[key]) != 0 ||
+        strcmp(record.values[3].string_value, "untouched") != 0) {
+      ok = 0;
+    }
+    returned++;
+  }
+  bplus_scan_close(scan);
+  if (scan == NULL || expected == 0 || returned != expected) ok = 0;
+
+  bplus_close_file(file_desc, info);
+  remove(REGRESS_FILE);
+  report("scan with predicate and projection", ok);
+}
+
+// record of key for the dictionary checks: 300 names, 50 surnames and a city
+// of its own for each key
+static void coded_record(int key, Record *record) {
+  memset(record, 0, sizeof(Record));
+  record->values[0].int_value = key;
+  snprintf(record->values[1].string_value, MAX_STRING_LENGTH, "n%d", key % 300);
+  snprintf(record->values[2].string_value, MAX_STRING_LENGTH, "s%d", key % 50);
+  snprintf(record->values[3].string_value, MAX_STRING_LENGTH, "c%d", key);
+}
+
+// keys from 0 up to count in order, failing the first malloc after fail_at
+typedef struct {
+  int key;
+  int count;
+  int fail_at;
+} CodedSource;
+
+static int coded_source_next(void *ctx, Record *record) {
+  CodedSource *source = ctx;
+  if (source->key == source->count) return -1;
+  coded_record(source->key, record);
+  // the dictionary takes a block for every 256 values, the name of key
+  // 256 needs the second one of its column
+  if (source->key == source->fail_at) failing_mallocs = 1;
+  source->key++;
+  return 0;
+}
+
+/**
+ * Records of a file with dictionaries read back as they were put in, from
+ * the bulk load and from inserts, after a reopen. A bulk load whose
+ * dictionary cannot take a value fails and leaves no file to open.
+ */
+static void check_dictionary(void) {
+  const TableSchema schema = employee_get_schema();
+  BPlusCreateOptions create_options = {0};
+  create_options.dictionary = 1;
+  int ok = 1;
+
+  remove(REGRESS_FILE);
+  CodedSource source = {0, 3000, -1};
+  BPlusRecordIterator iterator = {coded_source_next, &source, 1};
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_bulk_load_with_options(&schema, REGRESS_FILE, &iterator, 0.7, &create_options) != 0 ||
+      bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("dictionary round trip", 0);
+    return;
+  }
+  Record record;
+  for (int key = 3000; key < 3500; key++) {
+    coded_record(key, &record);
+    if (bplus_record_insert(file_desc, info, &record) < 0) ok = 0;
+  }
+  bplus_close_file(file_desc, info);
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    report("dictionary round trip", 0);
+    return;
+  }
+  for (int key = 0; key < 3500; key++) {
+    Record found;
+    coded_record(key, &record);
+    if (bplus_record_find_into(file_desc, info, key, &found) != 0) {
+      ok = 0;
+      continue;
+    }
+    for (int i = 1; i < schema.count; i++) {
+      if (strcmp(found.values[i].string_value, record.values[i].string_value) != 0) ok = 0;
+    }
+  }
+  bplus_close_file(file_desc, info);
+
+  remove(REGRESS_FILE);
+  CodedSource failing = {0, 3000, 256};
+  iterator.ctx = &failing;
+  if (bplus_bulk_load_with_options(&schema, REGRESS_FILE, &iterator, 0.7, &create_options) != -1) ok = 0;
+  failing_mallocs = 0;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) == 0) {
+    bplus_close_file(file_desc, info);
+    ok = 0;
+  }
+  remove(REGRESS_FILE);
+  report("dictionary round trip", ok);
+}
+
+// fill a new file of page_size with keys below count, 0 if it failed
+static int fill_file(const TableSchema *schema, int page_size, int count) {
+  BPlusCreateOptions create_options = {0};
+  create_options.page_size = page_size;
+  remove(REGRESS_FILE);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_create_file_with_options(schema, REGRESS_FILE, &create_options) != 0 ||
+      bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+    return 0;
+  }
+  int ok = 1;
+  for (int i = 0; i < count; i++) {
+    if (insert_key(file_desc, info, schema, (i * 1237) % count) < 0) ok = 0;
+  }
+  if (bplus_close_file(file_desc, info) != 0) ok = 0;
+  return ok;
+}
+
+/**
+ * Files with pages bigger than libbf's go through the native page manager
+ * and read back whole when opened again. A file whose format version is
+ * not this library's is refused.
+ */
+static void check_native_reopen(void) {
+  const TableSchema schema = employee_get_schema();
+  int ok = 1;
+  for (int page_size = 4096; page_size <= 16384; page_size *= 4) {
+    if (!fill_file(&schema, page_size, 5000)) ok = 0;
+    int file_desc;
+    BPlusMeta *info;
+    if (bplus_open_file(REGRESS_FILE, &file_desc, &info) != 0) {
+      ok = 0;
+      continue;
+    }
+    if (tree_count(file_desc, info) != 5000) ok = 0;
+    bplus_close_file(file_desc, info);
+  }
+
+  // format_version follows the magic number at the start of block 0
+  FILE *file = fopen(REGRESS_FILE, "r+b");
+  int version = 1000;
+  if (file == NULL || fseek(file, sizeof(int), SEEK_SET) != 0 || fwrite(&version, sizeof(int), 1, file) != 1) {
+    ok = 0;
+  }
+  if (file != NULL) fclose(file);
+  int file_desc;
+  BPlusMeta *info;
+  if (bplus_open_file(REGRESS_FILE, &file_desc, &info) == 0) {
+    bplus_close_file(file_desc, info);
+    ok = 0;
+  }
+  remove(REGRESS_FILE);
+  report("native pages reopen", ok);
+}
+
+/**
+ * A file opened read-only is mapped and read in place, libbf pages or
+ * native ones. Every record is there, and inserts and deletes are refused
+ * without changing it.
+ */
+static void check_readonly_reopen(void) {
+  const TableSchema schema = employee_get_schema();
+  int ok = 1;
+  for (int page_size = 0; page_size <= 4096; page_size += 4096) {
+    if (!fill_file(&schema, page_size, 3000)) ok = 0;
+    int file_desc;
+    BPlusMeta *info;
+    if (bplus_open_file_readonly(REGRESS_FILE, &file_desc, &info) != 0) {
+      ok = 0;
+      continue;
+    }
+    if (tree_count(file_desc, info) != 3000) ok = 0;
+    if (insert_key(file_desc, info, &schema, 5000) != -1) ok = 0;
+    if (bplus_record_delete(file_desc, info, 0) != -1) ok = 0;
+    if (bplus_record_find_into(file_desc, info, 0, NULL) != 0) ok = 0;
+    bplus_close_file(file_desc, info);
+  }
+  remove(REGRESS_FILE);
+  report("read-only mapped reopen", ok);
+}
+
+int main() {
+  BF_Init(LRU);
+  check_rightmost_after_redistribute();
+  check_key_minus_one();
+  check_secondary_same_prefix();
+  check_bulk_load();
+  check_delete_reuse();
+  check_insert_batch();
+  check_reorganize();
+  check_bloom_absent();
+  check_counted();
+  check_scan_where();
+  check_dictionary();
+  check_native_reopen();
+  check_readonly_reopen();
+  BF_Close();
+  return failures;
+}
@@ -0,0 +1,38 @@
+#ifndef BPLUS_BLOOM_H
+#define BPLUS_BLOOM_H
+
+// blocked Bloom filter over int keys. every key sets 8 bits inside one 32
+// byte block, so a lookup reads a single cache line. keys cannot be taken
+// out again, a filter that saw many deletes or more keys than it was made
+// for is replaced by a new one built from the keys that are left
+typedef struct BloomFilter BloomFilter;
+
+// filter for about keys keys at bits_per_key bits each.
+// shared filters may get keys from several threads at once
+BloomFilter *bloom_create(long keys, int bits_per_key, int shared);
+
+// frees the filter and the older ones it keeps
+void bloom_destroy(BloomFilter *filter);
+
+void bloom_add(BloomFilter *filter, int key);
+
+// 0 if key was never added, 1 if it may have been
+int bloom_may_contain(const BloomFilter *filter, int key);
+
+// 1 once more keys were added than the filter was made for
+int bloom_full(const BloomFilter *filter);
+
+long bloom_count(const BloomFilter *filter);
+int bloom_bits_per_key(const BloomFilter *filter);
+
+// keep older until filter is destroyed, for readers that may still use it
+void bloom_keep(BloomFilter *filter, BloomFilter *older);
+
+// the filter as bytes, to be read back by bloom_load
+long bloom_saved_size(const BloomFilter *filter);
+void bloom_save(const BloomFilter *filter, char *out);
+
+// filter from the bytes bloom_save wrote, NULL if they are not one
+BloomFilter *bloom_load(const char *data, long length, int shared);
+
+#endif // BPLUS_BLOOM_H
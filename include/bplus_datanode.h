@@ -3,24 +3,56 @@
 
 #include "record.h"
 
-// max records in leaf. block is 512 bytes
-// record size is ~~ 100 bytes (5 fields * 20 bytes)
-// so 512 / 100 is ~~ 5. we use 4 to be safe 
-#define MAX_RECORDS_LEAF 4
-
+// leaf block layout (slotted page):
+//   DataNode header | keys[count] | slots[count] | free space | packed records
+// records are packed with record_pack and fill the block from its end
+// backwards, so a leaf holds as many records as fit in its bytes instead
+// of a fixed number of worst-case sized Records
 typedef struct {
-  int count;                      // number of records
-  int next_block_id;              // next leaf block id
-  Record records[MAX_RECORDS_LEAF]; // records array
+  int count;          // number of records
+  int next_block_id;  // next leaf block id
+  int heap_start;     // offset of the lowest packed record byte
+  int page_size;      // bytes of the block the node lives in
 } DataNode;
 
+typedef struct {
+  unsigned short offset;  // packed record position in the block
+  unsigned short length;  // packed record size
+} LeafSlot;
+
+// bytes for directory and records in a leaf of a page_size bytes page
+#define DATANODE_CAPACITY(page_size) ((page_size) - (int)sizeof(DataNode))
+
+// directory bytes per record, key plus slot
+#define DATANODE_SLOT_SIZE ((int)(sizeof(int) + sizeof(LeafSlot)))
+
+// a packed record on its way into a leaf
+typedef struct {
+  int key;
+  int length;
+  const char *packed;
+} PackedRecord;
+
 // helper funcs
-void datanode_init(DataNode *node);
-int datanode_find_insert_pos(const DataNode *node, const TableSchema *schema, int key);
-void datanode_insert_at(DataNode *node, int pos, const Record *record);
-int datanode_is_full(const DataNode *node);
-int datanode_find_key(const DataNode *node, const TableSchema *schema, int key);
-int datanode_split(DataNode *node, DataNode *new_node, const Record *record,
-                   const TableSchema *schema, int insert_pos, int new_block_id);
+void datanode_init(DataNode *node, int page_size);
+int datanode_capacity(const DataNode *node);
+const int *datanode_keys(const DataNode *node);
+int datanode_key_at(const DataNode *node, int pos);
+const char *datanode_packed_at(const DataNode *node, int pos, int *length);
+int datanode_find_insert_pos(const DataNode *node, int key);
+int datanode_find_key(const DataNode *node, int key);
+int datanode_used_bytes(const DataNode *node);
+int datanode_fits(const DataNode *node, int packed_size);
+void datanode_insert_packed(DataNode *node, int pos, int key, const char *packed, int length);
+int datanode_split(DataNode *node, DataNode *new_node, int key, const char *packed, int length,
+                   int insert_pos, int new_block_id, int append);
+int datanode_spread_limit(const DataNode *node, int nodes);
+int datanode_spread_count(const DataNode *node, const PackedRecord *records, int count, int fill);
+void datanode_spread(DataNode *node, DataNode *const *new_nodes, const int *new_ids, int new_count,
+                     const PackedRecord *records, int count, int fill);
+void datanode_remove_at(DataNode *node, int pos);
+int datanode_is_underfull(const DataNode *node);
+void datanode_merge(DataNode *node, const DataNode *right);
+void datanode_redistribute(DataNode *left, DataNode *right);
 
 #endif // BPLUS_DATANODE_H
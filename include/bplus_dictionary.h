@@ -0,0 +1,65 @@
+#ifndef BPLUS_DICTIONARY_H
+#define BPLUS_DICTIONARY_H
+
+#include "record.h"
+
+// per column dictionaries of CHAR values. every CHAR attribute but the key
+// gets one, and records keep a code into it in place of the bytes. a coded
+// field has the layout of record_pack, only its bytes are the code:
+//   one byte below 0x80 for the first DICTIONARY_SHORT_CODES values,
+//   two bytes starting 0x80 to 0xfe for the rest up to DICTIONARY_MAX_CODES,
+//   DICTIONARY_RAW and then the value itself once the column is out of codes
+// values are only ever added, so a code stays valid for good. lookups and
+// decoding take no lock, adds must not run at the same time as each other
+#define DICTIONARY_SHORT_CODES 0x80
+#define DICTIONARY_MAX_CODES (DICTIONARY_SHORT_CODES + 0x7f * 256)
+#define DICTIONARY_RAW 0xff
+
+// most bytes a coded field takes
+#define DICTIONARY_FIELD_MAX (MAX_STRING_LENGTH + 1)
+
+typedef struct Dictionary Dictionary;
+
+// empty dictionaries for the attributes of schema that get coded
+Dictionary *dictionary_create(const TableSchema *schema);
+void dictionary_destroy(Dictionary *dict);
+
+// 1 if schema has an attribute that would be coded
+int dictionary_schema_codes(const TableSchema *schema);
+
+// 1 if attr is stored as codes
+int dictionary_coded(const Dictionary *dict, int attr);
+
+// values of attr with a code so far
+int dictionary_count(const Dictionary *dict, int attr);
+
+// code of the value, -1 if it has none
+int dictionary_find(const Dictionary *dict, int attr, const char *bytes, int length);
+
+// makes sure the next add to attr cannot fail, -1 if the column is out
+// of codes or memory
+int dictionary_reserve(Dictionary *dict, int attr);
+
+// gives the value the next code of attr, which is returned.
+// -1 if the column is out of codes or memory
+int dictionary_add(Dictionary *dict, int attr, const char *bytes, int length);
+
+// adds the values of record that have no code, while their columns have codes left
+// -1 if out of memory
+int dictionary_add_values(Dictionary *dict, const TableSchema *schema, const Record *record);
+
+// bytes of the value of code, an empty value for a code not given out
+const char *dictionary_value(const Dictionary *dict, int attr, int code, int *length);
+
+// the coded field of a value of attr, returns its length
+int dictionary_encode(const Dictionary *dict, int attr, const char *bytes, int length, char *out);
+
+// the value a coded field of attr stands for
+const char *dictionary_decode(const Dictionary *dict, int attr, const char *field, int length, int *value_length);
+
+// record_pack and record_unpack with the coded attributes as codes.
+// values without a code are stored as they are
+int dictionary_pack(const Dictionary *dict, const TableSchema *schema, const Record *record, char *buf);
+void dictionary_unpack(const Dictionary *dict, const TableSchema *schema, const char *buf, Record *record);
+
+#endif // BPLUS_DICTIONARY_H
@@ -4,20 +4,92 @@
 #include "record.h"
 #include "bplus_file_structs.h"
 #include "record_generator.h"
+#include "record_predicate.h"
 #include "bplus_index_node.h"
 #include "bplus_datanode.h"
+#include "bplus_pager.h"
 #include "bf.h"
 
 /**
  * @brief Creates a new empty B+ tree file with the given schema.
+ *
+ * The primary key may be an INT, a FLOAT or a CHAR of up to 4 bytes, the
+ * tree orders records by its int from record_get_key. Wider keys are not
+ * supported and fail.
  * @param schema Pointer to the TableSchema describing the table.
  * @param fileName Name of the file to create.
  * @return 0 on success, -1 on failure.
  */
 int bplus_create_file(const TableSchema *schema, const char *fileName);
 
+/**
+ * @brief Settings fixed when a B+ tree file is created.
+ *
+ * Zeroed options give the same file as bplus_create_file.
+ */
+typedef struct {
+  int page_size;  /**< Bytes per page: BF_BLOCK_SIZE (libbf, the default when 0) or a power of two from 4 KiB to 64 KiB (native pread/pwrite backend) */
+  int counted;    /**< 1 keeps the number of records under every index entry, for bplus_rank, bplus_select and bplus_count_range. Index nodes then hold a third fewer keys and concurrent inserts run one at a time */
+  int dictionary; /**< 1 stores the CHAR attributes other than the key as one or two byte codes into a dictionary of their values kept in the file, for columns with few distinct values. Packed records then need bplus_record_unpack */
+} BPlusCreateOptions;
+
+/**
+ * @brief Creates a new empty B+ tree file with a chosen page size.
+ *
+ * The page size and the node capacities derived from it are recorded in
+ * the metadata, so bplus_open_file picks the matching backend later on.
+ * @param schema Pointer to the TableSchema describing the table.
+ * @param fileName Name of the file to create.
+ * @param options Settings, or NULL for the defaults.
+ * @return 0 on success, -1 on failure.
+ */
+int bplus_create_file_with_options(const TableSchema *schema, const char *fileName,
+                                   const BPlusCreateOptions *options);
+
+/**
+ * @brief Source of records for bplus_bulk_load.
+ */
+typedef struct {
+  int (*next)(void *ctx, Record *record); /**< Fills record, returns 0, or -1 when exhausted */
+  void *ctx;                              /**< Passed back to next */
+  int sorted;                             /**< Non-zero if records come in ascending key order */
+} BPlusRecordIterator;
+
+/**
+ * @brief Creates a new B+ tree file and fills it bottom-up from a record source.
+ *
+ * Unsorted input is buffered and sorted first, sorted input is streamed.
+ * Records whose key was already loaded are skipped, as bplus_record_insert would.
+ * Leaves are packed to fill_factor and linked in key order, then the index
+ * levels are built on top of them. The metadata block is written once at the end.
+ * @param schema Pointer to the TableSchema describing the table.
+ * @param fileName Name of the file to create.
+ * @param iterator Source of the records to load.
+ * @param fill_factor Fraction of every node to fill, in (0, 1].
+ * @return 0 on success, -1 on failure.
+ */
+int bplus_bulk_load(const TableSchema *schema, const char *fileName,
+                    BPlusRecordIterator *iterator, double fill_factor);
+
+/**
+ * @brief Same as bplus_bulk_load, creating the file with the given settings.
+ * @param schema Pointer to the TableSchema describing the table.
+ * @param fileName Name of the file to create.
+ * @param iterator Source of the records to load.
+ * @param fill_factor Fraction of every node to fill, in (0, 1].
+ * @param options Settings, or NULL for the defaults.
+ * @return 0 on success, -1 on failure.
+ */
+int bplus_bulk_load_with_options(const TableSchema *schema, const char *fileName,
+                                 BPlusRecordIterator *iterator, double fill_factor,
+                                 const BPlusCreateOptions *options);
+
 /**
  * @brief Opens a B+ tree file and loads its metadata.
+ *
+ * The page manager backend is picked from the page size stored in the file.
+ * If the last session that logged changes did not close the file, its log
+ * (fileName with ".wal" appended) is replayed first.
  * @param fileName Name of the file to open.
  * @param file_desc Pointer to store the file descriptor.
  * @param metadata Pointer to store the metadata structure (allocated by the function).
@@ -26,24 +98,144 @@ int bplus_create_file(const TableSchema *schema, const char *fileName);
 int bplus_open_file(const char *fileName, int *file_desc, BPlusMeta **metadata);
 
 
+/**
+ * @brief Optional settings for bplus_open_file_with_options.
+ *
+ * Zeroed options give the same behaviour as bplus_open_file.
+ */
+typedef struct {
+  int index_cache_levels;  /**< Keep this many index levels below the root in memory (0 = no level limit) */
+  long index_cache_bytes;  /**< Memory budget for those levels in bytes (0 = no byte limit) */
+  int buffer_pool_mb;      /**< Buffer pool of the native backend in MB (0 = PAGER_DEFAULT_POOL_MB), libbf keeps its own */
+  PagerPolicy replacement; /**< Replacement policy of the native buffer pool (default LRU); libbf uses the one given to BF_Init */
+  int concurrent;          /**< Non-zero to allow calls from several threads at once, cannot be combined with the index cache */
+  int wal;                 /**< Non-zero to log inserts and deletes to fileName.wal so they survive a crash */
+  int wal_commit_interval_ms; /**< With wal, 0 makes every insert and delete wait until it is logged on disk; more lets them return at once and syncs the log at most this often */
+  long memtable_bytes;     /**< Buffer inserts in memory up to this many bytes and merge them into the tree in key order (0 = off) */
+  int bloom_bits_per_key;  /**< Bits per key of the Bloom filter that turns away lookups of absent keys (0 = 10, -1 = no filter) */
+} BPlusOpenOptions;
+
+/**
+ * @brief Opens a B+ tree file with extra settings.
+ *
+ * If index_cache_levels or index_cache_bytes is set, whole index levels
+ * from the root are copied into memory, as many as fit both limits.
+ * Descents route through these copies without pinning their blocks, and
+ * inserts keep them in step with the file.
+ *
+ * With concurrent set, lookups, scans and inserts from different threads
+ * run in parallel. Inserts latch blocks top-down (latch coupling) and keep
+ * write latches only on the nodes below the last one that cannot split.
+ * bplus_record_find, bplus_record_find_into and scans read optimistically:
+ * they take no latch, check per-block version counters after reading and
+ * retry when a writer was there, falling back to latches after a few tries.
+ * Deletes take the whole tree for themselves, so they wait for open record
+ * views and batch lookups, and new calls wait for a waiting delete. So a
+ * thread must release its own views before it modifies the tree, and
+ * before any other call while deletes may run.
+ *
+ * With wal set, inserts and deletes are appended to a redo log that is
+ * replayed by the next open after a crash. Threads waiting for the log
+ * share one sync (group commit). With a commit interval, changes made in
+ * the last interval before a crash may be lost, but never part of one.
+ * Block 0 is only rewritten at checkpoints: at close, and whenever the
+ * log has grown large, which waits for the other calls like a delete.
+ *
+ * With memtable_bytes set, bplus_record_insert only checks that the key is
+ * new and keeps the record in a memory buffer, returning 0 instead of a
+ * block id. Once the buffer holds memtable_bytes, all of it is inserted
+ * into the tree in key order, so random keys change each leaf once per
+ * merge rather than once per insert. Lookups and deletes see buffered
+ * records first. A scan, a checkpoint and closing the file merge the
+ * buffer first. With wal the buffered inserts are logged as they come, so
+ * they survive a crash like any other insert.
+ *
+ * Unless bloom_bits_per_key is -1, a Bloom filter over the keys is kept in
+ * memory. Lookups, batch lookups and deletes of a key it has never seen
+ * return at once without reading a block; about 1 in 100 absent keys gets
+ * through at the default 10 bits per key. Closing the file saves the filter
+ * in blocks of its own and the next open reads it back. A file that was
+ * bulk loaded starts with one, any other file has its leaves read once to
+ * build it, as after a crash. Deleted keys stay in the filter until it has
+ * seen twice the keys it was built with and is built again.
+ * @param fileName Name of the file to open.
+ * @param file_desc Pointer to store the file descriptor.
+ * @param metadata Pointer to store the metadata structure (allocated by the function).
+ * @param options Settings, or NULL for the defaults.
+ * @return 0 on success, -1 on failure.
+ */
+int bplus_open_file_with_options(const char *fileName, int *file_desc, BPlusMeta **metadata,
+                                 const BPlusOpenOptions *options);
+
+/**
+ * @brief Opens a B+ tree file for lookups and scans only, by mapping it into memory.
+ *
+ * Pages are read in place from the mapping, so the OS page cache stands in
+ * for the buffer pool and pinning costs nothing. Views and packed scan
+ * records point straight into the mapping. Inserts and deletes fail, and
+ * closing does not write the metadata back. The file must not be changed
+ * by anyone else while it is mapped.
+ * @param fileName Name of the file to open.
+ * @param file_desc Pointer to store the file descriptor.
+ * @param metadata Pointer to store the metadata structure (allocated by the function).
+ * @return 0 on success, -1 on failure or if the file is not a B+ tree file.
+ */
+int bplus_open_file_readonly(const char *fileName, int *file_desc, BPlusMeta **metadata);
+
 /**
  * @brief Closes a B+ tree file and frees its metadata.
  * @param file_desc File descriptor of the B+ tree file.
- * @param metadata Pointer to the BPlusMeta structure to free.
+ * @param metadata Pointer to the BPlusMeta structure to free. With NULL only
+ *        file_desc is closed, which must then be a libbf file descriptor.
  * @return 0 on success, -1 on failure.
  */
 int bplus_close_file(int file_desc, BPlusMeta* metadata);
 
+/**
+ * @brief Waits until every insert and delete so far is logged on disk.
+ *
+ * Only needed with a commit interval, e.g. at the end of a batch.
+ * Does nothing if the file was not opened with wal.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @return 0 on success, -1 on failure.
+ */
+int bplus_sync(int file_desc, BPlusMeta *metadata);
+
 
 /**
  * @brief Inserts a record into the B+ tree.
+ *
+ * Keys past the end of the tree go straight into the rightmost leaf while
+ * it has room, without a descent from the root. When the rightmost leaf or
+ * index node splits for such a key it stays full and the new node starts
+ * almost empty, so ascending keys leave the tree packed instead of half full.
  * @param file_desc File descriptor of the B+ tree file.
  * @param metadata Pointer to the BPlusMeta structure of the tree.
  * @param record Record to insert.
- * @return Block ID of inserted record on success, -1 on failure.
+ * @return Block ID of inserted record on success (0 if it was buffered in the memtable), -1 on failure or if the key already exists.
  */
 int bplus_record_insert(int file_desc, BPlusMeta* metadata, const Record *record);
 
+/**
+ * @brief Inserts a batch of records into the B+ tree.
+ *
+ * The batch is sorted by key once and inserted run by run: the records
+ * that go to the same leaf are put in during one descent, and a leaf that
+ * runs out of room is split once into as many leaves as the run needs,
+ * with all their separators going into the parent together. The metadata
+ * block is written at most once for the whole batch. Records whose key is
+ * already in the tree, or earlier in the batch, are skipped. With a
+ * memtable the buffered inserts are merged first and the batch goes
+ * straight into the tree.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param records Records to insert, in any order.
+ * @param n Number of records.
+ * @return Number of records inserted, -1 on failure (records before the failure may be in).
+ */
+int bplus_record_insert_batch(int file_desc, BPlusMeta *metadata, const Record *records, int n);
+
 /**
  * @brief Finds a record in the B+ tree by key.
  * @param file_desc File descriptor of the B+ tree file.
@@ -54,4 +246,327 @@ int bplus_record_insert(int file_desc, BPlusMeta* metadata, const Record *record
  */
 int bplus_record_find(int file_desc, const BPlusMeta *metadata, int key, Record** out_record);
 
+/**
+ * @brief Finds a record in the B+ tree by key, copying it into caller storage.
+ *
+ * Unlike bplus_record_find nothing is allocated, the descent reuses block
+ * handles kept by the open file.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param key Key value to search for.
+ * @param out_record Receives the record if found, may be NULL to only test for the key.
+ * @return 0 if found, -1 if not found.
+ */
+int bplus_record_find_into(int file_desc, const BPlusMeta *metadata, int key, Record *out_record);
+
+/**
+ * @brief Borrowed view of a stored record, returned by bplus_record_find_view.
+ *
+ * The leaf holding the record stays pinned until bplus_record_view_release.
+ */
+typedef struct {
+  const char *packed;         /**< Record bytes in record_pack format, decode with bplus_record_unpack */
+  int length;                 /**< Number of packed bytes */
+  const TableSchema *schema;  /**< Schema to decode packed with */
+  const BPlusMeta *meta;      /**< Internal, tree the view belongs to */
+  Page page;                  /**< Internal, pinned leaf page */
+} BPlusRecordView;
+
+/**
+ * @brief Finds a record in the B+ tree by key without copying it.
+ *
+ * The view points into the buffer pool, so it must be released before the
+ * tree is modified, and a pinned view holds one buffer frame. On a file
+ * opened with bplus_open_file_readonly it points into the mapping instead.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param key Key value to search for.
+ * @param view Receives the view; nothing is left to release if not found.
+ * @return 0 if found, -1 if not found.
+ */
+int bplus_record_find_view(int file_desc, const BPlusMeta *metadata, int key, BPlusRecordView *view);
+
+/**
+ * @brief Unpacks a record of the file from its packed bytes.
+ *
+ * Same as record_unpack with the file's schema, except that the values of
+ * a file created with BPlusCreateOptions.dictionary are looked up by their
+ * codes as well.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param packed Bytes from bplus_record_find_view or bplus_scan_next_packed.
+ * @param record Pointer to store the record.
+ */
+void bplus_record_unpack(const BPlusMeta *metadata, const char *packed, Record *record);
+
+/**
+ * @brief Unpins the block behind a view returned by bplus_record_find_view.
+ * @param view View to release, safe to call again on a released view.
+ */
+void bplus_record_view_release(BPlusRecordView *view);
+
+/**
+ * @brief Finds many records at once, sharing the descent between keys.
+ *
+ * Keys are sorted and routed down the tree together, so every index and
+ * leaf block is pinned once for all the keys that go through it.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param keys Keys to search for, in any order.
+ * @param n Number of keys.
+ * @param out Array of n records; out[i] receives the record of keys[i] if found.
+ * @param found Array of n flags (may be NULL); found[i] is 1 if keys[i] was found, 0 otherwise.
+ * @return Number of keys found, -1 on failure.
+ */
+int bplus_record_find_batch(int file_desc, const BPlusMeta *metadata, const int *keys, int n,
+                            Record *out, int *found);
+
+/**
+ * @brief Deletes a record from the B+ tree by key.
+ *
+ * Underfull nodes borrow from or merge with a sibling and the tree gets
+ * shorter when the root is left with a single child. Blocks that drop out
+ * of the tree go on a free list and are reused by later inserts.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param key Key of the record to delete.
+ * @return 0 on success, -1 if not found or on failure.
+ */
+int bplus_record_delete(int file_desc, BPlusMeta *metadata, int key);
+
+/**
+ * @brief Rewrites the leaves in key order into new blocks at the end of the file.
+ *
+ * After random inserts the leaf chain jumps between blocks all over the file.
+ * This copies the leaves, a group of siblings at a time, into blocks that
+ * follow each other, packed to fill_factor of a leaf (leaves already fuller
+ * than that are packed full instead of split), and puts the old blocks on the
+ * free list. Groups that are already in order and packed are left alone. The
+ * pass goes on where the last call stopped, so it can be spread over many
+ * short calls between other work; each call blocks writers only while it runs.
+ * Index nodes stay where they are.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param fill_factor Share of a leaf to fill, in (0, 1].
+ * @param max_leaves Leaves to go through in this call, 0 for the rest of the pass.
+ * @return 1 if the pass is not done yet, 0 when it is, -1 on failure.
+ */
+int bplus_reorganize(int file_desc, BPlusMeta *metadata, double fill_factor, int max_leaves);
+
+/**
+ * @brief Counts the records with a key smaller than key.
+ *
+ * Only for files created with BPlusCreateOptions.counted. The counts kept in
+ * the index nodes left of the path to key are added up, so this reads one
+ * block per level instead of the leaves before key.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param key Key to rank, it does not have to be in the tree.
+ * @return The number of smaller keys, -1 on failure or if the file is not counted.
+ */
+long bplus_rank(int file_desc, const BPlusMeta *metadata, int key);
+
+/**
+ * @brief Finds the record at position k in key order.
+ *
+ * Only for files created counted. The descent skips whole children by their
+ * counts, one block per level. bplus_select(k) for k = bplus_rank(key) is the
+ * record with key if there is one.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param k Position, 0 for the record with the smallest key.
+ * @param out_record Pointer to store the record (may be NULL).
+ * @return 0 if found, -1 if the tree has k records or fewer, on failure or if the file is not counted.
+ */
+int bplus_select(int file_desc, const BPlusMeta *metadata, long k, Record *out_record);
+
+/**
+ * @brief Counts the records with lo <= key <= hi.
+ *
+ * Only for files created counted. Two descents, one for each end of the
+ * range, whatever its length; inserts wait while they run.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param lo Lowest key of the range (inclusive).
+ * @param hi Highest key of the range (inclusive).
+ * @return The number of records in the range, -1 on failure or if the file is not counted.
+ */
+long bplus_count_range(int file_desc, const BPlusMeta *metadata, int lo, int hi);
+
+/**
+ * @brief Cursor over the records of a key range, in key order.
+ */
+typedef struct BPlusScan BPlusScan;
+
+/**
+ * @brief Opens a range scan over all records with lo <= key <= hi.
+ *
+ * Descends once to the first leaf of the range and then follows the leaf
+ * chain. At most one leaf block stays pinned while the cursor is open.
+ * Leaves after the first are read with a sequential hint, so with the
+ * CLOCK or 2Q policies a long scan does not evict the pages lookups use.
+ * On a file opened concurrent nothing stays pinned between calls, every
+ * record is copied out under a version check instead.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param lo Lowest key of the range (inclusive).
+ * @param hi Highest key of the range (inclusive).
+ * @return The cursor on success, NULL on failure.
+ */
+BPlusScan *bplus_scan_open(int file_desc, const BPlusMeta *metadata, int lo, int hi);
+
+/**
+ * @brief Opens a range scan that returns only the records matching a predicate.
+ *
+ * Each record of the range is tested in its packed form where it lies, in
+ * the pinned leaf (or the copy a concurrent scan makes), by the accessors
+ * predicate_compile worked out, so records that fail are never unpacked.
+ * Terms on the primary key also narrow the range before the descent.
+ * bplus_scan_next copies only the projected attributes of a match and
+ * leaves the other fields of out_record as they are; bplus_scan_next_packed
+ * returns matches whole. The predicate and projection are copied, they
+ * need not outlive this call.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param lo Lowest key of the range (inclusive).
+ * @param hi Highest key of the range (inclusive).
+ * @param where Predicate compiled against the file's schema, NULL to return every record.
+ * @param columns Attributes to copy out, NULL for all of them.
+ * @return The cursor on success, NULL on failure.
+ */
+BPlusScan *bplus_scan_open_where(int file_desc, const BPlusMeta *metadata, int lo, int hi,
+                                 const Predicate *where, const Projection *columns);
+
+/**
+ * @brief Copies the next record of the range into out_record.
+ * @param scan Cursor returned by bplus_scan_open.
+ * @param out_record Pointer to store the record.
+ * @return 0 if a record was returned, -1 when the range is exhausted or on failure.
+ */
+int bplus_scan_next(BPlusScan *scan, Record *out_record);
+
+/**
+ * @brief Returns the next record of the range without copying it.
+ *
+ * The bytes stay valid until the next call on the cursor or bplus_scan_close.
+ * @param scan Cursor returned by bplus_scan_open.
+ * @param packed Receives the record bytes in record_pack format, decode with bplus_record_unpack.
+ * @param length Receives the number of packed bytes.
+ * @return 0 if a record was returned, -1 when the range is exhausted or on failure.
+ */
+int bplus_scan_next_packed(BPlusScan *scan, const char **packed, int *length);
+
+/**
+ * @brief Unpins the current leaf and frees the cursor.
+ * @param scan Cursor returned by bplus_scan_open (may be NULL).
+ */
+void bplus_scan_close(BPlusScan *scan);
+
+/**
+ * @brief Builds a secondary index on an attribute that is not the primary key.
+ *
+ * The index is a B+ tree file of its own, fileName.attr_name.idx, keyed on
+ * the value of the attribute. Each value holds a posting list: blocks filled
+ * with just the primary keys of the records that have it, so a value shared
+ * by many records costs 4 bytes per record. From then on bplus_record_insert,
+ * bplus_record_insert_batch and bplus_record_delete keep the index up to
+ * date, and bplus_open_file opens it with the file. An index that was not
+ * saved by bplus_close_file, after a crash, is built again by the next open.
+ * Lookups made while this runs may miss records.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param attr_name Name of the attribute to index.
+ * @return 0 on success, -1 on failure or if the attribute has an index already.
+ */
+int bplus_create_secondary_index(int file_desc, BPlusMeta *metadata, const char *attr_name);
+
+/**
+ * @brief Cursor over the records that have one value of an indexed attribute.
+ */
+typedef struct BPlusSecondaryScan BPlusSecondaryScan;
+
+/**
+ * @brief Opens a lookup of the records whose attribute attr_name equals value.
+ *
+ * The posting list of value is copied out and sorted, and the records are
+ * then fetched in primary key order with batched lookups. Values are compared
+ * by their first 4 bytes in the index, so records of values that only share
+ * those are fetched too and skipped.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param attr_name Name of an attribute with a secondary index.
+ * @param value Value to look for, in the field of the attribute's type.
+ * @return The cursor on success, NULL on failure or if the attribute has no index.
+ */
+BPlusSecondaryScan *bplus_secondary_scan_open(int file_desc, const BPlusMeta *metadata, const char *attr_name,
+                                              const FieldValue *value);
+
+/**
+ * @brief Copies the next matching record into out_record.
+ * @param scan Cursor returned by bplus_secondary_scan_open.
+ * @param out_record Pointer to store the record.
+ * @return 0 if a record was returned, -1 when there are no more or on failure.
+ */
+int bplus_secondary_scan_next(BPlusSecondaryScan *scan, Record *out_record);
+
+/**
+ * @brief Frees the cursor.
+ * @param scan Cursor returned by bplus_secondary_scan_open (may be NULL).
+ */
+void bplus_secondary_scan_close(BPlusSecondaryScan *scan);
+
+/**
+ * @brief Levels bplus_stats_snapshot counts splits for, level 0 are the leaves.
+ */
+#define BPLUS_STATS_LEVELS 32
+
+/**
+ * @brief Latencies of one kind of operation, in nanoseconds.
+ */
+typedef struct {
+  long count;                   /**< Operations timed */
+  long mean_ns;                 /**< Average latency */
+  long max_ns;                  /**< Slowest operation */
+  long p50_ns;                  /**< Median, within 1/8th as the histogram buckets are */
+  long p99_ns;                  /**< 99th percentile */
+  long p999_ns;                 /**< 99.9th percentile */
+  LatencyHistogram histogram;   /**< The buckets, for other percentiles use latency_percentile */
+} BPlusLatency;
+
+/**
+ * @brief What the tree of an open file did since it was opened or last reset.
+ */
+typedef struct {
+  int enabled;                           /**< 0 unless the library was built with -DBPLUS_STATS=1, all else is then 0 */
+  long pins;                             /**< Pages pinned through the pager */
+  long reads;                            /**< Pages read from the file; libbf: BF_GetBlock calls, mmap: 0 */
+  long dirty_marks;                      /**< Pages marked dirty */
+  long file_growth;                      /**< Pages added at the end of the file */
+  long blocks_allocated;                 /**< Blocks taken for nodes, from the free list or the end of the file */
+  long bytes_allocated;                  /**< blocks_allocated in bytes */
+  long splits[BPLUS_STATS_LEVELS];       /**< Nodes split per level, 0 for the leaves */
+  long height_changes;                   /**< Roots added on top by splits or taken away by deletes */
+  BPlusLatency find;                     /**< bplus_record_find, _find_into and _find_view */
+  BPlusLatency insert;                   /**< bplus_record_insert */
+} BPlusStats;
+
+/**
+ * @brief Copies the statistics of an open file.
+ *
+ * The counters are read one by one while other threads may be bumping them,
+ * so on a concurrent file they need not add up exactly with each other.
+ * Secondary indexes are files of their own and are not included.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ * @param stats Receives the statistics.
+ * @return 0 on success, -1 if the library was built without statistics (the default, see -DBPLUS_STATS=1).
+ */
+int bplus_stats_snapshot(int file_desc, const BPlusMeta *metadata, BPlusStats *stats);
+
+/**
+ * @brief Sets all statistics of an open file back to 0.
+ * @param file_desc File descriptor of the B+ tree file.
+ * @param metadata Pointer to the BPlusMeta structure of the tree.
+ */
+void bplus_stats_reset(int file_desc, BPlusMeta *metadata);
+
 #endif 
@@ -0,0 +1,31 @@
+#ifndef BPLUS_INDEX_CACHE_H
+#define BPLUS_INDEX_CACHE_H
+
+#include "bplus_index_node.h"
+
+// private copies of the top index levels of an open tree
+// keyed by block id, so descents can route through them without
+// going to the buffer manager
+typedef struct IndexCache IndexCache;
+
+IndexCache *index_cache_create(int max_levels, long max_bytes);
+void index_cache_destroy(IndexCache *cache);
+void index_cache_clear(IndexCache *cache);
+
+// cached copy of block_id, NULL if it is not cached
+const IndexNode *index_cache_get(const IndexCache *cache, int block_id);
+
+// add or overwrite the copy of block_id
+int index_cache_put(IndexCache *cache, int block_id, const IndexNode *node);
+void index_cache_remove(IndexCache *cache, int block_id);
+
+// levels from the root that are fully cached
+int index_cache_levels(const IndexCache *cache);
+void index_cache_set_levels(IndexCache *cache, int levels);
+
+// limits given at creation, 0 means no limit
+int index_cache_max_levels(const IndexCache *cache);
+long index_cache_max_bytes(const IndexCache *cache);
+long index_cache_bytes(const IndexCache *cache);
+
+#endif // BPLUS_INDEX_CACHE_H
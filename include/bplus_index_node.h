@@ -1,24 +1,50 @@
 #ifndef BPLUS_INDEX_NODE_H
 #define BPLUS_INDEX_NODE_H
 
-// max keys for index node
-// block 512 bytes. key is 4 bytes, pointer is 4 bytes
-// 512 / 8 = 64. minus overhead.. we use 60 to be safe
-#define MAX_KEYS_INDEX 60
-
+// index block layout:
+//   IndexNode header | keys[max_keys] | children[max_keys + 1]
+// nodes of a counted tree also keep the records under each child:
+//   ... | children[max_keys + 1] | counts[max_keys + 1]
+// max_keys depends on the page size, every node records its own so the
+// helpers below work on any page size
 typedef struct {
-  int count;                    // key count
-  int keys[MAX_KEYS_INDEX];     // the keys
-  int children[MAX_KEYS_INDEX + 1]; // child pointers
+  int count;                // key count
+  unsigned short max_keys;  // capacity, set by indexnode_init
+  unsigned short counted;   // 1 if the counts follow the children, 0 in older files
+  int keys[];               // the keys, child pointers come right after them
 } IndexNode;
 
+// keys that fit in an index node of a page_size bytes page
+// key is 4 bytes, pointer is 4 bytes, one extra pointer
+#define INDEXNODE_MAX_KEYS(page_size) \
+  (((page_size) - (int)sizeof(IndexNode) - (int)sizeof(int)) / (2 * (int)sizeof(int)))
+
+// same for a counted node, a count goes with every pointer
+#define INDEXNODE_MAX_KEYS_COUNTED(page_size) \
+  (((page_size) - (int)sizeof(IndexNode) - 2 * (int)sizeof(int)) / (3 * (int)sizeof(int)))
+
+// bytes of a node with max_keys keys, header, keys, children and counts
+#define INDEXNODE_SIZE(max_keys, counted) \
+  ((int)sizeof(IndexNode) + (2 * (max_keys) + 1 + ((counted) ? (max_keys) + 1 : 0)) * (int)sizeof(int))
+
 // helpers
-void indexnode_init(IndexNode *node);
+// the ones that move children move the counts of counted nodes with
+// them, right_counts may be NULL for the others
+void indexnode_init(IndexNode *node, int page_size, int counted);
+int *indexnode_children(const IndexNode *node);
+int *indexnode_counts(const IndexNode *node);
+long indexnode_total(const IndexNode *node);
+int indexnode_size(const IndexNode *node);
+int indexnode_min_keys(const IndexNode *node);
 int indexnode_find_child_index(const IndexNode *node, int key);
+int indexnode_find_lower_child_index(const IndexNode *node, int key);
 int indexnode_get_child(const IndexNode *node, int key);
-int indexnode_is_full(const IndexNode *node);
-void indexnode_insert_at(IndexNode *node, int pos, int key, int right_child);
-void indexnode_split(IndexNode *node, IndexNode *new_node, int new_key,
-                     int new_child, int insert_pos, int *promoted_key);
+void indexnode_insert_many(IndexNode *node, int pos, const int *keys, const int *right_children,
+                           const int *right_counts, int count);
+void indexnode_split_many(IndexNode *node, IndexNode *new_node, const int *keys, const int *right_children,
+                          const int *right_counts, int count, int insert_pos, int append, int *promoted_key);
+void indexnode_remove_at(IndexNode *node, int pos);
+int indexnode_is_underfull(const IndexNode *node);
+void indexnode_merge(IndexNode *node, int separator, const IndexNode *right);
 
 #endif // BPLUS_INDEX_NODE_H
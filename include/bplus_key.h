@@ -0,0 +1,54 @@
+#ifndef BPLUS_KEY_H
+#define BPLUS_KEY_H
+
+#include "record.h"
+
+// order-preserving normalized keys. the key attribute of a record is
+// written as bytes that memcmp orders the way the values order, at a fixed
+// width, so comparing two keys never looks at the schema:
+//   INT    4 bytes big endian with the sign bit flipped
+//   FLOAT  4 bytes, the sign bit flipped for positives and every bit for
+//          negatives, -0 is stored as 0 and every NaN as one NaN after +inf
+//   CHAR   length bytes, zero padded, so a prefix sorts before the longer string
+// the tree itself orders by one int per key, the first KEY_TREE_WIDTH
+// normalized bytes. only primary keys that fit those bytes whole can be
+// indexed: INT, FLOAT and CHAR of up to 4. wider keys are refused when a
+// file is created or bulk loaded, there is no fallback that compares the
+// full keys when the int prefixes tie. keys are one attribute, there are no
+// composite keys
+
+// widest normalized key, a CHAR of the largest length
+#define KEY_MAX_WIDTH MAX_STRING_LENGTH
+
+// bytes of a normalized key the tree orders by, one int
+#define KEY_TREE_WIDTH 4
+
+typedef struct {
+  int attr;    // schema index of the key attribute
+  int width;   // bytes of a normalized key
+} KeyCodec;
+
+// codec for the attribute of schema at attr
+// -1 if it is TYPE_NULL or out of range
+int key_codec_init(KeyCodec *codec, const TableSchema *schema, int attr);
+
+// codec for the primary key of schema
+int key_codec_primary(KeyCodec *codec, const TableSchema *schema);
+
+// write the normalized key of record to out, codec->width bytes
+void key_normalize(const KeyCodec *codec, const TableSchema *schema, const Record *record, unsigned char *out);
+
+// codec for the primary key of schema if it fits the tree's int keys
+// whole, otherwise says why and returns -1. an open file builds it once
+int key_tree_codec(KeyCodec *codec, const TableSchema *schema);
+
+// int key of record the tree orders by, for a codec from key_tree_codec.
+// for an INT it is the value itself
+int key_tree_key(const KeyCodec *codec, const TableSchema *schema, const Record *record);
+
+// the first KEY_TREE_WIDTH bytes of a normalized key as an int with the
+// same order, shorter keys are padded with zeros. for a key no wider than
+// that it is the whole key, for an INT it is the value itself
+int key_prefix(const unsigned char *normalized, int width);
+
+#endif // BPLUS_KEY_H
@@ -0,0 +1,60 @@
+#ifndef BPLUS_LATCH_H
+#define BPLUS_LATCH_H
+
+#include <pthread.h>
+
+// latches of a tree open for use from several threads
+//   tree:  shared by lookups, scans and inserts, exclusive for deletes
+//   root:  guards root_block_id and height, taken before the root block
+//   alloc: guards the free list head and total_blocks
+//   memtable: guards the buffered inserts, taken inside tree
+//   dictionary: lets one thread at a time give values codes, taken inside tree
+//   pages: one reader/writer latch per block id, taken top-down
+//          (and left to right along the leaf chain) so they cannot deadlock
+// next to every latch is a version word for optimistic readers, which
+// take no latch at all: a writer makes the version odd while it changes
+// what the version covers, a reader that sees it odd or changed retries
+typedef struct LatchTable LatchTable;
+
+typedef struct {
+  pthread_rwlock_t tree;
+  pthread_rwlock_t root;
+  pthread_mutex_t alloc;
+  pthread_rwlock_t memtable;
+  pthread_mutex_t dictionary;
+  LatchTable *pages;
+  unsigned int tree_version;   // odd while a delete runs
+  unsigned int root_version;   // odd while root_block_id and height change
+} TreeLatches;
+
+TreeLatches *tree_latches_create(void);
+void tree_latches_destroy(TreeLatches *latches);
+
+void latch_shared(TreeLatches *latches, int block_id);
+void latch_exclusive(TreeLatches *latches, int block_id);
+void latch_release(TreeLatches *latches, int block_id);
+
+// version word of block_id
+unsigned int *latch_version(TreeLatches *latches, int block_id);
+
+static inline unsigned int version_read(const unsigned int *version) {
+  return __atomic_load_n(version, __ATOMIC_ACQUIRE);
+}
+
+// nothing was written since seen was read, seen must have been even
+static inline int version_validate(const unsigned int *version, unsigned int seen) {
+  __atomic_thread_fence(__ATOMIC_ACQUIRE);
+  return __atomic_load_n(version, __ATOMIC_RELAXED) == seen;
+}
+
+// only with the latch that covers the version held exclusive
+static inline void version_write_begin(unsigned int *version) {
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void version_write_end(unsigned int *version) {
+  __atomic_store_n(version, *version + 1, __ATOMIC_RELEASE);
+}
+
+#endif // BPLUS_LATCH_H
@@ -0,0 +1,39 @@
+#ifndef BPLUS_MEMTABLE_H
+#define BPLUS_MEMTABLE_H
+
+// in-memory buffer of packed records keyed by int, a hash table that is
+// put in key order only when asked to. entries are carved out of large
+// chunks and only given back all at once by memtable_clear, so an entry
+// never moves and a removed one keeps its memory until then
+typedef struct Memtable Memtable;
+
+// one record in the memtable, valid until memtable_clear
+typedef struct MemtableEntry MemtableEntry;
+
+Memtable *memtable_create(void);
+void memtable_destroy(Memtable *table);
+void memtable_clear(Memtable *table);
+
+// copy a packed record in under key
+// returns 0 if put, 1 if key is there already, -1 if out of memory
+int memtable_put(Memtable *table, int key, const char *packed, int length);
+
+// entry of key, NULL if it is not there
+const MemtableEntry *memtable_get(const Memtable *table, int key);
+
+// take key out, -1 if it is not there
+int memtable_remove(Memtable *table, int key);
+
+// all entries in key order, *count gets how many
+// the array is the table's and valid until it changes, NULL if out of memory
+const MemtableEntry *const *memtable_sorted(Memtable *table, int *count);
+
+int memtable_entry_key(const MemtableEntry *entry);
+const char *memtable_entry_packed(const MemtableEntry *entry, int *length);
+
+int memtable_count(const Memtable *table);
+
+// memory taken by the entries and their slots, removed entries included
+long memtable_bytes(const Memtable *table);
+
+#endif // BPLUS_MEMTABLE_H
@@ -0,0 +1,147 @@
+#ifndef BPLUS_PAGER_H
+#define BPLUS_PAGER_H
+
+#include "bplus_stats.h"
+#include <pthread.h>
+
+// page manager the tree code goes through instead of calling libbf
+// directly. a backend supplies the ops, the tree only sees pinned pages
+//   libbf:  512 byte blocks through BF_GetBlock and friends
+//   native: 4 KiB to 64 KiB pages in its own buffer pool, pread/pwrite I/O
+//   mmap:   read-only, any page size, pages addressed in a mapping of the file
+
+// smallest and largest page of the native backend
+#define PAGER_NATIVE_MIN_PAGE_SIZE 4096
+#define PAGER_NATIVE_MAX_PAGE_SIZE 65536
+
+// buffer pool of the native backend when no size is given
+#define PAGER_DEFAULT_POOL_MB 8
+
+typedef struct Pager Pager;
+
+// replacement policy of the native buffer pool
+// libbf files keep the algorithm given to BF_Init
+typedef enum {
+  PAGER_POLICY_LRU = 0,  // least recently used
+  PAGER_POLICY_CLOCK,    // second chance, one reference bit per frame
+  PAGER_POLICY_2Q        // new pages wait in a fifo, only re-referenced ones reach the lru
+} PagerPolicy;
+
+// how a page is going to be used, lets the pool keep sequential
+// reads from pushing out the pages lookups keep coming back to
+typedef enum {
+  PAGER_HINT_NORMAL = 0,
+  PAGER_HINT_SEQUENTIAL  // read once in order, e.g. the leaf chain during a scan
+} PagerHint;
+
+// settings for opening a file, zeroed means defaults
+typedef struct {
+  int pool_mb;          // native buffer pool size, 0 for PAGER_DEFAULT_POOL_MB
+  PagerPolicy policy;   // native replacement policy
+} PagerConfig;
+
+// a pinned page, valid until it is unpinned
+typedef struct {
+  char *data;   // page_size bytes
+  int id;       // page number in the file
+  void *frame;  // backend handle for the page
+} Page;
+
+// what the tree asked of a pager, counted when BPLUS_STATS is 1
+typedef struct {
+  long pins;          // pages handed out by get and allocate
+  long reads;         // pages the backend read from the file (libbf: BF_GetBlock calls)
+  long dirty_marks;   // set_dirty calls
+  long allocations;   // pages added at the end of the file
+} PagerStats;
+
+typedef struct {
+  int (*get)(Pager *pager, int id, PagerHint hint, Page *page);
+  int (*allocate)(Pager *pager, Page *page);  // new zeroed page at the end of the file
+  void (*set_dirty)(Pager *pager, Page *page);
+  void (*unpin)(Pager *pager, Page *page);
+  int (*page_count)(Pager *pager);
+  int (*close)(Pager *pager);                 // writes dirty pages back and frees the pager
+  // the changes to a pinned page are in the log up to lsn, the page must
+  // not reach the file before the log is on disk that far
+  void (*set_lsn)(Pager *pager, Page *page, long lsn);
+  int (*sync)(Pager *pager);                  // writes dirty pages back and syncs the file
+} PagerOps;
+
+struct Pager {
+  const PagerOps *ops;
+  int page_size;
+  int fd;         // handed out as file_desc by the public API
+  int read_only;  // allocate fails and pages must not be changed
+  // set by pager_make_thread_safe: ops then take lock around the backend ops
+  const PagerOps *backend_ops;
+  pthread_mutex_t *lock;
+  // write-ahead log of the tree, NULL if it keeps none
+  struct Wal *wal;
+  PagerStats stats;
+};
+
+// create an empty file for pages of page_size bytes and open it
+// BF_BLOCK_SIZE picks libbf, other sizes the native backend
+Pager *pager_create(const char *fileName, int page_size, const PagerConfig *config);
+
+// open an existing file whose pages are page_size bytes
+Pager *pager_open(const char *fileName, int page_size, const PagerConfig *config);
+
+// read the first n bytes of a file without opening it through a backend
+int pager_peek(const char *fileName, void *buf, int n);
+
+// let several threads call the pager, each op holds a mutex for its duration
+// libbf pagers share one mutex since libbf state is global
+int pager_make_thread_safe(Pager *pager);
+
+// is page_size supported by one of the backends?
+int pager_page_size_valid(int page_size);
+
+// backends
+Pager *pager_bf_open(const char *fileName, int create);
+Pager *pager_native_open(const char *fileName, int page_size, const PagerConfig *config, int create);
+Pager *pager_mmap_open(const char *fileName, int page_size);
+
+static inline int pager_get(Pager *pager, int id, Page *page) {
+  STATS_ADD(pager->stats.pins, 1);
+  return pager->ops->get(pager, id, PAGER_HINT_NORMAL, page);
+}
+
+static inline int pager_get_hinted(Pager *pager, int id, PagerHint hint, Page *page) {
+  STATS_ADD(pager->stats.pins, 1);
+  return pager->ops->get(pager, id, hint, page);
+}
+
+static inline int pager_allocate(Pager *pager, Page *page) {
+  STATS_ADD(pager->stats.pins, 1);
+  STATS_ADD(pager->stats.allocations, 1);
+  return pager->ops->allocate(pager, page);
+}
+
+static inline void pager_set_dirty(Pager *pager, Page *page) {
+  STATS_ADD(pager->stats.dirty_marks, 1);
+  pager->ops->set_dirty(pager, page);
+}
+
+static inline void pager_unpin(Pager *pager, Page *page) {
+  pager->ops->unpin(pager, page);
+}
+
+static inline int pager_page_count(Pager *pager) {
+  return pager->ops->page_count(pager);
+}
+
+static inline void pager_set_lsn(Pager *pager, Page *page, long lsn) {
+  pager->ops->set_lsn(pager, page, lsn);
+}
+
+static inline int pager_sync(Pager *pager) {
+  return pager->ops->sync(pager);
+}
+
+static inline int pager_close(Pager *pager) {
+  return pager->ops->close(pager);
+}
+
+#endif // BPLUS_PAGER_H
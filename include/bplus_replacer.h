@@ -0,0 +1,29 @@
+#ifndef BPLUS_REPLACER_H
+#define BPLUS_REPLACER_H
+
+#include "bplus_pager.h"
+
+// replacement policy state of a buffer pool with nframes frames
+// the pool tells it when frames get a page, are hit and are emptied,
+// and asks it which frame to empty next
+typedef struct Replacer Replacer;
+
+// returns non-zero if frame f is pinned and must not be evicted
+typedef int (*ReplacerPinned)(void *ctx, int f);
+
+Replacer *replacer_create(PagerPolicy policy, int nframes);
+void replacer_destroy(Replacer *r);
+
+// frame f was just filled with page_id after a miss
+void replacer_on_load(Replacer *r, int f, int page_id, PagerHint hint);
+
+// frame f was requested again
+void replacer_on_hit(Replacer *r, int f, PagerHint hint);
+
+// frame f to evict next, -1 if every frame is pinned
+int replacer_victim(Replacer *r, ReplacerPinned pinned, void *ctx);
+
+// frame f holding page_id is being emptied
+void replacer_on_evict(Replacer *r, int f, int page_id);
+
+#endif // BPLUS_REPLACER_H
@@ -0,0 +1,17 @@
+#ifndef BPLUS_SEARCH_H
+#define BPLUS_SEARCH_H
+
+// key search kernels shared by index and leaf nodes
+// keys must be sorted ascending. the kernel (AVX2, SSE4.2 or scalar)
+// is picked once at runtime from what the cpu supports
+
+// number of keys < key, i.e. position of the first key >= key
+int search_lower_bound(const int *keys, int n, int key);
+
+// number of keys <= key, i.e. position of the first key > key
+int search_upper_bound(const int *keys, int n, int key);
+
+// name of the kernel in use, "avx2", "sse4.2" or "scalar"
+const char *search_kernel_name(void);
+
+#endif // BPLUS_SEARCH_H
@@ -0,0 +1,81 @@
+#ifndef BPLUS_STATS_H
+#define BPLUS_STATS_H
+
+#include <time.h>
+
+// operation counters and latency histograms of an open file. they are
+// only compiled in when the library is built with -DBPLUS_STATS=1 (make
+// STATS=1), otherwise every hook below is empty and the tree pays nothing
+// for them, not even a clock read per find. counters are bumped with
+// relaxed atomics, so threads of a concurrent file can share them
+#ifndef BPLUS_STATS
+#define BPLUS_STATS 0
+#endif
+
+// latencies go into log-linear buckets: exact below 8 ns, then 8 buckets
+// for every power of two, so a percentile is off by at most 1/8th. the last
+// bucket also takes everything slower than about a minute
+#define LATENCY_SUB_BUCKETS 8
+#define LATENCY_BUCKETS 272
+
+typedef struct {
+  long count;
+  long total_ns;
+  long max_ns;
+  long buckets[LATENCY_BUCKETS];
+} LatencyHistogram;
+
+#if BPLUS_STATS
+#define STATS_ADD(counter, n) __atomic_fetch_add(&(counter), (n), __ATOMIC_RELAXED)
+#else
+#define STATS_ADD(counter, n) ((void)0)
+#endif
+
+// bucket a latency of ns falls in
+static inline int latency_bucket(long ns) {
+    if (ns < LATENCY_SUB_BUCKETS) {
+        return ns < 0 ? 0 : (int)ns;
+    }
+    int msb = 63 - __builtin_clzl((unsigned long)ns);
+    if (msb > 35) {
+        return LATENCY_BUCKETS - 1;
+    }
+    return (msb - 2) * LATENCY_SUB_BUCKETS + (int)((ns >> (msb - 3)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// start of a timed operation, 0 when stats are compiled out
+static inline long stats_clock(void) {
+#if BPLUS_STATS
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+#else
+    return 0;
+#endif
+}
+
+// the operation timed from start is done
+static inline void latency_record(LatencyHistogram *histogram, long start) {
+#if BPLUS_STATS
+    long ns = stats_clock() - start;
+    STATS_ADD(histogram->count, 1);
+    STATS_ADD(histogram->total_ns, ns);
+    STATS_ADD(histogram->buckets[latency_bucket(ns)], 1);
+    long max = __atomic_load_n(&histogram->max_ns, __ATOMIC_RELAXED);
+    while (ns > max && !__atomic_compare_exchange_n(&histogram->max_ns, &max, ns, 0, __ATOMIC_RELAXED,
+                                                    __ATOMIC_RELAXED)) {
+    }
+#else
+    (void)histogram;
+    (void)start;
+#endif
+}
+
+// largest latency bucket can hold
+long latency_bucket_limit(int bucket);
+
+// latency below which quantile (0 to 1) of the operations of histogram
+// finished, rounded up to the end of its bucket. 0 if there were none
+long latency_percentile(const LatencyHistogram *histogram, double quantile);
+
+#endif // BPLUS_STATS_H
@@ -0,0 +1,74 @@
+#ifndef BPLUS_WAL_H
+#define BPLUS_WAL_H
+
+#include <pthread.h>
+
+// append-only redo log kept next to a tree file. records are appended to
+// a memory buffer and reach the file when the log is forced. forcing is a
+// group commit: the first thread that asks writes and syncs everything
+// appended so far, threads asking meanwhile wait for that sync (or the
+// next one) instead of each issuing their own.
+// a position in the log (lsn) only grows, also across truncates, so a page
+// can remember the last record that changed it
+typedef struct Wal Wal;
+
+// what a record holds is up to the caller, the log only keeps the type
+typedef enum {
+  WAL_RECORD_PAGES = 1,  // page images
+  WAL_RECORD_INSERT,     // one record put into a leaf
+  WAL_RECORD_DELETE,     // one record taken out of a leaf
+  WAL_RECORD_BUFFERED,   // one insert kept in memory
+  WAL_RECORD_UNBUFFERED, // a buffered insert deleted again
+  WAL_RECORD_MERGED      // every buffered insert before is in the tree
+} WalRecordType;
+
+// a record is appended from several pieces
+typedef struct {
+  const void *data;
+  int length;
+} WalPart;
+
+// create the log at path, or empty it if it exists
+// commit_interval_ms is how long wal_commit may leave records unsynced
+Wal *wal_open(const char *path, int page_size, int commit_interval_ms);
+
+// append a record made of nparts pieces, returns the lsn past it or -1
+long wal_append(Wal *wal, int type, const WalPart *parts, int nparts);
+
+// wait until the log is on disk up to lsn
+int wal_force(Wal *wal, long lsn);
+
+// wait until everything appended so far is on disk
+int wal_sync(Wal *wal);
+
+// lsn up to which the log is on disk
+long wal_durable(Wal *wal);
+
+// an operation that appended up to lsn is done. without a commit interval
+// this waits for lsn to be on disk, otherwise the log is synced only once
+// the interval has passed since the last sync
+int wal_commit(Wal *wal, long lsn);
+
+// bytes of records in the log, synced or not
+long wal_size(Wal *wal);
+
+// mark page_id as changed since the last truncate, 1 if it was not yet
+int wal_mark_page(Wal *wal, int page_id);
+
+// drop every record, the caller made sure the file has all their changes
+// and nothing appends meanwhile
+int wal_truncate(Wal *wal);
+
+// close the log, remove_file deletes it too, only once it was truncated
+int wal_close(Wal *wal, int remove_file);
+
+// call fn for every intact record of the log at path in order, stopping
+// at a torn tail. returns how many records were replayed (0 if there is
+// no log) or -1 if the log is unusable or fn failed
+int wal_replay(const char *path, int page_size,
+               int (*fn)(void *ctx, int type, const char *data, int length), void *ctx);
+
+// name of the log of a tree file, "<fileName>.wal", the caller frees it
+char *wal_path_of(const char *fileName);
+
+#endif // BPLUS_WAL_H
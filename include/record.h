@@ -7,6 +7,7 @@
 #define MAX_ATTRIBUTES 5
 #define MAX_NAME_LENGTH 15
 #define MAX_STRING_LENGTH 20
+#define MAX_PACKED_RECORD_SIZE (MAX_ATTRIBUTES * (MAX_STRING_LENGTH + 1))
 
 /**
  * @brief Supported attribute data types.
@@ -90,12 +91,30 @@ void record_print(const TableSchema *schema, const Record *record);
 
 /**
  * @brief Gets the key value from a record.
+ *
+ * INT keys come back as they are. FLOAT keys and CHAR keys of up to 4
+ * bytes come back as the int made of their normalized bytes (see
+ * bplus_key.h), which orders the same way the values do. Lookups, deletes
+ * and range scans by such a key pass the key of a record that has just
+ * the key attribute set. Wider keys are not supported.
  * @param schema Pointer to the table schema.
  * @param record Pointer to the record.
- * @return Key value as integer.
+ * @return Key value as integer, -1 (with a message) if the key does not fit
+ *         in one. A key of -1 looks the same, use record_key to tell them apart.
  */
 int record_get_key(const TableSchema *schema, const Record *record);
 
+/**
+ * @brief Gets the key value from a record, reporting errors apart.
+ *
+ * Same key as record_get_key.
+ * @param schema Pointer to the table schema.
+ * @param record Pointer to the record.
+ * @param key Where the key is stored.
+ * @return 0 on success, -1 (with a message) if the key does not fit in an int.
+ */
+int record_key(const TableSchema *schema, const Record *record, int *key);
+
 /**
  * @brief Retrieves a value from a record by attribute name.
  * @param schema Pointer to the table schema.
@@ -106,7 +125,40 @@ int record_get_key(const TableSchema *schema, const Record *record);
  */
 DataType record_get_value(const TableSchema *schema, const Record *record, const char *attr_name, char *output);
 
+/**
+ * @brief Size of a record in its packed (on-page) form.
+ *
+ * INT and FLOAT fields take 4 bytes each and come first, in schema order.
+ * They are followed by one end-offset byte per CHAR field and then the
+ * CHAR bytes themselves, without padding or terminator.
+ * @param schema Pointer to the table schema.
+ * @param record Pointer to the record.
+ * @return Packed size in bytes.
+ */
+int record_packed_size(const TableSchema *schema, const Record *record);
 
+/**
+ * @brief Largest packed size a record of the schema can have.
+ * @param schema Pointer to the table schema.
+ * @return Packed size in bytes.
+ */
+int schema_max_packed_size(const TableSchema *schema);
 
+/**
+ * @brief Packs a record into buf.
+ * @param schema Pointer to the table schema.
+ * @param record Pointer to the record to pack.
+ * @param buf Destination, at least record_packed_size bytes.
+ * @return Number of bytes written.
+ */
+int record_pack(const TableSchema *schema, const Record *record, char *buf);
+
+/**
+ * @brief Unpacks a record written by record_pack.
+ * @param schema Pointer to the table schema.
+ * @param buf Packed record.
+ * @param record Pointer to store the record.
+ */
+void record_unpack(const TableSchema *schema, const char *buf, Record *record);
 
 #endif //BPLUS_MY_RECORD_H
\ No newline at end of file
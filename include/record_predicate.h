@@ -0,0 +1,149 @@
+#ifndef RECORD_PREDICATE_H
+#define RECORD_PREDICATE_H
+
+#include "bplus_dictionary.h"
+#include "record.h"
+
+#define PREDICATE_MAX_TERMS 8
+
+/**
+ * @brief Comparison of one predicate term.
+ */
+typedef enum {
+    PRED_EQ,      /**< attribute == value */
+    PRED_LT,      /**< attribute < value */
+    PRED_GT,      /**< attribute > value */
+    PRED_BETWEEN, /**< value <= attribute <= high */
+    PRED_PREFIX   /**< CHAR attribute starts with value */
+} PredicateOp;
+
+/**
+ * @brief One condition on an attribute, as written by the caller.
+ *
+ * CHAR values compare byte by byte, a shorter string before a longer one
+ * it is a prefix of. FLOAT comparisons with NaN are never true.
+ */
+typedef struct {
+    const char *attr_name; /**< Attribute to test */
+    PredicateOp op;        /**< Comparison */
+    FieldValue value;      /**< Value compared with, in the field of the attribute's type */
+    FieldValue high;       /**< Upper bound, PRED_BETWEEN only */
+} PredicateTerm;
+
+/**
+ * @brief A term resolved against a schema: where the attribute is in a packed record.
+ */
+typedef struct {
+    DataType type;
+    PredicateOp op;
+    int attr;              /**< Attribute index in the schema */
+    int offset;            /**< INT/FLOAT: byte offset in the packed record */
+    int slot;              /**< CHAR: which end-offset byte is its */
+    FieldValue value;
+    FieldValue high;
+    int value_length;      /**< CHAR: bytes of value */
+    int high_length;       /**< CHAR: bytes of high */
+    int coded;             /**< CHAR: stored as a dictionary code, see predicate_bind */
+    char code[DICTIONARY_FIELD_MAX]; /**< PRED_EQ on a coded attribute: the field that matches */
+    int code_length;
+} PredicateCompiledTerm;
+
+/**
+ * @brief A conjunction of terms compiled once against a schema.
+ *
+ * Matching reads the attributes straight out of packed records (see
+ * record_pack) at offsets worked out by predicate_compile, without
+ * unpacking the record or looking attributes up by name.
+ */
+typedef struct {
+    int count;                                         /**< Terms, all must hold */
+    PredicateCompiledTerm terms[PREDICATE_MAX_TERMS];
+    int chars_at;                                      /**< Offset of the CHAR bytes in a packed record */
+    int ends_at;                                       /**< Offset of the CHAR end-offset bytes */
+    const Dictionary *dictionary;                      /**< Codes of the records matched, NULL if none */
+} Predicate;
+
+/**
+ * @brief The attributes a scan copies out of each record.
+ */
+typedef struct {
+    int count;                          /**< Projected attributes */
+    int attrs[MAX_ATTRIBUTES];          /**< Their schema index */
+    DataType types[MAX_ATTRIBUTES];
+    int offsets[MAX_ATTRIBUTES];        /**< INT/FLOAT: byte offset in the packed record */
+    int slots[MAX_ATTRIBUTES];          /**< CHAR: which end-offset byte is its */
+    int chars_at;
+    int ends_at;
+    const Dictionary *dictionary;       /**< Codes of the records copied, NULL if none */
+} Projection;
+
+/**
+ * @brief Compiles the conjunction of count terms against schema.
+ * @param predicate Pointer to the predicate to fill.
+ * @param schema Pointer to the table schema.
+ * @param terms Terms that must all hold.
+ * @param count Number of terms, 0 matches every record.
+ * @return 0 on success, -1 (with a message) for an unknown attribute, a
+ *         PRED_PREFIX on an attribute that is not CHAR or too many terms.
+ */
+int predicate_compile(Predicate *predicate, const TableSchema *schema, const PredicateTerm *terms, int count);
+
+/**
+ * @brief Tests a packed record.
+ * @param predicate Compiled predicate.
+ * @param packed Record as written by record_pack.
+ * @return 1 if every term holds, 0 otherwise.
+ */
+int predicate_match(const Predicate *predicate, const char *packed);
+
+/**
+ * @brief Points a predicate at the dictionary the records it tests were packed with.
+ *
+ * PRED_EQ on a coded attribute then compares the code in the record with
+ * the code of the value, the other comparisons look the value of the code
+ * up. bplus_scan_open_where binds its copy of the predicate to the file.
+ * @param predicate Compiled predicate.
+ * @param dictionary Dictionary of the records, NULL if they are not coded.
+ */
+void predicate_bind(Predicate *predicate, const Dictionary *dictionary);
+
+/**
+ * @brief Narrows a key range to the keys the predicate can match.
+ *
+ * Terms on the primary key bound the range, as their values map to keys
+ * the way record_get_key maps them. Other terms leave it as it is.
+ * @param predicate Compiled predicate.
+ * @param schema Schema it was compiled against.
+ * @param lo Lowest key of the range, raised if a term allows.
+ * @param hi Highest key of the range, lowered if a term allows.
+ */
+void predicate_key_range(const Predicate *predicate, const TableSchema *schema, int *lo, int *hi);
+
+/**
+ * @brief Compiles the list of attributes to copy out.
+ * @param projection Pointer to the projection to fill.
+ * @param schema Pointer to the table schema.
+ * @param columns Names of the attributes, NULL for all of them.
+ * @param count Number of names.
+ * @return 0 on success, -1 (with a message) for an unknown attribute.
+ */
+int projection_compile(Projection *projection, const TableSchema *schema, const char *const *columns, int count);
+
+/**
+ * @brief Points a projection at the dictionary the records it copies were packed with.
+ * @param projection Compiled projection.
+ * @param dictionary Dictionary of the records, NULL if they are not coded.
+ */
+void projection_bind(Projection *projection, const Dictionary *dictionary);
+
+/**
+ * @brief Copies the projected attributes of a packed record into record.
+ *
+ * The other fields of record are left as they are.
+ * @param projection Compiled projection.
+ * @param packed Record as written by record_pack.
+ * @param record Pointer to the record to fill.
+ */
+void projection_copy(const Projection *projection, const char *packed, Record *record);
+
+#endif // RECORD_PREDICATE_H
@@ -0,0 +1,178 @@
+/**
+ * split block Bloom filter
+ * the hash of a key picks a block of eight 32-bit words and sets one bit in
+ * each of them, the bit in word i comes from the hash times its own odd
+ * constant. eight bits in one cache line cost about as much as one bit,
+ * and at 10 bits per key about 1 in 100 absent keys gets through
+ */
+
+#include "bplus_bloom.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BLOOM_WORDS 8
+#define BLOOM_BLOCK_BITS (BLOOM_WORDS * 32)
+#define BLOOM_MAGIC 0xB100F117
+
+struct BloomFilter {
+  uint32_t *words;      // blocks * BLOOM_WORDS
+  long blocks;
+  long capacity;        // keys it was made for
+  long count;           // keys added
+  int bits_per_key;
+  int shared;           // bits and count are changed atomically
+  BloomFilter *older;   // replaced filters kept for readers
+};
+
+// head of the saved bytes, the words follow
+typedef struct {
+  unsigned int magic;
+  int bits_per_key;
+  long blocks;
+  long capacity;
+  long count;
+} BloomHead;
+
+static const uint32_t salts[BLOOM_WORDS] = {
+  0x47b6137bU, 0x44974d91U, 0x8824ad5bU, 0xa2b7289dU,
+  0x705495c7U, 0x2df1424bU, 0x9efc4947U, 0x5c6bfb31U
+};
+
+static uint64_t hash_key(int key) {
+    uint64_t h = (uint32_t)key;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// block of the hash, by multiply and shift instead of a modulo
+static const uint32_t *block_of(const BloomFilter *filter, uint64_t h) {
+    uint64_t block = ((h >> 32) * (uint64_t)filter->blocks) >> 32;
+    return filter->words + block * BLOOM_WORDS;
+}
+
+static BloomFilter *alloc_filter(long blocks, int shared) {
+    BloomFilter *filter = calloc(1, sizeof(BloomFilter));
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->words = calloc(blocks * BLOOM_WORDS, sizeof(uint32_t));
+    if (filter->words == NULL) {
+        free(filter);
+        return NULL;
+    }
+    filter->blocks = blocks;
+    filter->shared = shared;
+    return filter;
+}
+
+BloomFilter *bloom_create(long keys, int bits_per_key, int shared) {
+    if (keys < 1024) keys = 1024;
+    long blocks = (keys * bits_per_key + BLOOM_BLOCK_BITS - 1) / BLOOM_BLOCK_BITS;
+    // block_of scales the top 32 bits of the hash
+    if (blocks > UINT32_MAX) {
+        return NULL;
+    }
+    BloomFilter *filter = alloc_filter(blocks, shared);
+    if (filter == NULL) {
+        return NULL;
+    }
+    filter->capacity = keys;
+    filter->bits_per_key = bits_per_key;
+    return filter;
+}
+
+void bloom_destroy(BloomFilter *filter) {
+    while (filter) {
+        BloomFilter *older = filter->older;
+        free(filter->words);
+        free(filter);
+        filter = older;
+    }
+}
+
+void bloom_add(BloomFilter *filter, int key) {
+    uint64_t h = hash_key(key);
+    uint32_t *block = (uint32_t*)block_of(filter, h);
+    uint32_t low = (uint32_t)h;
+    for (int i = 0; i < BLOOM_WORDS; i++) {
+        uint32_t bit = 1U << ((low * salts[i]) >> 27);
+        // most bits are set already once the filter fills up
+        if (filter->shared) {
+            if ((__atomic_load_n(&block[i], __ATOMIC_RELAXED) & bit) == 0) {
+                __atomic_fetch_or(&block[i], bit, __ATOMIC_RELAXED);
+            }
+        } else {
+            block[i] |= bit;
+        }
+    }
+    if (filter->shared) __atomic_fetch_add(&filter->count, 1, __ATOMIC_RELAXED);
+    else filter->count++;
+}
+
+int bloom_may_contain(const BloomFilter *filter, int key) {
+    uint64_t h = hash_key(key);
+    const uint32_t *block = block_of(filter, h);
+    uint32_t low = (uint32_t)h;
+    for (int i = 0; i < BLOOM_WORDS; i++) {
+        uint32_t bit = 1U << ((low * salts[i]) >> 27);
+        if ((__atomic_load_n(&block[i], __ATOMIC_RELAXED) & bit) == 0) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int bloom_full(const BloomFilter *filter) {
+    return bloom_count(filter) > filter->capacity;
+}
+
+long bloom_count(const BloomFilter *filter) {
+    return __atomic_load_n(&filter->count, __ATOMIC_RELAXED);
+}
+
+int bloom_bits_per_key(const BloomFilter *filter) {
+    return filter->bits_per_key;
+}
+
+void bloom_keep(BloomFilter *filter, BloomFilter *older) {
+    BloomFilter *last = filter;
+    while (last->older) last = last->older;
+    last->older = older;
+}
+
+long bloom_saved_size(const BloomFilter *filter) {
+    return (long)sizeof(BloomHead) + filter->blocks * BLOOM_WORDS * (long)sizeof(uint32_t);
+}
+
+void bloom_save(const BloomFilter *filter, char *out) {
+    BloomHead head = {BLOOM_MAGIC, filter->bits_per_key, filter->blocks, filter->capacity,
+                      bloom_count(filter)};
+    memcpy(out, &head, sizeof(head));
+    memcpy(out + sizeof(head), filter->words, filter->blocks * BLOOM_WORDS * sizeof(uint32_t));
+}
+
+BloomFilter *bloom_load(const char *data, long length, int shared) {
+    BloomHead head;
+    if (length < (long)sizeof(head)) {
+        return NULL;
+    }
+    memcpy(&head, data, sizeof(head));
+    if (head.magic != BLOOM_MAGIC || head.blocks <= 0 || head.blocks > UINT32_MAX ||
+        length < (long)sizeof(head) + head.blocks * BLOOM_WORDS * (long)sizeof(uint32_t)) {
+        return NULL;
+    }
+    BloomFilter *filter = alloc_filter(head.blocks, shared);
+    if (filter == NULL) {
+        return NULL;
+    }
+    memcpy(filter->words, data + sizeof(head), head.blocks * BLOOM_WORDS * sizeof(uint32_t));
+    filter->capacity = head.capacity;
+    filter->count = head.count;
+    filter->bits_per_key = head.bits_per_key;
+    return filter;
+}
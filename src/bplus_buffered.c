@@ -0,0 +1,163 @@
+/**
+ * inserts buffered in the memtable and merged into the tree in key order
+ * every key is looked up in the tree before it is buffered, so primary
+ * keys stay unique without waiting for the merge. the lookup only reads,
+ * the leaf is changed later together with its neighbours in the memtable
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// records unpacked at a time for bplus_tree_insert_sorted
+#define BPLUS_MERGE_BATCH 1024
+
+static void buffer_lock(const BPlusMetaImpl *meta, int exclusive) {
+    if (meta->rt.latches == NULL) {
+        return;
+    }
+    if (exclusive) pthread_rwlock_wrlock(&meta->rt.latches->memtable);
+    else pthread_rwlock_rdlock(&meta->rt.latches->memtable);
+}
+
+static void buffer_unlock(const BPlusMetaImpl *meta) {
+    if (meta->rt.latches) pthread_rwlock_unlock(&meta->rt.latches->memtable);
+}
+
+// merge if the memtable takes at least min_bytes
+static int flush_from(BPlusMetaImpl *meta, long min_bytes) {
+    bplus_tree_enter(meta, 1);
+    int ret = 0;
+    // another thread may have merged while this one waited
+    if (memtable_count(meta->rt.memtable) > 0 && memtable_bytes(meta->rt.memtable) >= min_bytes) {
+        ret = bplus_memtable_merge(meta);
+    }
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+int bplus_buffered_insert(BPlusMetaImpl *meta, const Record *record) {
+    Memtable *table = meta->rt.memtable;
+    int key = bplus_record_key(meta, record);
+    char packed[MAX_PACKED_RECORD_SIZE];
+    int length = 0;
+
+    // only a merge puts keys into the tree and it waits for this insert,
+    // so the key cannot get there between the lookup and the put
+    bplus_tree_enter(meta, 0);
+    int ret = bplus_tree_find(meta, key, NULL) == 0 ? -1 : 0;
+    if (ret == 0) ret = bplus_dictionary_learn(meta, record);
+    if (ret == 0) length = bplus_pack(meta, record, packed);
+    if (ret == 0) bplus_filter_add(meta, key);
+    long lsn = 0;
+    long bytes = 0;
+    if (ret == 0) {
+        buffer_lock(meta, 1);
+        int put = memtable_put(table, key, packed, length);
+        if (put == 0) {
+            lsn = bplus_log_buffered_insert(meta, key, packed, length);
+            if (lsn < 0) {
+                memtable_remove(table, key);
+                ret = -1;
+            }
+        } else {
+            if (put < 0) fprintf(stderr, "Error: out of memory for the memtable\n");
+            ret = -1;
+        }
+        bytes = memtable_bytes(table);
+        buffer_unlock(meta);
+    }
+    bplus_tree_leave(meta);
+
+    if (ret == 0 && bplus_log_commit(meta, lsn) != 0) {
+        ret = -1;
+    }
+    if (ret == 0 && bytes >= meta->rt.memtable_limit && flush_from(meta, meta->rt.memtable_limit) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
+int bplus_buffered_find(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    if (meta->rt.memtable == NULL) {
+        return -1;
+    }
+    buffer_lock(meta, 0);
+    const MemtableEntry *entry = memtable_get(meta->rt.memtable, key);
+    if (entry != NULL && out_record != NULL) {
+        int length;
+        bplus_unpack(meta, memtable_entry_packed(entry, &length), out_record);
+    }
+    buffer_unlock(meta);
+    return entry != NULL ? 0 : -1;
+}
+
+const char *bplus_buffered_packed(const BPlusMetaImpl *meta, int key, int *length) {
+    if (meta->rt.memtable == NULL) {
+        return NULL;
+    }
+    buffer_lock(meta, 0);
+    const MemtableEntry *entry = memtable_get(meta->rt.memtable, key);
+    // entries never move and a merge waits for the caller to leave the tree
+    const char *packed = entry != NULL ? memtable_entry_packed(entry, length) : NULL;
+    buffer_unlock(meta);
+    return packed;
+}
+
+int bplus_buffered_remove(BPlusMetaImpl *meta, int key, long *lsn) {
+    *lsn = 0;
+    if (meta->rt.memtable == NULL) {
+        return -1;
+    }
+    buffer_lock(meta, 1);
+    int ret = memtable_remove(meta->rt.memtable, key);
+    if (ret == 0) *lsn = bplus_log_buffered_delete(meta, key);
+    buffer_unlock(meta);
+    return ret;
+}
+
+int bplus_memtable_merge(BPlusMetaImpl *meta) {
+    Memtable *table = meta->rt.memtable;
+    if (table == NULL || memtable_count(table) == 0) {
+        return 0;
+    }
+    Record *records = malloc(BPLUS_MERGE_BATCH * sizeof(Record));
+    if (records == NULL) {
+        return -1;
+    }
+    // keys come in order, so one descent puts in every record of a leaf
+    // that fits, and the leaf is written back once
+    // the key is only in the tree already when an earlier merge failed
+    // half way or when replay puts back a merge the crash cut short
+    int count;
+    const MemtableEntry *const *sorted = memtable_sorted(table, &count);
+    int ret = sorted == NULL ? -1 : 0;
+    for (int i = 0; i < count && ret == 0; i += BPLUS_MERGE_BATCH) {
+        int n = count - i < BPLUS_MERGE_BATCH ? count - i : BPLUS_MERGE_BATCH;
+        for (int j = 0; j < n; j++) {
+            int length;
+            bplus_unpack(meta, memtable_entry_packed(sorted[i + j], &length), &records[j]);
+        }
+        long lsn;
+        if (bplus_tree_insert_sorted(meta, records, n, &lsn) < 0) ret = -1;
+    }
+    free(records);
+    if (ret != 0) {
+        // the records stay buffered, lookups still find them there
+        return -1;
+    }
+    if (bplus_log_merged(meta) < 0) {
+        return -1;
+    }
+    buffer_lock(meta, 1);
+    memtable_clear(table);
+    buffer_unlock(meta);
+    return 0;
+}
+
+int bplus_memtable_flush(BPlusMetaImpl *meta) {
+    if (meta->rt.memtable == NULL) {
+        return 0;
+    }
+    return flush_from(meta, 1);
+}
@@ -0,0 +1,311 @@
+/**
+ * bottom-up construction of a B+ tree from a record source
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// first key and block id of a finished node,
+// the level above is built from these
+typedef struct {
+  int key;
+  int block_id;
+  int records;    // under the node, for counted trees
+} LevelEntry;
+
+typedef struct {
+  LevelEntry *items;
+  int count;
+  int capacity;
+} Level;
+
+// records buffered for sorting when the input is not sorted
+typedef struct {
+  int key;
+  int seq;       // input position, keeps the sort stable for duplicates
+  Record record;
+} KeyedRecord;
+
+typedef struct {
+  KeyedRecord *items;
+  int count;
+  int pos;
+} SortedBuffer;
+
+// keys loaded so far, the key filter is made from them at the end
+typedef struct {
+  int *items;
+  long count;
+  long capacity;
+} LoadedKeys;
+
+static int level_push(Level *level, int key, int block_id) {
+    if (level->count == level->capacity) {
+        int capacity = level->capacity ? level->capacity * 2 : 64;
+        LevelEntry *items = realloc(level->items, capacity * sizeof(LevelEntry));
+        if (items == NULL) return -1;
+        level->items = items;
+        level->capacity = capacity;
+    }
+    level->items[level->count].key = key;
+    level->items[level->count].block_id = block_id;
+    level->items[level->count].records = 0;
+    level->count++;
+    return 0;
+}
+
+static int loaded_keys_push(LoadedKeys *keys, int key) {
+    if (keys->count == keys->capacity) {
+        long capacity = keys->capacity ? keys->capacity * 2 : 4096;
+        int *items = realloc(keys->items, capacity * sizeof(int));
+        if (items == NULL) return -1;
+        keys->items = items;
+        keys->capacity = capacity;
+    }
+    keys->items[keys->count++] = key;
+    return 0;
+}
+
+static int keyed_record_cmp(const void *a, const void *b) {
+    const KeyedRecord *ka = a;
+    const KeyedRecord *kb = b;
+    if (ka->key != kb->key) return (ka->key > kb->key) - (ka->key < kb->key);
+    return (ka->seq > kb->seq) - (ka->seq < kb->seq);
+}
+
+static int sorted_buffer_next(void *ctx, Record *record) {
+    SortedBuffer *buf = ctx;
+    if (buf->pos >= buf->count) return -1;
+    *record = buf->items[buf->pos++].record;
+    return 0;
+}
+
+// drain the iterator into buf and sort it by key
+static int sorted_buffer_fill(SortedBuffer *buf, const KeyCodec *codec, const TableSchema *schema,
+                              BPlusRecordIterator *it) {
+    int capacity = 0;
+    Record rec;
+    while (it->next(it->ctx, &rec) == 0) {
+        if (buf->count == capacity) {
+            capacity = capacity ? capacity * 2 : 1024;
+            KeyedRecord *items = realloc(buf->items, capacity * sizeof(KeyedRecord));
+            if (items == NULL) return -1;
+            buf->items = items;
+        }
+        buf->items[buf->count].key = key_tree_key(codec, schema, &rec);
+        buf->items[buf->count].seq = buf->count;
+        buf->items[buf->count].record = rec;
+        buf->count++;
+    }
+    qsort(buf->items, buf->count, sizeof(KeyedRecord), keyed_record_cmp);
+    return 0;
+}
+
+
+// write the leaf level, up to leaf_bytes of each leaf used, linked in key order.
+// with a dictionary the CHAR values get their codes on the way
+static int write_leaves(Pager *pager, const KeyCodec *codec, const TableSchema *schema, Dictionary *dict,
+                        BPlusRecordIterator *it, int leaf_bytes, Level *out, LoadedKeys *keys) {
+    Page page;
+    CALL_PM(pager_allocate(pager, &page));
+    DataNode *leaf = (DataNode*)page.data;
+    datanode_init(leaf, pager->page_size);
+    if (level_push(out, 0, page.id) != 0) { pager_unpin(pager, &page); return -1; }
+
+    Record rec;
+    int prev_key = 0;
+    int loaded = 0;
+    while (it->next(it->ctx, &rec) == 0) {
+        int key = key_tree_key(codec, schema, &rec);
+        if (loaded > 0 && key < prev_key) {
+            printf("Error: bulk load input is not sorted!\n");
+            pager_set_dirty(pager, &page);
+            pager_unpin(pager, &page);
+            return -1;
+        }
+        if (loaded > 0 && key == prev_key) {
+            // duplicate primary key, first one wins
+            continue;
+        }
+
+        char packed[MAX_PACKED_RECORD_SIZE];
+        int length;
+        if (dict) {
+            if (dictionary_add_values(dict, schema, &rec) != 0) {
+                pager_set_dirty(pager, &page);
+                pager_unpin(pager, &page);
+                return -1;
+            }
+            length = dictionary_pack(dict, schema, &rec, packed);
+        } else {
+            length = record_pack(schema, &rec, packed);
+        }
+        if (leaf->count > 0 && (!datanode_fits(leaf, length) ||
+            datanode_used_bytes(leaf) + DATANODE_SLOT_SIZE + length > leaf_bytes)) {
+            // leaf is packed, chain a new one after it
+            Page new_page;
+            if (pager_allocate(pager, &new_page) != 0) {
+                pager_set_dirty(pager, &page);
+                pager_unpin(pager, &page);
+                return -1;
+            }
+            leaf->next_block_id = new_page.id;
+            pager_set_dirty(pager, &page);
+            pager_unpin(pager, &page);
+
+            page = new_page;
+            leaf = (DataNode*)page.data;
+            datanode_init(leaf, pager->page_size);
+            if (level_push(out, key, page.id) != 0) {
+                pager_set_dirty(pager, &page);
+                pager_unpin(pager, &page);
+                return -1;
+            }
+        }
+
+        if (leaf->count == 0) {
+            out->items[out->count - 1].key = key;
+        }
+        if (loaded_keys_push(keys, key) != 0) {
+            pager_set_dirty(pager, &page);
+            pager_unpin(pager, &page);
+            return -1;
+        }
+        datanode_insert_packed(leaf, leaf->count, key, packed, length);
+        out->items[out->count - 1].records++;
+        prev_key = key;
+        loaded++;
+    }
+
+    pager_set_dirty(pager, &page);
+    pager_unpin(pager, &page);
+    return 0;
+}
+
+// build one index level over children, up to fan children per node
+static int write_index_level(Pager *pager, const Level *children, int fan, int counted, Level *out) {
+    int i = 0;
+    while (i < children->count) {
+        int take = children->count - i;
+        if (take > fan) {
+            // never leave a single child for the last node
+            if (take - fan == 1) take = fan > 2 ? fan - 1 : fan + 1;
+            else take = fan;
+        }
+
+        Page page;
+        CALL_PM(pager_allocate(pager, &page));
+        IndexNode *node = (IndexNode*)page.data;
+        indexnode_init(node, pager->page_size, counted);
+        int *node_children = indexnode_children(node);
+        int *counts = indexnode_counts(node);
+        int records = 0;
+        node_children[0] = children->items[i].block_id;
+        for (int j = 0; j < take; j++) {
+            if (j > 0) {
+                node->keys[j - 1] = children->items[i + j].key;
+                node_children[j] = children->items[i + j].block_id;
+            }
+            if (counted) counts[j] = children->items[i + j].records;
+            records += children->items[i + j].records;
+        }
+        node->count = take - 1;
+        pager_set_dirty(pager, &page);
+        pager_unpin(pager, &page);
+
+        CALL_PM(level_push(out, children->items[i].key, page.id));
+        out->items[out->count - 1].records = records;
+        i += take;
+    }
+    return 0;
+}
+
+int bplus_bulk_load(const TableSchema *schema, const char *fileName,
+                    BPlusRecordIterator *iterator, double fill_factor) {
+    return bplus_bulk_load_with_options(schema, fileName, iterator, fill_factor, NULL);
+}
+
+int bplus_bulk_load_with_options(const TableSchema *schema, const char *fileName,
+                                 BPlusRecordIterator *iterator, double fill_factor,
+                                 const BPlusCreateOptions *options) {
+    KeyCodec codec;
+    if (fill_factor <= 0.0 || fill_factor > 1.0 || key_tree_codec(&codec, schema) != 0) {
+        return -1;
+    }
+    int page_size = options && options->page_size ? options->page_size : BF_BLOCK_SIZE;
+    int leaf_bytes = (int)(DATANODE_CAPACITY(page_size) * fill_factor);
+    int counted = options && options->counted;
+    int max_keys = counted ? INDEXNODE_MAX_KEYS_COUNTED(page_size) : INDEXNODE_MAX_KEYS(page_size);
+    int fan = (int)((max_keys + 1) * fill_factor);
+    if (fan < 2) fan = 2;
+
+    // unsorted input is buffered and sorted, sorted input streams straight through
+    SortedBuffer buf = {NULL, 0, 0};
+    BPlusRecordIterator it = *iterator;
+    if (!iterator->sorted) {
+        if (sorted_buffer_fill(&buf, &codec, schema, iterator) != 0) {
+            free(buf.items);
+            return -1;
+        }
+        it.next = sorted_buffer_next;
+        it.ctx = &buf;
+        it.sorted = 1;
+    }
+
+    Pager *pager = pager_create(fileName, page_size, NULL);
+    if (pager == NULL) {
+        free(buf.items);
+        return -1;
+    }
+    bplus_log_discard(fileName);
+
+    int ret = -1;
+    Level level = {NULL, 0, 0};
+    Level upper = {NULL, 0, 0};
+    LoadedKeys keys = {NULL, 0, 0};
+    Dictionary *dict = NULL;
+
+    // block 0 is reserved for the metadata, written once at the end
+    Page p0;
+    if (pager_allocate(pager, &p0) != 0) goto done;
+    pager_unpin(pager, &p0);
+
+    if (options && options->dictionary && dictionary_schema_codes(schema)) {
+        dict = dictionary_create(schema);
+        if (dict == NULL) goto done;
+    }
+    if (write_leaves(pager, &codec, schema, dict, &it, leaf_bytes, &level, &keys) != 0) goto done;
+
+    int height = 1;
+    while (level.count > 1) {
+        upper.count = 0;
+        if (write_index_level(pager, &level, fan, counted, &upper) != 0) goto done;
+        Level tmp = level; level = upper; upper = tmp;
+        height++;
+    }
+
+    BPlusMetaImpl meta;
+    bplus_meta_init(&meta, schema, page_size, counted);
+    meta.root_block_id = level.items[0].block_id;
+    meta.height = height;
+    meta.total_blocks = pager_page_count(pager);
+    meta.rt.pager = pager;
+    // the values are saved after the tree, in the order they got codes
+    meta.rt.dictionary = dict;
+    if (dict && bplus_dictionary_write(&meta) != 0) goto done;
+    // the first open reads the key filter instead of every leaf
+    if (bplus_filter_save_keys(&meta, keys.items, keys.count) != 0) goto done;
+    if (bplus_meta_store(&meta) != 0) goto done;
+    ret = 0;
+
+done:
+    free(level.items);
+    free(upper.items);
+    free(keys.items);
+    free(buf.items);
+    dictionary_destroy(dict);
+    if (pager_close(pager) != 0) ret = -1;
+    return ret;
+}
@@ -0,0 +1,166 @@
+/**
+ * column dictionaries of a file
+ * the values are kept in a chain of blocks, each value as its attribute,
+ * its length and its bytes, in the order they got their codes, so reading
+ * the chain back gives every value the code it had. a new value is added
+ * to the last block and logged before the dictionary hands out its code,
+ * no record with the code can get to the log or the file ahead of it
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+// head of a block of the chain, the values follow
+typedef struct {
+  int next_block;   // -1 for the last one
+  int used;         // bytes of values after the head
+} DictionaryBlock;
+
+// attribute and length byte in front of every value
+#define DICTIONARY_VALUE_HEAD 2
+
+static void block_init(Page *page) {
+    DictionaryBlock *block = (DictionaryBlock*)page->data;
+    block->next_block = -1;
+    block->used = 0;
+}
+
+// put a value at the end of the chain, the blocks it changed go into change
+static int append_value(BPlusMetaImpl *meta, int attr, const char *bytes, int length, BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    Page page;
+    CALL_PM(pager_get(pager, meta->rt.dictionary_tail, &page));
+    DictionaryBlock *block = (DictionaryBlock*)page.data;
+    if ((int)sizeof(DictionaryBlock) + block->used + DICTIONARY_VALUE_HEAD + length > meta->page_size) {
+        // full, the chain goes on in a new block
+        Page next;
+        if (bplus_allocate_block(meta, &next) != 0) {
+            pager_unpin(pager, &page);
+            return -1;
+        }
+        block_init(&next);
+        block->next_block = next.id;
+        pager_set_dirty(pager, &page);
+        bplus_change_keep(meta, change, &page);
+        meta->rt.dictionary_tail = next.id;
+        page = next;
+        block = (DictionaryBlock*)page.data;
+    }
+    unsigned char *at = (unsigned char*)(block + 1) + block->used;
+    at[0] = (unsigned char)attr;
+    at[1] = (unsigned char)length;
+    memcpy(at + DICTIONARY_VALUE_HEAD, bytes, length);
+    block->used += DICTIONARY_VALUE_HEAD + length;
+    pager_set_dirty(pager, &page);
+    bplus_change_keep(meta, change, &page);
+    return 0;
+}
+
+int bplus_dictionary_write(BPlusMetaImpl *meta) {
+    const Dictionary *dict = meta->rt.dictionary;
+    Page page;
+    CALL_PM(bplus_allocate_block_at_end(meta, &page));
+    block_init(&page);
+    pager_set_dirty(meta->rt.pager, &page);
+    pager_unpin(meta->rt.pager, &page);
+    meta->dictionary_block = page.id;
+    meta->rt.dictionary_tail = page.id;
+
+    // a new file has no log, every block is let go as soon as it is written
+    BPlusChange change;
+    bplus_change_init(&change);
+    for (int attr = 0; attr < meta->schema.count; attr++) {
+        if (!dictionary_coded(dict, attr)) continue;
+        int count = dictionary_count(dict, attr);
+        for (int code = 0; code < count; code++) {
+            int length;
+            const char *bytes = dictionary_value(dict, attr, code, &length);
+            CALL_PM(append_value(meta, attr, bytes, length, &change));
+        }
+    }
+    return 0;
+}
+
+int bplus_dictionary_open(BPlusMetaImpl *meta) {
+    if (meta->dictionary_block == 0 || meta->rt.dictionary != NULL) {
+        return 0;
+    }
+    Dictionary *dict = dictionary_create(&meta->schema);
+    if (dict == NULL) {
+        fprintf(stderr, "Error: out of memory for the column dictionary\n");
+        return -1;
+    }
+    Pager *pager = meta->rt.pager;
+    int block_id = meta->dictionary_block;
+    int ret = 0;
+    while (block_id != -1 && ret == 0) {
+        Page page;
+        if (pager_get(pager, block_id, &page) != 0) {
+            ret = -1;
+            break;
+        }
+        const DictionaryBlock *block = (const DictionaryBlock*)page.data;
+        const unsigned char *at = (const unsigned char*)(block + 1);
+        const unsigned char *end = at + block->used;
+        if (block->used < 0 || (int)sizeof(DictionaryBlock) + block->used > meta->page_size) {
+            ret = -1;
+        }
+        while (ret == 0 && at < end) {
+            int attr = at[0];
+            int length = at[1];
+            if (at + DICTIONARY_VALUE_HEAD + length > end || !dictionary_coded(dict, attr) ||
+                dictionary_add(dict, attr, (const char*)at + DICTIONARY_VALUE_HEAD, length) < 0) {
+                ret = -1;
+            }
+            at += DICTIONARY_VALUE_HEAD + length;
+        }
+        meta->rt.dictionary_tail = block_id;
+        block_id = block->next_block;
+        pager_unpin(pager, &page);
+    }
+    if (ret != 0) {
+        printf("Error: the column dictionary of the file cannot be read\n");
+        dictionary_destroy(dict);
+        return -1;
+    }
+    meta->rt.dictionary = dict;
+    return 0;
+}
+
+static int value_length(const AttributeSchema *attr, const FieldValue *value) {
+    int max = attr->length < MAX_STRING_LENGTH ? attr->length : MAX_STRING_LENGTH;
+    return (int)strnlen(value->string_value, max);
+}
+
+int bplus_dictionary_learn(BPlusMetaImpl *meta, const Record *record) {
+    Dictionary *dict = meta->rt.dictionary;
+    if (dict == NULL) {
+        return 0;
+    }
+    TreeLatches *latches = meta->rt.latches;
+    int locked = 0;
+    int ret = 0;
+    for (int attr = 0; attr < meta->schema.count && ret == 0; attr++) {
+        if (!dictionary_coded(dict, attr)) continue;
+        const char *bytes = record->values[attr].string_value;
+        int length = value_length(&meta->schema.attributes[attr], &record->values[attr]);
+        // usually known, then nothing is locked at all
+        if (dictionary_find(dict, attr, bytes, length) >= 0) continue;
+        if (!locked && latches) pthread_mutex_lock(&latches->dictionary);
+        locked = 1;
+        // another thread may have added it while this one waited, and a
+        // column out of codes stores its new values as they are
+        if (dictionary_find(dict, attr, bytes, length) >= 0 || dictionary_reserve(dict, attr) != 0) continue;
+        BPlusChange change;
+        bplus_change_init(&change);
+        int appended = append_value(meta, attr, bytes, length, &change) == 0;
+        if (bplus_change_log(meta, &change) < 0 || !appended) {
+            ret = -1;
+        } else {
+            dictionary_add(dict, attr, bytes, length);
+        }
+    }
+    if (locked && latches) pthread_mutex_unlock(&latches->dictionary);
+    return ret;
+}
@@ -0,0 +1,190 @@
+/**
+ * order statistics of counted trees
+ * every index node of a counted tree keeps the records under each of its
+ * children, so the number of keys below a key and the record at a position
+ * come out of a single descent, adding up the counts left of the path
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+
+static int check_counted(const BPlusMetaImpl *meta) {
+    if (!meta->counted) {
+        printf("Error: file was not created counted\n");
+        return -1;
+    }
+    return 0;
+}
+
+// records in the tree with a key below key, or up to key with inclusive.
+// latches are coupled on the way down as in a lookup, an insert keeps
+// every node it counts in latched, so the counts seen belong together
+static long count_below(const BPlusMetaImpl *meta, int key, int inclusive) {
+    Pager *pager = meta->rt.pager;
+    int height;
+    int curr = bplus_root_latch(meta, 0, &height);
+    long below = 0;
+
+    for (int h = 1; h < height; h++) {
+        Page page;
+        int pinned;
+        const IndexNode *idx = bplus_index_read(meta, curr, &page, &pinned);
+        if (idx == NULL) {
+            bplus_latch_release(meta, curr);
+            return -1;
+        }
+        // children left of pos hold smaller keys only
+        int pos = indexnode_find_child_index(idx, key);
+        const int *counts = indexnode_counts(idx);
+        for (int i = 0; i < pos; i++) {
+            below += counts[i];
+        }
+        int child = indexnode_children(idx)[pos];
+        bplus_latch_shared(meta, child);
+        if (pinned) pager_unpin(pager, &page);
+        bplus_latch_release(meta, curr);
+        curr = child;
+    }
+
+    Page page;
+    if (pager_get(pager, curr, &page) != 0) {
+        bplus_latch_release(meta, curr);
+        return -1;
+    }
+    const DataNode *leaf = (const DataNode*)page.data;
+    int pos = datanode_find_insert_pos(leaf, key);
+    if (inclusive && pos < leaf->count && datanode_key_at(leaf, pos) == key) {
+        pos++;
+    }
+    below += pos;
+    pager_unpin(pager, &page);
+    bplus_latch_release(meta, curr);
+    return below;
+}
+
+// copy the record at position k in key order, -1 if there are not that many
+static int record_at(const BPlusMetaImpl *meta, long k, Record *out_record) {
+    Pager *pager = meta->rt.pager;
+    int height;
+    int curr = bplus_root_latch(meta, 0, &height);
+
+    for (int h = 1; h < height; h++) {
+        Page page;
+        int pinned;
+        const IndexNode *idx = bplus_index_read(meta, curr, &page, &pinned);
+        if (idx == NULL) {
+            bplus_latch_release(meta, curr);
+            return -1;
+        }
+        // skip whole children until the one holding position k
+        const int *counts = indexnode_counts(idx);
+        int pos = 0;
+        while (pos < idx->count && k >= counts[pos]) {
+            k -= counts[pos];
+            pos++;
+        }
+        int child = k < counts[pos] ? indexnode_children(idx)[pos] : -1;
+        if (child != -1) bplus_latch_shared(meta, child);
+        if (pinned) pager_unpin(pager, &page);
+        bplus_latch_release(meta, curr);
+        if (child == -1) {
+            return -1;
+        }
+        curr = child;
+    }
+
+    Page page;
+    if (pager_get(pager, curr, &page) != 0) {
+        bplus_latch_release(meta, curr);
+        return -1;
+    }
+    const DataNode *leaf = (const DataNode*)page.data;
+    int ret = -1;
+    if (k < leaf->count) {
+        int length;
+        if (out_record) bplus_unpack(meta, datanode_packed_at(leaf, (int)k, &length), out_record);
+        ret = 0;
+    }
+    pager_unpin(pager, &page);
+    bplus_latch_release(meta, curr);
+    return ret;
+}
+
+long bplus_rank(int file_desc, const BPlusMeta *metadata, int key) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    // buffered inserts are only counted once they are in the tree
+    if (check_counted(meta) != 0 || bplus_memtable_flush(meta) != 0) {
+        return -1;
+    }
+    bplus_tree_enter(meta, 0);
+    long rank = count_below(meta, key, 0);
+    bplus_tree_leave(meta);
+    return rank;
+}
+
+int bplus_select(int file_desc, const BPlusMeta *metadata, long k, Record *out_record) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (check_counted(meta) != 0 || bplus_memtable_flush(meta) != 0) {
+        return -1;
+    }
+    if (k < 0) {
+        return -1;
+    }
+    bplus_tree_enter(meta, 0);
+    int ret = record_at(meta, k, out_record);
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+long bplus_count_range(int file_desc, const BPlusMeta *metadata, int lo, int hi) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (check_counted(meta) != 0 || bplus_memtable_flush(meta) != 0) {
+        return -1;
+    }
+    if (lo > hi) {
+        return 0;
+    }
+    // two descents, no insert may come in between them
+    bplus_tree_enter(meta, 1);
+    long upto = count_below(meta, hi, 1);
+    long below = count_below(meta, lo, 0);
+    bplus_tree_leave(meta);
+    if (upto < 0 || below < 0) {
+        return -1;
+    }
+    return upto - below;
+}
+
+// records under block, the counts of the index nodes below are set on the way
+static long recount_node(BPlusMetaImpl *meta, int block, int height) {
+    Pager *pager = meta->rt.pager;
+    Page page;
+    CALL_PM(pager_get(pager, block, &page));
+    if (height == 1) {
+        long records = ((const DataNode*)page.data)->count;
+        pager_unpin(pager, &page);
+        return records;
+    }
+
+    IndexNode *idx = (IndexNode*)page.data;
+    long total = 0;
+    for (int i = 0; i <= idx->count; i++) {
+        long records = recount_node(meta, indexnode_children(idx)[i], height - 1);
+        if (records < 0) {
+            pager_unpin(pager, &page);
+            return -1;
+        }
+        indexnode_counts(idx)[i] = (int)records;
+        total += records;
+    }
+    pager_set_dirty(pager, &page);
+    pager_unpin(pager, &page);
+    return total;
+}
+
+int bplus_recount(BPlusMetaImpl *meta) {
+    return recount_node(meta, meta->root_block_id, meta->height) < 0 ? -1 : 0;
+}
@@ -3,87 +3,318 @@
  */
 
 #include "bplus_datanode.h"
+#include "bplus_search.h"
 #include <string.h>
 
+static int *node_keys(DataNode *node) {
+    return (int*)(node + 1);
+}
+
+// slots come right after the count keys
+static LeafSlot *node_slots(DataNode *node) {
+    return (LeafSlot*)(node_keys(node) + node->count);
+}
+
+static const LeafSlot *node_slots_const(const DataNode *node) {
+    return (const LeafSlot*)(datanode_keys(node) + node->count);
+}
+
 // init empty data node
-void datanode_init(DataNode *node) {
+void datanode_init(DataNode *node, int page_size) {
     node->count = 0;
     node->next_block_id = -1;
+    node->heap_start = page_size;
+    node->page_size = page_size;
 }
 
-// find where to insert key in leaf
-// returns the index
-int datanode_find_insert_pos(const DataNode *node, const TableSchema *schema, int key) {
-    int pos = 0;
-    while (pos < node->count && record_get_key(schema, &node->records[pos]) < key) {
-        pos++;
-    }
-    return pos;
+int datanode_capacity(const DataNode *node) {
+    return DATANODE_CAPACITY(node->page_size);
 }
 
-// insert record at pos, shifting others
-void datanode_insert_at(DataNode *node, int pos, const Record *record) {
-    // shift records
-    for (int i = node->count; i > pos; i--) {
-        node->records[i] = node->records[i - 1];
-    }
-    node->records[pos] = *record;
-    node->count++;
+const int *datanode_keys(const DataNode *node) {
+    return (const int*)(node + 1);
+}
+
+int datanode_key_at(const DataNode *node, int pos) {
+    return datanode_keys(node)[pos];
 }
 
-// //
-int datanode_is_full(const DataNode *node) {
-    return node->count >= MAX_RECORDS_LEAF;
+// packed bytes of record pos, points into the block
+const char *datanode_packed_at(const DataNode *node, int pos, int *length) {
+    const LeafSlot *slot = &node_slots_const(node)[pos];
+    *length = slot->length;
+    return (const char*)node + slot->offset;
+}
+
+// find where to insert key in leaf
+// returns the index
+int datanode_find_insert_pos(const DataNode *node, int key) {
+    return search_lower_bound(datanode_keys(node), node->count, key);
 }
 
 // search for key
 // returns index or -1 if not found
-int datanode_find_key(const DataNode *node, const TableSchema *schema, int key) {
-    for (int i = 0; i < node->count; i++) {
-        if (record_get_key(schema, &node->records[i]) == key) {
-            return i;
-        }
+int datanode_find_key(const DataNode *node, int key) {
+    int pos = datanode_find_insert_pos(node, key);
+    if (pos < node->count && datanode_keys(node)[pos] == key) {
+        return pos;
     }
     return -1;
 }
 
-// splits leaf node
+// directory plus packed records
+int datanode_used_bytes(const DataNode *node) {
+    return node->count * DATANODE_SLOT_SIZE + (node->page_size - node->heap_start);
+}
+
+// is there room for one more record of this size?
+int datanode_fits(const DataNode *node, int packed_size) {
+    return datanode_used_bytes(node) + DATANODE_SLOT_SIZE + packed_size <= datanode_capacity(node);
+}
+
+// insert already packed record at pos, caller checked datanode_fits
+void datanode_insert_packed(DataNode *node, int pos, int key, const char *packed, int length) {
+    int n = node->count;
+    int *keys = node_keys(node);
+    LeafSlot *old_slots = (LeafSlot*)(keys + n);
+    LeafSlot *new_slots = (LeafSlot*)(keys + n + 1);
+
+    // slots move up by one key to make room, tail first since it moves further
+    memmove(new_slots + pos + 1, old_slots + pos, (n - pos) * sizeof(LeafSlot));
+    memmove(new_slots, old_slots, pos * sizeof(LeafSlot));
+    memmove(keys + pos + 1, keys + pos, (n - pos) * sizeof(int));
+
+    node->heap_start -= length;
+    memcpy((char*)node + node->heap_start, packed, length);
+    keys[pos] = key;
+    new_slots[pos].offset = (unsigned short)node->heap_start;
+    new_slots[pos].length = (unsigned short)length;
+    node->count++;
+}
+
+// splits leaf node by bytes, the packed record with key goes in at insert_pos
+// append is for a record past the last key of the rightmost leaf: keys
+// keep coming in ascending order, so node stays full and new_node starts
+// with just the record instead of both ending up half empty for good
 // returns key to promote
-int datanode_split(DataNode *node, DataNode *new_node, const Record *record, 
-                   const TableSchema *schema, int insert_pos, int new_block_id) {
-    // temp array for records
-    Record temp[MAX_RECORDS_LEAF + 1];
+int datanode_split(DataNode *node, DataNode *new_node, int key, const char *packed, int length,
+                   int insert_pos, int new_block_id, int append) {
+    // work from a copy, both nodes are rebuilt compacted
+    int page_size = node->page_size;
+    char copy[page_size];
+    memcpy(copy, node, page_size);
+    const DataNode *old = (const DataNode*)copy;
+
+    int total = old->count + 1;
+    int half = (datanode_used_bytes(old) + DATANODE_SLOT_SIZE + length) / 2;
+    if (append) {
+        half = datanode_capacity(old) + 1;
+    }
+
+    int next = old->next_block_id;
+    datanode_init(node, page_size);
+    datanode_init(new_node, page_size);
+
+    // first half stays, the rest moves
+    DataNode *target = node;
     int j = 0;
-    
-    for (int i = 0; i < node->count; i++) {
+    for (int i = 0; i < total; i++) {
+        int at_key, at_length;
+        const char *bytes;
         if (i == insert_pos) {
-            temp[j++] = *record;
+            at_key = key;
+            bytes = packed;
+            at_length = length;
+        } else {
+            at_key = datanode_key_at(old, j);
+            bytes = datanode_packed_at(old, j, &at_length);
+            j++;
         }
-        temp[j++] = node->records[i];
-    }
-    if (insert_pos == node->count) {
-        temp[j++] = *record;
-    }
-    
-    // split in middle
-    int split = (MAX_RECORDS_LEAF + 1) / 2;
-    
-    // first half stays
-    node->count = split;
-    for (int i = 0; i < split; i++) {
-        node->records[i] = temp[i];
-    }
-    
-    // second half moves
-    new_node->count = (MAX_RECORDS_LEAF + 1) - split;
-    for (int i = 0; i < new_node->count; i++) {
-        new_node->records[i] = temp[split + i];
+        // switch once half the bytes are in, keep one record for the right side
+        if (target == node && node->count > 0 &&
+            (datanode_used_bytes(node) >= half || i == total - 1)) {
+            target = new_node;
+        }
+        datanode_insert_packed(target, target->count, at_key, bytes, at_length);
     }
-    
+
     // fix pointers
-    new_node->next_block_id = node->next_block_id;
+    new_node->next_block_id = next;
     node->next_block_id = new_block_id;
-    
+
     // return first key of new node
-    return record_get_key(schema, &new_node->records[0]);
-}
\ No newline at end of file
+    return datanode_key_at(new_node, 0);
+}
+
+// node's records and the sorted new ones together in key order
+static int spread_merge(const DataNode *node, const PackedRecord *records, int count, PackedRecord *out) {
+    int i = 0, j = 0, n = 0;
+    while (i < node->count || j < count) {
+        if (j == count || (i < node->count && datanode_key_at(node, i) < records[j].key)) {
+            out[n].key = datanode_key_at(node, i);
+            out[n].packed = datanode_packed_at(node, i, &out[n].length);
+            i++;
+        } else {
+            out[n] = records[j++];
+        }
+        n++;
+    }
+    return n;
+}
+
+// first record of every node when merged is spread over nodes of them.
+// each node but the last takes records until it holds its share of the
+// bytes, or is full with fill. returns how many nodes got records or 0
+// if the last overflows
+static int spread_plan(const PackedRecord *merged, int total, int capacity, int nodes, int fill, int *starts) {
+    long bytes = 0;
+    for (int i = 0; i < total; i++) {
+        bytes += merged[i].length + DATANODE_SLOT_SIZE;
+    }
+    long share = fill ? capacity : (bytes + nodes - 1) / nodes;
+    int node = 0;
+    int used = 0;
+    starts[0] = 0;
+    for (int i = 0; i < total; i++) {
+        int size = merged[i].length + DATANODE_SLOT_SIZE;
+        if (used > 0 && (used + size > capacity || (used >= share && node < nodes - 1))) {
+            if (node == nodes - 1) return 0;
+            starts[++node] = i;
+            used = 0;
+        }
+        used += size;
+    }
+    return node + 1;
+}
+
+// fewest nodes merged spreads over, starts as in spread_plan
+static int spread_nodes(const PackedRecord *merged, int total, int capacity, int fill, int *starts) {
+    long bytes = 0;
+    for (int i = 0; i < total; i++) {
+        bytes += merged[i].length + DATANODE_SLOT_SIZE;
+    }
+    int nodes = (int)((bytes + capacity - 1) / capacity);
+    if (nodes < 1) nodes = 1;
+    // one record per node always works, so this ends
+    int used;
+    while ((used = spread_plan(merged, total, capacity, nodes, fill, starts)) == 0) {
+        nodes++;
+    }
+    return used;
+}
+
+// bytes of records that spread over nodes leaves whatever their sizes,
+// every share then leaves room for the largest record on top
+int datanode_spread_limit(const DataNode *node, int nodes) {
+    return nodes * (datanode_capacity(node) - MAX_PACKED_RECORD_SIZE - DATANODE_SLOT_SIZE);
+}
+
+// leaves needed for node's records and the sorted new ones, none of
+// which may be in node already. fill packs the leaves full in order, as
+// datanode_split does with append
+int datanode_spread_count(const DataNode *node, const PackedRecord *records, int count, int fill) {
+    int total = node->count + count;
+    PackedRecord merged[total];
+    int starts[total];
+    spread_merge(node, records, count, merged);
+    return spread_nodes(merged, total, datanode_capacity(node), fill, starts);
+}
+
+// rebuild node from its records and the sorted new ones, spread evenly
+// over node and new_nodes, new_count + 1 being datanode_spread_count.
+// the new nodes come after node in the chain, their first keys go up
+void datanode_spread(DataNode *node, DataNode *const *new_nodes, const int *new_ids, int new_count,
+                     const PackedRecord *records, int count, int fill) {
+    // work from a copy, every node is rebuilt compacted
+    int page_size = node->page_size;
+    char copy[page_size];
+    memcpy(copy, node, page_size);
+    const DataNode *old = (const DataNode*)copy;
+
+    int total = old->count + count;
+    PackedRecord merged[total];
+    int starts[total + 1];
+    spread_merge(old, records, count, merged);
+    int nodes = spread_nodes(merged, total, datanode_capacity(old), fill, starts);
+    starts[nodes] = total;
+
+    int next = old->next_block_id;
+    for (int n = 0; n < nodes && n <= new_count; n++) {
+        DataNode *target = n == 0 ? node : new_nodes[n - 1];
+        datanode_init(target, page_size);
+        for (int i = starts[n]; i < starts[n + 1]; i++) {
+            datanode_insert_packed(target, target->count, merged[i].key, merged[i].packed, merged[i].length);
+        }
+        target->next_block_id = n < new_count ? new_ids[n] : next;
+    }
+}
+
+// remove record at pos, the heap is compacted right away
+void datanode_remove_at(DataNode *node, int pos) {
+    int n = node->count;
+    int *keys = node_keys(node);
+    LeafSlot *old_slots = node_slots(node);
+    int offset = old_slots[pos].offset;
+    int length = old_slots[pos].length;
+
+    // close the hole, records below it move up
+    char *base = (char*)node;
+    memmove(base + node->heap_start + length, base + node->heap_start, offset - node->heap_start);
+    for (int i = 0; i < n; i++) {
+        if (old_slots[i].offset < offset) {
+            old_slots[i].offset += length;
+        }
+    }
+    node->heap_start += length;
+
+    LeafSlot *new_slots = (LeafSlot*)(keys + n - 1);
+    memmove(keys + pos, keys + pos + 1, (n - pos - 1) * sizeof(int));
+    memmove(new_slots, old_slots, pos * sizeof(LeafSlot));
+    memmove(new_slots + pos, old_slots + pos + 1, (n - pos - 1) * sizeof(LeafSlot));
+    node->count--;
+}
+
+// less than half of the bytes in use
+int datanode_is_underfull(const DataNode *node) {
+    return datanode_used_bytes(node) * 2 < datanode_capacity(node);
+}
+
+// append right sibling into node, right is dropped from the chain
+// caller checked that both fit in one block
+void datanode_merge(DataNode *node, const DataNode *right) {
+    for (int i = 0; i < right->count; i++) {
+        int length;
+        const char *bytes = datanode_packed_at(right, i, &length);
+        datanode_insert_packed(node, node->count, datanode_key_at(right, i), bytes, length);
+    }
+    node->next_block_id = right->next_block_id;
+}
+
+// move records between two neighbours until their bytes are about even
+void datanode_redistribute(DataNode *left, DataNode *right) {
+    for (;;) {
+        int lu = datanode_used_bytes(left);
+        int ru = datanode_used_bytes(right);
+        int length;
+        if (lu > ru && left->count > 1) {
+            const char *bytes = datanode_packed_at(left, left->count - 1, &length);
+            int moved = length + DATANODE_SLOT_SIZE;
+            // stop if the move would only flip the imbalance
+            if (ru + moved > lu - moved || !datanode_fits(right, length)) break;
+            char packed[MAX_PACKED_RECORD_SIZE];
+            memcpy(packed, bytes, length);
+            datanode_insert_packed(right, 0, datanode_key_at(left, left->count - 1), packed, length);
+            datanode_remove_at(left, left->count - 1);
+        } else if (ru > lu && right->count > 1) {
+            const char *bytes = datanode_packed_at(right, 0, &length);
+            int moved = length + DATANODE_SLOT_SIZE;
+            if (lu + moved > ru - moved || !datanode_fits(left, length)) break;
+            char packed[MAX_PACKED_RECORD_SIZE];
+            memcpy(packed, bytes, length);
+            datanode_insert_packed(left, left->count, datanode_key_at(right, 0), packed, length);
+            datanode_remove_at(right, 0);
+        } else {
+            break;
+        }
+    }
+}
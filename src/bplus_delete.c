@@ -0,0 +1,268 @@
+/**
+ * record deletion, rebalancing underfull nodes through their siblings
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// child at pos of parent underflowed
+// merge it with a sibling if both fit in one block, otherwise borrow
+// records from the sibling until their bytes are about even
+static int fix_leaf_child(BPlusMetaImpl *meta, IndexNode *parent, int pos, BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    int *children = indexnode_children(parent);
+    // prefer the left sibling, the first child only has a right one
+    int left_pos = pos > 0 ? pos - 1 : pos;
+    int right_pos = left_pos + 1;
+
+    Page lp, rp;
+    CALL_PM(pager_get(pager, children[left_pos], &lp));
+    if (pager_get(pager, children[right_pos], &rp) != 0) {
+        pager_unpin(pager, &lp);
+        return -1;
+    }
+    DataNode *left = (DataNode*)lp.data;
+    DataNode *right = (DataNode*)rp.data;
+
+    int ret = 0;
+    if (datanode_used_bytes(left) + datanode_used_bytes(right) > datanode_capacity(left)) {
+        // too much for one block, even them out instead. the separator
+        // moves, right may be the rightmost leaf appends go by
+        datanode_redistribute(left, right);
+        parent->keys[left_pos] = datanode_key_at(right, 0);
+        bplus_forget_rightmost(meta);
+        if (parent->counted) {
+            indexnode_counts(parent)[left_pos] = left->count;
+            indexnode_counts(parent)[right_pos] = right->count;
+        }
+        pager_set_dirty(pager, &lp);
+        pager_set_dirty(pager, &rp);
+        bplus_change_keep(meta, change, &lp);
+        bplus_change_keep(meta, change, &rp);
+    } else {
+        // right is folded into left and goes to the free list
+        int right_id = children[right_pos];
+        datanode_merge(left, right);
+        if (parent->counted) indexnode_counts(parent)[left_pos] = left->count;
+        indexnode_remove_at(parent, left_pos);
+        pager_set_dirty(pager, &lp);
+        bplus_change_keep(meta, change, &lp);
+        pager_unpin(pager, &rp);
+        ret = bplus_free_block(meta, right_id, change);
+    }
+    return ret;
+}
+
+// same as fix_leaf_child for a child that is an index node
+static int fix_index_child(BPlusMetaImpl *meta, IndexNode *parent, int pos, int child_height,
+                           BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    int *children = indexnode_children(parent);
+    int left_pos = pos > 0 ? pos - 1 : pos;
+    int right_pos = left_pos + 1;
+
+    Page lp, rp;
+    CALL_PM(pager_get(pager, children[left_pos], &lp));
+    if (pager_get(pager, children[right_pos], &rp) != 0) {
+        pager_unpin(pager, &lp);
+        return -1;
+    }
+    IndexNode *left = (IndexNode*)lp.data;
+    IndexNode *right = (IndexNode*)rp.data;
+    int *lc = indexnode_children(left);
+    int *rc = indexnode_children(right);
+    int *ln = indexnode_counts(left);
+    int *rn = indexnode_counts(right);
+    IndexNode *sibling = (left_pos == pos) ? right : left;
+
+    int ret = 0;
+    if (sibling->count > indexnode_min_keys(sibling)) {
+        if (sibling == left) {
+            // rotate right: separator comes down, last key of left goes up
+            for (int i = right->count; i > 0; i--) {
+                right->keys[i] = right->keys[i - 1];
+            }
+            for (int i = right->count + 1; i > 0; i--) {
+                rc[i] = rc[i - 1];
+                if (right->counted) rn[i] = rn[i - 1];
+            }
+            right->keys[0] = parent->keys[left_pos];
+            rc[0] = lc[left->count];
+            if (right->counted) rn[0] = ln[left->count];
+            right->count++;
+            parent->keys[left_pos] = left->keys[left->count - 1];
+            left->count--;
+        } else {
+            // rotate left: separator comes down, first key of right goes up
+            left->keys[left->count] = parent->keys[left_pos];
+            lc[left->count + 1] = rc[0];
+            if (left->counted) ln[left->count + 1] = rn[0];
+            left->count++;
+            parent->keys[left_pos] = right->keys[0];
+            for (int i = 0; i < right->count - 1; i++) {
+                right->keys[i] = right->keys[i + 1];
+            }
+            for (int i = 0; i < right->count; i++) {
+                rc[i] = rc[i + 1];
+                if (right->counted) rn[i] = rn[i + 1];
+            }
+            right->count--;
+        }
+        if (parent->counted) {
+            indexnode_counts(parent)[left_pos] = (int)indexnode_total(left);
+            indexnode_counts(parent)[right_pos] = (int)indexnode_total(right);
+        }
+        // the rotated separators bound the leaves below them
+        bplus_forget_rightmost(meta);
+        pager_set_dirty(pager, &lp);
+        pager_set_dirty(pager, &rp);
+        bplus_index_cache_sync(meta, children[left_pos], child_height, left);
+        bplus_index_cache_sync(meta, children[right_pos], child_height, right);
+        bplus_change_keep(meta, change, &lp);
+        bplus_change_keep(meta, change, &rp);
+    } else {
+        int right_id = children[right_pos];
+        indexnode_merge(left, parent->keys[left_pos], right);
+        if (parent->counted) indexnode_counts(parent)[left_pos] = (int)indexnode_total(left);
+        indexnode_remove_at(parent, left_pos);
+        pager_set_dirty(pager, &lp);
+        bplus_index_cache_sync(meta, children[left_pos], child_height, left);
+        bplus_change_keep(meta, change, &lp);
+        pager_unpin(pager, &rp);
+        ret = bplus_free_block(meta, right_id, change);
+    }
+    return ret;
+}
+
+// returns 0 if deleted, -1 if not found or on error
+// *underflow tells the caller to rebalance this node
+// every page the delete changes goes into change
+static int delete_recursive(BPlusMetaImpl *meta, int curr_block, int key, int height, int *underflow,
+                            BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    Page page;
+    *underflow = 0;
+    CALL_PM(pager_get(pager, curr_block, &page));
+
+    int ret_val = -1;
+    int changed = 0;
+
+    if (height == 1) { // leaf node
+        DataNode *leaf = (DataNode*)page.data;
+        int pos = datanode_find_key(leaf, key);
+        if (pos >= 0) {
+            datanode_remove_at(leaf, pos);
+            pager_set_dirty(pager, &page);
+            *underflow = datanode_is_underfull(leaf);
+            changed = 1;
+            ret_val = 0;
+        }
+    } else { // index node
+        IndexNode *idx = (IndexNode*)page.data;
+        int pos = indexnode_find_child_index(idx, key);
+
+        int child_underflow;
+        ret_val = delete_recursive(meta, indexnode_children(idx)[pos], key, height - 1, &child_underflow, change);
+        if (ret_val == 0 && idx->counted) {
+            indexnode_counts(idx)[pos]--;
+        }
+
+        if (ret_val == 0 && child_underflow && idx->count > 0) {
+            if (height == 2) ret_val = fix_leaf_child(meta, idx, pos, change);
+            else ret_val = fix_index_child(meta, idx, pos, height - 1, change);
+            pager_set_dirty(pager, &page);
+            bplus_index_cache_sync(meta, curr_block, height, idx);
+            *underflow = indexnode_is_underfull(idx);
+            changed = 1;
+        } else if (ret_val == 0 && idx->counted) {
+            // just the count, the page stays out of the change so a delete
+            // that rebalances nothing is still logged as the leaf's record
+            pager_set_dirty(pager, &page);
+            bplus_index_cache_sync(meta, curr_block, height, idx);
+            if (bplus_log_counts(meta, &page) < 0) ret_val = -1;
+        }
+    }
+
+    if (changed) bplus_change_keep(meta, change, &page);
+    else pager_unpin(pager, &page);
+    return ret_val;
+}
+
+static int delete_key(BPlusMetaImpl *meta, int key, BPlusChange *change) {
+    int underflow;
+    if (delete_recursive(meta, meta->root_block_id, key, meta->height, &underflow, change) != 0) {
+        return -1;
+    }
+
+    if (meta->height == 1) {
+        // root leaf may go down to zero records
+        return 0;
+    }
+
+    Page page;
+    CALL_PM(pager_get(meta->rt.pager, meta->root_block_id, &page));
+    IndexNode *root = (IndexNode*)page.data;
+    int only_child = root->count == 0 ? indexnode_children(root)[0] : -1;
+    pager_unpin(meta->rt.pager, &page);
+
+    if (only_child != -1) {
+        // root emptied, its only child takes over
+        int old_root = meta->root_block_id;
+        meta->root_block_id = only_child;
+        meta->height--;
+        STATS_ADD(meta->rt.stats.height_changes, 1);
+        change->root_changed = 1;
+        if (bplus_free_block(meta, old_root, change) != 0) return -1;
+        // with a log the record carries the new root until a checkpoint
+        if (meta->rt.wal == NULL && bplus_meta_store(meta) != 0) return -1;
+        if (bplus_index_cache_reload(meta) != 0) return -1;
+    }
+    return 0;
+}
+
+int bplus_record_delete(int file_desc, BPlusMeta *metadata, int key) {
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (meta->rt.pager->read_only) {
+        fprintf(stderr, "Error: file is open read-only\n");
+        return -1;
+    }
+    // a key the filter never saw is in neither the tree nor the memtable
+    if (!bplus_filter_may_contain(meta, key)) {
+        return -1;
+    }
+    // the secondary indexes unlist the record by its values
+    Record old;
+    int listed = bplus_secondary_any(meta);
+    if (listed && bplus_record_find_into(file_desc, metadata, key, &old) != 0) {
+        return -1;
+    }
+    // merges reach sideways into siblings, so deletes run alone
+    // optimistic readers take no latch, the tree version sends them back
+    bplus_tree_enter(meta, 1);
+    if (meta->rt.latches) version_write_begin(&meta->rt.latches->tree_version);
+    long lsn = 0;
+    int ret = 0;
+    // a buffered insert is just dropped, the tree does not have the key
+    if (bplus_buffered_remove(meta, key, &lsn) != 0) {
+        BPlusChange change;
+        bplus_change_init(&change);
+        ret = delete_key(meta, key, &change);
+
+        if (change.count == 1 && !change.root_changed) {
+            // only the leaf changed, no rebalancing
+            lsn = bplus_log_leaf_delete(meta, &change.pages[0], key);
+            pager_unpin(meta->rt.pager, &change.pages[0]);
+        } else {
+            lsn = bplus_change_log(meta, &change);
+        }
+    }
+    if (lsn < 0) ret = -1;
+    if (meta->rt.latches) version_write_end(&meta->rt.latches->tree_version);
+    bplus_tree_leave(meta);
+
+    if (ret == 0 && bplus_log_commit(meta, lsn) != 0) ret = -1;
+    if (ret == 0 && listed && bplus_secondary_remove(meta, &old) != 0) ret = -1;
+    return ret;
+}
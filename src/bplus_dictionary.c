@@ -0,0 +1,291 @@
+/**
+ * column dictionaries of CHAR values
+ * every column keeps its values in the order they got their codes, in
+ * chunks that never move once allocated, and an open addressing table from
+ * the hash of a value to its code. an add fills in the value before it
+ * publishes the table slot and the count, so readers that go by either
+ * never see a half written value
+ */
+
+#include "bplus_dictionary.h"
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define DICTIONARY_CHUNK 256
+#define DICTIONARY_CHUNKS ((DICTIONARY_MAX_CODES + DICTIONARY_CHUNK - 1) / DICTIONARY_CHUNK)
+// at least twice the codes, so probes stay short
+#define DICTIONARY_SLOTS 65536
+
+typedef struct {
+  unsigned char length;
+  char bytes[MAX_STRING_LENGTH];
+} DictionaryValue;
+
+typedef struct {
+  int count;                                      // codes given out
+  DictionaryValue *chunks[DICTIONARY_CHUNKS];     // value of every code
+  int *slots;                                     // code + 1 by hash of the value, 0 if free
+} DictionaryColumn;
+
+struct Dictionary {
+  DictionaryColumn *columns[MAX_ATTRIBUTES];      // NULL for attributes stored as they are
+};
+
+static int coded_attribute(const TableSchema *schema, int attr) {
+    return schema->attributes[attr].type == TYPE_CHAR && attr != schema->key_index;
+}
+
+int dictionary_schema_codes(const TableSchema *schema) {
+    for (int i = 0; i < schema->count; i++) {
+        if (coded_attribute(schema, i)) return 1;
+    }
+    return 0;
+}
+
+Dictionary *dictionary_create(const TableSchema *schema) {
+    Dictionary *dict = calloc(1, sizeof(Dictionary));
+    if (dict == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < schema->count; i++) {
+        if (!coded_attribute(schema, i)) continue;
+        DictionaryColumn *column = calloc(1, sizeof(DictionaryColumn));
+        if (column != NULL) column->slots = calloc(DICTIONARY_SLOTS, sizeof(int));
+        if (column == NULL || column->slots == NULL) {
+            free(column);
+            dictionary_destroy(dict);
+            return NULL;
+        }
+        dict->columns[i] = column;
+    }
+    return dict;
+}
+
+void dictionary_destroy(Dictionary *dict) {
+    if (dict == NULL) {
+        return;
+    }
+    for (int i = 0; i < MAX_ATTRIBUTES; i++) {
+        DictionaryColumn *column = dict->columns[i];
+        if (column == NULL) continue;
+        for (int c = 0; c < DICTIONARY_CHUNKS; c++) {
+            free(column->chunks[c]);
+        }
+        free(column->slots);
+        free(column);
+    }
+    free(dict);
+}
+
+int dictionary_coded(const Dictionary *dict, int attr) {
+    return attr >= 0 && attr < MAX_ATTRIBUTES && dict->columns[attr] != NULL;
+}
+
+int dictionary_count(const Dictionary *dict, int attr) {
+    return __atomic_load_n(&dict->columns[attr]->count, __ATOMIC_ACQUIRE);
+}
+
+// FNV-1a
+static uint32_t hash_value(const char *bytes, int length) {
+    uint32_t h = 2166136261U;
+    for (int i = 0; i < length; i++) {
+        h ^= (unsigned char)bytes[i];
+        h *= 16777619U;
+    }
+    return h;
+}
+
+static const DictionaryValue *value_of(const DictionaryColumn *column, int code) {
+    return &column->chunks[code / DICTIONARY_CHUNK][code % DICTIONARY_CHUNK];
+}
+
+int dictionary_find(const Dictionary *dict, int attr, const char *bytes, int length) {
+    const DictionaryColumn *column = dict->columns[attr];
+    uint32_t slot = hash_value(bytes, length) & (DICTIONARY_SLOTS - 1);
+    for (;;) {
+        int entry = __atomic_load_n(&column->slots[slot], __ATOMIC_ACQUIRE);
+        if (entry == 0) {
+            return -1;
+        }
+        const DictionaryValue *value = value_of(column, entry - 1);
+        if (value->length == length && memcmp(value->bytes, bytes, length) == 0) {
+            return entry - 1;
+        }
+        slot = (slot + 1) & (DICTIONARY_SLOTS - 1);
+    }
+}
+
+int dictionary_reserve(Dictionary *dict, int attr) {
+    DictionaryColumn *column = dict->columns[attr];
+    int code = column->count;
+    if (code == DICTIONARY_MAX_CODES) {
+        return -1;
+    }
+    DictionaryValue **chunk = &column->chunks[code / DICTIONARY_CHUNK];
+    if (*chunk == NULL) {
+        DictionaryValue *values = malloc(DICTIONARY_CHUNK * sizeof(DictionaryValue));
+        if (values == NULL) return -1;
+        __atomic_store_n(chunk, values, __ATOMIC_RELEASE);
+    }
+    return 0;
+}
+
+int dictionary_add(Dictionary *dict, int attr, const char *bytes, int length) {
+    DictionaryColumn *column = dict->columns[attr];
+    if (dictionary_reserve(dict, attr) != 0) {
+        return -1;
+    }
+    int code = column->count;
+    if (length > MAX_STRING_LENGTH) length = MAX_STRING_LENGTH;
+    DictionaryValue *value = &column->chunks[code / DICTIONARY_CHUNK][code % DICTIONARY_CHUNK];
+    value->length = (unsigned char)length;
+    memcpy(value->bytes, bytes, length);
+
+    uint32_t slot = hash_value(bytes, length) & (DICTIONARY_SLOTS - 1);
+    while (column->slots[slot] != 0) {
+        slot = (slot + 1) & (DICTIONARY_SLOTS - 1);
+    }
+    __atomic_store_n(&column->slots[slot], code + 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&column->count, code + 1, __ATOMIC_RELEASE);
+    return code;
+}
+
+const char *dictionary_value(const Dictionary *dict, int attr, int code, int *length) {
+    const DictionaryColumn *column = dict->columns[attr];
+    if (code < 0 || code >= __atomic_load_n(&column->count, __ATOMIC_ACQUIRE)) {
+        *length = 0;
+        return "";
+    }
+    const DictionaryValue *value = value_of(column, code);
+    *length = value->length;
+    return value->bytes;
+}
+
+int dictionary_encode(const Dictionary *dict, int attr, const char *bytes, int length, char *out) {
+    int code = dictionary_find(dict, attr, bytes, length);
+    if (code < 0) {
+        out[0] = (char)DICTIONARY_RAW;
+        memcpy(out + 1, bytes, length);
+        return length + 1;
+    }
+    if (code < DICTIONARY_SHORT_CODES) {
+        out[0] = (char)code;
+        return 1;
+    }
+    code -= DICTIONARY_SHORT_CODES;
+    out[0] = (char)(0x80 | (code >> 8));
+    out[1] = (char)(code & 0xff);
+    return 2;
+}
+
+const char *dictionary_decode(const Dictionary *dict, int attr, const char *field, int length, int *value_length) {
+    const unsigned char *bytes = (const unsigned char*)field;
+    if (length <= 0) {
+        *value_length = 0;
+        return field;
+    }
+    if (bytes[0] == DICTIONARY_RAW) {
+        *value_length = length - 1;
+        return field + 1;
+    }
+    if (bytes[0] < 0x80) {
+        return dictionary_value(dict, attr, bytes[0], value_length);
+    }
+    int low = length > 1 ? bytes[1] : 0;
+    return dictionary_value(dict, attr, DICTIONARY_SHORT_CODES + ((bytes[0] & 0x7f) << 8 | low), value_length);
+}
+
+static int char_length(const AttributeSchema *attr, const FieldValue *value) {
+    int max = attr->length < MAX_STRING_LENGTH ? attr->length : MAX_STRING_LENGTH;
+    return (int)strnlen(value->string_value, max);
+}
+
+// bytes of the INT/FLOAT fields and number of CHAR fields
+static int fixed_size(const TableSchema *schema, int *char_count) {
+    int fixed = 0;
+    *char_count = 0;
+    for (int i = 0; i < schema->count; i++) {
+        if (schema->attributes[i].type == TYPE_CHAR) (*char_count)++;
+        else if (schema->attributes[i].type != TYPE_NULL) fixed += 4;
+    }
+    return fixed;
+}
+
+int dictionary_add_values(Dictionary *dict, const TableSchema *schema, const Record *record) {
+    for (int i = 0; i < schema->count; i++) {
+        // a column out of codes stores its new values as they are
+        if (dict->columns[i] == NULL || dictionary_count(dict, i) == DICTIONARY_MAX_CODES) continue;
+        const char *value = record->values[i].string_value;
+        int len = char_length(&schema->attributes[i], &record->values[i]);
+        if (dictionary_find(dict, i, value, len) < 0 && dictionary_add(dict, i, value, len) < 0) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+int dictionary_pack(const Dictionary *dict, const TableSchema *schema, const Record *record, char *buf) {
+    int char_count;
+    int fixed = fixed_size(schema, &char_count);
+    unsigned char *ends = (unsigned char*)buf + fixed;
+    char *chars = buf + fixed + char_count;
+    int pos = 0;
+    int var = 0;
+    int c = 0;
+    for (int i = 0; i < schema->count; i++) {
+        switch (schema->attributes[i].type) {
+            case TYPE_INT:
+            case TYPE_FLOAT:
+                memcpy(buf + pos, &record->values[i], 4);
+                pos += 4;
+                break;
+            case TYPE_CHAR: {
+                const char *value = record->values[i].string_value;
+                int len = char_length(&schema->attributes[i], &record->values[i]);
+                if (dict->columns[i]) {
+                    var += dictionary_encode(dict, i, value, len, chars + var);
+                } else {
+                    memcpy(chars + var, value, len);
+                    var += len;
+                }
+                ends[c++] = (unsigned char)var;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return fixed + char_count + var;
+}
+
+void dictionary_unpack(const Dictionary *dict, const TableSchema *schema, const char *buf, Record *record) {
+    int char_count;
+    int fixed = fixed_size(schema, &char_count);
+    const unsigned char *ends = (const unsigned char*)buf + fixed;
+    const char *chars = buf + fixed + char_count;
+    int pos = 0;
+    int start = 0;
+    int c = 0;
+    for (int i = 0; i < schema->count; i++) {
+        switch (schema->attributes[i].type) {
+            case TYPE_INT:
+            case TYPE_FLOAT:
+                memcpy(&record->values[i], buf + pos, 4);
+                pos += 4;
+                break;
+            case TYPE_CHAR: {
+                int len = ends[c] - start;
+                const char *value = chars + start;
+                if (dict->columns[i]) value = dictionary_decode(dict, i, value, len, &len);
+                if (len > MAX_STRING_LENGTH) len = MAX_STRING_LENGTH;
+                memcpy(record->values[i].string_value, value, len);
+                if (len < MAX_STRING_LENGTH) record->values[i].string_value[len] = '\0';
+                start = ends[c++];
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
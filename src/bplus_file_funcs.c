@@ -1,310 +1,1683 @@
-#include "bplus_file_funcs.h"
+#include "bplus_internal.h"
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#define BPLUS_MAGIC 0xBEEFBEEF
+void bplus_meta_init(BPlusMetaImpl *meta, const TableSchema *schema, int page_size, int counted) {
+    memset(meta, 0, sizeof(BPlusMetaImpl));
+    meta->magic_number = BPLUS_MAGIC;
+    meta->format_version = BPLUS_FORMAT_VERSION;
+    meta->page_size = page_size;
+    meta->counted = counted != 0;
+    meta->max_keys_index = counted ? INDEXNODE_MAX_KEYS_COUNTED(page_size) : INDEXNODE_MAX_KEYS(page_size);
+    meta->leaf_capacity = DATANODE_CAPACITY(page_size);
+    meta->height = 1;
+    meta->schema = *schema;
+    meta->free_block_head = -1;
+}
 
-typedef struct {
-  int magic_number;
-  int root_block_id;
-  int height;
-  int total_blocks;
-  TableSchema schema;
-} BPlusMetaImpl;
-
-// macro to check bf errors
-#define CALL_BF(call) do { \
-    BF_ErrorCode code = call; \
-    if (code != BF_OK) { \
-        BF_PrintError(code); \
-        return -1; \
-    } \
-} while (0)
+int bplus_meta_store(const BPlusMetaImpl *meta) {
+    Pager *pager = meta->rt.pager;
+    Page p0;
+    CALL_PM(pager_get(pager, 0, &p0));
+    if (meta->rt.latches) pthread_mutex_lock(&meta->rt.latches->alloc);
+    memcpy(p0.data, meta, BPLUS_META_DISK_SIZE);
+    if (meta->rt.latches) pthread_mutex_unlock(&meta->rt.latches->alloc);
+    pager_set_dirty(pager, &p0);
+    pager_unpin(pager, &p0);
+    return 0;
+}
+
+static int allocate_block(BPlusMetaImpl *meta, Page *page, int reuse) {
+    Pager *pager = meta->rt.pager;
+    STATS_ADD(meta->rt.stats.blocks_allocated, 1);
+    if (reuse && meta->free_block_head != -1) {
+        // pop the free list
+        CALL_PM(pager_get(pager, meta->free_block_head, page));
+        meta->free_block_head = ((FreeBlock*)page->data)->next_free_block;
+        return 0;
+    }
+
+    CALL_PM(pager_allocate(pager, page));
+    meta->total_blocks = page->id + 1;
+    return 0;
+}
+
+int bplus_allocate_block(BPlusMetaImpl *meta, Page *page) {
+    if (meta->rt.latches == NULL) {
+        return allocate_block(meta, page, 1);
+    }
+    pthread_mutex_lock(&meta->rt.latches->alloc);
+    int ret = allocate_block(meta, page, 1);
+    pthread_mutex_unlock(&meta->rt.latches->alloc);
+    return ret;
+}
+
+int bplus_allocate_block_at_end(BPlusMetaImpl *meta, Page *page) {
+    if (meta->rt.latches == NULL) {
+        return allocate_block(meta, page, 0);
+    }
+    pthread_mutex_lock(&meta->rt.latches->alloc);
+    int ret = allocate_block(meta, page, 0);
+    pthread_mutex_unlock(&meta->rt.latches->alloc);
+    return ret;
+}
+
+int bplus_free_block(BPlusMetaImpl *meta, int block_id, BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    Page page;
+    CALL_PM(pager_get(pager, block_id, &page));
+    ((FreeBlock*)page.data)->next_free_block = meta->free_block_head;
+    meta->free_block_head = block_id;
+    pager_set_dirty(pager, &page);
+    bplus_change_keep(meta, change, &page);
+    if (meta->rt.index_cache) {
+        index_cache_remove(meta->rt.index_cache, block_id);
+    }
+    // the freed block may be the rightmost leaf
+    bplus_forget_rightmost(meta);
+    return 0;
+}
+
+const IndexNode *bplus_index_read(const BPlusMetaImpl *meta, int block_id, Page *page, int *pinned) {
+    if (meta->rt.index_cache) {
+        const IndexNode *cached = index_cache_get(meta->rt.index_cache, block_id);
+        if (cached) {
+            *pinned = 0;
+            return cached;
+        }
+    }
+    if (pager_get(meta->rt.pager, block_id, page) != 0) {
+        *pinned = 0;
+        return NULL;
+    }
+    *pinned = 1;
+    return (const IndexNode*)page->data;
+}
+
+void bplus_index_cache_sync(BPlusMetaImpl *meta, int block_id, int height, const IndexNode *node) {
+    IndexCache *cache = meta->rt.index_cache;
+    if (cache == NULL) {
+        return;
+    }
+    if (index_cache_get(cache, block_id)) {
+        index_cache_put(cache, block_id, node);
+        return;
+    }
+    // new node on a cached level, e.g. the right half of a split
+    // if it does not fit the budget descents just pin it instead
+    long max_bytes = index_cache_max_bytes(cache);
+    if (meta->height - height < index_cache_levels(cache) &&
+        (max_bytes == 0 || index_cache_bytes(cache) + indexnode_size(node) <= max_bytes)) {
+        index_cache_put(cache, block_id, node);
+    }
+}
+
+int bplus_index_cache_reload(BPlusMetaImpl *meta) {
+    IndexCache *cache = meta->rt.index_cache;
+    if (cache == NULL) {
+        return 0;
+    }
+    index_cache_clear(cache);
+
+    int max_levels = index_cache_max_levels(cache);
+    long max_bytes = index_cache_max_bytes(cache);
+    int *level = malloc(sizeof(int));
+    if (level == NULL) return -1;
+    level[0] = meta->root_block_id;
+    int count = 1;
+    int levels = 0;
+    int ret = 0;
+
+    Pager *pager = meta->rt.pager;
+    long node_size = INDEXNODE_SIZE(meta->max_keys_index, meta->counted);
+
+    // take whole index levels from the root while they fit the limits
+    while (levels < meta->height - 1 && (max_levels == 0 || levels < max_levels)) {
+        if (max_bytes != 0 && index_cache_bytes(cache) + count * node_size > max_bytes) {
+            break;
+        }
+        int *next = NULL;
+        int next_count = 0;
+        for (int i = 0; i < count && ret == 0; i++) {
+            Page page;
+            if (pager_get(pager, level[i], &page) != 0) { ret = -1; break; }
+            const IndexNode *node = (const IndexNode*)page.data;
+            int *grown = realloc(next, (next_count + node->count + 1) * sizeof(int));
+            if (grown == NULL || index_cache_put(cache, level[i], node) != 0) {
+                next = grown ? grown : next;
+                ret = -1;
+            } else {
+                next = grown;
+                memcpy(next + next_count, indexnode_children(node), (node->count + 1) * sizeof(int));
+                next_count += node->count + 1;
+            }
+            pager_unpin(pager, &page);
+        }
+        free(level);
+        level = next;
+        count = next_count;
+        if (ret != 0) break;
+        levels++;
+    }
+
+    free(level);
+    if (ret != 0) {
+        index_cache_clear(cache);
+        return -1;
+    }
+    index_cache_set_levels(cache, levels);
+    return 0;
+}
+
+void bplus_tree_enter(const BPlusMetaImpl *meta, int exclusive) {
+    if (meta->rt.latches == NULL) {
+        return;
+    }
+    if (exclusive) pthread_rwlock_wrlock(&meta->rt.latches->tree);
+    else pthread_rwlock_rdlock(&meta->rt.latches->tree);
+}
+
+void bplus_tree_leave(const BPlusMetaImpl *meta) {
+    if (meta->rt.latches) pthread_rwlock_unlock(&meta->rt.latches->tree);
+}
+
+int bplus_root_latch(const BPlusMetaImpl *meta, int exclusive, int *height) {
+    TreeLatches *latches = meta->rt.latches;
+    if (latches == NULL) {
+        *height = meta->height;
+        return meta->root_block_id;
+    }
+    if (exclusive) pthread_rwlock_wrlock(&latches->root);
+    else pthread_rwlock_rdlock(&latches->root);
+    int root = meta->root_block_id;
+    *height = meta->height;
+    if (exclusive) {
+        latch_exclusive(latches, root);
+    } else {
+        // holding the root pointer until the root block is latched means
+        // a root split in between cannot send us to a half of the tree
+        latch_shared(latches, root);
+        pthread_rwlock_unlock(&latches->root);
+    }
+    return root;
+}
+
+void bplus_root_unlatch(const BPlusMetaImpl *meta) {
+    if (meta->rt.latches) pthread_rwlock_unlock(&meta->rt.latches->root);
+}
 
 int bplus_create_file(const TableSchema *schema, const char *fileName) {
-    CALL_BF(BF_CreateFile(fileName));
-    int fd;
-    CALL_BF(BF_OpenFile(fileName, &fd));
+    return bplus_create_file_with_options(schema, fileName, NULL);
+}
 
-    BF_Block *b0;
-    BF_Block_Init(&b0);
-    BF_Block *b1;
-    BF_Block_Init(&b1);
+int bplus_create_file_with_options(const TableSchema *schema, const char *fileName,
+                                   const BPlusCreateOptions *options) {
+    // the tree orders by int keys, wider ones cannot be indexed
+    KeyCodec codec;
+    if (key_tree_codec(&codec, schema) != 0) {
+        return -1;
+    }
+    int page_size = options && options->page_size ? options->page_size : BF_BLOCK_SIZE;
+    Pager *pager = pager_create(fileName, page_size, NULL);
+    if (pager == NULL) {
+        return -1;
+    }
 
     // allocate block 0 and 1
-    if (BF_AllocateBlock(fd, b0) != BF_OK) { 
-        BF_Block_Destroy(&b0); 
-        BF_Block_Destroy(&b1); 
-        return -1; 
+    Page p0, p1;
+    if (pager_allocate(pager, &p0) != 0) {
+        pager_close(pager);
+        return -1;
     }
-    
-    if (BF_AllocateBlock(fd, b1) != BF_OK) { 
-        BF_Block_Destroy(&b0); 
-        BF_Block_Destroy(&b1); 
-        return -1; 
+    if (pager_allocate(pager, &p1) != 0) {
+        pager_unpin(pager, &p0);
+        pager_close(pager);
+        return -1;
     }
 
+    // a log left by an earlier file of the same name is not ours
+    bplus_log_discard(fileName);
+
     BPlusMetaImpl meta;
-    meta.magic_number = BPLUS_MAGIC;
-    meta.root_block_id = 1;
-    meta.height = 1;
-    meta.schema = *schema;
-    
-    int blocks;
-    // get total blocks
-    if (BF_GetBlockCounter(fd, &blocks) != BF_OK) { 
-        BF_Block_Destroy(&b0); 
-        BF_Block_Destroy(&b1); 
-        return -1; 
-    }
-    meta.total_blocks = blocks;
-
-    memcpy(BF_Block_GetData(b0), &meta, sizeof(BPlusMetaImpl));
-    BF_Block_SetDirty(b0);
+    bplus_meta_init(&meta, schema, page_size, options && options->counted);
+    meta.root_block_id = p1.id;
+    meta.rt.pager = pager;
 
     // init root as empty leaf
-    DataNode leaf;
-    datanode_init(&leaf);
-    memcpy(BF_Block_GetData(b1), &leaf, sizeof(DataNode));
-    BF_Block_SetDirty(b1);
-
-    BF_UnpinBlock(b0); BF_Block_Destroy(&b0);
-    BF_UnpinBlock(b1); BF_Block_Destroy(&b1);
-    CALL_BF(BF_CloseFile(fd));
-    return 0;
+    datanode_init((DataNode*)p1.data, page_size);
+    pager_set_dirty(pager, &p1);
+    pager_unpin(pager, &p1);
+
+    int ret = 0;
+    if (options && options->dictionary && dictionary_schema_codes(schema)) {
+        // the chain starts out empty, inserts add the values to it
+        meta.rt.dictionary = dictionary_create(schema);
+        if (meta.rt.dictionary == NULL || bplus_dictionary_write(&meta) != 0) ret = -1;
+        dictionary_destroy(meta.rt.dictionary);
+        meta.rt.dictionary = NULL;
+    }
+    meta.total_blocks = pager_page_count(pager);
+
+    memcpy(p0.data, &meta, BPLUS_META_DISK_SIZE);
+    pager_set_dirty(pager, &p0);
+    pager_unpin(pager, &p0);
+    if (pager_close(pager) != 0) ret = -1;
+    return ret;
 }
 
+static int open_with_pager(Pager *pager, const char *fileName, int *file_desc, BPlusMeta **metadata,
+                           const BPlusOpenOptions *options);
+
 int bplus_open_file(const char *fileName, int *file_desc, BPlusMeta **metadata) {
-    CALL_BF(BF_OpenFile(fileName, file_desc));
-    BF_Block *b0;
-    BF_Block_Init(&b0);
-    
+    return bplus_open_file_with_options(fileName, file_desc, metadata, NULL);
+}
+
+// 1 if the metadata is of a file this library can read
+static int meta_format_ok(const char *fileName, const BPlusMetaImpl *head) {
+    if (head->magic_number == BPLUS_MAGIC_V1) {
+        printf("Error: %s is in the old file format, it has to be created again\n", fileName);
+        return 0;
+    }
+    if (head->magic_number != BPLUS_MAGIC) {
+        return 0;
+    }
+    if (head->format_version != BPLUS_FORMAT_VERSION) {
+        printf("Error: %s is in file format %d, this library reads %d\n", fileName, head->format_version,
+               BPLUS_FORMAT_VERSION);
+        return 0;
+    }
+    return 1;
+}
+
+int bplus_open_file_with_options(const char *fileName, int *file_desc, BPlusMeta **metadata,
+                                 const BPlusOpenOptions *options) {
+    *metadata = NULL;
+
+    // the page size in the metadata decides which backend opens the file
+    BPlusMetaImpl head;
+    if (pager_peek(fileName, &head, BPLUS_META_DISK_SIZE) != 0 || !meta_format_ok(fileName, &head)) {
+        return -1;
+    }
+    PagerConfig config = {0, PAGER_POLICY_LRU};
+    if (options) {
+        config.pool_mb = options->buffer_pool_mb;
+        config.policy = options->replacement;
+    }
+    Pager *pager = pager_open(fileName, head.page_size, &config);
+    if (pager == NULL) {
+        return -1;
+    }
+    return open_with_pager(pager, fileName, file_desc, metadata, options);
+}
+
+int bplus_open_file_readonly(const char *fileName, int *file_desc, BPlusMeta **metadata) {
+    *metadata = NULL;
+
+    BPlusMetaImpl head;
+    if (pager_peek(fileName, &head, BPLUS_META_DISK_SIZE) != 0 || !meta_format_ok(fileName, &head) ||
+        !pager_page_size_valid(head.page_size)) {
+        return -1;
+    }
+    Pager *pager = pager_mmap_open(fileName, head.page_size);
+    if (pager == NULL) {
+        return -1;
+    }
+    return open_with_pager(pager, fileName, file_desc, metadata, NULL);
+}
+
+// load the metadata through an opened pager, the pager is closed on failure
+static int open_with_pager(Pager *pager, const char *fileName, int *file_desc, BPlusMeta **metadata,
+                           const BPlusOpenOptions *options) {
+    BPlusMetaImpl *meta = malloc(sizeof(BPlusMetaImpl));
+    if (meta == NULL) {
+        pager_close(pager);
+        return -1;
+    }
+
     // get metadata block
-    if (BF_GetBlock(*file_desc, 0, b0) != BF_OK) {
-        BF_Block_Destroy(&b0);
-        BF_CloseFile(*file_desc);
+    Page p0;
+    if (pager_get(pager, 0, &p0) != 0) {
+        free(meta);
+        pager_close(pager);
+        return -1;
+    }
+    memcpy(meta, p0.data, BPLUS_META_DISK_SIZE);
+    memset(&meta->rt, 0, sizeof(BPlusRuntime));
+    meta->rt.pager = pager;
+    meta->rt.rightmost = -1;
+    meta->rt.reorg_from = INT_MIN;
+    pager_unpin(pager, &p0);
+    if (!meta_format_ok(fileName, meta) || key_tree_codec(&meta->rt.key_codec, &meta->schema) != 0) {
+        free(meta);
+        pager_close(pager);
+        return -1;
+    }
+    meta->rt.file_name = strdup(fileName);
+    if (meta->rt.file_name == NULL) {
+        free(meta);
+        pager_close(pager);
         return -1;
     }
 
-    *metadata = (BPlusMeta*)malloc(sizeof(BPlusMetaImpl));
-    if (*metadata == NULL) {
-        BF_UnpinBlock(b0);
-        BF_Block_Destroy(&b0);
-        BF_CloseFile(*file_desc);
+    // a log left behind means the last session did not close the file,
+    // replay loads the dictionary itself once the log put its blocks back
+    if (bplus_recover(meta, fileName) != 0 || bplus_dictionary_open(meta) != 0) {
+        dictionary_destroy(meta->rt.dictionary);
+        free(meta->rt.file_name);
+        free(meta);
+        pager_close(pager);
         return -1;
     }
-    memcpy(*metadata, BF_Block_GetData(b0), sizeof(BPlusMetaImpl));
+    if (options && options->wal) {
+        char *path = wal_path_of(fileName);
+        meta->rt.wal = path ? wal_open(path, meta->page_size, options->wal_commit_interval_ms) : NULL;
+        free(path);
+        if (meta->rt.wal == NULL) {
+            dictionary_destroy(meta->rt.dictionary);
+            free(meta->rt.file_name);
+            free(meta);
+            pager_close(pager);
+            return -1;
+        }
+        pager->wal = meta->rt.wal;
+    }
 
-    // check magic number is correct
-    if (((BPlusMetaImpl*)(*metadata))->magic_number != BPLUS_MAGIC) {
-        free(*metadata);
-        *metadata = NULL;
-        BF_UnpinBlock(b0);
-        BF_Block_Destroy(&b0);
-        BF_CloseFile(*file_desc);
+    if (options && options->concurrent) {
+        if (options->index_cache_levels > 0 || options->index_cache_bytes > 0) {
+            printf("Error: the index cache cannot be used with concurrent\n");
+            bplus_close_file(pager->fd, (BPlusMeta*)meta);
+            return -1;
+        }
+        meta->rt.latches = tree_latches_create();
+        if (meta->rt.latches == NULL || pager_make_thread_safe(pager) != 0) {
+            tree_latches_destroy(meta->rt.latches);
+            meta->rt.latches = NULL;
+            bplus_close_file(pager->fd, (BPlusMeta*)meta);
+            return -1;
+        }
+    } else if (options && (options->index_cache_levels > 0 || options->index_cache_bytes > 0)) {
+        meta->rt.index_cache = index_cache_create(options->index_cache_levels, options->index_cache_bytes);
+        if (meta->rt.index_cache == NULL || bplus_index_cache_reload(meta) != 0) {
+            bplus_close_file(pager->fd, (BPlusMeta*)meta);
+            return -1;
+        }
+    }
+
+    if (options && options->memtable_bytes > 0) {
+        meta->rt.memtable = memtable_create();
+        meta->rt.memtable_limit = options->memtable_bytes;
+        if (meta->rt.memtable == NULL) {
+            bplus_close_file(pager->fd, (BPlusMeta*)meta);
+            return -1;
+        }
+    }
+
+    if (bplus_filter_open(meta, options ? options->bloom_bits_per_key : 0) != 0 ||
+        bplus_secondary_open(meta) != 0) {
+        bplus_close_file(pager->fd, (BPlusMeta*)meta);
         return -1;
     }
 
-    BF_UnpinBlock(b0);
-    BF_Block_Destroy(&b0);
+    *file_desc = pager->fd;
+    *metadata = (BPlusMeta*)meta;
     return 0;
 }
 
 int bplus_close_file(int file_desc, BPlusMeta* metadata) {
-    if (metadata) {
-        BF_Block *b0;
-        BF_Block_Init(&b0);
-        // save metadata back
-        if (BF_GetBlock(file_desc, 0, b0) != BF_OK) { BF_Block_Destroy(&b0); return -1; }
-        memcpy(BF_Block_GetData(b0), metadata, sizeof(BPlusMetaImpl));
-        BF_Block_SetDirty(b0);
-        BF_UnpinBlock(b0);
-        BF_Block_Destroy(&b0);
-        free(metadata);
-    }
-    CALL_BF(BF_CloseFile(file_desc));
+    if (metadata == NULL) {
+        // nothing to save, but the descriptor still goes. without the
+        // metadata there is no pager to close it through, so it is libbf's
+        BF_ErrorCode code = BF_CloseFile(file_desc);
+        if (code != BF_OK) {
+            BF_PrintError(code);
+            return -1;
+        }
+        return 0;
+    }
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    // buffered inserts go into the tree, with a log they are replayed
+    // by the next open if this fails
+    int ret = bplus_memtable_merge(meta);
+    if (ret == 0 && bplus_filter_save(meta) != 0) ret = -1;
+    if (bplus_secondary_close(meta) != 0) ret = -1;
+    // save metadata back
+    if (!meta->rt.pager->read_only && bplus_meta_store(meta) != 0) ret = -1;
+    if (meta->rt.wal) {
+        // the log goes only once the file holds all of it, otherwise
+        // it stays for the next open to replay
+        int checkpointed = bplus_checkpoint(meta) == 0;
+        if (!checkpointed) ret = -1;
+        meta->rt.pager->wal = NULL;
+        if (wal_close(meta->rt.wal, checkpointed) != 0) ret = -1;
+    }
+    index_cache_destroy(meta->rt.index_cache);
+    memtable_destroy(meta->rt.memtable);
+    bloom_destroy(meta->rt.bloom);
+    dictionary_destroy(meta->rt.dictionary);
+    tree_latches_destroy(meta->rt.latches);
+    if (pager_close(meta->rt.pager) != 0) ret = -1;
+    free(meta->rt.file_name);
+    free(metadata);
+    return ret;
+}
+
+int bplus_sync(int file_desc, BPlusMeta *metadata) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    return meta->rt.wal ? wal_sync(meta->rt.wal) : 0;
+}
+
+// descend to the leaf that can hold key, it is left pinned in leaf and
+// latched shared. leftmost picks the first leaf that can hold key, as a
+// range starting at key needs when keys repeat in the index
+static int find_leaf(const BPlusMetaImpl *meta, int key, int leftmost, Page *leaf) {
+    int height;
+    int curr = bplus_root_latch(meta, 0, &height);
+
+    // go thru index nodes
+    for (int h = 1; h < height; h++) {
+        Page page;
+        int pinned;
+        const IndexNode *idx = bplus_index_read(meta, curr, &page, &pinned);
+        if (idx == NULL) {
+            bplus_latch_release(meta, curr);
+            return -1;
+        }
+
+        // find child, latched before its parent is let go
+        int child = leftmost ? indexnode_children(idx)[indexnode_find_lower_child_index(idx, key)]
+                             : indexnode_get_child(idx, key);
+        bplus_latch_shared(meta, child);
+        if (pinned) pager_unpin(meta->rt.pager, &page);
+        bplus_latch_release(meta, curr);
+        curr = child;
+    }
+
+    if (pager_get(meta->rt.pager, curr, leaf) != 0) {
+        bplus_latch_release(meta, curr);
+        return -1;
+    }
     return 0;
 }
 
-int bplus_record_find(int file_desc, const BPlusMeta *metadata, int key, Record** out_record) {
+// unpin and unlatch a leaf from find_leaf
+static void release_leaf(const BPlusMetaImpl *meta, Page *leaf) {
+    int id = leaf->id;
+    pager_unpin(meta->rt.pager, leaf);
+    bplus_latch_release(meta, id);
+}
+
+// lookup without latches, BPLUS_CONFLICT if writers kept getting in the way
+static int find_optimistic(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    for (int attempt = 0; attempt < BPLUS_OPTIMISTIC_RETRIES; attempt++) {
+        int ret = bplus_optimistic_find(meta, key, out_record);
+        if (ret != BPLUS_CONFLICT) return ret;
+    }
+    return BPLUS_CONFLICT;
+}
+
+// lookup through find_leaf, the caller entered the tree
+static int find_latched(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    Page page;
+    if (find_leaf(meta, key, 0, &page) != 0) {
+        return -1;
+    }
+
+    // search in leaf
+    const DataNode *leaf = (const DataNode*)page.data;
+    int found_idx = datanode_find_key(leaf, key);
+    if (found_idx >= 0 && out_record) {
+        int length;
+        bplus_unpack(meta, datanode_packed_at(leaf, found_idx, &length), out_record);
+    }
+
+    release_leaf(meta, &page);
+    return found_idx >= 0 ? 0 : -1;
+}
+
+int bplus_tree_find(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    if (!bplus_filter_may_contain(meta, key)) {
+        return -1;
+    }
+    if (meta->rt.latches) {
+        int ret = find_optimistic(meta, key, out_record);
+        if (ret != BPLUS_CONFLICT) return ret;
+    }
+    return find_latched(meta, key, out_record);
+}
+
+static int find_into(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    if (!bplus_filter_may_contain(meta, key)) {
+        return -1;
+    }
+    // a buffered record is newer than anything in the tree
+    if (meta->rt.memtable && bplus_buffered_find(meta, key, out_record) == 0) {
+        return 0;
+    }
+    if (meta->rt.latches) {
+        // latch free first, latches only if writers keep getting in the way
+        int ret = find_optimistic(meta, key, out_record);
+        if (ret != BPLUS_CONFLICT) return ret;
+    }
+
+    bplus_tree_enter(meta, 0);
+    int ret = find_latched(meta, key, out_record);
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+int bplus_record_find_into(int file_desc, const BPlusMeta *metadata, int key, Record *out_record) {
+    (void)file_desc;
     const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    long start = stats_clock();
+    int ret = find_into(meta, key, out_record);
+    // the stats are runtime state, kept even by a tree that is only read
+    latency_record((LatencyHistogram*)&meta->rt.stats.find, start);
+    return ret;
+}
+
+int bplus_record_find(int file_desc, const BPlusMeta *metadata, int key, Record** out_record) {
     // init to null just in case
-    if (out_record) {
-        *out_record = NULL;
+    if (out_record == NULL) {
+        return bplus_record_find_into(file_desc, metadata, key, NULL);
     }
+    *out_record = NULL;
 
-    int curr = meta->root_block_id;
-    int height = meta->height;
+    Record *rec = malloc(sizeof(Record));
+    if (rec == NULL) {
+        return -1;
+    }
+    if (bplus_record_find_into(file_desc, metadata, key, rec) != 0) {
+        free(rec);
+        return -1;
+    }
+    // found it, the caller frees it
+    *out_record = rec;
+    return 0;
+}
 
-    // go thru index nodes
-    for (int h = 1; h < height; h++) {
-        BF_Block *b;
-        BF_Block_Init(&b);
-        if (BF_GetBlock(file_desc, curr, b) != BF_OK) { BF_Block_Destroy(&b); return -1; }
-        IndexNode *idx = (IndexNode*)BF_Block_GetData(b);
+static int find_view(const BPlusMetaImpl *meta, int key, BPlusRecordView *view) {
+    view->packed = NULL;
+    view->length = 0;
+    view->schema = &meta->schema;
+    view->meta = (const BPlusMeta*)meta;
+    view->page.frame = NULL;
+    if (!bplus_filter_may_contain(meta, key)) {
+        return -1;
+    }
 
-        // find child
-        curr = indexnode_get_child(idx, key);
-        BF_UnpinBlock(b);
-        BF_Block_Destroy(&b);
+    Page page;
+    bplus_tree_enter(meta, 0);
+    if (meta->rt.memtable) {
+        // the view keeps the tree entered, which holds off merges
+        view->packed = bplus_buffered_packed(meta, key, &view->length);
+        if (view->packed) return 0;
+    }
+    if (find_leaf(meta, key, 0, &page) != 0) {
+        bplus_tree_leave(meta);
+        return -1;
     }
 
-    // search in leaf
-    BF_Block *bl;
-    BF_Block_Init(&bl);
-    if (BF_GetBlock(file_desc, curr, bl) != BF_OK) { BF_Block_Destroy(&bl); return -1; }
-    DataNode *leaf = (DataNode*)BF_Block_GetData(bl);
-
-    int found_idx = datanode_find_key(leaf, &meta->schema, key);
-    if (found_idx >= 0) {
-        // found it, copy it out
-        if (out_record) {
-            *out_record = malloc(sizeof(Record));
-            if (*out_record) {
-                **out_record = leaf->records[found_idx];
+    const DataNode *leaf = (const DataNode*)page.data;
+    int found_idx = datanode_find_key(leaf, key);
+    if (found_idx < 0) {
+        release_leaf(meta, &page);
+        bplus_tree_leave(meta);
+        return -1;
+    }
+
+    // leaf stays pinned and latched until the view is released
+    view->packed = datanode_packed_at(leaf, found_idx, &view->length);
+    view->page = page;
+    return 0;
+}
+
+int bplus_record_find_view(int file_desc, const BPlusMeta *metadata, int key, BPlusRecordView *view) {
+    (void)file_desc;
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    long start = stats_clock();
+    int ret = find_view(meta, key, view);
+    latency_record((LatencyHistogram*)&meta->rt.stats.find, start);
+    return ret;
+}
+
+void bplus_record_unpack(const BPlusMeta *metadata, const char *packed, Record *record) {
+    bplus_unpack((const BPlusMetaImpl*)metadata, packed, record);
+}
+
+void bplus_record_view_release(BPlusRecordView *view) {
+    if (view == NULL || view->packed == NULL) {
+        return;
+    }
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)view->meta;
+    // a buffered record has no leaf behind it
+    if (view->page.frame) release_leaf(meta, &view->page);
+    view->page.frame = NULL;
+    bplus_tree_leave(meta);
+    view->packed = NULL;
+    view->length = 0;
+}
+
+// key of a batch lookup and where its result goes
+typedef struct {
+  int key;
+  int slot;
+} BatchKey;
+
+// equal keys stay in input order
+static int batch_key_cmp(const void *a, const void *b) {
+    const BatchKey *ka = a;
+    const BatchKey *kb = b;
+    if (ka->key != kb->key) return (ka->key > kb->key) - (ka->key < kb->key);
+    return (ka->slot > kb->slot) - (ka->slot < kb->slot);
+}
+
+// keys are sorted, so the ones for each child are a contiguous run
+// curr_block comes latched shared and is released here
+static int find_batch_recursive(const BPlusMetaImpl *meta, int curr_block, int height,
+                                const BatchKey *keys, int n, Record *out, int *found) {
+    Pager *pager = meta->rt.pager;
+    Page page;
+
+    int hits = 0;
+    if (height == 1) { // leaf node
+        if (pager_get(pager, curr_block, &page) != 0) {
+            bplus_latch_release(meta, curr_block);
+            return -1;
+        }
+        const DataNode *leaf = (const DataNode*)page.data;
+        for (int i = 0; i < n; i++) {
+            int pos = datanode_find_key(leaf, keys[i].key);
+            if (pos >= 0) {
+                int length;
+                bplus_unpack(meta, datanode_packed_at(leaf, pos, &length), &out[keys[i].slot]);
+                if (found) found[keys[i].slot] = 1;
+                hits++;
             }
         }
-        BF_UnpinBlock(bl);
-        BF_Block_Destroy(&bl);
+        pager_unpin(pager, &page);
+    } else { // index node
+        int pinned;
+        const IndexNode *idx = bplus_index_read(meta, curr_block, &page, &pinned);
+        if (idx == NULL) {
+            bplus_latch_release(meta, curr_block);
+            return -1;
+        }
+        const int *children = indexnode_children(idx);
+        int i = 0;
+        while (i < n && hits >= 0) {
+            int pos = indexnode_find_child_index(idx, keys[i].key);
+            int j = i + 1;
+            while (j < n && (pos == idx->count || keys[j].key < idx->keys[pos])) {
+                j++;
+            }
+            bplus_latch_shared(meta, children[pos]);
+            int child_hits = find_batch_recursive(meta, children[pos], height - 1,
+                                                  keys + i, j - i, out, found);
+            hits = child_hits < 0 ? -1 : hits + child_hits;
+            i = j;
+        }
+        if (pinned) pager_unpin(pager, &page);
+    }
+
+    bplus_latch_release(meta, curr_block);
+    return hits;
+}
+
+int bplus_record_find_batch(int file_desc, const BPlusMeta *metadata, const int *keys, int n,
+                            Record *out, int *found) {
+    (void)file_desc;
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    if (found) {
+        memset(found, 0, n * sizeof(int));
+    }
+    if (n <= 0) {
         return 0;
     }
 
-    BF_UnpinBlock(bl);
-    BF_Block_Destroy(&bl);
-    return -1;
+    // one allocation per batch for the sorted routing order
+    BatchKey *sorted = malloc(n * sizeof(BatchKey));
+    if (sorted == NULL) {
+        return -1;
+    }
+    // buffered records are answered first, the rest go down the tree
+    int buffered = 0;
+    int count = 0;
+    for (int i = 0; i < n; i++) {
+        if (!bplus_filter_may_contain(meta, keys[i])) {
+            continue;
+        }
+        if (meta->rt.memtable && bplus_buffered_find(meta, keys[i], &out[i]) == 0) {
+            if (found) found[i] = 1;
+            buffered++;
+            continue;
+        }
+        sorted[count].key = keys[i];
+        sorted[count].slot = i;
+        count++;
+    }
+    if (count == 0) {
+        free(sorted);
+        return buffered;
+    }
+    qsort(sorted, count, sizeof(BatchKey), batch_key_cmp);
+
+    bplus_tree_enter(meta, 0);
+    int height;
+    int root = bplus_root_latch(meta, 0, &height);
+    int hits = find_batch_recursive(meta, root, height, sorted, count, out, found);
+    bplus_tree_leave(meta);
+    free(sorted);
+    return hits < 0 ? -1 : hits + buffered;
 }
 
-static int insert_recursive(int file_desc, BPlusMetaImpl *metadata, int curr_block, const Record *record, int *up_key, int *up_right, int height) {
-    BF_Block *b;
-    BF_Block_Init(&b);
-    if (BF_GetBlock(file_desc, curr_block, b) != BF_OK) { BF_Block_Destroy(&b); return -1; }
+// new leaves one split may make for a sorted run
+#define BPLUS_RUN_MAX_LEAVES 8
+
+// exclusive latches of an insert, indexed by depth from the root.
+// only a split changes the parent, so once a node is known not to split
+// every latch above it is let go. in a counted tree every insert changes
+// the counts above it, so they are all kept
+typedef struct {
+  int ids[BPLUS_MAX_HEIGHT];
+  int top;        // ids[top] down to the current depth are still held
+  int root;       // root pointer still held
+  int writing;    // ids[writing] and below are marked written until let go
+  // pages of a split, logged before the topmost latch is let go so
+  // no other change to them can get into the log ahead of this one
+  BPlusChange change;
+  long lsn;       // log position the insert has to commit
+  // rest of a sorted run, put into the leaf the insert reaches for as
+  // long as its keys belong there and the leaf has room
+  const Record *run;
+  int run_count;
+  int run_taken;  // records of run used up, put in or duplicates
+  int run_added;  // of those, the ones put in
+  int hi;         // keys below hi belong to the current subtree
+  int bounded;    // 0 while the subtree is the rightmost one
+  int lo;         // lowest key of the current subtree, INT_MIN at first
+  // new rightmost leaf of a split and its lowest key, noted only once the
+  // split is logged and let go, -1 if there is none
+  int rightmost;
+  int rightmost_lo;
+  int max_up;     // most separators a split below can send to its parent
+  // separators after the first one of a leaf split with a run
+  int more_keys[BPLUS_RUN_MAX_LEAVES];
+  int more_rights[BPLUS_RUN_MAX_LEAVES];
+  int more_count;
+  // records in the node that split and in each new one, for the counts
+  // of a counted tree
+  int up_counts[BPLUS_RUN_MAX_LEAVES + 1];
+} InsertLatches;
+
+// the node at depth will not split, nothing above it changes
+static void release_ancestors(BPlusMetaImpl *meta, InsertLatches *held, int depth) {
+    for (; held->top < depth; held->top++) {
+        bplus_latch_release(meta, held->ids[held->top]);
+    }
+    if (held->root) {
+        bplus_root_unlatch(meta);
+        held->root = 0;
+    }
+}
+
+// ids[from..depth] are about to change. a split reaches every node still
+// held, they all go into the write together so an optimistic reader cannot
+// see the child split before the parent is marked. the same goes for the
+// root pointer while it is held
+static void begin_writes(BPlusMetaImpl *meta, InsertLatches *held, int from, int depth) {
+    if (held->root && meta->rt.latches) {
+        version_write_begin(&meta->rt.latches->root_version);
+    }
+    for (int i = from; i <= depth; i++) {
+        bplus_write_begin(meta, held->ids[i]);
+    }
+    held->writing = from;
+}
+
+static int insert_node(BPlusMetaImpl *metadata, int curr_block, const Record *record, int *up_key, int *up_right,
+                       int height, InsertLatches *held, int depth);
+
+// an insert got to the rightmost leaf, keep it for the appends after it
+static void note_rightmost(BPlusMetaImpl *meta, int leaf, int lo) {
+    long word = ((long)leaf << 32) | (unsigned int)lo;
+    // usually unchanged, then the line is not written at all
+    if (__atomic_load_n(&meta->rt.rightmost, __ATOMIC_RELAXED) != word) {
+        __atomic_store_n(&meta->rt.rightmost, word, __ATOMIC_RELAXED);
+    }
+}
+
+// put record straight into the rightmost leaf if it belongs there and
+// fits, ascending keys then skip the descent from the root. the leaf is
+// still the rightmost one if it has no next leaf: splits only move keys
+// to the right, and deletes and bplus_reorganize forget it whenever they
+// move a separator or free a block
+// returns the block id, -1 on a duplicate or failure, BPLUS_CONFLICT if
+// the insert has to descend
+static int insert_rightmost(BPlusMetaImpl *meta, const Record *record, long *lsn) {
+    if (meta->counted) {
+        // the nodes above the leaf count it too
+        return BPLUS_CONFLICT;
+    }
+    long word = __atomic_load_n(&meta->rt.rightmost, __ATOMIC_RELAXED);
+    int leaf_id = (int)(word >> 32);
+    int key = bplus_record_key(meta, record);
+    if (leaf_id < 0 || key < (int)(unsigned int)word) {
+        return BPLUS_CONFLICT;
+    }
+    char packed[MAX_PACKED_RECORD_SIZE];
+    int length = bplus_pack(meta, record, packed);
+    Pager *pager = meta->rt.pager;
+    Page page;
+    bplus_latch_exclusive(meta, leaf_id);
+    if (pager_get(pager, leaf_id, &page) != 0) {
+        bplus_latch_release(meta, leaf_id);
+        return -1;
+    }
+    DataNode *leaf = (DataNode*)page.data;
+    int ret = BPLUS_CONFLICT;
+    int pos = datanode_find_insert_pos(leaf, key);
+    if (leaf->next_block_id != -1) {
+        // split since, the descent finds the new one
+    } else if (pos < leaf->count && datanode_key_at(leaf, pos) == key) {
+        ret = -1;
+    } else if (datanode_fits(leaf, length)) {
+        bplus_write_begin(meta, leaf_id);
+        datanode_insert_packed(leaf, pos, key, packed, length);
+        pager_set_dirty(pager, &page);
+        *lsn = bplus_log_leaf_insert(meta, &page, pos);
+        bplus_write_end(meta, leaf_id);
+        ret = *lsn < 0 ? -1 : leaf_id;
+    }
+    pager_unpin(pager, &page);
+    bplus_latch_release(meta, leaf_id);
+    return ret;
+}
+
+// the leaf just took a record of a sorted run, put in the records after
+// it that belong to the same leaf while they fit. the leaf is latched and
+// marked written, which covers these too
+static void insert_run(BPlusMetaImpl *meta, InsertLatches *held, Page *page) {
+    DataNode *leaf = (DataNode*)page->data;
+    while (held->run_taken < held->run_count) {
+        const Record *record = &held->run[held->run_taken];
+        int key = bplus_record_key(meta, record);
+        if (held->bounded && key >= held->hi) {
+            break;
+        }
+        int pos = datanode_find_insert_pos(leaf, key);
+        if (pos < leaf->count && datanode_key_at(leaf, pos) == key) {
+            held->run_taken++;
+            continue;
+        }
+        char packed[MAX_PACKED_RECORD_SIZE];
+        int length = bplus_pack(meta, record, packed);
+        if (!datanode_fits(leaf, length)) {
+            // the next descent splits the leaf
+            break;
+        }
+        datanode_insert_packed(leaf, pos, key, packed, length);
+        held->lsn = bplus_log_leaf_insert(meta, page, pos);
+        if (held->lsn < 0) {
+            return;
+        }
+        held->run_taken++;
+        held->run_added++;
+    }
+}
+
+// the leaf in page has no room for record. record, the records of the run
+// that belong to the leaf and the leaf's own are spread evenly over the
+// leaf and as many new ones as they need, so a dense run splits the leaf
+// once instead of once per leaf's worth of records. the run is cut where
+// the records would need more than BPLUS_RUN_MAX_LEAVES new leaves
+static int split_run(BPlusMetaImpl *meta, int curr_block, Page *page, const Record *record,
+                     int *up_key, int *up_right, InsertLatches *held, int depth) {
+    Pager *pager = meta->rt.pager;
+    DataNode *leaf = (DataNode*)page->data;
+    int limit = datanode_spread_limit(leaf, BPLUS_RUN_MAX_LEAVES + 1) - datanode_used_bytes(leaf);
+    int max_records = limit / DATANODE_SLOT_SIZE + 1;
+    char *buf = malloc(limit + MAX_PACKED_RECORD_SIZE);
+    PackedRecord *records = malloc(max_records * sizeof(PackedRecord));
+    if (buf == NULL || records == NULL) {
+        free(buf);
+        free(records);
+        return -1;
+    }
+
+    // a run past the end of the rightmost leaf fills the leaves in order
+    int first = bplus_record_key(meta, record);
+    int fill = !held->bounded && (leaf->count == 0 || first > datanode_key_at(leaf, leaf->count - 1));
+    records[0].key = first;
+    records[0].packed = buf;
+    records[0].length = bplus_pack(meta, record, buf);
+    int bytes = records[0].length + DATANODE_SLOT_SIZE;
+    int count = 1;
+    int taken = held->run_taken;
+    while (taken < held->run_count && count < max_records) {
+        const Record *next = &held->run[taken];
+        int key = bplus_record_key(meta, next);
+        if (held->bounded && key >= held->hi) {
+            break;
+        }
+        if (key == records[count - 1].key || datanode_find_key(leaf, key) >= 0) {
+            taken++;
+            continue;
+        }
+        // buf has room for one record past limit
+        int length = bplus_pack(meta, next, buf + bytes);
+        if (bytes + length + DATANODE_SLOT_SIZE > limit) {
+            break;
+        }
+        records[count].key = key;
+        records[count].packed = buf + bytes;
+        records[count].length = length;
+        bytes += length + DATANODE_SLOT_SIZE;
+        count++;
+        taken++;
+    }
+
+    int new_count = datanode_spread_count(leaf, records, count, fill) - 1;
+    Page new_pages[BPLUS_RUN_MAX_LEAVES];
+    DataNode *new_leaves[BPLUS_RUN_MAX_LEAVES];
+    int new_ids[BPLUS_RUN_MAX_LEAVES];
+    for (int i = 0; i < new_count; i++) {
+        if (bplus_allocate_block(meta, &new_pages[i]) != 0) {
+            while (i-- > 0) pager_unpin(pager, &new_pages[i]);
+            free(buf);
+            free(records);
+            return -1;
+        }
+        new_ids[i] = new_pages[i].id;
+        new_leaves[i] = (DataNode*)new_pages[i].data;
+    }
+
+    begin_writes(meta, held, held->top, depth);
+    for (int i = 0; i < new_count; i++) bplus_write_begin(meta, new_ids[i]);
+    datanode_spread(leaf, new_leaves, new_ids, new_count, records, count, fill);
+    STATS_ADD(meta->rt.stats.splits[0], new_count);
+    for (int i = 0; i < new_count; i++) bplus_write_end(meta, new_ids[i]);
+
+    int ret = curr_block;
+    held->up_counts[0] = leaf->count;
+    for (int i = 0; i < new_count; i++) {
+        int sep = datanode_key_at(new_leaves[i], 0);
+        held->up_counts[1 + i] = new_leaves[i]->count;
+        if (records[0].key >= sep) ret = new_ids[i];
+        if (i == 0) {
+            *up_key = sep;
+            *up_right = new_ids[0];
+        } else {
+            held->more_keys[i - 1] = sep;
+            held->more_rights[i - 1] = new_ids[i];
+        }
+        pager_set_dirty(pager, &new_pages[i]);
+        bplus_change_keep(meta, &held->change, &new_pages[i]);
+    }
+    held->more_count = new_count - 1;
+    if (!held->bounded) {
+        int last = new_count - 1;
+        held->rightmost = new_ids[last];
+        held->rightmost_lo = last == 0 ? *up_key : held->more_keys[last - 1];
+    }
+    pager_set_dirty(pager, page);
+    bplus_change_keep(meta, &held->change, page);
+
+    held->run_added += count - 1;
+    held->run_taken = taken;
+    free(buf);
+    free(records);
+    return ret;
+}
+
+// curr_block comes latched exclusive, its latch is let go on return
+static int insert_recursive(BPlusMetaImpl *metadata, int curr_block, const Record *record, int *up_key, int *up_right,
+                            int height, InsertLatches *held, int depth) {
+    held->ids[depth] = curr_block;
+    int ret = insert_node(metadata, curr_block, record, up_key, up_right, height, held, depth);
+    if (held->top == depth && !held->root && held->change.count > 0) {
+        long lsn = bplus_change_log(metadata, &held->change);
+        if (lsn < 0) ret = -1;
+        else held->lsn = lsn;
+    }
+    if (held->top <= depth) {
+        if (depth >= held->writing) bplus_write_end(metadata, curr_block);
+        bplus_latch_release(metadata, curr_block);
+    }
+    return ret;
+}
+
+static int insert_node(BPlusMetaImpl *metadata, int curr_block, const Record *record, int *up_key, int *up_right,
+                       int height, InsertLatches *held, int depth) {
+    *up_right = -1;
+    Pager *pager = metadata->rt.pager;
+    Page page;
 
     int ret_val = -1;
+    int key = bplus_record_key(metadata, record);
 
     if (height == 1) { // leaf node
-        DataNode *leaf = (DataNode*)BF_Block_GetData(b);
-        int key = record_get_key(&metadata->schema, record);
+        CALL_PM(pager_get(pager, curr_block, &page));
+        DataNode *leaf = (DataNode*)page.data;
         
-        int pos = datanode_find_insert_pos(leaf, &metadata->schema, key);
+        int pos = datanode_find_insert_pos(leaf, key);
+        int duplicate = pos < leaf->count && datanode_key_at(leaf, pos) == key;
+        char packed[MAX_PACKED_RECORD_SIZE];
+        int length = bplus_pack(metadata, record, packed);
+        int fits = datanode_fits(leaf, length);
+        if (duplicate || (fits && !metadata->counted)) {
+            release_ancestors(metadata, held, depth);
+        }
 
-        if (!datanode_is_full(leaf)) {
+        if (duplicate) {
+            // key is the primary key, keep it unique
+            ret_val = -1;
+        } else if (fits) {
             // just insert, no split
-            datanode_insert_at(leaf, pos, record);
-            BF_Block_SetDirty(b);
+            begin_writes(metadata, held, depth, depth);
+            datanode_insert_packed(leaf, pos, key, packed, length);
+            pager_set_dirty(pager, &page);
             *up_right = -1; 
-            ret_val = curr_block;
+            held->lsn = bplus_log_leaf_insert(metadata, &page, pos);
+            if (held->run && held->lsn >= 0) insert_run(metadata, held, &page);
+            if (!held->bounded) note_rightmost(metadata, curr_block, held->lo);
+            ret_val = held->lsn < 0 ? -1 : curr_block;
+        } else if (held->run) {
+            ret_val = split_run(metadata, curr_block, &page, record, up_key, up_right, held, depth);
         } else {
             // split leaf
-            BF_Block *new_b;
-            BF_Block_Init(&new_b);
-            if (BF_AllocateBlock(file_desc, new_b) != BF_OK) {
-                BF_UnpinBlock(b); BF_Block_Destroy(&b); BF_Block_Destroy(&new_b); return -1;
+            Page new_page;
+            if (bplus_allocate_block(metadata, &new_page) != 0) {
+                pager_unpin(pager, &page); return -1;
             }
-            int new_id;
-            BF_GetBlockCounter(file_desc, &new_id); new_id--;
-            metadata->total_blocks = new_id + 1;
+            int new_id = new_page.id;
+            begin_writes(metadata, held, held->top, depth);
+            bplus_write_begin(metadata, new_id);
             
-            DataNode *new_leaf = (DataNode*)BF_Block_GetData(new_b);
-            datanode_init(new_leaf);
+            DataNode *new_leaf = (DataNode*)new_page.data;
+            datanode_init(new_leaf, metadata->page_size);
 
-            int split = (MAX_RECORDS_LEAF + 1) / 2;
-            *up_key = datanode_split(leaf, new_leaf, record, &metadata->schema, pos, new_id);
+            int append = !held->bounded && pos == leaf->count;
+            *up_key = datanode_split(leaf, new_leaf, key, packed, length, pos, new_id, append);
+            STATS_ADD(metadata->rt.stats.splits[0], 1);
             *up_right = new_id;
+            held->up_counts[0] = leaf->count;
+            held->up_counts[1] = new_leaf->count;
+            if (!held->bounded) {
+                held->rightmost = new_id;
+                held->rightmost_lo = *up_key;
+            }
+            bplus_write_end(metadata, new_id);
 
-            if (pos < split) ret_val = curr_block;
+            if (key < *up_key) ret_val = curr_block;
             else ret_val = new_id;
 
-            BF_Block_SetDirty(b);
-            BF_Block_SetDirty(new_b);
-            BF_UnpinBlock(new_b); BF_Block_Destroy(&new_b);
+            pager_set_dirty(pager, &page);
+            pager_set_dirty(pager, &new_page);
+            bplus_change_keep(metadata, &held->change, &new_page);
+            bplus_change_keep(metadata, &held->change, &page);
         }
+        if (page.frame) pager_unpin(pager, &page);
     } else { // index node
-        IndexNode *idx = (IndexNode*)BF_Block_GetData(b);
-        int key = record_get_key(&metadata->schema, record);
+        // route through the cached copy if there is one, the block
+        // itself is only needed when the child split
+        int pinned;
+        const IndexNode *route = bplus_index_read(metadata, curr_block, &page, &pinned);
+        if (route == NULL) return -1;
         
-        int pos = indexnode_find_child_index(idx, key);
-        int child = idx->children[pos];
+        int pos = indexnode_find_child_index(route, key);
+        int child = indexnode_children(route)[pos];
+        if (pos < route->count) {
+            held->hi = route->keys[pos];
+            held->bounded = 1;
+        }
+        if (pos > 0) {
+            held->lo = route->keys[pos - 1];
+        }
+        if (!metadata->counted && route->count + held->max_up <= route->max_keys) {
+            release_ancestors(metadata, held, depth);
+        }
+        if (depth + 1 == BPLUS_MAX_HEIGHT) {
+            if (pinned) pager_unpin(pager, &page);
+            return -1;
+        }
 
         int child_up_key, child_up_right;
-        ret_val = insert_recursive(file_desc, metadata, child, record, &child_up_key, &child_up_right, height - 1);
+        bplus_latch_exclusive(metadata, child);
+        ret_val = insert_recursive(metadata, child, record, &child_up_key, &child_up_right, height - 1, held, depth + 1);
+
+        // a counted node changes with every record put in below it
+        int counts_changed = metadata->counted && ret_val >= 0;
+        if ((child_up_right != -1 || counts_changed) && !pinned) {
+            CALL_PM(pager_get(pager, curr_block, &page));
+            pinned = 1;
+        }
 
         if (child_up_right != -1) {
-            // child split, insert here
-            if (!indexnode_is_full(idx)) {
-                indexnode_insert_at(idx, pos, child_up_key, child_up_right);
-                BF_Block_SetDirty(b);
+            IndexNode *idx = (IndexNode*)page.data;
+            // child split, insert here, a leaf split with a run may have
+            // sent up several separators
+            int up_keys[BPLUS_RUN_MAX_LEAVES];
+            int up_rights[BPLUS_RUN_MAX_LEAVES];
+            int up_counts[BPLUS_RUN_MAX_LEAVES];
+            int up_count = 1 + held->more_count;
+            up_keys[0] = child_up_key;
+            up_rights[0] = child_up_right;
+            memcpy(up_keys + 1, held->more_keys, held->more_count * sizeof(int));
+            memcpy(up_rights + 1, held->more_rights, held->more_count * sizeof(int));
+            memcpy(up_counts, held->up_counts + 1, up_count * sizeof(int));
+            if (metadata->counted) indexnode_counts(idx)[pos] = held->up_counts[0];
+            held->more_count = 0;
+            if (idx->count + up_count <= idx->max_keys) {
+                indexnode_insert_many(idx, pos, up_keys, up_rights, up_counts, up_count);
+                pager_set_dirty(pager, &page);
                 *up_right = -1;
+                bplus_index_cache_sync(metadata, curr_block, height, idx);
             } else {
                 // split index node
-                BF_Block *new_b;
-                BF_Block_Init(&new_b);
-                if (BF_AllocateBlock(file_desc, new_b) != BF_OK) {
-                    BF_UnpinBlock(b); BF_Block_Destroy(&b); BF_Block_Destroy(&new_b); return -1;
+                Page new_page;
+                if (bplus_allocate_block(metadata, &new_page) != 0) {
+                    pager_unpin(pager, &page); return -1;
                 }
-                int new_id;
-                BF_GetBlockCounter(file_desc, &new_id); new_id--;
-                metadata->total_blocks = new_id + 1;
+                int new_id = new_page.id;
+                bplus_write_begin(metadata, new_id);
                 
-                IndexNode *new_idx = (IndexNode*)BF_Block_GetData(new_b);
-                indexnode_init(new_idx);
+                IndexNode *new_idx = (IndexNode*)new_page.data;
+                indexnode_init(new_idx, metadata->page_size, metadata->counted);
 
-                indexnode_split(idx, new_idx, child_up_key, child_up_right, pos, up_key);
+                indexnode_split_many(idx, new_idx, up_keys, up_rights, up_counts, up_count, pos, !held->bounded,
+                                     up_key);
+                STATS_ADD(metadata->rt.stats.splits[height - 1], 1);
                 *up_right = new_id;
+                if (metadata->counted) {
+                    held->up_counts[0] = (int)indexnode_total(idx);
+                    held->up_counts[1] = (int)indexnode_total(new_idx);
+                }
+                bplus_write_end(metadata, new_id);
 
-                BF_Block_SetDirty(b);
-                BF_Block_SetDirty(new_b);
-                BF_UnpinBlock(new_b); BF_Block_Destroy(&new_b);
+                pager_set_dirty(pager, &page);
+                pager_set_dirty(pager, &new_page);
+                bplus_index_cache_sync(metadata, new_id, height, new_idx);
+                bplus_index_cache_sync(metadata, curr_block, height, idx);
+                bplus_change_keep(metadata, &held->change, &new_page);
             }
+            bplus_change_keep(metadata, &held->change, &page);
+        } else if (counts_changed) {
+            IndexNode *idx = (IndexNode*)page.data;
+            indexnode_counts(idx)[pos] += 1 + held->run_added;
+            pager_set_dirty(pager, &page);
+            bplus_index_cache_sync(metadata, curr_block, height, idx);
+            if (bplus_log_counts(metadata, &page) < 0) ret_val = -1;
+            pager_unpin(pager, &page);
         } else {
              *up_right = -1;
+             if (pinned) pager_unpin(pager, &page);
         }
     }
 
-    BF_UnpinBlock(b);
-    BF_Block_Destroy(&b);
     return ret_val;
 }
 
+// the root split into it and right, put a new root above both, or above
+// all of them when a root leaf split with a run
+// the root pointer is still latched by the insert and marked written.
+// store_meta writes block 0 now, sorted inserts write it once at the end
+static int insert_new_root(BPlusMetaImpl *meta, int up_key, int up_right, InsertLatches *held,
+                           int store_meta) {
+    BPlusChange *change = &held->change;
+    Page root_page;
+    CALL_PM(bplus_allocate_block(meta, &root_page));
+
+    IndexNode *root = (IndexNode*)root_page.data;
+    indexnode_init(root, meta->page_size, meta->counted);
+    root->count = 1;
+    root->keys[0] = up_key;
+    indexnode_children(root)[0] = meta->root_block_id;
+    indexnode_children(root)[1] = up_right;
+    if (meta->counted) {
+        indexnode_counts(root)[0] = held->up_counts[0];
+        indexnode_counts(root)[1] = held->up_counts[1];
+    }
+    indexnode_insert_many(root, 1, held->more_keys, held->more_rights, held->up_counts + 2, held->more_count);
+    held->more_count = 0;
+
+    pager_set_dirty(meta->rt.pager, &root_page);
+    bplus_change_keep(meta, change, &root_page);
+
+    meta->root_block_id = root_page.id;
+    meta->height++;
+    STATS_ADD(meta->rt.stats.height_changes, 1);
+    change->root_changed = 1;
+
+    // update metadata, with a log the record carries it until a checkpoint
+    if (meta->rt.wal == NULL && store_meta && bplus_meta_store(meta) != 0) return -1;
+    if (bplus_index_cache_reload(meta) != 0) return -1;
+    return 0;
+}
+
+// insert record and as much of run after it as goes into the same leaf,
+// *taken gets how many records of run were used up, *added how many went in.
+// with a run (even an empty one) block 0 is left to the caller, *new_root
+// tells if the root split
+static int insert_with_run(BPlusMetaImpl *meta, const Record *record, const Record *run, int run_count,
+                           int *taken, int *added, long *lsn, int *new_root) {
+    InsertLatches held;
+    held.top = 0;
+    held.root = 1;
+    held.writing = BPLUS_MAX_HEIGHT;
+    bplus_change_init(&held.change);
+    held.lsn = 0;
+    held.run = run;
+    held.run_count = run_count;
+    held.run_taken = 0;
+    held.run_added = 0;
+    held.bounded = 0;
+    held.lo = INT_MIN;
+    held.rightmost = -1;
+    held.max_up = run ? BPLUS_RUN_MAX_LEAVES : 1;
+    held.more_count = 0;
+    int height;
+    int root = bplus_root_latch(meta, 1, &height);
+    int up_key, up_right;
+    int ret = insert_recursive(meta, root, record, &up_key, &up_right, height, &held, 0);
+    *new_root = up_right != -1;
+    if (up_right != -1 && insert_new_root(meta, up_key, up_right, &held, run == NULL) != 0) {
+        ret = -1;
+    }
+    if (held.change.count > 0) {
+        // the root split, its change is logged under the root pointer
+        long lsn = bplus_change_log(meta, &held.change);
+        if (lsn < 0) ret = -1;
+        else held.lsn = lsn;
+    }
+    if (held.root) {
+        if (held.writing != BPLUS_MAX_HEIGHT && meta->rt.latches) {
+            version_write_end(&meta->rt.latches->root_version);
+        }
+        bplus_root_unlatch(meta);
+    }
+    // a split leaf may only be appended to directly once its change is
+    // in the log ahead of the append and nothing is latched any more
+    if (held.rightmost != -1) {
+        note_rightmost(meta, held.rightmost, held.rightmost_lo);
+    }
+    *taken = held.run_taken;
+    *added = held.run_added;
+    *lsn = held.lsn;
+    return ret;
+}
+
+int bplus_tree_insert(BPlusMetaImpl *meta, const Record *record, long *lsn) {
+    int ret = insert_rightmost(meta, record, lsn);
+    if (ret != BPLUS_CONFLICT) {
+        return ret;
+    }
+    int taken, added, new_root;
+    return insert_with_run(meta, record, NULL, 0, &taken, &added, lsn, &new_root);
+}
+
+int bplus_tree_insert_sorted(BPlusMetaImpl *meta, const Record *records, int count, long *lsn) {
+    *lsn = 0;
+    int inserted = 0;
+    int root_split = 0;
+    int i = 0;
+    while (i < count) {
+        int taken, added, new_root;
+        long record_lsn;
+        int ret = insert_with_run(meta, &records[i], records + i + 1, count - i - 1, &taken, &added,
+                                  &record_lsn, &new_root);
+        root_split |= new_root;
+        if (ret == -1) {
+            // tell a duplicate from a failure
+            if (bplus_tree_find(meta, bplus_record_key(meta, &records[i]), NULL) != 0) return -1;
+        } else {
+            inserted += 1 + added;
+        }
+        if (record_lsn > 0) *lsn = record_lsn;
+        i += 1 + taken;
+    }
+    // one metadata write for all the root splits, a log carries it instead
+    if (root_split && meta->rt.wal == NULL && bplus_meta_store(meta) != 0) {
+        return -1;
+    }
+    return inserted;
+}
+
+static int record_insert(BPlusMetaImpl *meta, const Record *record) {
+    if (meta->rt.memtable) {
+        int ret = bplus_buffered_insert(meta, record);
+        if (ret != -1 && bplus_filter_grow(meta) != 0) ret = -1;
+        if (ret != -1 && bplus_secondary_insert(meta, record) != 0) ret = -1;
+        return ret;
+    }
+    bplus_tree_enter(meta, 0);
+    long lsn = 0;
+    int ret = bplus_dictionary_learn(meta, record);
+    if (ret == 0) {
+        bplus_filter_add(meta, bplus_record_key(meta, record));
+        ret = bplus_tree_insert(meta, record, &lsn);
+    }
+    bplus_tree_leave(meta);
+    if (ret != -1 && bplus_log_commit(meta, lsn) != 0) {
+        ret = -1;
+    }
+    if (ret != -1 && bplus_filter_grow(meta) != 0) {
+        ret = -1;
+    }
+    if (ret != -1 && bplus_secondary_insert(meta, record) != 0) {
+        ret = -1;
+    }
+    return ret;
+}
+
 int bplus_record_insert(int file_desc, BPlusMeta* metadata, const Record *record) {
+    (void)file_desc;
     BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
-    int up_key, up_right;
-    int ret = insert_recursive(file_desc, meta, meta->root_block_id, record, &up_key, &up_right, meta->height);
+    if (meta->rt.pager->read_only) {
+        fprintf(stderr, "Error: file is open read-only\n");
+        return -1;
+    }
+    long start = stats_clock();
+    int ret = record_insert(meta, record);
+    latency_record(&meta->rt.stats.insert, start);
+    return ret;
+}
 
-    if (up_right != -1) {
-        // root split, make new root
-        BF_Block *new_root_b;
-        BF_Block_Init(&new_root_b);
-        
-        if (BF_AllocateBlock(file_desc, new_root_b) != BF_OK) { 
-            BF_Block_Destroy(&new_root_b); 
-            return -1; 
+int bplus_record_insert_batch(int file_desc, BPlusMeta *metadata, const Record *records, int n) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (meta->rt.pager->read_only) {
+        fprintf(stderr, "Error: file is open read-only\n");
+        return -1;
+    }
+    if (n <= 0) {
+        return 0;
+    }
+
+    // sort once, of equal keys the first one goes in as with single inserts
+    BatchKey *order = malloc(n * sizeof(BatchKey));
+    Record *sorted = malloc(n * sizeof(Record));
+    if (order == NULL || sorted == NULL) {
+        free(order);
+        free(sorted);
+        return -1;
+    }
+    for (int i = 0; i < n; i++) {
+        order[i].key = bplus_record_key(meta, &records[i]);
+        order[i].slot = i;
+    }
+    qsort(order, n, sizeof(BatchKey), batch_key_cmp);
+    for (int i = 0; i < n; i++) {
+        sorted[i] = records[order[i].slot];
+    }
+    free(order);
+
+    char *fresh = NULL;
+    if (bplus_secondary_any(meta)) {
+        fresh = malloc(n);
+        if (fresh == NULL) {
+            free(sorted);
+            return -1;
         }
-        
-        int new_root_id;
-        BF_GetBlockCounter(file_desc, &new_root_id); new_root_id--;
-        meta->total_blocks = new_root_id + 1;
-
-        IndexNode *root = (IndexNode*)BF_Block_GetData(new_root_b);
-        indexnode_init(root);
-        root->count = 1;
-        root->keys[0] = up_key;
-        root->children[0] = meta->root_block_id;
-        root->children[1] = up_right;
-
-        BF_Block_SetDirty(new_root_b);
-        BF_UnpinBlock(new_root_b); BF_Block_Destroy(&new_root_b);
-
-        meta->root_block_id = new_root_id;
-        meta->height++;
-
-        // update metadata
-        BF_Block *meta_b;
-        BF_Block_Init(&meta_b);
-        if (BF_GetBlock(file_desc, 0, meta_b) != BF_OK) { BF_Block_Destroy(&meta_b); return -1; }
-        memcpy(BF_Block_GetData(meta_b), meta, sizeof(BPlusMetaImpl));
-        BF_Block_SetDirty(meta_b);
-        BF_UnpinBlock(meta_b); BF_Block_Destroy(&meta_b);
     }
+
+    // the batch goes straight into the tree. buffered inserts only check
+    // the tree for their key, so with a memtable it is merged first and
+    // kept out until the batch is in
+    int exclusive = meta->rt.memtable != NULL || fresh != NULL;
+    bplus_tree_enter(meta, exclusive);
+    long lsn = 0;
+    int ret = meta->rt.memtable ? bplus_memtable_merge(meta) : 0;
+    // the batch does not tell which records it skipped, so the ones to list
+    // in the secondary indexes are picked before it: the first of each key
+    // that the tree does not have yet. the tree is held exclusively for it,
+    // so no other writer puts one of the keys in between
+    for (int i = 0; fresh && ret == 0 && i < n; i++) {
+        int key = bplus_record_key(meta, &sorted[i]);
+        fresh[i] = (i == 0 || key != bplus_record_key(meta, &sorted[i - 1])) &&
+                   bplus_tree_find(meta, key, NULL) != 0;
+    }
+    for (int i = 0; i < n && ret == 0; i++) {
+        ret = bplus_dictionary_learn(meta, &sorted[i]);
+    }
+    if (ret == 0) {
+        for (int i = 0; i < n; i++) {
+            bplus_filter_add(meta, bplus_record_key(meta, &sorted[i]));
+        }
+        ret = bplus_tree_insert_sorted(meta, sorted, n, &lsn);
+    }
+    bplus_tree_leave(meta);
+    if (ret != -1 && bplus_log_commit(meta, lsn) != 0) {
+        ret = -1;
+    }
+    if (ret != -1 && bplus_filter_grow(meta) != 0) {
+        ret = -1;
+    }
+    for (int i = 0; fresh && ret != -1 && i < n; i++) {
+        if (fresh[i] && bplus_secondary_insert(meta, &sorted[i]) != 0) ret = -1;
+    }
+    free(fresh);
+    free(sorted);
     return ret;
 }
+
+struct BPlusScan {
+  const BPlusMetaImpl *meta;
+  int hi;
+  Page page;        // current leaf
+  int pinned;       // 0 once the scan is exhausted
+  int pos;          // next record in the pinned leaf
+  // files opened concurrent are scanned without holding anything between
+  // calls, records are copied out under a version check instead
+  int optimistic;
+  OptimisticCursor cursor;
+  char buf[MAX_PACKED_RECORD_SIZE];
+  int filtered;          // only records matching where are returned
+  Predicate where;
+  int projected;         // only the columns are copied out
+  Projection columns;
+};
+
+// drop the pinned leaf, scan is over after this
+static void scan_release(BPlusScan *scan) {
+    if (scan->pinned) {
+        release_leaf(scan->meta, &scan->page);
+        scan->pinned = 0;
+    }
+}
+
+BPlusScan *bplus_scan_open(int file_desc, const BPlusMeta *metadata, int lo, int hi) {
+    return bplus_scan_open_where(file_desc, metadata, lo, hi, NULL, NULL);
+}
+
+BPlusScan *bplus_scan_open_where(int file_desc, const BPlusMeta *metadata, int lo, int hi,
+                                 const Predicate *where, const Projection *columns) {
+    (void)file_desc;
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    // terms on the key only leave part of the range to read
+    if (where) predicate_key_range(where, &meta->schema, &lo, &hi);
+    // the range is read from the tree alone, buffered inserts go there first
+    if (bplus_memtable_flush((BPlusMetaImpl*)meta) != 0) {
+        return NULL;
+    }
+    BPlusScan *scan = malloc(sizeof(BPlusScan));
+    if (scan == NULL) {
+        return NULL;
+    }
+    scan->meta = meta;
+    scan->hi = hi;
+    scan->pos = 0;
+    scan->pinned = 0;
+    scan->filtered = where != NULL;
+    if (where) {
+        scan->where = *where;
+        predicate_bind(&scan->where, meta->rt.dictionary);
+    }
+    scan->projected = columns != NULL;
+    if (columns) {
+        scan->columns = *columns;
+        projection_bind(&scan->columns, meta->rt.dictionary);
+    }
+    scan->optimistic = meta->rt.latches != NULL;
+    if (scan->optimistic) {
+        scan->cursor.from = lo;
+        scan->cursor.leaf = -1;
+        scan->cursor.done = 0;
+        return scan;
+    }
+
+    // descend once, to the leftmost leaf that can hold lo
+    bplus_tree_enter(meta, 0);
+    if (find_leaf(meta, lo, 1, &scan->page) != 0) {
+        bplus_tree_leave(meta);
+        free(scan);
+        return NULL;
+    }
+    scan->pinned = 1;
+    DataNode *leaf = (DataNode*)scan->page.data;
+    scan->pos = datanode_find_insert_pos(leaf, lo);
+    return scan;
+}
+
+// leaf and position of the next record in range, NULL when done
+static const DataNode *scan_advance(BPlusScan *scan, int *pos) {
+    while (scan->pinned) {
+        const DataNode *leaf = (const DataNode*)scan->page.data;
+
+        if (scan->pos < leaf->count) {
+            if (datanode_key_at(leaf, scan->pos) > scan->hi) {
+                scan_release(scan);
+                return NULL;
+            }
+            *pos = scan->pos++;
+            return leaf;
+        }
+
+        // leaf done, move to the next one in the chain, latched before
+        // the current one is let go so a split in between is not missed
+        // hinted so a long scan does not push out the pages lookups use
+        int next = leaf->next_block_id;
+        if (next != -1) bplus_latch_shared(scan->meta, next);
+        scan_release(scan);
+        if (next == -1) {
+            return NULL;
+        }
+        if (pager_get_hinted(scan->meta->rt.pager, next, PAGER_HINT_SEQUENTIAL, &scan->page) != 0) {
+            bplus_latch_release(scan->meta, next);
+            return NULL;
+        }
+        scan->pinned = 1;
+        scan->pos = 0;
+    }
+    return NULL;
+}
+
+// next record of an optimistic scan taken with latches, once writers got in
+// the way of the optimistic attempts too often. returns its length or -1
+static int scan_next_latched(BPlusScan *scan) {
+    const BPlusMetaImpl *meta = scan->meta;
+    OptimisticCursor *cursor = &scan->cursor;
+    cursor->leaf = -1;
+    Page page;
+    bplus_tree_enter(meta, 0);
+    if (find_leaf(meta, cursor->from, 1, &page) != 0) {
+        bplus_tree_leave(meta);
+        return -1;
+    }
+
+    int length = -1;
+    while (1) {
+        const DataNode *leaf = (const DataNode*)page.data;
+        int pos = datanode_find_insert_pos(leaf, cursor->from);
+        if (pos < leaf->count) {
+            int key = datanode_key_at(leaf, pos);
+            if (key <= scan->hi) {
+                const char *packed = datanode_packed_at(leaf, pos, &length);
+                memcpy(scan->buf, packed, length);
+                if (key == scan->hi) cursor->done = 1;
+                else cursor->from = key + 1;
+            } else {
+                cursor->done = 1;
+            }
+            break;
+        }
+        int next = leaf->next_block_id;
+        if (next == -1) {
+            cursor->done = 1;
+            break;
+        }
+        bplus_latch_shared(meta, next);
+        release_leaf(meta, &page);
+        if (pager_get_hinted(meta->rt.pager, next, PAGER_HINT_SEQUENTIAL, &page) != 0) {
+            bplus_latch_release(meta, next);
+            bplus_tree_leave(meta);
+            return -1;
+        }
+    }
+    release_leaf(meta, &page);
+    bplus_tree_leave(meta);
+    return length;
+}
+
+// copy of the next record of an optimistic scan in scan->buf, its length or -1
+static int scan_next_optimistic(BPlusScan *scan) {
+    for (int attempt = 0; attempt < BPLUS_OPTIMISTIC_RETRIES; attempt++) {
+        int ret = bplus_optimistic_next(scan->meta, &scan->cursor, scan->hi, scan->buf);
+        if (ret != BPLUS_CONFLICT) return ret;
+    }
+    if (scan->cursor.done || scan->cursor.from > scan->hi) {
+        return -1;
+    }
+    return scan_next_latched(scan);
+}
+
+// packed bytes of the next record in range that matches the predicate.
+// they are tested where they are, in the pinned leaf or the copy an
+// optimistic scan made, and records that fail are never unpacked
+static const char *scan_next_match(BPlusScan *scan, int *length) {
+    while (1) {
+        const char *packed;
+        if (scan->optimistic) {
+            *length = scan_next_optimistic(scan);
+            if (*length < 0) return NULL;
+            packed = scan->buf;
+        } else {
+            int pos;
+            const DataNode *leaf = scan_advance(scan, &pos);
+            if (leaf == NULL) return NULL;
+            packed = datanode_packed_at(leaf, pos, length);
+        }
+        if (!scan->filtered || predicate_match(&scan->where, packed)) {
+            return packed;
+        }
+    }
+}
+
+int bplus_scan_next(BPlusScan *scan, Record *out_record) {
+    int length;
+    const char *packed = scan_next_match(scan, &length);
+    if (packed == NULL) {
+        return -1;
+    }
+    if (scan->projected) projection_copy(&scan->columns, packed, out_record);
+    else bplus_unpack(scan->meta, packed, out_record);
+    return 0;
+}
+
+int bplus_scan_next_packed(BPlusScan *scan, const char **packed, int *length) {
+    *packed = scan_next_match(scan, length);
+    return *packed == NULL ? -1 : 0;
+}
+
+void bplus_scan_close(BPlusScan *scan) {
+    if (scan == NULL) {
+        return;
+    }
+    if (!scan->optimistic) {
+        scan_release(scan);
+        bplus_tree_leave(scan->meta);
+    }
+    free(scan);
+}
@@ -0,0 +1,237 @@
+/**
+ * Bloom filter over the keys of the tree
+ * lookups of keys the filter has never seen return without reading a
+ * block. the filter lives in memory and is written to blocks of its own
+ * when the file is closed, the next open reads it back instead of going
+ * through the leaves. it is sized for twice the keys it was built with and
+ * built again from the leaves once that many were added, which also drops
+ * the keys deleted in the meantime
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BPLUS_BLOOM_BITS_PER_KEY 10
+
+// keys of the leaves, collected to size the filter before filling it
+typedef struct {
+  int *items;
+  long count;
+  long capacity;
+} KeyList;
+
+static int key_list_push(KeyList *list, int key) {
+    if (list->count == list->capacity) {
+        long capacity = list->capacity ? list->capacity * 2 : 4096;
+        int *items = realloc(list->items, capacity * sizeof(int));
+        if (items == NULL) return -1;
+        list->items = items;
+        list->capacity = capacity;
+    }
+    list->items[list->count++] = key;
+    return 0;
+}
+
+// every key in the leaves, walking the leaf chain from the leftmost one
+static int collect_keys(const BPlusMetaImpl *meta, KeyList *keys) {
+    Pager *pager = meta->rt.pager;
+    int block = meta->root_block_id;
+    for (int height = meta->height; height > 1; height--) {
+        Page page;
+        int pinned;
+        const IndexNode *node = bplus_index_read(meta, block, &page, &pinned);
+        if (node == NULL) return -1;
+        block = indexnode_children(node)[0];
+        if (pinned) pager_unpin(pager, &page);
+    }
+    while (block != -1) {
+        Page page;
+        CALL_PM(pager_get(pager, block, &page));
+        const DataNode *leaf = (const DataNode*)page.data;
+        const int *leaf_keys = datanode_keys(leaf);
+        for (int i = 0; i < leaf->count; i++) {
+            if (key_list_push(keys, leaf_keys[i]) != 0) {
+                pager_unpin(pager, &page);
+                return -1;
+            }
+        }
+        block = leaf->next_block_id;
+        pager_unpin(pager, &page);
+    }
+    return 0;
+}
+
+// filter of keys with room for as many again
+static BloomFilter *filter_of(const BPlusMetaImpl *meta, const int *keys, long count, int bits_per_key) {
+    BloomFilter *bloom = bloom_create(2 * count, bits_per_key, meta->rt.latches != NULL);
+    if (bloom == NULL) {
+        fprintf(stderr, "Error: out of memory for the key filter\n");
+        return NULL;
+    }
+    for (long i = 0; i < count; i++) {
+        bloom_add(bloom, keys[i]);
+    }
+    return bloom;
+}
+
+static BloomFilter *build(const BPlusMetaImpl *meta, int bits_per_key) {
+    KeyList keys = {NULL, 0, 0};
+    BloomFilter *bloom = NULL;
+    if (collect_keys(meta, &keys) == 0) {
+        bloom = filter_of(meta, keys.items, keys.count, bits_per_key);
+    }
+    free(keys.items);
+    return bloom;
+}
+
+// the filter saved in the blocks the metadata points to
+static BloomFilter *load(const BPlusMetaImpl *meta) {
+    Pager *pager = meta->rt.pager;
+    long length = (long)meta->bloom_blocks * meta->page_size;
+    char *data = malloc(length);
+    if (data == NULL) {
+        return NULL;
+    }
+    for (int i = 0; i < meta->bloom_blocks; i++) {
+        Page page;
+        if (pager_get(pager, meta->bloom_block + i, &page) != 0) {
+            free(data);
+            return NULL;
+        }
+        memcpy(data + (long)i * meta->page_size, page.data, meta->page_size);
+        pager_unpin(pager, &page);
+    }
+    BloomFilter *bloom = bloom_load(data, length, meta->rt.latches != NULL);
+    free(data);
+    return bloom;
+}
+
+int bplus_filter_open(BPlusMetaImpl *meta, int bits_per_key) {
+    Pager *pager = meta->rt.pager;
+    if (bits_per_key >= 0) {
+        if (bits_per_key == 0) bits_per_key = BPLUS_BLOOM_BITS_PER_KEY;
+        if (meta->bloom_saved && meta->bloom_block > 0) {
+            meta->rt.bloom = load(meta);
+        }
+        if (meta->rt.bloom == NULL) {
+            meta->rt.bloom = build(meta, bits_per_key);
+            if (meta->rt.bloom == NULL) return -1;
+        }
+    }
+    if (!pager->read_only && meta->bloom_saved) {
+        // the saved filter misses whatever this session inserts, a crash
+        // must not leave it looking current
+        meta->bloom_saved = 0;
+        if (bplus_meta_store(meta) != 0 || pager_sync(pager) != 0) return -1;
+    }
+    return 0;
+}
+
+int bplus_filter_save(BPlusMetaImpl *meta) {
+    BloomFilter *bloom = meta->rt.bloom;
+    Pager *pager = meta->rt.pager;
+    if (bloom == NULL || pager->read_only) {
+        return 0;
+    }
+    long length = bloom_saved_size(bloom);
+    int blocks = (int)((length + meta->page_size - 1) / meta->page_size);
+    char *data = calloc((long)blocks * meta->page_size, 1);
+    if (data == NULL) {
+        return -1;
+    }
+    bloom_save(bloom, data);
+
+    int ret = 0;
+    if (meta->bloom_blocks < blocks) {
+        // too small, the filter moves to new blocks at the end of the file
+        BPlusChange change;
+        bplus_change_init(&change);
+        for (int i = 0; i < meta->bloom_blocks && ret == 0; i++) {
+            if (change.count == BPLUS_CHANGE_MAX_PAGES && bplus_change_log(meta, &change) < 0) ret = -1;
+            if (ret == 0 && bplus_free_block(meta, meta->bloom_block + i, &change) != 0) ret = -1;
+        }
+        if (bplus_change_log(meta, &change) < 0) ret = -1;
+        meta->bloom_block = 0;
+        meta->bloom_blocks = 0;
+        for (int i = 0; i < blocks && ret == 0; i++) {
+            Page page;
+            if (bplus_allocate_block_at_end(meta, &page) != 0) {
+                ret = -1;
+                break;
+            }
+            if (i == 0) meta->bloom_block = page.id;
+            // nothing else allocates at close, the blocks follow each other
+            if (page.id != meta->bloom_block + i) ret = -1;
+            pager_set_dirty(pager, &page);
+            pager_unpin(pager, &page);
+            meta->bloom_blocks++;
+        }
+    }
+    for (int i = 0; i < blocks && ret == 0; i++) {
+        Page page;
+        if (pager_get(pager, meta->bloom_block + i, &page) != 0) {
+            ret = -1;
+            break;
+        }
+        memcpy(page.data, data + (long)i * meta->page_size, meta->page_size);
+        pager_set_dirty(pager, &page);
+        pager_unpin(pager, &page);
+    }
+    free(data);
+    meta->bloom_saved = ret == 0;
+    return ret;
+}
+
+// build a filter from the leaves and the memtable and put it in place,
+// with the tree held exclusive
+static int rebuild(BPlusMetaImpl *meta) {
+    BloomFilter *old = meta->rt.bloom;
+    if (old == NULL) {
+        return 0;
+    }
+    // buffered keys go into the tree first, so the leaves have them all
+    if (bplus_memtable_merge(meta) != 0) {
+        return -1;
+    }
+    BloomFilter *bloom = build(meta, bloom_bits_per_key(old));
+    if (bloom == NULL) {
+        return -1;
+    }
+    __atomic_store_n(&meta->rt.bloom, bloom, __ATOMIC_RELEASE);
+    // readers take no latch, one may still look at the old filter
+    if (meta->rt.latches) bloom_keep(bloom, old);
+    else bloom_destroy(old);
+    return 0;
+}
+
+void bplus_filter_add(BPlusMetaImpl *meta, int key) {
+    if (meta->rt.bloom) bloom_add(meta->rt.bloom, key);
+}
+
+int bplus_filter_grow(BPlusMetaImpl *meta) {
+    const BloomFilter *bloom = __atomic_load_n(&meta->rt.bloom, __ATOMIC_ACQUIRE);
+    if (bloom == NULL || !bloom_full(bloom)) {
+        return 0;
+    }
+    bplus_tree_enter(meta, 1);
+    int ret = 0;
+    // another thread may have rebuilt it while this one waited
+    if (bloom_full(meta->rt.bloom)) {
+        ret = rebuild(meta);
+    }
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+int bplus_filter_save_keys(BPlusMetaImpl *meta, const int *keys, long count) {
+    meta->rt.bloom = filter_of(meta, keys, count, BPLUS_BLOOM_BITS_PER_KEY);
+    if (meta->rt.bloom == NULL) {
+        return -1;
+    }
+    int ret = bplus_filter_save(meta);
+    bloom_destroy(meta->rt.bloom);
+    meta->rt.bloom = NULL;
+    return ret;
+}
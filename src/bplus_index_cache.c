@@ -0,0 +1,175 @@
+/**
+ * hash table of cached index nodes, open addressing with linear probing
+ */
+
+#include "bplus_index_cache.h"
+#include <stdlib.h>
+#include <string.h>
+
+typedef struct {
+  int block_id;     // -1 if the slot is empty
+  IndexNode *node;
+} CacheEntry;
+
+struct IndexCache {
+  CacheEntry *entries;
+  int capacity;     // power of two
+  int count;
+  long bytes;       // size of all the copies
+  int levels;       // levels from the root held in the table
+  int max_levels;
+  long max_bytes;
+};
+
+static unsigned int slot_of(const IndexCache *cache, int block_id) {
+    return ((unsigned int)block_id * 2654435761u) & (cache->capacity - 1);
+}
+
+static int table_init(IndexCache *cache, int capacity) {
+    cache->entries = malloc(capacity * sizeof(CacheEntry));
+    if (cache->entries == NULL) return -1;
+    for (int i = 0; i < capacity; i++) {
+        cache->entries[i].block_id = -1;
+        cache->entries[i].node = NULL;
+    }
+    cache->capacity = capacity;
+    cache->count = 0;
+    return 0;
+}
+
+static int find_slot(const IndexCache *cache, int block_id) {
+    unsigned int i = slot_of(cache, block_id);
+    while (cache->entries[i].block_id != -1) {
+        if (cache->entries[i].block_id == block_id) return (int)i;
+        i = (i + 1) & (cache->capacity - 1);
+    }
+    return -1;
+}
+
+// move every entry to a table twice the size
+static int grow(IndexCache *cache) {
+    CacheEntry *old = cache->entries;
+    int old_capacity = cache->capacity;
+    int count = cache->count;
+    if (table_init(cache, old_capacity * 2) != 0) {
+        cache->entries = old;
+        cache->capacity = old_capacity;
+        return -1;
+    }
+    for (int j = 0; j < old_capacity; j++) {
+        if (old[j].block_id == -1) continue;
+        unsigned int i = slot_of(cache, old[j].block_id);
+        while (cache->entries[i].block_id != -1) i = (i + 1) & (cache->capacity - 1);
+        cache->entries[i] = old[j];
+    }
+    cache->count = count;
+    free(old);
+    return 0;
+}
+
+IndexCache *index_cache_create(int max_levels, long max_bytes) {
+    IndexCache *cache = malloc(sizeof(IndexCache));
+    if (cache == NULL) return NULL;
+    if (table_init(cache, 64) != 0) {
+        free(cache);
+        return NULL;
+    }
+    cache->bytes = 0;
+    cache->levels = 0;
+    cache->max_levels = max_levels;
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void index_cache_clear(IndexCache *cache) {
+    for (int i = 0; i < cache->capacity; i++) {
+        free(cache->entries[i].node);
+        cache->entries[i].node = NULL;
+        cache->entries[i].block_id = -1;
+    }
+    cache->count = 0;
+    cache->bytes = 0;
+    cache->levels = 0;
+}
+
+void index_cache_destroy(IndexCache *cache) {
+    if (cache == NULL) return;
+    index_cache_clear(cache);
+    free(cache->entries);
+    free(cache);
+}
+
+const IndexNode *index_cache_get(const IndexCache *cache, int block_id) {
+    int i = find_slot(cache, block_id);
+    return i < 0 ? NULL : cache->entries[i].node;
+}
+
+int index_cache_put(IndexCache *cache, int block_id, const IndexNode *node) {
+    int i = find_slot(cache, block_id);
+    if (i >= 0) {
+        memcpy(cache->entries[i].node, node, indexnode_size(node));
+        return 0;
+    }
+
+    // keep the load factor under one half
+    if ((cache->count + 1) * 2 > cache->capacity && grow(cache) != 0) return -1;
+
+    // nodes of one tree share a page size, so a copy never changes size
+    IndexNode *copy = malloc(indexnode_size(node));
+    if (copy == NULL) return -1;
+    memcpy(copy, node, indexnode_size(node));
+
+    unsigned int s = slot_of(cache, block_id);
+    while (cache->entries[s].block_id != -1) s = (s + 1) & (cache->capacity - 1);
+    cache->entries[s].block_id = block_id;
+    cache->entries[s].node = copy;
+    cache->count++;
+    cache->bytes += indexnode_size(copy);
+    return 0;
+}
+
+void index_cache_remove(IndexCache *cache, int block_id) {
+    int i = find_slot(cache, block_id);
+    if (i < 0) return;
+    cache->bytes -= indexnode_size(cache->entries[i].node);
+    free(cache->entries[i].node);
+    cache->entries[i].node = NULL;
+    cache->entries[i].block_id = -1;
+    cache->count--;
+
+    // backward shift, so probe chains stay unbroken without tombstones
+    unsigned int mask = cache->capacity - 1;
+    unsigned int hole = (unsigned int)i;
+    unsigned int j = (hole + 1) & mask;
+    while (cache->entries[j].block_id != -1) {
+        unsigned int home = slot_of(cache, cache->entries[j].block_id);
+        // entry at j may fill the hole if its home is not in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            cache->entries[hole] = cache->entries[j];
+            cache->entries[j].block_id = -1;
+            cache->entries[j].node = NULL;
+            hole = j;
+        }
+        j = (j + 1) & mask;
+    }
+}
+
+int index_cache_levels(const IndexCache *cache) {
+    return cache->levels;
+}
+
+void index_cache_set_levels(IndexCache *cache, int levels) {
+    cache->levels = levels;
+}
+
+int index_cache_max_levels(const IndexCache *cache) {
+    return cache->max_levels;
+}
+
+long index_cache_max_bytes(const IndexCache *cache) {
+    return cache->max_bytes;
+}
+
+long index_cache_bytes(const IndexCache *cache) {
+    return cache->bytes;
+}
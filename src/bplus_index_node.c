@@ -3,94 +3,153 @@
  */
 
 #include "bplus_index_node.h"
+#include "bplus_search.h"
 #include <string.h>
 
-// init new index node
-void indexnode_init(IndexNode *node) {
+// init new index node, as many keys as fit the page
+void indexnode_init(IndexNode *node, int page_size, int counted) {
     node->count = 0;
+    node->max_keys = counted ? INDEXNODE_MAX_KEYS_COUNTED(page_size) : INDEXNODE_MAX_KEYS(page_size);
+    node->counted = counted != 0;
+}
+
+// child pointers, right after the max_keys keys
+int *indexnode_children(const IndexNode *node) {
+    return (int*)(node->keys + node->max_keys);
+}
+
+// records under each child, right after the pointers, counted nodes only
+int *indexnode_counts(const IndexNode *node) {
+    return indexnode_children(node) + node->max_keys + 1;
+}
+
+// records under the whole node
+long indexnode_total(const IndexNode *node) {
+    const int *counts = indexnode_counts(node);
+    long total = 0;
+    for (int i = 0; i <= node->count; i++) {
+        total += counts[i];
+    }
+    return total;
+}
+
+int indexnode_size(const IndexNode *node) {
+    return INDEXNODE_SIZE(node->max_keys, node->counted);
+}
+
+// below this an index node borrows from or merges with a sibling
+int indexnode_min_keys(const IndexNode *node) {
+    return node->max_keys / 2;
 }
 
 // find child index for key
 int indexnode_find_child_index(const IndexNode *node, int key) {
-    int pos = 0;
-    while (pos < node->count && key >= node->keys[pos]) {
-        pos++;
-    }
-    return pos;
+    return search_upper_bound(node->keys, node->count, key);
+}
+
+// like above but stops at the first key >= key
+// so duplicates that straddle a split are not skipped
+int indexnode_find_lower_child_index(const IndexNode *node, int key) {
+    return search_lower_bound(node->keys, node->count, key);
 }
 
 // get child block id
 int indexnode_get_child(const IndexNode *node, int key) {
     int idx = indexnode_find_child_index(node, key);
-    return node->children[idx];
+    return indexnode_children(node)[idx];
 }
 
-// is it full?
-int indexnode_is_full(const IndexNode *node) {
-    return node->count >= MAX_KEYS_INDEX;
+// insert count sorted keys with their right children, all after child pos
+// caller checked that they fit
+void indexnode_insert_many(IndexNode *node, int pos, const int *keys, const int *right_children,
+                           const int *right_counts, int count) {
+    int *children = indexnode_children(node);
+    memmove(node->keys + pos + count, node->keys + pos, (node->count - pos) * sizeof(int));
+    memmove(children + pos + 1 + count, children + pos + 1, (node->count - pos) * sizeof(int));
+    memcpy(node->keys + pos, keys, count * sizeof(int));
+    memcpy(children + pos + 1, right_children, count * sizeof(int));
+    if (node->counted) {
+        int *counts = indexnode_counts(node);
+        memmove(counts + pos + 1 + count, counts + pos + 1, (node->count - pos) * sizeof(int));
+        memcpy(counts + pos + 1, right_counts, count * sizeof(int));
+    }
+    node->count += count;
 }
 
-// insert key and right child pointer
-void indexnode_insert_at(IndexNode *node, int pos, int key, int right_child) {
-    // shift everything
-    for (int i = node->count; i > pos; i--) {
-        node->keys[i] = node->keys[i - 1];
-        node->children[i + 1] = node->children[i];
+// split index node that cannot take count more keys after child insert_pos
+// middle key goes up, new_node gets the keys after it. with append, for
+// the rightmost node of ascending inserts, node keeps all it can and
+// new_node just one key
+void indexnode_split_many(IndexNode *node, IndexNode *new_node, const int *keys, const int *right_children,
+                          const int *right_counts, int count, int insert_pos, int append, int *promoted_key) {
+    int total_keys = node->count + count;
+    int merged_keys[total_keys];
+    int merged_children[total_keys + 1];
+    int merged_counts[total_keys + 1];
+    const int *children = indexnode_children(node);
+    memcpy(merged_keys, node->keys, insert_pos * sizeof(int));
+    memcpy(merged_keys + insert_pos, keys, count * sizeof(int));
+    memcpy(merged_keys + insert_pos + count, node->keys + insert_pos, (node->count - insert_pos) * sizeof(int));
+    memcpy(merged_children, children, (insert_pos + 1) * sizeof(int));
+    memcpy(merged_children + insert_pos + 1, right_children, count * sizeof(int));
+    memcpy(merged_children + insert_pos + 1 + count, children + insert_pos + 1,
+           (node->count - insert_pos) * sizeof(int));
+    if (node->counted) {
+        // the counts go the same way as the children
+        const int *counts = indexnode_counts(node);
+        memcpy(merged_counts, counts, (insert_pos + 1) * sizeof(int));
+        memcpy(merged_counts + insert_pos + 1, right_counts, count * sizeof(int));
+        memcpy(merged_counts + insert_pos + 1 + count, counts + insert_pos + 1,
+               (node->count - insert_pos) * sizeof(int));
     }
-    node->keys[pos] = key;
-    node->children[pos + 1] = right_child;
-    node->count++;
-}
 
-// split index node
-// middle key goes up
-void indexnode_split(IndexNode *node, IndexNode *new_node, int new_key, 
-                     int new_child, int insert_pos, int *promoted_key) {
-    int temp_keys[MAX_KEYS_INDEX + 1];
-    int temp_children[MAX_KEYS_INDEX + 2];
-    
-    // copy keys
-    int j = 0;
-    for (int i = 0; i < node->count; i++) {
-        if (i == insert_pos) {
-            temp_keys[j++] = new_key;
-        }
-        temp_keys[j++] = node->keys[i];
+    int mid = total_keys / 2;
+    if (append) {
+        mid = total_keys - 2 < node->max_keys ? total_keys - 2 : node->max_keys;
     }
-    if (insert_pos == node->count) {
-        temp_keys[j++] = new_key;
+    *promoted_key = merged_keys[mid];
+    node->count = mid;
+    memcpy(node->keys, merged_keys, mid * sizeof(int));
+    memcpy(indexnode_children(node), merged_children, (mid + 1) * sizeof(int));
+    new_node->count = total_keys - mid - 1;
+    memcpy(new_node->keys, merged_keys + mid + 1, new_node->count * sizeof(int));
+    memcpy(indexnode_children(new_node), merged_children + mid + 1, (new_node->count + 1) * sizeof(int));
+    if (node->counted) {
+        memcpy(indexnode_counts(node), merged_counts, (mid + 1) * sizeof(int));
+        memcpy(indexnode_counts(new_node), merged_counts + mid + 1, (new_node->count + 1) * sizeof(int));
     }
-    
-    // copy children
-    j = 0;
-    for (int i = 0; i <= node->count; i++) {
-        if (i == insert_pos + 1) {
-            temp_children[j++] = new_child;
-        }
-        temp_children[j++] = node->children[i];
+}
+
+// remove key at pos and its right child pointer
+void indexnode_remove_at(IndexNode *node, int pos) {
+    int *children = indexnode_children(node);
+    int *counts = indexnode_counts(node);
+    for (int i = pos; i < node->count - 1; i++) {
+        node->keys[i] = node->keys[i + 1];
+        children[i + 1] = children[i + 2];
+        if (node->counted) counts[i + 1] = counts[i + 2];
     }
-    if (insert_pos + 1 == node->count + 1) {
-        temp_children[j++] = new_child;
+    node->count--;
+}
+
+int indexnode_is_underfull(const IndexNode *node) {
+    return node->count < indexnode_min_keys(node);
+}
+
+// append right sibling into node
+// the parent separator comes down between them
+void indexnode_merge(IndexNode *node, int separator, const IndexNode *right) {
+    node->keys[node->count] = separator;
+    for (int i = 0; i < right->count; i++) {
+        node->keys[node->count + 1 + i] = right->keys[i];
     }
-    
-    int total_keys = MAX_KEYS_INDEX + 1;
-    int mid = total_keys / 2;
-    
-    *promoted_key = temp_keys[mid];
-    
-    // left half
-    node->count = mid;
-    for (int i = 0; i < mid; i++) {
-        node->keys[i] = temp_keys[i];
-        node->children[i] = temp_children[i];
+    int *children = indexnode_children(node);
+    const int *right_children = indexnode_children(right);
+    for (int i = 0; i <= right->count; i++) {
+        children[node->count + 1 + i] = right_children[i];
     }
-    node->children[mid] = temp_children[mid];
-    
-    // right half
-    new_node->count = total_keys - mid - 1;
-    for (int i = 0; i < new_node->count; i++) {
-        new_node->keys[i] = temp_keys[mid + 1 + i];
-        new_node->children[i] = temp_children[mid + 1 + i];
+    if (node->counted) {
+        memcpy(indexnode_counts(node) + node->count + 1, indexnode_counts(right), (right->count + 1) * sizeof(int));
     }
-    new_node->children[new_node->count] = temp_children[total_keys];
-}
\ No newline at end of file
+    node->count += right->count + 1;
+}
@@ -0,0 +1,396 @@
+/**
+ * private definitions shared by the bplus_*.c files
+ * (kept out of include/ so the metadata layout is not visible to users)
+ */
+
+#ifndef BPLUS_INTERNAL_H
+#define BPLUS_INTERNAL_H
+
+#include "bplus_bloom.h"
+#include "bplus_dictionary.h"
+#include "bplus_file_funcs.h"
+#include "bplus_index_cache.h"
+#include "bplus_key.h"
+#include "bplus_latch.h"
+#include "bplus_memtable.h"
+#include "bplus_pager.h"
+#include "bplus_wal.h"
+#include <stddef.h>
+
+// block 0 starts with the magic and the format version. files of the first
+// layout carry BPLUS_MAGIC_V1 and no version, they cannot be read any more.
+// a change to what is stored on disk bumps BPLUS_FORMAT_VERSION
+#define BPLUS_MAGIC 0x42505432
+#define BPLUS_MAGIC_V1 ((int)0xBEEFBEEF)
+#define BPLUS_FORMAT_VERSION 1
+
+typedef struct SecondaryIndex SecondaryIndex;
+
+// deepest tree an insert can keep latches for
+#define BPLUS_MAX_HEIGHT 32
+
+// what the tree did since the file was opened or the stats were reset,
+// the pager counts its own part
+typedef struct {
+  long splits[BPLUS_MAX_HEIGHT];   // nodes split at each level, 0 for the leaves
+  long height_changes;             // roots put on top or taken away
+  long blocks_allocated;           // blocks taken for nodes, reused or new
+  LatencyHistogram find;
+  LatencyHistogram insert;
+} TreeStats;
+
+// per open file state, never written to disk
+typedef struct {
+  Pager *pager;              // page manager the file is open through
+  IndexCache *index_cache;   // copies of the top index levels, NULL if off
+  TreeLatches *latches;      // NULL unless opened for several threads
+  Wal *wal;                  // write-ahead log, NULL if changes are not logged
+  Memtable *memtable;        // inserts not merged into the tree yet, NULL if off
+  long memtable_limit;       // merge once the memtable takes this many bytes
+  // rightmost leaf in the high half and the lowest key routed to it in the
+  // low half, one word so threads read both together. -1 if not known
+  long rightmost;
+  int reorg_from;            // bplus_reorganize goes on from the leaf holding this key
+  BloomFilter *bloom;        // every key in the tree and memtable, NULL if off
+  char *file_name;           // name the file was opened by, index files are named after it
+  SecondaryIndex *secondary[MAX_ATTRIBUTES];   // open index of each attribute, NULL if none
+  Dictionary *dictionary;    // codes of the CHAR attributes, NULL if they are stored as they are
+  int dictionary_tail;       // last block of the dictionary chain
+  TreeStats stats;           // see bplus_stats_snapshot
+  KeyCodec key_codec;        // primary key of the schema, built once on open
+} BPlusRuntime;
+
+typedef struct {
+  int magic_number;
+  int format_version;    // BPLUS_FORMAT_VERSION of the library that created the file
+  int page_size;         // picks the page manager backend on open
+  int max_keys_index;    // index node capacity for this page size
+  int leaf_capacity;     // bytes for directory and records in a leaf
+  int root_block_id;
+  int height;
+  int total_blocks;
+  TableSchema schema;
+  int free_block_head;   // first block of the free list, -1 if empty
+  int bloom_block;       // first of the blocks the key filter is saved in, 0 if none
+  int bloom_blocks;      // blocks from there on, one after the other
+  int bloom_saved;       // 1 if they hold the filter of the keys in the file
+  int counted;           // 1 if index nodes keep the records under each child
+  int secondary;         // bit per attribute that has a secondary index
+  int secondary_saved;   // 1 if their files hold every record of the file
+  int dictionary_block;  // first block of the column dictionary chain, 0 if none
+  BPlusRuntime rt;       // must stay last, everything before it goes to block 0
+} BPlusMetaImpl;
+
+// bytes of BPlusMetaImpl stored in block 0
+#define BPLUS_META_DISK_SIZE offsetof(BPlusMetaImpl, rt)
+
+// a block on the free list, only the link is used
+typedef struct {
+  int next_free_block;
+} FreeBlock;
+
+// macro to check page manager errors, the backend already reported them
+#define CALL_PM(call) do { \
+    if ((call) != 0) { \
+        return -1; \
+    } \
+} while (0)
+
+// fill in the page size dependent fields of new metadata
+void bplus_meta_init(BPlusMetaImpl *meta, const TableSchema *schema, int page_size, int counted);
+
+// write metadata to block 0
+int bplus_meta_store(const BPlusMetaImpl *meta);
+
+// get a block for a new node, reusing the free list before growing the file
+// the block is left pinned in page, page->id is its block id
+int bplus_allocate_block(BPlusMetaImpl *meta, Page *page);
+
+// same, but always a new block at the end of the file, so blocks taken one
+// after the other follow each other on disk
+int bplus_allocate_block_at_end(BPlusMetaImpl *meta, Page *page);
+
+typedef struct BPlusChange BPlusChange;
+
+// int key the tree orders record by
+static inline int bplus_record_key(const BPlusMetaImpl *meta, const Record *record) {
+    return key_tree_key(&meta->rt.key_codec, &meta->schema, record);
+}
+
+// a separator above a leaf moved or a block was freed, the rightmost leaf
+// kept for appends may hold other keys now or be gone. the next insert that
+// descends to the rightmost leaf notes it again
+static inline void bplus_forget_rightmost(BPlusMetaImpl *meta) {
+    __atomic_store_n(&meta->rt.rightmost, -1L, __ATOMIC_RELAXED);
+}
+
+// put a block that is no longer part of the tree on the free list
+// the block is part of change, see bplus_change_keep
+int bplus_free_block(BPlusMetaImpl *meta, int block_id, BPlusChange *change);
+
+// index node for routing a descent
+// served from the index cache when held there, otherwise pinned in page
+// and *pinned is set so the caller unpins it. NULL on failure
+const IndexNode *bplus_index_read(const BPlusMetaImpl *meta, int block_id, Page *page, int *pinned);
+
+// refresh the cached copy of an index node after it changed
+// height counts the levels down to the leaves, as in insert_recursive
+void bplus_index_cache_sync(BPlusMetaImpl *meta, int block_id, int height, const IndexNode *node);
+
+// reload the cached levels from the root, needed after the height changes
+int bplus_index_cache_reload(BPlusMetaImpl *meta);
+
+// the tree alone, without the memtable, the caller entered the tree
+// insert returns the block id as bplus_record_insert does and *lsn gets
+// the log position to commit. find copies the record into out_record
+// (may be NULL) and returns 0 if found, -1 if not
+int bplus_tree_insert(BPlusMetaImpl *meta, const Record *record, long *lsn);
+
+// insert count records sorted by key, the caller entered the tree.
+// records that go to the leaf the one before went to are put in during
+// the same descent while the leaf has room, so a leaf is pinned once for
+// all of them. keys already in the tree are skipped
+// returns how many were inserted, -1 on failure
+int bplus_tree_insert_sorted(BPlusMetaImpl *meta, const Record *records, int count, long *lsn);
+int bplus_tree_find(const BPlusMetaImpl *meta, int key, Record *out_record);
+
+// latching, all of these do nothing unless the file was opened concurrent
+
+// enter and leave an operation on the tree, exclusive keeps everyone else out
+void bplus_tree_enter(const BPlusMetaImpl *meta, int exclusive);
+void bplus_tree_leave(const BPlusMetaImpl *meta);
+
+// start a descent: latch the root block and return its id, *height gets
+// the height it was latched at. exclusive also keeps the root pointer
+// latched until bplus_root_unlatch, so the root cannot be replaced
+int bplus_root_latch(const BPlusMetaImpl *meta, int exclusive, int *height);
+void bplus_root_unlatch(const BPlusMetaImpl *meta);
+
+static inline void bplus_latch_shared(const BPlusMetaImpl *meta, int block_id) {
+    if (meta->rt.latches) latch_shared(meta->rt.latches, block_id);
+}
+
+static inline void bplus_latch_exclusive(const BPlusMetaImpl *meta, int block_id) {
+    if (meta->rt.latches) latch_exclusive(meta->rt.latches, block_id);
+}
+
+static inline void bplus_latch_release(const BPlusMetaImpl *meta, int block_id) {
+    if (meta->rt.latches) latch_release(meta->rt.latches, block_id);
+}
+
+// mark block_id as being written for optimistic readers, the caller holds
+// its latch exclusive or the block is not reachable yet
+static inline void bplus_write_begin(const BPlusMetaImpl *meta, int block_id) {
+    if (meta->rt.latches) version_write_begin(latch_version(meta->rt.latches, block_id));
+}
+
+static inline void bplus_write_end(const BPlusMetaImpl *meta, int block_id) {
+    if (meta->rt.latches) version_write_end(latch_version(meta->rt.latches, block_id));
+}
+
+// write-ahead logging (bplus_log.c), all of this does nothing unless
+// the file was opened with a log.
+// a page's first change after a checkpoint is logged as its full image,
+// later records that only put a record into or take one out of a leaf are
+// logged as just that. splits, merges and root changes log the images of
+// every page they changed as one record, so replay never sees half of one.
+// block 0 is only written at checkpoints, the records carry the metadata
+
+// pages changed by one split, merge or root change, they stay pinned
+// until the change is logged so none of them reaches the file first
+#define BPLUS_CHANGE_MAX_PAGES (3 * BPLUS_MAX_HEIGHT + 2)
+
+struct BPlusChange {
+  Page pages[BPLUS_CHANGE_MAX_PAGES];
+  int count;
+  int root_changed;   // root_block_id and height go into the record
+};
+
+static inline void bplus_change_init(BPlusChange *change) {
+    change->count = 0;
+    change->root_changed = 0;
+}
+
+// page was changed as part of change, without a log it is just unpinned
+void bplus_change_keep(BPlusMetaImpl *meta, BPlusChange *change, Page *page);
+
+// log the pages of change as one record and unpin them
+// returns the lsn past the record, 0 if nothing was logged, -1 on error
+long bplus_change_log(BPlusMetaImpl *meta, BPlusChange *change);
+
+// the record at pos was put into the pinned leaf, log it, lsn as above
+long bplus_log_leaf_insert(BPlusMetaImpl *meta, Page *leaf, int pos);
+
+// the record with key was taken out of the pinned leaf, log it
+long bplus_log_leaf_delete(BPlusMetaImpl *meta, Page *leaf, int key);
+
+// only the counts of the pinned index node changed. they are logged just
+// as the page's first image after a checkpoint, so a torn write can be
+// undone, recovery counts again for the changes after that
+long bplus_log_counts(BPlusMetaImpl *meta, Page *node);
+
+// an insert or delete that logged up to lsn is done, waits for the log
+// as the commit interval asks and checkpoints when the log got long
+int bplus_log_commit(BPlusMetaImpl *meta, long lsn);
+
+// write every change back to the file and empty the log
+// nothing else may run on the tree meanwhile
+int bplus_checkpoint(BPlusMetaImpl *meta);
+
+// replay the log of fileName, if it has one, into the file open in meta
+// and make the file hold it all, then remove the log
+int bplus_recover(BPlusMetaImpl *meta, const char *fileName);
+
+// delete the log of fileName, for a file that was just created
+void bplus_log_discard(const char *fileName);
+
+// an insert of key went into the memtable, log it with its packed record
+long bplus_log_buffered_insert(BPlusMetaImpl *meta, int key, const char *packed, int length);
+
+// the buffered insert of key was deleted again
+long bplus_log_buffered_delete(BPlusMetaImpl *meta, int key);
+
+// everything buffered so far is in the tree now
+long bplus_log_merged(BPlusMetaImpl *meta);
+
+// buffered inserts (bplus_buffered.c), only for files opened with a memtable.
+// inserts go into the memtable and are merged into the tree in key order
+// once it is full, so a leaf is changed once per merge instead of once per
+// insert. lookups and deletes look in the memtable first, scans merge it
+// before they start. with a log, replay puts back what was not merged
+
+// put record into the memtable, same result as bplus_record_insert
+// except that 0 stands for the block id
+int bplus_buffered_insert(BPlusMetaImpl *meta, const Record *record);
+
+// copy the buffered record with key into out_record (may be NULL)
+// 0 if found, -1 if not
+int bplus_buffered_find(const BPlusMetaImpl *meta, int key, Record *out_record);
+
+// packed bytes of the buffered record with key, NULL if there is none.
+// they stay put while the caller is in the tree
+const char *bplus_buffered_packed(const BPlusMetaImpl *meta, int key, int *length);
+
+// take the buffered insert of key out, with the tree held exclusive
+// 0 if it was there, *lsn gets the log position to commit
+int bplus_buffered_remove(BPlusMetaImpl *meta, int key, long *lsn);
+
+// insert every buffered record into the tree and empty the memtable,
+// with the tree held exclusive
+int bplus_memtable_merge(BPlusMetaImpl *meta);
+
+// merge if the memtable holds anything, taking the tree for it
+int bplus_memtable_flush(BPlusMetaImpl *meta);
+
+// Bloom filter over the keys (bplus_filter.c). a key is added before its
+// insert starts, so a lookup that the filter turns away cannot miss an
+// insert that finished before it. the filter only says a key may be there,
+// deleted keys stay in it until it is rebuilt. it is saved at close and
+// the saved one counts as gone while the file is open for writing, so a
+// crash leaves it to be rebuilt from the leaves by the next open
+
+// load the saved filter of the file or build it from the leaves,
+// bits_per_key < 0 turns it off
+int bplus_filter_open(BPlusMetaImpl *meta, int bits_per_key);
+
+// save the filter into its blocks, before the metadata is stored at close
+int bplus_filter_save(BPlusMetaImpl *meta);
+
+// key is about to be inserted, called in the tree so no rebuild gets
+// in between the two
+void bplus_filter_add(BPlusMetaImpl *meta, int key);
+
+// build the filter again from the leaves once it got full, called
+// outside the tree after inserts
+int bplus_filter_grow(BPlusMetaImpl *meta);
+
+// 0 if key is neither in the tree nor in the memtable
+static inline int bplus_filter_may_contain(const BPlusMetaImpl *meta, int key) {
+    const BloomFilter *bloom = __atomic_load_n(&meta->rt.bloom, __ATOMIC_ACQUIRE);
+    return bloom == NULL || bloom_may_contain(bloom, key);
+}
+
+// save a filter of keys for a file the bulk load is making
+int bplus_filter_save_keys(BPlusMetaImpl *meta, const int *keys, long count);
+
+// counted trees (bplus_count.c). every index node keeps the records under
+// each child next to its pointer, inserts and deletes add to or take from
+// them on the way back up, splits and merges count what the nodes hold
+
+// set the counts of every index node from the leaves up, for recovery
+int bplus_recount(BPlusMetaImpl *meta);
+
+// secondary indexes (bplus_secondary.c). every index is a B+ tree file of
+// its own, from a value of the attribute to the primary keys of the records
+// holding it. inserts and deletes list and unlist their record once the
+// file has it, lookups check each record they fetch, so a record listed
+// but gone again is just skipped. like the key filter, the index files
+// count as out of date while the file is open for writing, and the next
+// open rebuilds them from the file if it was not closed
+
+// open the index files of the file, rebuilding those that were not saved
+int bplus_secondary_open(BPlusMetaImpl *meta);
+
+// close the index files, before the metadata is stored at close
+int bplus_secondary_close(BPlusMetaImpl *meta);
+
+// 1 if the file has secondary indexes, 0 lets inserts and deletes skip them
+static inline int bplus_secondary_any(const BPlusMetaImpl *meta) {
+    return __atomic_load_n(&meta->secondary, __ATOMIC_ACQUIRE) != 0;
+}
+
+// record was put into the file or taken out of it, change its lists
+int bplus_secondary_insert(BPlusMetaImpl *meta, const Record *record);
+int bplus_secondary_remove(BPlusMetaImpl *meta, const Record *record);
+
+// column dictionaries (bplus_codes.c). files created with the dictionary
+// option keep their non-key CHAR values as codes, see bplus_dictionary.h.
+// the values are saved in a chain of blocks from dictionary_block, in the
+// order they got their codes, and a value is logged before any record
+// can be written with its code
+
+// write a new chain with every value of rt.dictionary, for a new file
+int bplus_dictionary_write(BPlusMetaImpl *meta);
+
+// load the dictionary from its chain, nothing to do if it is loaded or
+// the file has none
+int bplus_dictionary_open(BPlusMetaImpl *meta);
+
+// give the values of record codes if they have none, before it is packed.
+// the caller entered the tree
+int bplus_dictionary_learn(BPlusMetaImpl *meta, const Record *record);
+
+// record_pack and record_unpack for the records of the file
+static inline int bplus_pack(const BPlusMetaImpl *meta, const Record *record, char *buf) {
+    const Dictionary *dict = meta->rt.dictionary;
+    return dict ? dictionary_pack(dict, &meta->schema, record, buf) : record_pack(&meta->schema, record, buf);
+}
+
+static inline void bplus_unpack(const BPlusMetaImpl *meta, const char *packed, Record *record) {
+    const Dictionary *dict = meta->rt.dictionary;
+    if (dict) dictionary_unpack(dict, &meta->schema, packed, record);
+    else record_unpack(&meta->schema, packed, record);
+}
+
+// optimistic reads, no latches taken (bplus_optimistic.c)
+// only for files opened concurrent. each returns BPLUS_CONFLICT when a writer
+// got in the way, the caller retries a few times and then takes latches
+#define BPLUS_CONFLICT -2
+#define BPLUS_OPTIMISTIC_RETRIES 4
+
+// copy the record with key into out_record (may be NULL), 0 if found, -1 if not
+int bplus_optimistic_find(const BPlusMetaImpl *meta, int key, Record *out_record);
+
+// position of a range cursor, the next record is the first with key >= from
+typedef struct {
+  int from;
+  int leaf;               // leaf holding from, -1 to descend to it first
+  unsigned int version;   // version of leaf when the cursor got there
+  int done;               // range exhausted
+} OptimisticCursor;
+
+// copy the packed bytes of the next record <= hi to buf and move past it
+// returns the length, -1 when the range is exhausted
+int bplus_optimistic_next(const BPlusMetaImpl *meta, OptimisticCursor *cursor, int hi, char *buf);
+
+#endif // BPLUS_INTERNAL_H
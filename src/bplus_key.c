@@ -0,0 +1,114 @@
+/**
+ * order-preserving normalized keys
+ * the type of the key attribute is looked at once, when the key of a
+ * record is written out. after that keys are plain bytes compared with
+ * memcmp, or the int made of their first bytes
+ */
+
+#include "bplus_key.h"
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#define SIGN_BIT 0x80000000U
+
+static int attribute_width(const AttributeSchema *attr) {
+    switch (attr->type) {
+    case TYPE_INT:
+    case TYPE_FLOAT:
+        return 4;
+    case TYPE_CHAR:
+        return attr->length;
+    default:
+        return -1;
+    }
+}
+
+static void put_big_endian(unsigned char *out, uint32_t bits) {
+    out[0] = (unsigned char)(bits >> 24);
+    out[1] = (unsigned char)(bits >> 16);
+    out[2] = (unsigned char)(bits >> 8);
+    out[3] = (unsigned char)bits;
+}
+
+// float bits that order as unsigned ints the way the floats do
+static uint32_t float_bits(float value) {
+    if (value == 0.0f) {
+        value = 0.0f;   // -0 and 0 are the same key
+    }
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    if (value != value) {
+        bits = 0x7fc00000U;   // one NaN, above +inf
+    }
+    return (bits & SIGN_BIT) ? ~bits : bits | SIGN_BIT;
+}
+
+int key_codec_init(KeyCodec *codec, const TableSchema *schema, int attr) {
+    if (attr < 0 || attr >= schema->count) {
+        return -1;
+    }
+    int width = attribute_width(&schema->attributes[attr]);
+    if (width <= 0) {
+        return -1;
+    }
+    codec->attr = attr;
+    codec->width = width;
+    return 0;
+}
+
+int key_codec_primary(KeyCodec *codec, const TableSchema *schema) {
+    return key_codec_init(codec, schema, schema->key_index);
+}
+
+void key_normalize(const KeyCodec *codec, const TableSchema *schema, const Record *record, unsigned char *out) {
+    const AttributeSchema *attr = &schema->attributes[codec->attr];
+    const FieldValue *value = &record->values[codec->attr];
+    switch (attr->type) {
+    case TYPE_INT:
+        put_big_endian(out, (uint32_t)value->int_value ^ SIGN_BIT);
+        break;
+    case TYPE_FLOAT:
+        put_big_endian(out, float_bits(value->float_value));
+        break;
+    default: {
+        // strings end at their terminator, the padding sorts first
+        int length = (int)strnlen(value->string_value, attr->length);
+        memcpy(out, value->string_value, length);
+        memset(out + length, 0, attr->length - length);
+        break;
+    }
+    }
+}
+
+int key_tree_codec(KeyCodec *codec, const TableSchema *schema) {
+    if (schema->key_index < 0 || key_codec_primary(codec, schema) != 0) {
+        printf("Error: No usable primary key in schema!\n");
+        return -1;
+    }
+    if (codec->width > KEY_TREE_WIDTH) {
+        // a wider key would need byte string keys in every node,
+        // log record, memtable and filter
+        printf("Error: Primary key is %d bytes normalized, at most %d fit!\n", codec->width, KEY_TREE_WIDTH);
+        return -1;
+    }
+    return 0;
+}
+
+int key_tree_key(const KeyCodec *codec, const TableSchema *schema, const Record *record) {
+    if (schema->attributes[codec->attr].type == TYPE_INT) {
+        return record->values[codec->attr].int_value;
+    }
+    unsigned char normalized[KEY_TREE_WIDTH];
+    key_normalize(codec, schema, record, normalized);
+    return key_prefix(normalized, codec->width);
+}
+
+int key_prefix(const unsigned char *normalized, int width) {
+    uint32_t bits = 0;
+    for (int i = 0; i < KEY_TREE_WIDTH; i++) {
+        bits = (bits << 8) | (i < width ? normalized[i] : 0);
+    }
+    // flipping the sign bit back makes signed order match byte order
+    return (int)(bits ^ SIGN_BIT);
+}
@@ -0,0 +1,116 @@
+/**
+ * per block latches for concurrent access to one open tree
+ * latches live in chunks made on first use, so a block id maps to its
+ * latch without a lookup structure and existing latches never move
+ */
+
+#define _GNU_SOURCE
+#include "bplus_latch.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+#define LATCH_CHUNK_BITS 12
+#define LATCH_CHUNK_SIZE (1 << LATCH_CHUNK_BITS)
+#define LATCH_MAX_CHUNKS (1 << 16)   // 2^28 blocks
+
+// a latch and its version share a cache line
+typedef struct {
+  pthread_rwlock_t lock;
+  unsigned int version;
+} Latch;
+
+struct LatchTable {
+  Latch *chunks[LATCH_MAX_CHUNKS];
+  pthread_mutex_t grow;   // serializes making new chunks
+};
+
+static Latch *latch_of(LatchTable *table, int block_id) {
+    unsigned int c = (unsigned int)block_id >> LATCH_CHUNK_BITS;
+    if (c >= LATCH_MAX_CHUNKS) {
+        fprintf(stderr, "Error: block %d has no latch\n", block_id);
+        abort();
+    }
+    Latch *chunk = __atomic_load_n(&table->chunks[c], __ATOMIC_ACQUIRE);
+    if (chunk == NULL) {
+        pthread_mutex_lock(&table->grow);
+        chunk = table->chunks[c];
+        if (chunk == NULL) {
+            chunk = malloc(LATCH_CHUNK_SIZE * sizeof(Latch));
+            if (chunk == NULL) {
+                fprintf(stderr, "Error: out of memory for latches\n");
+                abort();
+            }
+            for (int i = 0; i < LATCH_CHUNK_SIZE; i++) {
+                pthread_rwlock_init(&chunk[i].lock, NULL);
+                chunk[i].version = 0;
+            }
+            __atomic_store_n(&table->chunks[c], chunk, __ATOMIC_RELEASE);
+        }
+        pthread_mutex_unlock(&table->grow);
+    }
+    return &chunk[block_id & (LATCH_CHUNK_SIZE - 1)];
+}
+
+TreeLatches *tree_latches_create(void) {
+    TreeLatches *latches = malloc(sizeof(TreeLatches));
+    if (latches == NULL) {
+        return NULL;
+    }
+    latches->pages = calloc(1, sizeof(LatchTable));
+    if (latches->pages == NULL) {
+        free(latches);
+        return NULL;
+    }
+    pthread_mutex_init(&latches->pages->grow, NULL);
+    // deletes would never get in between a steady stream of lookups otherwise
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+    pthread_rwlock_init(&latches->tree, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    pthread_rwlock_init(&latches->root, NULL);
+    pthread_mutex_init(&latches->alloc, NULL);
+    pthread_rwlock_init(&latches->memtable, NULL);
+    pthread_mutex_init(&latches->dictionary, NULL);
+    latches->tree_version = 0;
+    latches->root_version = 0;
+    return latches;
+}
+
+void tree_latches_destroy(TreeLatches *latches) {
+    if (latches == NULL) {
+        return;
+    }
+    for (int c = 0; c < LATCH_MAX_CHUNKS; c++) {
+        Latch *chunk = latches->pages->chunks[c];
+        if (chunk == NULL) continue;
+        for (int i = 0; i < LATCH_CHUNK_SIZE; i++) {
+            pthread_rwlock_destroy(&chunk[i].lock);
+        }
+        free(chunk);
+    }
+    pthread_mutex_destroy(&latches->pages->grow);
+    free(latches->pages);
+    pthread_rwlock_destroy(&latches->tree);
+    pthread_rwlock_destroy(&latches->root);
+    pthread_mutex_destroy(&latches->alloc);
+    pthread_rwlock_destroy(&latches->memtable);
+    pthread_mutex_destroy(&latches->dictionary);
+    free(latches);
+}
+
+void latch_shared(TreeLatches *latches, int block_id) {
+    pthread_rwlock_rdlock(&latch_of(latches->pages, block_id)->lock);
+}
+
+void latch_exclusive(TreeLatches *latches, int block_id) {
+    pthread_rwlock_wrlock(&latch_of(latches->pages, block_id)->lock);
+}
+
+void latch_release(TreeLatches *latches, int block_id) {
+    pthread_rwlock_unlock(&latch_of(latches->pages, block_id)->lock);
+}
+
+unsigned int *latch_version(TreeLatches *latches, int block_id) {
+    return &latch_of(latches->pages, block_id)->version;
+}
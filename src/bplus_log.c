@@ -0,0 +1,387 @@
+/**
+ * logging tree changes to the write-ahead log, checkpoints and recovery
+ * replay starts from the file as a crash left it. every page changed since
+ * the last checkpoint was logged in full the first time, so replay puts it
+ * back to that image and then redoes each later record on exactly the page
+ * the insert or delete saw. pages never reach the file before their records
+ * are on disk, so the file holds nothing replay does not know about
+ */
+
+#include "bplus_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// checkpoint once the log holds this many bytes
+#define BPLUS_WAL_CHECKPOINT_BYTES (64L * 1024 * 1024)
+
+// what of the metadata a WAL_RECORD_PAGES record carries
+#define LOG_META_ALLOC 1   // total_blocks and free_block_head
+#define LOG_META_ROOT 2    // root_block_id and height
+
+// head of a WAL_RECORD_PAGES record, count times a block id and the
+// page_size bytes of its image follow
+typedef struct {
+  int flags;
+  int root_block_id;
+  int height;
+  int total_blocks;
+  int free_block_head;
+  int count;
+} LogPagesHead;
+
+// head of a WAL_RECORD_INSERT record, the packed record follows
+// a WAL_RECORD_DELETE record is just the head
+typedef struct {
+  int leaf;
+  int key;
+} LogLeafHead;
+
+// a WAL_RECORD_BUFFERED record is the key and then the packed record,
+// WAL_RECORD_UNBUFFERED just the key and WAL_RECORD_MERGED empty
+
+// what replay is working on
+typedef struct {
+  BPlusMetaImpl *meta;
+  Memtable *buffered;   // buffered inserts not merged yet
+} LogReplay;
+
+void bplus_change_keep(BPlusMetaImpl *meta, BPlusChange *change, Page *page) {
+    Pager *pager = meta->rt.pager;
+    if (meta->rt.wal == NULL) {
+        pager_unpin(pager, page);
+        return;
+    }
+    for (int i = 0; i < change->count; i++) {
+        if (change->pages[i].id == page->id) {
+            // changed again, the pin taken first is enough
+            pager_unpin(pager, page);
+            return;
+        }
+    }
+    if (change->count == BPLUS_CHANGE_MAX_PAGES) {
+        fprintf(stderr, "Error: too many pages in one change\n");
+        abort();
+    }
+    change->pages[change->count++] = *page;
+    page->frame = NULL;   // the change holds the pin now
+}
+
+// append the images of pages as one record, under the alloc latch so the
+// free list and block count in the record match the order of the log
+static long log_pages(BPlusMetaImpl *meta, Page *pages, int count, int flags) {
+    Wal *wal = meta->rt.wal;
+    WalPart parts[1 + 2 * BPLUS_CHANGE_MAX_PAGES];
+    int ids[BPLUS_CHANGE_MAX_PAGES];
+    LogPagesHead head;
+    head.flags = flags;
+    head.count = count;
+    parts[0].data = &head;
+    parts[0].length = sizeof(head);
+    for (int i = 0; i < count; i++) {
+        ids[i] = pages[i].id;
+        parts[1 + 2 * i].data = &ids[i];
+        parts[1 + 2 * i].length = sizeof(int);
+        parts[2 + 2 * i].data = pages[i].data;
+        parts[2 + 2 * i].length = meta->page_size;
+        wal_mark_page(wal, ids[i]);
+    }
+
+    if (meta->rt.latches) pthread_mutex_lock(&meta->rt.latches->alloc);
+    head.root_block_id = meta->root_block_id;
+    head.height = meta->height;
+    head.total_blocks = meta->total_blocks;
+    head.free_block_head = meta->free_block_head;
+    long lsn = wal_append(wal, WAL_RECORD_PAGES, parts, 1 + 2 * count);
+    if (meta->rt.latches) pthread_mutex_unlock(&meta->rt.latches->alloc);
+    return lsn;
+}
+
+long bplus_change_log(BPlusMetaImpl *meta, BPlusChange *change) {
+    if (meta->rt.wal == NULL || change->count == 0) {
+        return 0;
+    }
+    // the root only changes with the root pointer latched, other changes
+    // must not write down a root they saw half way through its change
+    int flags = LOG_META_ALLOC | (change->root_changed ? LOG_META_ROOT : 0);
+    long lsn = log_pages(meta, change->pages, change->count, flags);
+    for (int i = 0; i < change->count; i++) {
+        if (lsn > 0) pager_set_lsn(meta->rt.pager, &change->pages[i], lsn);
+        pager_unpin(meta->rt.pager, &change->pages[i]);
+    }
+    bplus_change_init(change);
+    return lsn;
+}
+
+long bplus_log_leaf_insert(BPlusMetaImpl *meta, Page *leaf, int pos) {
+    Wal *wal = meta->rt.wal;
+    if (wal == NULL) {
+        return 0;
+    }
+    long lsn;
+    if (wal_mark_page(wal, leaf->id)) {
+        lsn = log_pages(meta, leaf, 1, 0);
+    } else {
+        const DataNode *node = (const DataNode*)leaf->data;
+        LogLeafHead head = {leaf->id, datanode_key_at(node, pos)};
+        int length;
+        const char *packed = datanode_packed_at(node, pos, &length);
+        WalPart parts[2] = {{&head, sizeof(head)}, {packed, length}};
+        lsn = wal_append(wal, WAL_RECORD_INSERT, parts, 2);
+    }
+    if (lsn > 0) pager_set_lsn(meta->rt.pager, leaf, lsn);
+    return lsn;
+}
+
+long bplus_log_leaf_delete(BPlusMetaImpl *meta, Page *leaf, int key) {
+    Wal *wal = meta->rt.wal;
+    if (wal == NULL) {
+        return 0;
+    }
+    long lsn;
+    if (wal_mark_page(wal, leaf->id)) {
+        lsn = log_pages(meta, leaf, 1, 0);
+    } else {
+        LogLeafHead head = {leaf->id, key};
+        WalPart part = {&head, sizeof(head)};
+        lsn = wal_append(wal, WAL_RECORD_DELETE, &part, 1);
+    }
+    if (lsn > 0) pager_set_lsn(meta->rt.pager, leaf, lsn);
+    return lsn;
+}
+
+long bplus_log_counts(BPlusMetaImpl *meta, Page *node) {
+    Wal *wal = meta->rt.wal;
+    if (wal == NULL || !wal_mark_page(wal, node->id)) {
+        return 0;
+    }
+    long lsn = log_pages(meta, node, 1, 0);
+    if (lsn > 0) pager_set_lsn(meta->rt.pager, node, lsn);
+    return lsn;
+}
+
+long bplus_log_buffered_insert(BPlusMetaImpl *meta, int key, const char *packed, int length) {
+    if (meta->rt.wal == NULL) {
+        return 0;
+    }
+    WalPart parts[2] = {{&key, sizeof(int)}, {packed, length}};
+    return wal_append(meta->rt.wal, WAL_RECORD_BUFFERED, parts, 2);
+}
+
+long bplus_log_buffered_delete(BPlusMetaImpl *meta, int key) {
+    if (meta->rt.wal == NULL) {
+        return 0;
+    }
+    WalPart part = {&key, sizeof(int)};
+    return wal_append(meta->rt.wal, WAL_RECORD_UNBUFFERED, &part, 1);
+}
+
+long bplus_log_merged(BPlusMetaImpl *meta) {
+    if (meta->rt.wal == NULL) {
+        return 0;
+    }
+    return wal_append(meta->rt.wal, WAL_RECORD_MERGED, NULL, 0);
+}
+
+int bplus_checkpoint(BPlusMetaImpl *meta) {
+    Wal *wal = meta->rt.wal;
+    if (wal == NULL) {
+        return 0;
+    }
+    // buffered inserts are only in the log, they go into the tree first
+    if (bplus_memtable_merge(meta) != 0) return -1;
+    // pages wait for their records, so the whole log goes first
+    if (wal_sync(wal) != 0) return -1;
+    if (bplus_meta_store(meta) != 0) return -1;
+    if (pager_sync(meta->rt.pager) != 0) return -1;
+    // a crash before the truncate replays the log onto these pages,
+    // which ends in the same tree
+    return wal_truncate(wal);
+}
+
+int bplus_log_commit(BPlusMetaImpl *meta, long lsn) {
+    Wal *wal = meta->rt.wal;
+    if (wal == NULL || lsn <= 0) {
+        return 0;
+    }
+    if (wal_commit(wal, lsn) != 0) {
+        return -1;
+    }
+    if (wal_size(wal) < BPLUS_WAL_CHECKPOINT_BYTES) {
+        return 0;
+    }
+    int ret = 0;
+    bplus_tree_enter(meta, 1);
+    // another thread may have checkpointed while this one waited
+    if (wal_size(wal) >= BPLUS_WAL_CHECKPOINT_BYTES) {
+        ret = bplus_checkpoint(meta);
+    }
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+// page id for an image, growing the file up to it if a crash left it shorter
+static int replay_page(BPlusMetaImpl *meta, int id, Page *page) {
+    Pager *pager = meta->rt.pager;
+    while (pager_page_count(pager) <= id) {
+        Page grown;
+        CALL_PM(pager_allocate(pager, &grown));
+        pager_set_dirty(pager, &grown);
+        pager_unpin(pager, &grown);
+    }
+    return pager_get(pager, id, page);
+}
+
+static int replay_pages(BPlusMetaImpl *meta, const char *data, int length) {
+    LogPagesHead head;
+    if (length < (int)sizeof(head)) return -1;
+    memcpy(&head, data, sizeof(head));
+    if (length != (int)sizeof(head) + head.count * (int)(sizeof(int) + meta->page_size)) return -1;
+
+    const char *p = data + sizeof(head);
+    for (int i = 0; i < head.count; i++) {
+        int id;
+        memcpy(&id, p, sizeof(int));
+        p += sizeof(int);
+        Page page;
+        CALL_PM(replay_page(meta, id, &page));
+        memcpy(page.data, p, meta->page_size);
+        p += meta->page_size;
+        pager_set_dirty(meta->rt.pager, &page);
+        pager_unpin(meta->rt.pager, &page);
+    }
+    if (head.flags & LOG_META_ALLOC) {
+        meta->total_blocks = head.total_blocks;
+        meta->free_block_head = head.free_block_head;
+    }
+    if (head.flags & LOG_META_ROOT) {
+        meta->root_block_id = head.root_block_id;
+        meta->height = head.height;
+    }
+    return 0;
+}
+
+// redo an insert or delete on the leaf, which is exactly as it was then
+static int replay_leaf(BPlusMetaImpl *meta, int type, const char *data, int length) {
+    LogLeafHead head;
+    if (length < (int)sizeof(head)) return -1;
+    memcpy(&head, data, sizeof(head));
+    Page page;
+    CALL_PM(pager_get(meta->rt.pager, head.leaf, &page));
+    DataNode *leaf = (DataNode*)page.data;
+
+    int ret = 0;
+    if (type == WAL_RECORD_INSERT) {
+        int packed_length = length - (int)sizeof(head);
+        int pos = datanode_find_insert_pos(leaf, head.key);
+        if (datanode_fits(leaf, packed_length)) {
+            datanode_insert_packed(leaf, pos, head.key, data + sizeof(head), packed_length);
+        } else {
+            ret = -1;
+        }
+    } else {
+        int pos = datanode_find_key(leaf, head.key);
+        if (pos >= 0) datanode_remove_at(leaf, pos);
+        else ret = -1;
+    }
+    pager_set_dirty(meta->rt.pager, &page);
+    pager_unpin(meta->rt.pager, &page);
+    if (ret != 0) {
+        fprintf(stderr, "Error: log record for key %d does not match leaf %d\n", head.key, head.leaf);
+    }
+    return ret;
+}
+
+// buffered inserts are collected and put into the tree after the rest,
+// unless a merge record says they are there already
+static int replay_buffered(LogReplay *replay, int type, const char *data, int length) {
+    if (type == WAL_RECORD_MERGED) {
+        memtable_clear(replay->buffered);
+        return 0;
+    }
+    int key;
+    if (length < (int)sizeof(int)) return -1;
+    memcpy(&key, data, sizeof(int));
+    if (type == WAL_RECORD_UNBUFFERED) {
+        memtable_remove(replay->buffered, key);
+        return 0;
+    }
+    return memtable_put(replay->buffered, key, data + sizeof(int), length - (int)sizeof(int)) < 0 ? -1 : 0;
+}
+
+static int replay_record(void *ctx, int type, const char *data, int length) {
+    LogReplay *replay = (LogReplay*)ctx;
+    switch (type) {
+    case WAL_RECORD_PAGES:
+        return replay_pages(replay->meta, data, length);
+    case WAL_RECORD_INSERT:
+    case WAL_RECORD_DELETE:
+        return replay_leaf(replay->meta, type, data, length);
+    case WAL_RECORD_BUFFERED:
+    case WAL_RECORD_UNBUFFERED:
+    case WAL_RECORD_MERGED:
+        return replay_buffered(replay, type, data, length);
+    default:
+        fprintf(stderr, "Error: unknown log record type %d\n", type);
+        return -1;
+    }
+}
+
+int bplus_recover(BPlusMetaImpl *meta, const char *fileName) {
+    char *path = wal_path_of(fileName);
+    if (path == NULL) {
+        return -1;
+    }
+    struct stat st;
+    if (stat(path, &st) != 0) {
+        // closed cleanly or never logged
+        free(path);
+        return 0;
+    }
+    if (meta->rt.pager->read_only) {
+        printf("Error: %s has a log to replay, open the file for writing first\n", fileName);
+        free(path);
+        return -1;
+    }
+
+    LogReplay replay = {meta, memtable_create()};
+    if (replay.buffered == NULL) {
+        free(path);
+        return -1;
+    }
+    int count = wal_replay(path, meta->page_size, replay_record, &replay);
+    int ret = count < 0 ? -1 : 0;
+    // counts are not logged after a page's first image, the index nodes
+    // may hold counts of records the log never got
+    if (ret == 0 && (count > 0 || meta->counted)) {
+        int pages = pager_page_count(meta->rt.pager);
+        if (meta->total_blocks < pages) meta->total_blocks = pages;
+        // inserts that were still buffered, nothing is logged yet. they
+        // are unpacked with the dictionary the log put back
+        meta->rt.memtable = replay.buffered;
+        if (bplus_dictionary_open(meta) != 0 || bplus_memtable_merge(meta) != 0) ret = -1;
+        meta->rt.memtable = NULL;
+        if (ret == 0 && meta->counted && bplus_recount(meta) != 0) ret = -1;
+        // the saved key filter may not match what replay made of the file
+        meta->bloom_saved = 0;
+        if (bplus_meta_store(meta) != 0 || pager_sync(meta->rt.pager) != 0) ret = -1;
+    }
+    memtable_destroy(replay.buffered);
+    // the log is only gone once the file holds everything in it
+    if (ret == 0 && unlink(path) != 0) {
+        perror(path);
+        ret = -1;
+    }
+    free(path);
+    return ret;
+}
+
+void bplus_log_discard(const char *fileName) {
+    char *path = wal_path_of(fileName);
+    if (path != NULL) {
+        unlink(path);
+        free(path);
+    }
+}
@@ -0,0 +1,229 @@
+/**
+ * hash table of buffered records, open addressing with linear probing
+ * slots keep the key next to the entry, so a lookup touches one slot and
+ * the entry only on a hit. the key order is only needed when the records
+ * are merged, one sort then is much cheaper than keeping them sorted
+ */
+
+#include "bplus_memtable.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MEMTABLE_CHUNK_SIZE (256 * 1024)
+
+struct MemtableEntry {
+  int key;
+  int length;        // bytes of the packed record
+  char packed[];
+};
+
+typedef struct {
+  int key;
+  MemtableEntry *entry;   // NULL if the slot is empty
+} MemtableSlot;
+
+typedef struct Chunk {
+  struct Chunk *next;
+  long used;
+  long size;
+  char data[];
+} Chunk;
+
+struct Memtable {
+  MemtableSlot *slots;
+  int capacity;      // power of two
+  int count;
+  long entry_bytes;
+  Chunk *chunks;     // newest first, entries come from the first
+  // entries in key order, made by memtable_sorted
+  const MemtableEntry **sorted;
+  int sorted_capacity;
+};
+
+static unsigned int slot_of(const Memtable *table, int key) {
+    return ((unsigned int)key * 2654435761u) & (table->capacity - 1);
+}
+
+static int find_slot(const Memtable *table, int key) {
+    unsigned int i = slot_of(table, key);
+    while (table->slots[i].entry != NULL) {
+        if (table->slots[i].key == key) return (int)i;
+        i = (i + 1) & (table->capacity - 1);
+    }
+    return -1;
+}
+
+// move every slot to a table twice the size
+static int grow(Memtable *table) {
+    MemtableSlot *old = table->slots;
+    int old_capacity = table->capacity;
+    MemtableSlot *slots = calloc(old_capacity * 2, sizeof(MemtableSlot));
+    if (slots == NULL) return -1;
+    table->slots = slots;
+    table->capacity = old_capacity * 2;
+    for (int j = 0; j < old_capacity; j++) {
+        if (old[j].entry == NULL) continue;
+        unsigned int i = slot_of(table, old[j].key);
+        while (table->slots[i].entry != NULL) i = (i + 1) & (table->capacity - 1);
+        table->slots[i] = old[j];
+    }
+    free(old);
+    return 0;
+}
+
+static void *chunk_alloc(Memtable *table, long size) {
+    Chunk *chunk = table->chunks;
+    if (chunk == NULL || chunk->used + size > chunk->size) {
+        long chunk_size = size > MEMTABLE_CHUNK_SIZE ? size : MEMTABLE_CHUNK_SIZE;
+        chunk = malloc(sizeof(Chunk) + chunk_size);
+        if (chunk == NULL) return NULL;
+        chunk->used = 0;
+        chunk->size = chunk_size;
+        chunk->next = table->chunks;
+        table->chunks = chunk;
+    }
+    void *p = chunk->data + chunk->used;
+    chunk->used += size;
+    return p;
+}
+
+Memtable *memtable_create(void) {
+    Memtable *table = calloc(1, sizeof(Memtable));
+    if (table == NULL) {
+        return NULL;
+    }
+    table->capacity = 1024;
+    table->slots = calloc(table->capacity, sizeof(MemtableSlot));
+    if (table->slots == NULL) {
+        free(table);
+        return NULL;
+    }
+    return table;
+}
+
+void memtable_clear(Memtable *table) {
+    while (table->chunks) {
+        Chunk *next = table->chunks->next;
+        free(table->chunks);
+        table->chunks = next;
+    }
+    // the table keeps its size, the next round fills it up again
+    memset(table->slots, 0, table->capacity * sizeof(MemtableSlot));
+    table->count = 0;
+    table->entry_bytes = 0;
+}
+
+void memtable_destroy(Memtable *table) {
+    if (table == NULL) {
+        return;
+    }
+    memtable_clear(table);
+    free(table->slots);
+    free(table->sorted);
+    free(table);
+}
+
+int memtable_put(Memtable *table, int key, const char *packed, int length) {
+    if (find_slot(table, key) >= 0) {
+        return 1;
+    }
+    // keep the load factor under one half
+    if ((table->count + 1) * 2 > table->capacity && grow(table) != 0) {
+        return -1;
+    }
+    long size = (sizeof(MemtableEntry) + length + 7) & ~7L;
+    MemtableEntry *entry = chunk_alloc(table, size);
+    if (entry == NULL) {
+        return -1;
+    }
+    entry->key = key;
+    entry->length = length;
+    memcpy(entry->packed, packed, length);
+
+    unsigned int i = slot_of(table, key);
+    while (table->slots[i].entry != NULL) i = (i + 1) & (table->capacity - 1);
+    table->slots[i].key = key;
+    table->slots[i].entry = entry;
+    table->count++;
+    table->entry_bytes += size;
+    return 0;
+}
+
+const MemtableEntry *memtable_get(const Memtable *table, int key) {
+    int i = find_slot(table, key);
+    return i < 0 ? NULL : table->slots[i].entry;
+}
+
+int memtable_remove(Memtable *table, int key) {
+    int i = find_slot(table, key);
+    if (i < 0) {
+        return -1;
+    }
+    table->slots[i].entry = NULL;
+    table->count--;
+
+    // backward shift, so probe chains stay unbroken without tombstones
+    unsigned int mask = table->capacity - 1;
+    unsigned int hole = (unsigned int)i;
+    unsigned int j = (hole + 1) & mask;
+    while (table->slots[j].entry != NULL) {
+        unsigned int home = slot_of(table, table->slots[j].key);
+        // slot j may fill the hole if its home is not in (hole, j]
+        if (((j - home) & mask) >= ((j - hole) & mask)) {
+            table->slots[hole] = table->slots[j];
+            table->slots[j].entry = NULL;
+            hole = j;
+        }
+        j = (j + 1) & mask;
+    }
+    return 0;
+}
+
+static int slot_cmp(const void *a, const void *b) {
+    int ka = ((const MemtableSlot*)a)->key;
+    int kb = ((const MemtableSlot*)b)->key;
+    return (ka > kb) - (ka < kb);
+}
+
+const MemtableEntry *const *memtable_sorted(Memtable *table, int *count) {
+    *count = table->count;
+    if (table->count > table->sorted_capacity) {
+        const MemtableEntry **grown = realloc(table->sorted, table->count * sizeof(MemtableEntry*));
+        if (grown == NULL) return NULL;
+        table->sorted = grown;
+        table->sorted_capacity = table->count;
+    }
+    // sort the keys with the slots, the entries are only touched afterwards
+    MemtableSlot *keys = malloc((table->count + 1) * sizeof(MemtableSlot));
+    if (keys == NULL) {
+        return NULL;
+    }
+    int n = 0;
+    for (int i = 0; i < table->capacity; i++) {
+        if (table->slots[i].entry != NULL) keys[n++] = table->slots[i];
+    }
+    qsort(keys, n, sizeof(MemtableSlot), slot_cmp);
+    for (int i = 0; i < n; i++) {
+        table->sorted[i] = keys[i].entry;
+    }
+    free(keys);
+    return table->sorted;
+}
+
+int memtable_entry_key(const MemtableEntry *entry) {
+    return entry->key;
+}
+
+const char *memtable_entry_packed(const MemtableEntry *entry, int *length) {
+    *length = entry->length;
+    return entry->packed;
+}
+
+int memtable_count(const Memtable *table) {
+    return table->count;
+}
+
+long memtable_bytes(const Memtable *table) {
+    // a slot per entry at a load factor of about one half
+    return table->entry_bytes + 2L * table->count * sizeof(MemtableSlot);
+}
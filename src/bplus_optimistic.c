@@ -0,0 +1,189 @@
+/**
+ * optimistic reads for files opened concurrent
+ * a reader takes no latch, it notes the version of every node before
+ * reading it and checks it again afterwards, and gives up if a writer was
+ * there in between. pages are still pinned while they are read so the
+ * memory stays valid, but their contents may be half written: every read
+ * stays inside the block and nothing read is used before the version check
+ */
+
+#include "bplus_internal.h"
+#include "bplus_search.h"
+#include <string.h>
+
+#define READ_ONCE(x) __atomic_load_n(&(x), __ATOMIC_RELAXED)
+
+// most records a leaf of the file can have
+static int leaf_max_count(const BPlusMetaImpl *meta) {
+    return meta->leaf_capacity / DATANODE_SLOT_SIZE;
+}
+
+// walk down to the leaf for key, leftmost as in find_leaf
+static int descend(const BPlusMetaImpl *meta, int key, int leftmost, int *leaf, unsigned int *leaf_version) {
+    TreeLatches *latches = meta->rt.latches;
+    Pager *pager = meta->rt.pager;
+
+    unsigned int root_seen = version_read(&latches->root_version);
+    if (root_seen & 1) return BPLUS_CONFLICT;
+    int curr = READ_ONCE(meta->root_block_id);
+    int height = READ_ONCE(meta->height);
+    unsigned int *version = latch_version(latches, curr);
+    unsigned int seen = version_read(version);
+    if ((seen & 1) || !version_validate(&latches->root_version, root_seen)) return BPLUS_CONFLICT;
+
+    for (int h = 1; h < height; h++) {
+        Page page;
+        CALL_PM(pager_get(pager, curr, &page));
+        const IndexNode *idx = (const IndexNode*)page.data;
+        int count = READ_ONCE(idx->count);
+        int child = -1;
+        if (count >= 0 && count <= meta->max_keys_index) {
+            int pos = leftmost ? search_lower_bound(idx->keys, count, key)
+                               : search_upper_bound(idx->keys, count, key);
+            child = READ_ONCE(idx->keys[meta->max_keys_index + pos]);  // children follow the keys
+        }
+        pager_unpin(pager, &page);
+        if (!version_validate(version, seen) || child < 0) return BPLUS_CONFLICT;
+
+        // the parent is checked again after the child version is read, so
+        // the child cannot have split unnoticed in between
+        unsigned int *child_version = latch_version(latches, child);
+        unsigned int child_seen = version_read(child_version);
+        if ((child_seen & 1) || !version_validate(version, seen)) return BPLUS_CONFLICT;
+        curr = child;
+        version = child_version;
+        seen = child_seen;
+    }
+    *leaf = curr;
+    *leaf_version = seen;
+    return 0;
+}
+
+// copy the bytes of record pos, -1 if the slot cannot be right
+static int copy_packed(const BPlusMetaImpl *meta, const DataNode *leaf, int count, int pos, char *buf) {
+    const LeafSlot *slots = (const LeafSlot*)(datanode_keys(leaf) + count);
+    int offset = READ_ONCE(slots[pos].offset);
+    int length = READ_ONCE(slots[pos].length);
+    if (length > MAX_PACKED_RECORD_SIZE || offset + length > meta->page_size) {
+        return -1;
+    }
+    memcpy(buf, (const char*)leaf + offset, length);
+    return length;
+}
+
+int bplus_optimistic_find(const BPlusMetaImpl *meta, int key, Record *out_record) {
+    TreeLatches *latches = meta->rt.latches;
+    unsigned int tree_seen = version_read(&latches->tree_version);
+    if (tree_seen & 1) return BPLUS_CONFLICT;
+
+    int leaf_id;
+    unsigned int seen;
+    int ret = descend(meta, key, 0, &leaf_id, &seen);
+    if (ret != 0) return ret;
+
+    Page page;
+    CALL_PM(pager_get(meta->rt.pager, leaf_id, &page));
+    const DataNode *leaf = (const DataNode*)page.data;
+    char buf[MAX_PACKED_RECORD_SIZE];
+    int count = READ_ONCE(leaf->count);
+    int found = 0;
+    int length = 0;
+    if (count >= 0 && count <= leaf_max_count(meta)) {
+        const int *keys = datanode_keys(leaf);
+        int pos = search_lower_bound(keys, count, key);
+        found = pos < count && READ_ONCE(keys[pos]) == key;
+        if (found && out_record) {
+            length = copy_packed(meta, leaf, count, pos, buf);
+        }
+    } else {
+        length = -1;
+    }
+    pager_unpin(meta->rt.pager, &page);
+
+    if (!version_validate(latch_version(latches, leaf_id), seen) ||
+        !version_validate(&latches->tree_version, tree_seen) || length < 0) {
+        return BPLUS_CONFLICT;
+    }
+    if (!found) {
+        return -1;
+    }
+    if (out_record) {
+        bplus_unpack(meta, buf, out_record);
+    }
+    return 0;
+}
+
+int bplus_optimistic_next(const BPlusMetaImpl *meta, OptimisticCursor *cursor, int hi, char *buf) {
+    TreeLatches *latches = meta->rt.latches;
+    if (cursor->done || cursor->from > hi) {
+        return -1;
+    }
+    unsigned int tree_seen = version_read(&latches->tree_version);
+    if (tree_seen & 1) return BPLUS_CONFLICT;
+
+    if (cursor->leaf == -1) {
+        int ret = descend(meta, cursor->from, 1, &cursor->leaf, &cursor->version);
+        if (ret != 0) {
+            cursor->leaf = -1;
+            return ret;
+        }
+    }
+
+    while (1) {
+        Page page;
+        if (pager_get_hinted(meta->rt.pager, cursor->leaf, PAGER_HINT_SEQUENTIAL, &page) != 0) {
+            cursor->leaf = -1;
+            return -1;
+        }
+        const DataNode *leaf = (const DataNode*)page.data;
+        int count = READ_ONCE(leaf->count);
+        int pos = 0;
+        int key = 0;
+        int length = 0;
+        int next = -1;
+        if (count >= 0 && count <= leaf_max_count(meta)) {
+            pos = search_lower_bound(datanode_keys(leaf), count, cursor->from);
+            if (pos < count) {
+                key = READ_ONCE(datanode_keys(leaf)[pos]);
+                if (key <= hi) length = copy_packed(meta, leaf, count, pos, buf);
+            } else {
+                next = READ_ONCE(leaf->next_block_id);
+            }
+        } else {
+            length = -1;
+        }
+        pager_unpin(meta->rt.pager, &page);
+
+        unsigned int *version = latch_version(latches, cursor->leaf);
+        if (!version_validate(version, cursor->version) ||
+            !version_validate(&latches->tree_version, tree_seen) || length < 0) {
+            // start over from the root for the same key
+            cursor->leaf = -1;
+            return BPLUS_CONFLICT;
+        }
+
+        if (pos < count) {
+            if (key > hi) {
+                cursor->done = 1;
+                return -1;
+            }
+            if (key == hi) cursor->done = 1;
+            else cursor->from = key + 1;
+            return length;
+        }
+
+        // nothing left here, on to the next leaf in the chain
+        if (next == -1) {
+            cursor->done = 1;
+            return -1;
+        }
+        unsigned int *next_version = latch_version(latches, next);
+        unsigned int next_seen = version_read(next_version);
+        if ((next_seen & 1) || !version_validate(version, cursor->version)) {
+            cursor->leaf = -1;
+            return BPLUS_CONFLICT;
+        }
+        cursor->leaf = next;
+        cursor->version = next_seen;
+    }
+}
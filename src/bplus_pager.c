@@ -0,0 +1,135 @@
+/**
+ * picks the page manager backend for a page size
+ */
+
+#include "bplus_pager.h"
+#include "bf.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+// libbf keeps one buffer for all files, so all its pagers share a lock
+static pthread_mutex_t bf_lock = PTHREAD_MUTEX_INITIALIZER;
+
+int pager_page_size_valid(int page_size) {
+    if (page_size == BF_BLOCK_SIZE) {
+        return 1;
+    }
+    return page_size >= PAGER_NATIVE_MIN_PAGE_SIZE && page_size <= PAGER_NATIVE_MAX_PAGE_SIZE &&
+           (page_size & (page_size - 1)) == 0;
+}
+
+Pager *pager_create(const char *fileName, int page_size, const PagerConfig *config) {
+    if (!pager_page_size_valid(page_size)) {
+        printf("Error: unsupported page size %d\n", page_size);
+        return NULL;
+    }
+    if (page_size == BF_BLOCK_SIZE) {
+        return pager_bf_open(fileName, 1);
+    }
+    return pager_native_open(fileName, page_size, config, 1);
+}
+
+Pager *pager_open(const char *fileName, int page_size, const PagerConfig *config) {
+    if (!pager_page_size_valid(page_size)) {
+        printf("Error: unsupported page size %d\n", page_size);
+        return NULL;
+    }
+    if (page_size == BF_BLOCK_SIZE) {
+        return pager_bf_open(fileName, 0);
+    }
+    return pager_native_open(fileName, page_size, config, 0);
+}
+
+// both backends keep page 0 at the start of the file
+int pager_peek(const char *fileName, void *buf, int n) {
+    FILE *f = fopen(fileName, "rb");
+    if (f == NULL) {
+        return -1;
+    }
+    size_t got = fread(buf, 1, n, f);
+    fclose(f);
+    return got == (size_t)n ? 0 : -1;
+}
+
+static int locked_get(Pager *pager, int id, PagerHint hint, Page *page) {
+    pthread_mutex_lock(pager->lock);
+    int ret = pager->backend_ops->get(pager, id, hint, page);
+    pthread_mutex_unlock(pager->lock);
+    return ret;
+}
+
+static int locked_allocate(Pager *pager, Page *page) {
+    pthread_mutex_lock(pager->lock);
+    int ret = pager->backend_ops->allocate(pager, page);
+    pthread_mutex_unlock(pager->lock);
+    return ret;
+}
+
+static void locked_set_dirty(Pager *pager, Page *page) {
+    pthread_mutex_lock(pager->lock);
+    pager->backend_ops->set_dirty(pager, page);
+    pthread_mutex_unlock(pager->lock);
+}
+
+static void locked_unpin(Pager *pager, Page *page) {
+    pthread_mutex_lock(pager->lock);
+    pager->backend_ops->unpin(pager, page);
+    pthread_mutex_unlock(pager->lock);
+}
+
+static int locked_page_count(Pager *pager) {
+    pthread_mutex_lock(pager->lock);
+    int ret = pager->backend_ops->page_count(pager);
+    pthread_mutex_unlock(pager->lock);
+    return ret;
+}
+
+static int locked_close(Pager *pager) {
+    // the backend frees the pager, keep what is needed afterwards
+    pthread_mutex_t *lock = pager->lock;
+    pthread_mutex_lock(lock);
+    int ret = pager->backend_ops->close(pager);
+    pthread_mutex_unlock(lock);
+    if (lock != &bf_lock) {
+        pthread_mutex_destroy(lock);
+        free(lock);
+    }
+    return ret;
+}
+
+static void locked_set_lsn(Pager *pager, Page *page, long lsn) {
+    pthread_mutex_lock(pager->lock);
+    pager->backend_ops->set_lsn(pager, page, lsn);
+    pthread_mutex_unlock(pager->lock);
+}
+
+static int locked_sync(Pager *pager) {
+    pthread_mutex_lock(pager->lock);
+    int ret = pager->backend_ops->sync(pager);
+    pthread_mutex_unlock(pager->lock);
+    return ret;
+}
+
+static const PagerOps locked_ops = {
+    locked_get, locked_allocate, locked_set_dirty, locked_unpin, locked_page_count, locked_close,
+    locked_set_lsn, locked_sync
+};
+
+int pager_make_thread_safe(Pager *pager) {
+    if (pager->read_only || pager->lock != NULL) {
+        // a read-only mapping needs no lock
+        return 0;
+    }
+    if (pager->page_size == BF_BLOCK_SIZE) {
+        pager->lock = &bf_lock;
+    } else {
+        pager->lock = malloc(sizeof(pthread_mutex_t));
+        if (pager->lock == NULL) {
+            return -1;
+        }
+        pthread_mutex_init(pager->lock, NULL);
+    }
+    pager->backend_ops = pager->ops;
+    pager->ops = &locked_ops;
+    return 0;
+}
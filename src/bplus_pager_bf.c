@@ -0,0 +1,301 @@
+/**
+ * page manager backend on top of libbf, pages are BF_BLOCK_SIZE blocks
+ */
+
+#include "bplus_pager.h"
+#include "bplus_wal.h"
+#include "bf.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// a block pinned through the pager
+// libbf does not count pins, the first BF_UnpinBlock of a block makes it
+// evictable, so a block pinned twice (e.g. by two threads) is pinned once
+// in libbf and counted here.
+// libbf writes a block back whenever it evicts it, so with a log a block
+// stays pinned in libbf after its last unpin until the records of its
+// changes are on disk (held, pins is 0 then)
+typedef struct {
+  int id;
+  int pins;
+  BF_Block *block;
+  long lsn;   // log records up to here changed the block, 0 if none
+} BFPinned;
+
+typedef struct {
+  Pager base;
+  // idle BF_Block handles kept for reuse, so a descent does not
+  // allocate and free one handle per node it visits
+  BF_Block **handles;
+  int count;
+  int capacity;
+  BFPinned *pinned;   // few at a time, searched linearly
+  int npinned;
+  int pinned_capacity;
+  int nheld;          // entries of pinned only waiting for the log
+  char *file_name;    // to reopen the file when syncing it
+} BFPager;
+
+// handles made up front, enough for a descent of a few levels
+#define BF_PAGER_INITIAL_HANDLES 16
+
+// held blocks before the log is forced to let them go, libbf has
+// BF_BUFFER_SIZE blocks for all files
+#define BF_PAGER_MAX_HELD 32
+
+static BF_Block *handle_get(BFPager *pager) {
+    if (pager->count > 0) {
+        return pager->handles[--pager->count];
+    }
+    BF_Block *b;
+    BF_Block_Init(&b);
+    return b;
+}
+
+static void handle_put(BFPager *pager, BF_Block *b) {
+    if (pager->count == pager->capacity) {
+        // only grows past the deepest pinning seen so far
+        int capacity = pager->capacity * 2;
+        BF_Block **handles = realloc(pager->handles, capacity * sizeof(BF_Block*));
+        if (handles == NULL) {
+            BF_Block_Destroy(&b);
+            return;
+        }
+        pager->handles = handles;
+        pager->capacity = capacity;
+    }
+    pager->handles[pager->count++] = b;
+}
+
+static int pinned_add(BFPager *pager, int id, BF_Block *b) {
+    if (pager->npinned == pager->pinned_capacity) {
+        int capacity = pager->pinned_capacity * 2;
+        BFPinned *pinned = realloc(pager->pinned, capacity * sizeof(BFPinned));
+        if (pinned == NULL) {
+            return -1;
+        }
+        pager->pinned = pinned;
+        pager->pinned_capacity = capacity;
+    }
+    BFPinned *p = &pager->pinned[pager->npinned++];
+    p->id = id;
+    p->pins = 1;
+    p->block = b;
+    p->lsn = 0;
+    return 0;
+}
+
+static void pinned_remove(BFPager *pager, int i) {
+    BF_UnpinBlock(pager->pinned[i].block);
+    handle_put(pager, pager->pinned[i].block);
+    pager->pinned[i] = pager->pinned[--pager->npinned];
+}
+
+// unpin the held blocks whose log records are on disk by now
+static void release_held(BFPager *pager) {
+    if (pager->nheld == 0) {
+        return;
+    }
+    long durable = wal_durable(pager->base.wal);
+    for (int i = pager->npinned - 1; i >= 0; i--) {
+        if (pager->pinned[i].pins == 0 && pager->pinned[i].lsn <= durable) {
+            pinned_remove(pager, i);
+            pager->nheld--;
+        }
+    }
+}
+
+// force the log past every held block and let them all go
+static int release_all_held(BFPager *pager) {
+    long lsn = 0;
+    for (int i = 0; i < pager->npinned; i++) {
+        if (pager->pinned[i].pins == 0 && pager->pinned[i].lsn > lsn) lsn = pager->pinned[i].lsn;
+    }
+    if (lsn > 0 && wal_force(pager->base.wal, lsn) != 0) {
+        return -1;
+    }
+    release_held(pager);
+    return 0;
+}
+
+static int bf_get(Pager *base, int id, PagerHint hint, Page *page) {
+    (void)hint;
+    BFPager *pager = (BFPager*)base;
+    for (int i = 0; i < pager->npinned; i++) {
+        if (pager->pinned[i].id == id) {
+            if (pager->pinned[i].pins++ == 0) pager->nheld--;
+            page->data = BF_Block_GetData(pager->pinned[i].block);
+            page->id = id;
+            page->frame = pager->pinned[i].block;
+            return 0;
+        }
+    }
+
+    BF_Block *b = handle_get(pager);
+    STATS_ADD(base->stats.reads, 1);
+    BF_ErrorCode code = BF_GetBlock(base->fd, id, b);
+    if (code != BF_OK) {
+        BF_PrintError(code);
+        handle_put(pager, b);
+        return -1;
+    }
+    if (pinned_add(pager, id, b) != 0) {
+        BF_UnpinBlock(b);
+        handle_put(pager, b);
+        return -1;
+    }
+    page->data = BF_Block_GetData(b);
+    page->id = id;
+    page->frame = b;
+    return 0;
+}
+
+static int bf_allocate(Pager *base, Page *page) {
+    BFPager *pager = (BFPager*)base;
+    BF_Block *b = handle_get(pager);
+    BF_ErrorCode code = BF_AllocateBlock(base->fd, b);
+    int blocks;
+    if (code == BF_OK) {
+        code = BF_GetBlockCounter(base->fd, &blocks);
+        if (code != BF_OK) BF_UnpinBlock(b);
+    }
+    if (code == BF_OK && pinned_add(pager, blocks - 1, b) != 0) {
+        BF_UnpinBlock(b);
+        code = BF_ERROR;
+    }
+    if (code != BF_OK) {
+        BF_PrintError(code);
+        handle_put(pager, b);
+        return -1;
+    }
+    page->data = BF_Block_GetData(b);
+    page->id = blocks - 1;
+    page->frame = b;
+    return 0;
+}
+
+static void bf_set_dirty(Pager *base, Page *page) {
+    (void)base;
+    BF_Block_SetDirty((BF_Block*)page->frame);
+}
+
+static void bf_unpin(Pager *base, Page *page) {
+    BFPager *pager = (BFPager*)base;
+    for (int i = 0; i < pager->npinned; i++) {
+        if (pager->pinned[i].block != page->frame) continue;
+        if (--pager->pinned[i].pins == 0) {
+            if (base->wal && pager->pinned[i].lsn > 0) {
+                pager->nheld++;
+            } else {
+                pinned_remove(pager, i);
+            }
+        }
+        break;
+    }
+    page->frame = NULL;
+    if (base->wal) {
+        release_held(pager);
+        if (pager->nheld > BF_PAGER_MAX_HELD) release_all_held(pager);
+    }
+}
+
+static void bf_set_lsn(Pager *base, Page *page, long lsn) {
+    BFPager *pager = (BFPager*)base;
+    for (int i = 0; i < pager->npinned; i++) {
+        if (pager->pinned[i].block == page->frame) {
+            if (lsn > pager->pinned[i].lsn) pager->pinned[i].lsn = lsn;
+            break;
+        }
+    }
+}
+
+// libbf only writes a file back when it is closed, so close and reopen it
+static int bf_sync(Pager *base) {
+    BFPager *pager = (BFPager*)base;
+    if (base->wal && release_all_held(pager) != 0) {
+        return -1;
+    }
+    if (pager->npinned > 0) {
+        fprintf(stderr, "Error: %d blocks of %s are pinned\n", pager->npinned, pager->file_name);
+        return -1;
+    }
+    BF_ErrorCode code = BF_CloseFile(base->fd);
+    if (code == BF_OK) code = BF_OpenFile(pager->file_name, &base->fd);
+    if (code != BF_OK) {
+        BF_PrintError(code);
+        return -1;
+    }
+    int fd = open(pager->file_name, O_RDONLY);
+    int ret = fd >= 0 && fsync(fd) == 0 ? 0 : -1;
+    if (ret != 0) perror(pager->file_name);
+    if (fd >= 0) close(fd);
+    return ret;
+}
+
+static int bf_page_count(Pager *base) {
+    int blocks;
+    if (BF_GetBlockCounter(base->fd, &blocks) != BF_OK) return -1;
+    return blocks;
+}
+
+static int bf_close(Pager *base) {
+    BFPager *pager = (BFPager*)base;
+    int ret = 0;
+    if (base->wal && release_all_held(pager) != 0) ret = -1;
+    if (BF_CloseFile(base->fd) != BF_OK) ret = -1;
+    for (int i = 0; i < pager->count; i++) {
+        BF_Block_Destroy(&pager->handles[i]);
+    }
+    free(pager->handles);
+    free(pager->pinned);
+    free(pager->file_name);
+    free(pager);
+    return ret;
+}
+
+static const PagerOps bf_ops = {
+    bf_get, bf_allocate, bf_set_dirty, bf_unpin, bf_page_count, bf_close,
+    bf_set_lsn, bf_sync
+};
+
+Pager *pager_bf_open(const char *fileName, int create) {
+    BFPager *pager = calloc(1, sizeof(BFPager));
+    if (pager == NULL) {
+        return NULL;
+    }
+    pager->handles = malloc(BF_PAGER_INITIAL_HANDLES * sizeof(BF_Block*));
+    pager->pinned = malloc(BF_PAGER_INITIAL_HANDLES * sizeof(BFPinned));
+    pager->file_name = strdup(fileName);
+    if (pager->handles == NULL || pager->pinned == NULL || pager->file_name == NULL) {
+        free(pager->handles);
+        free(pager->pinned);
+        free(pager->file_name);
+        free(pager);
+        return NULL;
+    }
+    pager->capacity = BF_PAGER_INITIAL_HANDLES;
+    pager->pinned_capacity = BF_PAGER_INITIAL_HANDLES;
+
+    BF_ErrorCode code = create ? BF_CreateFile(fileName) : BF_OK;
+    if (code == BF_OK) code = BF_OpenFile(fileName, &pager->base.fd);
+    if (code != BF_OK) {
+        BF_PrintError(code);
+        free(pager->handles);
+        free(pager->pinned);
+        free(pager->file_name);
+        free(pager);
+        return NULL;
+    }
+
+    // fill it now so the first operations do not allocate either
+    while (pager->count < pager->capacity) {
+        BF_Block_Init(&pager->handles[pager->count]);
+        pager->count++;
+    }
+    pager->base.ops = &bf_ops;
+    pager->base.page_size = BF_BLOCK_SIZE;
+    return &pager->base;
+}
@@ -0,0 +1,125 @@
+/**
+ * read-only page manager backend, the whole file is mapped and pages
+ * are addressed in place. the OS page cache is the buffer pool, so
+ * get hands out a pointer into the mapping and unpin has nothing to do
+ */
+
+#include "bplus_pager.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// pages asked to be read ahead when a sequential read leaves the last window
+#define MMAP_READAHEAD_PAGES 64
+
+typedef struct {
+  Pager base;
+  char *map;
+  size_t length;
+  int npages;
+  int ahead_end;   // first page past the last read-ahead window
+} MmapPager;
+
+static int mmap_get(Pager *base, int id, PagerHint hint, Page *page) {
+    MmapPager *pager = (MmapPager*)base;
+    if (id < 0 || id >= pager->npages) {
+        fprintf(stderr, "Error: page %d is past the end of the file\n", id);
+        return -1;
+    }
+    char *data = pager->map + (size_t)id * base->page_size;
+    if (hint == PAGER_HINT_SEQUENTIAL && (id >= pager->ahead_end || id + MMAP_READAHEAD_PAGES < pager->ahead_end)) {
+        // one madvise per window rather than per page
+        int end = id + MMAP_READAHEAD_PAGES < pager->npages ? id + MMAP_READAHEAD_PAGES : pager->npages;
+        madvise(data, (size_t)(end - id) * base->page_size, MADV_WILLNEED);
+        pager->ahead_end = end;
+    }
+    page->data = data;
+    page->id = id;
+    page->frame = data;  // never NULL, views test it to know they hold a page
+    return 0;
+}
+
+static int mmap_allocate(Pager *base, Page *page) {
+    (void)base;
+    (void)page;
+    fprintf(stderr, "Error: file is open read-only\n");
+    return -1;
+}
+
+static void mmap_set_dirty(Pager *base, Page *page) {
+    (void)base;
+    (void)page;
+}
+
+static void mmap_unpin(Pager *base, Page *page) {
+    (void)base;
+    page->frame = NULL;
+}
+
+static int mmap_page_count(Pager *base) {
+    return ((MmapPager*)base)->npages;
+}
+
+static int mmap_close(Pager *base) {
+    MmapPager *pager = (MmapPager*)base;
+    int ret = munmap(pager->map, pager->length) == 0 ? 0 : -1;
+    if (close(base->fd) != 0) ret = -1;
+    free(pager);
+    return ret;
+}
+
+static void mmap_set_lsn(Pager *base, Page *page, long lsn) {
+    (void)base;
+    (void)page;
+    (void)lsn;
+}
+
+static int mmap_sync(Pager *base) {
+    (void)base;
+    return 0;
+}
+
+static const PagerOps mmap_ops = {
+    mmap_get, mmap_allocate, mmap_set_dirty, mmap_unpin, mmap_page_count, mmap_close,
+    mmap_set_lsn, mmap_sync
+};
+
+Pager *pager_mmap_open(const char *fileName, int page_size) {
+    int fd = open(fileName, O_RDONLY);
+    if (fd < 0) {
+        perror(fileName);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size < page_size) {
+        fprintf(stderr, "Error: %s is too short for a page of %d bytes\n", fileName, page_size);
+        close(fd);
+        return NULL;
+    }
+
+    MmapPager *pager = calloc(1, sizeof(MmapPager));
+    if (pager == NULL) {
+        close(fd);
+        return NULL;
+    }
+    pager->npages = (int)(st.st_size / page_size);
+    pager->length = (size_t)pager->npages * page_size;
+    pager->map = mmap(NULL, pager->length, PROT_READ, MAP_SHARED, fd, 0);
+    if (pager->map == MAP_FAILED) {
+        perror("mmap");
+        free(pager);
+        close(fd);
+        return NULL;
+    }
+    // lookups jump around the file, the kernel should not read ahead for them
+    madvise(pager->map, pager->length, MADV_RANDOM);
+
+    pager->base.ops = &mmap_ops;
+    pager->base.page_size = page_size;
+    pager->base.fd = fd;
+    pager->base.read_only = 1;
+    return &pager->base;
+}
@@ -0,0 +1,294 @@
+/**
+ * native page manager backend: own buffer pool, pread/pwrite I/O
+ * pages of 4 KiB to 64 KiB, the file is just the pages back to back
+ */
+
+#define _GNU_SOURCE
+#include "bplus_pager.h"
+#include "bplus_replacer.h"
+#include "bplus_wal.h"
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+typedef struct {
+  int page_id;     // -1 if the frame holds no page
+  int pins;
+  int dirty;
+  int hash_next;   // next frame in the same hash bucket, -1 ends the chain
+  long lsn;        // log records up to here changed the page, 0 if none
+} Frame;
+
+typedef struct {
+  Pager base;
+  int page_count;
+  int nframes;
+  char *memory;      // nframes pages
+  Frame *frames;
+  int *buckets;      // page id -> first frame of the chain
+  int nbuckets;      // power of two
+  int *free_frames;  // stack of frames holding no page
+  int nfree;
+  Replacer *replacer;
+} NativePager;
+
+// never fewer frames than a deep descent with splits can pin at once
+#define NATIVE_MIN_FRAMES 64
+
+static unsigned int bucket_of(const NativePager *pager, int page_id) {
+    return ((unsigned int)page_id * 2654435761u) & (pager->nbuckets - 1);
+}
+
+static char *frame_data(const NativePager *pager, int f) {
+    return pager->memory + (size_t)f * pager->base.page_size;
+}
+
+static int lookup(const NativePager *pager, int page_id) {
+    int f = pager->buckets[bucket_of(pager, page_id)];
+    while (f != -1 && pager->frames[f].page_id != page_id) {
+        f = pager->frames[f].hash_next;
+    }
+    return f;
+}
+
+static void hash_insert(NativePager *pager, int f) {
+    unsigned int b = bucket_of(pager, pager->frames[f].page_id);
+    pager->frames[f].hash_next = pager->buckets[b];
+    pager->buckets[b] = f;
+}
+
+static void hash_remove(NativePager *pager, int f) {
+    int *link = &pager->buckets[bucket_of(pager, pager->frames[f].page_id)];
+    while (*link != f) {
+        link = &pager->frames[*link].hash_next;
+    }
+    *link = pager->frames[f].hash_next;
+}
+
+static int frame_pinned(void *ctx, int f) {
+    return ((NativePager*)ctx)->frames[f].pins > 0;
+}
+
+static int write_frame(NativePager *pager, int f) {
+    Frame *fr = &pager->frames[f];
+    // write-ahead: the records of its changes go to disk before the page
+    if (pager->base.wal && fr->lsn > 0 && wal_force(pager->base.wal, fr->lsn) != 0) {
+        return -1;
+    }
+    off_t offset = (off_t)fr->page_id * pager->base.page_size;
+    if (pwrite(pager->base.fd, frame_data(pager, f), pager->base.page_size, offset) != pager->base.page_size) {
+        perror("pwrite");
+        return -1;
+    }
+    fr->dirty = 0;
+    fr->lsn = 0;
+    return 0;
+}
+
+// a frame for a new page, a free one or the one the replacement policy
+// gives up, written back first if dirty. -1 if every frame is pinned
+static int take_frame(NativePager *pager) {
+    int f;
+    if (pager->nfree > 0) {
+        f = pager->free_frames[--pager->nfree];
+    } else {
+        f = replacer_victim(pager->replacer, frame_pinned, pager);
+        if (f == -1) {
+            fprintf(stderr, "Error: all %d buffer frames are pinned\n", pager->nframes);
+            return -1;
+        }
+        if (pager->frames[f].dirty && write_frame(pager, f) != 0) return -1;
+        replacer_on_evict(pager->replacer, f, pager->frames[f].page_id);
+        hash_remove(pager, f);
+    }
+    pager->frames[f].page_id = -1;
+    pager->frames[f].pins = 0;
+    pager->frames[f].dirty = 0;
+    pager->frames[f].lsn = 0;
+    return f;
+}
+
+// pin frame f and fill in page
+static void pin_frame(NativePager *pager, int f, Page *page) {
+    Frame *fr = &pager->frames[f];
+    fr->pins++;
+    page->data = frame_data(pager, f);
+    page->id = fr->page_id;
+    page->frame = fr;
+}
+
+static int native_get(Pager *base, int id, PagerHint hint, Page *page) {
+    NativePager *pager = (NativePager*)base;
+    if (id < 0 || id >= pager->page_count) {
+        fprintf(stderr, "Error: page %d is out of range\n", id);
+        return -1;
+    }
+    int f = lookup(pager, id);
+    if (f != -1) {
+        replacer_on_hit(pager->replacer, f, hint);
+        pin_frame(pager, f, page);
+        return 0;
+    }
+
+    f = take_frame(pager);
+    if (f == -1) return -1;
+    char *data = frame_data(pager, f);
+    STATS_ADD(base->stats.reads, 1);
+    ssize_t n = pread(base->fd, data, base->page_size, (off_t)id * base->page_size);
+    if (n < 0) {
+        perror("pread");
+        pager->free_frames[pager->nfree++] = f;
+        return -1;
+    }
+    // a page that was allocated but never written back reads as zeros
+    if (n < base->page_size) {
+        memset(data + n, 0, base->page_size - n);
+    }
+    pager->frames[f].page_id = id;
+    hash_insert(pager, f);
+    replacer_on_load(pager->replacer, f, id, hint);
+    pin_frame(pager, f, page);
+    return 0;
+}
+
+static int native_allocate(Pager *base, Page *page) {
+    NativePager *pager = (NativePager*)base;
+    int f = take_frame(pager);
+    if (f == -1) return -1;
+    memset(frame_data(pager, f), 0, base->page_size);
+    pager->frames[f].page_id = pager->page_count++;
+    pager->frames[f].dirty = 1;
+    hash_insert(pager, f);
+    replacer_on_load(pager->replacer, f, pager->frames[f].page_id, PAGER_HINT_NORMAL);
+    pin_frame(pager, f, page);
+    return 0;
+}
+
+static void native_set_dirty(Pager *base, Page *page) {
+    (void)base;
+    ((Frame*)page->frame)->dirty = 1;
+}
+
+static void native_unpin(Pager *base, Page *page) {
+    (void)base;
+    ((Frame*)page->frame)->pins--;
+    page->frame = NULL;
+}
+
+static int native_page_count(Pager *base) {
+    return ((NativePager*)base)->page_count;
+}
+
+static void native_set_lsn(Pager *base, Page *page, long lsn) {
+    (void)base;
+    Frame *fr = (Frame*)page->frame;
+    if (lsn > fr->lsn) fr->lsn = lsn;
+}
+
+static int write_dirty(NativePager *pager) {
+    int ret = 0;
+    for (int f = 0; f < pager->nframes; f++) {
+        if (pager->frames[f].page_id != -1 && pager->frames[f].dirty && write_frame(pager, f) != 0) {
+            ret = -1;
+        }
+    }
+    return ret;
+}
+
+static int native_sync(Pager *base) {
+    int ret = write_dirty((NativePager*)base);
+    if (fdatasync(base->fd) != 0) {
+        perror("fdatasync");
+        ret = -1;
+    }
+    return ret;
+}
+
+static int native_close(Pager *base) {
+    NativePager *pager = (NativePager*)base;
+    int ret = write_dirty(pager);
+    if (close(base->fd) != 0) ret = -1;
+    free(pager->memory);
+    free(pager->frames);
+    free(pager->buckets);
+    free(pager->free_frames);
+    replacer_destroy(pager->replacer);
+    free(pager);
+    return ret;
+}
+
+static const PagerOps native_ops = {
+    native_get, native_allocate, native_set_dirty, native_unpin, native_page_count, native_close,
+    native_set_lsn, native_sync
+};
+
+Pager *pager_native_open(const char *fileName, int page_size, const PagerConfig *config, int create) {
+    if (page_size < PAGER_NATIVE_MIN_PAGE_SIZE || page_size > PAGER_NATIVE_MAX_PAGE_SIZE ||
+        (page_size & (page_size - 1)) != 0) {
+        return NULL;
+    }
+    int pool_mb = config && config->pool_mb > 0 ? config->pool_mb : PAGER_DEFAULT_POOL_MB;
+    PagerPolicy policy = config ? config->policy : PAGER_POLICY_LRU;
+
+    NativePager *pager = calloc(1, sizeof(NativePager));
+    if (pager == NULL) {
+        return NULL;
+    }
+    pager->base.ops = &native_ops;
+    pager->base.page_size = page_size;
+
+    // same rule as BF_CreateFile, creating over an existing file fails
+    int flags = create ? O_RDWR | O_CREAT | O_EXCL : O_RDWR;
+    pager->base.fd = open(fileName, flags, 0644);
+    if (pager->base.fd < 0) {
+        perror(fileName);
+        free(pager);
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(pager->base.fd, &st) != 0) {
+        close(pager->base.fd);
+        free(pager);
+        return NULL;
+    }
+    pager->page_count = (int)((st.st_size + page_size - 1) / page_size);
+
+    long nframes = ((long)pool_mb << 20) / page_size;
+    if (nframes < NATIVE_MIN_FRAMES) nframes = NATIVE_MIN_FRAMES;
+    pager->nframes = (int)nframes;
+    pager->nbuckets = 1;
+    while (pager->nbuckets < 2 * pager->nframes) pager->nbuckets *= 2;
+
+    pager->memory = malloc((size_t)pager->nframes * page_size);
+    pager->frames = malloc(pager->nframes * sizeof(Frame));
+    pager->buckets = malloc(pager->nbuckets * sizeof(int));
+    pager->free_frames = malloc(pager->nframes * sizeof(int));
+    pager->replacer = replacer_create(policy, pager->nframes);
+    if (pager->memory == NULL || pager->frames == NULL || pager->buckets == NULL ||
+        pager->free_frames == NULL || pager->replacer == NULL) {
+        close(pager->base.fd);
+        free(pager->memory);
+        free(pager->frames);
+        free(pager->buckets);
+        free(pager->free_frames);
+        replacer_destroy(pager->replacer);
+        free(pager);
+        return NULL;
+    }
+    // taken from the top, so frames fill in order
+    for (int f = 0; f < pager->nframes; f++) {
+        pager->frames[f].page_id = -1;
+        pager->frames[f].pins = 0;
+        pager->frames[f].dirty = 0;
+        pager->frames[f].lsn = 0;
+        pager->free_frames[f] = pager->nframes - 1 - f;
+    }
+    pager->nfree = pager->nframes;
+    for (int i = 0; i < pager->nbuckets; i++) {
+        pager->buckets[i] = -1;
+    }
+    return &pager->base;
+}
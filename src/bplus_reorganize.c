@@ -0,0 +1,295 @@
+/**
+ * online reorganization of the leaf level
+ * random inserts take new leaves from the end of the file or the free list,
+ * so the leaf chain jumps around and a range scan reads blocks in random
+ * order. this rewrites the leaves in key order into new blocks at the end
+ * of the file, a few siblings at a time, packing them to a fill factor on
+ * the way. each group is one change of the tree, so the calls can be
+ * spread out between other requests
+ */
+
+#include "bplus_internal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// sibling leaves rewritten as one change, with a log all of them
+// and their new copies stay pinned until it is written
+#define BPLUS_REORG_GROUP 16
+
+// consecutive children of one height 2 node
+typedef struct {
+  int parent;
+  int pos;           // child index of the first one
+  int count;
+  int ids[BPLUS_REORG_GROUP];
+  int lo;            // keys of the group are >= lo
+  int lo_bounded;    // 0 if the group starts the tree
+  int hi;            // and < hi
+  int hi_bounded;    // 0 if the group ends the tree
+} ReorgGroup;
+
+// leaf whose range holds key
+static int leaf_of(const BPlusMetaImpl *meta, int key) {
+    Pager *pager = meta->rt.pager;
+    int block = meta->root_block_id;
+    for (int height = meta->height; height > 1; height--) {
+        Page page;
+        int pinned;
+        const IndexNode *node = bplus_index_read(meta, block, &page, &pinned);
+        if (node == NULL) return -1;
+        block = indexnode_get_child(node, key);
+        if (pinned) pager_unpin(pager, &page);
+    }
+    return block;
+}
+
+// the group that starts at the leaf holding from, its parent is left
+// pinned in page since the group is rewritten into it
+static int find_group(const BPlusMetaImpl *meta, int from, ReorgGroup *group, Page *page) {
+    Pager *pager = meta->rt.pager;
+    group->lo_bounded = 0;
+    group->hi_bounded = 0;
+    int block = meta->root_block_id;
+    for (int height = meta->height; height > 2; height--) {
+        Page p;
+        int pinned;
+        const IndexNode *node = bplus_index_read(meta, block, &p, &pinned);
+        if (node == NULL) return -1;
+        int pos = indexnode_find_child_index(node, from);
+        if (pos > 0) {
+            group->lo = node->keys[pos - 1];
+            group->lo_bounded = 1;
+        }
+        if (pos < node->count) {
+            group->hi = node->keys[pos];
+            group->hi_bounded = 1;
+        }
+        block = indexnode_children(node)[pos];
+        if (pinned) pager_unpin(pager, &p);
+    }
+
+    CALL_PM(pager_get(pager, block, page));
+    const IndexNode *parent = (const IndexNode*)page->data;
+    int pos = indexnode_find_child_index(parent, from);
+    int end = pos + BPLUS_REORG_GROUP;
+    if (end > parent->count + 1) end = parent->count + 1;
+    if (pos > 0) {
+        group->lo = parent->keys[pos - 1];
+        group->lo_bounded = 1;
+    }
+    if (end <= parent->count) {
+        group->hi = parent->keys[end - 1];
+        group->hi_bounded = 1;
+    }
+    group->parent = block;
+    group->pos = pos;
+    group->count = end - pos;
+    memcpy(group->ids, indexnode_children(parent) + pos, group->count * sizeof(int));
+    return 0;
+}
+
+// leaves the records of the group take when each is filled to leaf_bytes
+static int plan_leaves(const BPlusMetaImpl *meta, const ReorgGroup *group, int leaf_bytes) {
+    Pager *pager = meta->rt.pager;
+    int leaves = 1;
+    int used = 0;
+    for (int j = 0; j < group->count; j++) {
+        Page page;
+        CALL_PM(pager_get(pager, group->ids[j], &page));
+        const DataNode *leaf = (const DataNode*)page.data;
+        for (int i = 0; i < leaf->count; i++) {
+            int length;
+            datanode_packed_at(leaf, i, &length);
+            int size = length + DATANODE_SLOT_SIZE;
+            if (used > 0 && used + size > leaf_bytes) {
+                leaves++;
+                used = 0;
+            }
+            used += size;
+        }
+        pager_unpin(pager, &page);
+    }
+    return leaves;
+}
+
+// copy the records of the group into new leaves at the end of the file,
+// in the same way plan_leaves counted them, and put those in its place.
+// the old leaves go on the free list
+static int rewrite_group(BPlusMetaImpl *meta, const ReorgGroup *group, Page *parent_page,
+                         int leaf_bytes, BPlusChange *change) {
+    Pager *pager = meta->rt.pager;
+    int new_ids[BPLUS_REORG_GROUP];
+    int seps[BPLUS_REORG_GROUP];
+    int records[BPLUS_REORG_GROUP];
+    int count = 1;
+
+    Page cur;
+    CALL_PM(bplus_allocate_block_at_end(meta, &cur));
+    DataNode *out = (DataNode*)cur.data;
+    datanode_init(out, meta->page_size);
+    new_ids[0] = cur.id;
+    int next_after = -1;
+
+    for (int j = 0; j < group->count; j++) {
+        Page page;
+        CALL_PM(pager_get(pager, group->ids[j], &page));
+        const DataNode *leaf = (const DataNode*)page.data;
+        for (int i = 0; i < leaf->count; i++) {
+            int length;
+            const char *packed = datanode_packed_at(leaf, i, &length);
+            int key = datanode_key_at(leaf, i);
+            if (out->count > 0 && datanode_used_bytes(out) + DATANODE_SLOT_SIZE + length > leaf_bytes) {
+                // leaf is packed, chain the next one after it
+                Page next;
+                if (count == BPLUS_REORG_GROUP || bplus_allocate_block_at_end(meta, &next) != 0) {
+                    pager_unpin(pager, &page);
+                    pager_set_dirty(pager, &cur);
+                    bplus_change_keep(meta, change, &cur);
+                    return -1;
+                }
+                out->next_block_id = next.id;
+                records[count - 1] = out->count;
+                pager_set_dirty(pager, &cur);
+                bplus_change_keep(meta, change, &cur);
+                cur = next;
+                out = (DataNode*)cur.data;
+                datanode_init(out, meta->page_size);
+                new_ids[count] = cur.id;
+                seps[count] = key;
+                count++;
+            }
+            datanode_insert_packed(out, out->count, key, packed, length);
+        }
+        next_after = leaf->next_block_id;
+        pager_unpin(pager, &page);
+        if (bplus_free_block(meta, group->ids[j], change) != 0) {
+            pager_set_dirty(pager, &cur);
+            bplus_change_keep(meta, change, &cur);
+            return -1;
+        }
+    }
+    out->next_block_id = next_after;
+    records[count - 1] = out->count;
+    pager_set_dirty(pager, &cur);
+    bplus_change_keep(meta, change, &cur);
+
+    // the leaf before the group links to its first new leaf
+    int prev = -1;
+    if (group->pos > 0) {
+        prev = indexnode_children((const IndexNode*)parent_page->data)[group->pos - 1];
+    } else if (group->lo_bounded) {
+        prev = leaf_of(meta, group->lo - 1);
+    }
+    if (prev != -1) {
+        Page page;
+        CALL_PM(pager_get(pager, prev, &page));
+        ((DataNode*)page.data)->next_block_id = new_ids[0];
+        pager_set_dirty(pager, &page);
+        bplus_change_keep(meta, change, &page);
+    }
+
+    // the parent gets the new leaves instead of the old ones
+    IndexNode *parent = (IndexNode*)parent_page->data;
+    int *children = indexnode_children(parent);
+    int pos = group->pos;
+    int tail = pos + group->count;
+    memmove(parent->keys + pos + count - 1, parent->keys + tail - 1, (parent->count - tail + 1) * sizeof(int));
+    memmove(children + pos + count, children + tail, (parent->count + 1 - tail) * sizeof(int));
+    for (int i = 0; i < count; i++) {
+        children[pos + i] = new_ids[i];
+        if (i > 0) parent->keys[pos + i - 1] = seps[i];
+    }
+    if (parent->counted) {
+        // the group holds as many records as before, only its own slots change
+        int *counts = indexnode_counts(parent);
+        memmove(counts + pos + count, counts + tail, (parent->count + 1 - tail) * sizeof(int));
+        memcpy(counts + pos, records, count * sizeof(int));
+    }
+    parent->count -= group->count - count;
+    // new leaves and separators, whatever was kept for appends is stale
+    bplus_forget_rightmost(meta);
+    bplus_index_cache_sync(meta, group->parent, 2, parent);
+    pager_set_dirty(pager, parent_page);
+    bplus_change_keep(meta, change, parent_page);
+
+    if (group->parent == meta->root_block_id && parent->count == 0) {
+        // every leaf went into one, it becomes the root
+        meta->root_block_id = new_ids[0];
+        meta->height--;
+        STATS_ADD(meta->rt.stats.height_changes, 1);
+        change->root_changed = 1;
+        if (bplus_free_block(meta, group->parent, change) != 0) return -1;
+        if (meta->rt.wal == NULL && bplus_meta_store(meta) != 0) return -1;
+        if (bplus_index_cache_reload(meta) != 0) return -1;
+    }
+    return 0;
+}
+
+int bplus_reorganize(int file_desc, BPlusMeta *metadata, double fill_factor, int max_leaves) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (meta->rt.pager->read_only) {
+        fprintf(stderr, "Error: file is open read-only\n");
+        return -1;
+    }
+    if (fill_factor <= 0.0 || fill_factor > 1.0) {
+        return -1;
+    }
+    int fill_bytes = (int)(meta->leaf_capacity * fill_factor);
+
+    // leaves move and blocks get freed, so this runs alone like a delete
+    bplus_tree_enter(meta, 1);
+    if (meta->rt.latches) version_write_begin(&meta->rt.latches->tree_version);
+    int ret = 0;
+    int more = meta->height > 1;
+    int seen = 0;
+    long lsn = 0;
+    while (more && (max_leaves <= 0 || seen < max_leaves)) {
+        ReorgGroup group;
+        Page parent;
+        if (find_group(meta, meta->rt.reorg_from, &group, &parent) != 0) {
+            ret = -1;
+            break;
+        }
+        int consecutive = 1;
+        for (int j = 1; j < group.count; j++) {
+            if (group.ids[j] != group.ids[j - 1] + 1) consecutive = 0;
+        }
+        // records that are packed fuller than asked stay as full as they are
+        int leaf_bytes = fill_bytes;
+        int leaves = plan_leaves(meta, &group, leaf_bytes);
+        if (leaves > group.count) {
+            leaf_bytes = meta->leaf_capacity;
+            leaves = plan_leaves(meta, &group, leaf_bytes);
+        }
+
+        if (leaves < 0) {
+            pager_unpin(meta->rt.pager, &parent);
+            ret = -1;
+        } else if (consecutive && leaves == group.count) {
+            // in order already and nothing to pack
+            pager_unpin(meta->rt.pager, &parent);
+        } else {
+            BPlusChange change;
+            bplus_change_init(&change);
+            ret = rewrite_group(meta, &group, &parent, leaf_bytes, &change);
+            long change_lsn = bplus_change_log(meta, &change);
+            if (change_lsn < 0) ret = -1;
+            else if (change_lsn > 0) lsn = change_lsn;
+        }
+        if (ret != 0) {
+            break;
+        }
+        seen += group.count;
+        more = group.hi_bounded && meta->height > 1;
+        meta->rt.reorg_from = more ? group.hi : INT_MIN;
+    }
+    if (meta->rt.latches) version_write_end(&meta->rt.latches->tree_version);
+    bplus_tree_leave(meta);
+
+    if (ret == 0 && bplus_log_commit(meta, lsn) != 0) {
+        ret = -1;
+    }
+    return ret != 0 ? -1 : more;
+}
@@ -0,0 +1,264 @@
+/**
+ * buffer replacement policies for the native page manager
+ *   LRU:   one recency list, evict from the cold end
+ *   CLOCK: reference bit per frame and a sweeping hand
+ *   2Q:    pages seen once wait in a fifo (a1in), pages evicted from it
+ *          are remembered by id (a1out). a page referenced again while in
+ *          a1in or remembered in a1out enters the lru (am). one pass over
+ *          many pages cycles through a1in and leaves am alone
+ * pages read with PAGER_HINT_SEQUENTIAL go to the cold end and are not
+ * remembered, so a scan does not even make it into a1out
+ */
+
+#include "bplus_replacer.h"
+#include <stdlib.h>
+
+// list a frame is on
+enum {
+  QUEUE_NONE = 0,
+  QUEUE_AM,       // lru list, the only list of LRU
+  QUEUE_A1IN,     // 2Q fifo
+  QUEUE_CLOCK     // resident under CLOCK, no list
+};
+
+typedef struct {
+  int head;       // cold end, evicted first
+  int tail;
+  int count;
+} FrameList;
+
+struct Replacer {
+  PagerPolicy policy;
+  int nframes;
+  int *prev;           // list links, per frame
+  int *next;
+  char *queue;         // QUEUE_* per frame
+  char *ref;           // CLOCK reference bits
+  char *sequential;    // loaded with the sequential hint and not hit normally since
+  int hand;            // CLOCK position
+  FrameList am;
+  FrameList a1in;
+  int kin;             // 2Q: a1in is drained while it holds more than this
+  // 2Q a1out: ring of recently evicted page ids with a hash over the ring slots
+  int *ghost_ids;      // -1 for an empty slot
+  int *ghost_next;     // next slot in the same bucket
+  int *ghost_buckets;
+  int nghost;
+  int nghost_buckets;  // power of two
+  int ghost_pos;       // slot to overwrite next
+};
+
+static FrameList *list_of(Replacer *r, int queue) {
+    return queue == QUEUE_A1IN ? &r->a1in : &r->am;
+}
+
+static void list_push_tail(Replacer *r, int queue, int f) {
+    FrameList *l = list_of(r, queue);
+    r->prev[f] = l->tail;
+    r->next[f] = -1;
+    if (l->tail != -1) r->next[l->tail] = f;
+    else l->head = f;
+    l->tail = f;
+    l->count++;
+    r->queue[f] = (char)queue;
+}
+
+static void list_push_head(Replacer *r, int queue, int f) {
+    FrameList *l = list_of(r, queue);
+    r->prev[f] = -1;
+    r->next[f] = l->head;
+    if (l->head != -1) r->prev[l->head] = f;
+    else l->tail = f;
+    l->head = f;
+    l->count++;
+    r->queue[f] = (char)queue;
+}
+
+static void list_remove(Replacer *r, int f) {
+    FrameList *l = list_of(r, r->queue[f]);
+    if (r->prev[f] != -1) r->next[r->prev[f]] = r->next[f];
+    else l->head = r->next[f];
+    if (r->next[f] != -1) r->prev[r->next[f]] = r->prev[f];
+    else l->tail = r->prev[f];
+    l->count--;
+    r->queue[f] = QUEUE_NONE;
+}
+
+// first frame from the cold end that is not pinned
+static int list_first_unpinned(Replacer *r, const FrameList *l, ReplacerPinned pinned, void *ctx) {
+    for (int f = l->head; f != -1; f = r->next[f]) {
+        if (!pinned(ctx, f)) return f;
+    }
+    return -1;
+}
+
+static unsigned int ghost_bucket(const Replacer *r, int page_id) {
+    return ((unsigned int)page_id * 2654435761u) & (r->nghost_buckets - 1);
+}
+
+static int ghost_find(const Replacer *r, int page_id) {
+    int s = r->ghost_buckets[ghost_bucket(r, page_id)];
+    while (s != -1 && r->ghost_ids[s] != page_id) {
+        s = r->ghost_next[s];
+    }
+    return s;
+}
+
+static void ghost_remove(Replacer *r, int s) {
+    int *link = &r->ghost_buckets[ghost_bucket(r, r->ghost_ids[s])];
+    while (*link != s) {
+        link = &r->ghost_next[*link];
+    }
+    *link = r->ghost_next[s];
+    r->ghost_ids[s] = -1;
+}
+
+// remember page_id, forgetting the oldest id once the ring is full
+static void ghost_add(Replacer *r, int page_id) {
+    int s = r->ghost_pos;
+    r->ghost_pos = (r->ghost_pos + 1) % r->nghost;
+    if (r->ghost_ids[s] != -1) ghost_remove(r, s);
+    r->ghost_ids[s] = page_id;
+    unsigned int b = ghost_bucket(r, page_id);
+    r->ghost_next[s] = r->ghost_buckets[b];
+    r->ghost_buckets[b] = s;
+}
+
+Replacer *replacer_create(PagerPolicy policy, int nframes) {
+    Replacer *r = calloc(1, sizeof(Replacer));
+    if (r == NULL) {
+        return NULL;
+    }
+    r->policy = policy;
+    r->nframes = nframes;
+    r->prev = malloc(nframes * sizeof(int));
+    r->next = malloc(nframes * sizeof(int));
+    r->queue = calloc(nframes, 1);
+    r->ref = calloc(nframes, 1);
+    r->sequential = calloc(nframes, 1);
+    r->am.head = r->am.tail = -1;
+    r->a1in.head = r->a1in.tail = -1;
+    // sizes suggested for 2Q: a quarter of the pool for a1in,
+    // ids of half a pool of evicted pages in a1out
+    r->kin = nframes / 4 > 0 ? nframes / 4 : 1;
+    r->nghost = nframes / 2 > 0 ? nframes / 2 : 1;
+    r->nghost_buckets = 1;
+    while (r->nghost_buckets < 2 * r->nghost) r->nghost_buckets *= 2;
+    r->ghost_ids = malloc(r->nghost * sizeof(int));
+    r->ghost_next = malloc(r->nghost * sizeof(int));
+    r->ghost_buckets = malloc(r->nghost_buckets * sizeof(int));
+    if (r->prev == NULL || r->next == NULL || r->queue == NULL || r->ref == NULL ||
+        r->sequential == NULL || r->ghost_ids == NULL || r->ghost_next == NULL || r->ghost_buckets == NULL) {
+        replacer_destroy(r);
+        return NULL;
+    }
+    for (int i = 0; i < r->nghost; i++) {
+        r->ghost_ids[i] = -1;
+    }
+    for (int i = 0; i < r->nghost_buckets; i++) {
+        r->ghost_buckets[i] = -1;
+    }
+    return r;
+}
+
+void replacer_destroy(Replacer *r) {
+    if (r == NULL) {
+        return;
+    }
+    free(r->prev);
+    free(r->next);
+    free(r->queue);
+    free(r->ref);
+    free(r->sequential);
+    free(r->ghost_ids);
+    free(r->ghost_next);
+    free(r->ghost_buckets);
+    free(r);
+}
+
+void replacer_on_load(Replacer *r, int f, int page_id, PagerHint hint) {
+    int seq = hint == PAGER_HINT_SEQUENTIAL;
+    r->sequential[f] = (char)seq;
+    switch (r->policy) {
+    case PAGER_POLICY_CLOCK:
+        r->queue[f] = QUEUE_CLOCK;
+        r->ref[f] = (char)!seq;
+        break;
+    case PAGER_POLICY_2Q: {
+        int s = seq ? -1 : ghost_find(r, page_id);
+        if (s != -1) {
+            // seen again soon after leaving a1in, it is part of the working set
+            ghost_remove(r, s);
+            list_push_tail(r, QUEUE_AM, f);
+        } else if (seq) {
+            list_push_head(r, QUEUE_A1IN, f);
+        } else {
+            list_push_tail(r, QUEUE_A1IN, f);
+        }
+        break;
+    }
+    default:
+        if (seq) list_push_head(r, QUEUE_AM, f);
+        else list_push_tail(r, QUEUE_AM, f);
+        break;
+    }
+}
+
+void replacer_on_hit(Replacer *r, int f, PagerHint hint) {
+    if (hint == PAGER_HINT_SEQUENTIAL) {
+        // a scan passing a page others use does not make it hotter
+        return;
+    }
+    r->sequential[f] = 0;
+    switch (r->policy) {
+    case PAGER_POLICY_CLOCK:
+        r->ref[f] = 1;
+        break;
+    case PAGER_POLICY_2Q:
+        // second reference, from a1in or within am
+        list_remove(r, f);
+        list_push_tail(r, QUEUE_AM, f);
+        break;
+    default:
+        list_remove(r, f);
+        list_push_tail(r, QUEUE_AM, f);
+        break;
+    }
+}
+
+int replacer_victim(Replacer *r, ReplacerPinned pinned, void *ctx) {
+    switch (r->policy) {
+    case PAGER_POLICY_CLOCK:
+        // two sweeps clear every reference bit, a third finds nothing new
+        for (int step = 0; step < 2 * r->nframes + 1; step++) {
+            int f = r->hand;
+            r->hand = (r->hand + 1) % r->nframes;
+            if (r->queue[f] != QUEUE_CLOCK || pinned(ctx, f)) continue;
+            if (!r->ref[f]) return f;
+            r->ref[f] = 0;
+        }
+        return -1;
+    case PAGER_POLICY_2Q: {
+        int f = -1;
+        if (r->a1in.count > r->kin) f = list_first_unpinned(r, &r->a1in, pinned, ctx);
+        if (f == -1) f = list_first_unpinned(r, &r->am, pinned, ctx);
+        if (f == -1) f = list_first_unpinned(r, &r->a1in, pinned, ctx);
+        return f;
+    }
+    default:
+        return list_first_unpinned(r, &r->am, pinned, ctx);
+    }
+}
+
+void replacer_on_evict(Replacer *r, int f, int page_id) {
+    if (r->queue[f] == QUEUE_CLOCK) {
+        r->queue[f] = QUEUE_NONE;
+        return;
+    }
+    if (r->queue[f] == QUEUE_A1IN && !r->sequential[f]) {
+        ghost_add(r, page_id);
+    }
+    if (r->queue[f] != QUEUE_NONE) {
+        list_remove(r, f);
+    }
+}
@@ -0,0 +1,150 @@
+/**
+ * branch-free key search kernels
+ *
+ * long arrays are first narrowed with a branchless binary search, then
+ * the last window is counted with vector compares. counting instead of
+ * scanning for the first hit means no data dependent branches at all
+ */
+
+#include "bplus_search.h"
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SEARCH_X86 1
+#endif
+
+// windows up to this size are counted linearly
+#define SEARCH_LINEAR_MAX 64
+
+typedef int (*count_fn)(const int *keys, int n, int key);
+
+static int count_less_scalar(const int *keys, int n, int key) {
+    int cnt = 0;
+    for (int i = 0; i < n; i++) {
+        cnt += keys[i] < key;
+    }
+    return cnt;
+}
+
+static int count_greater_scalar(const int *keys, int n, int key) {
+    int cnt = 0;
+    for (int i = 0; i < n; i++) {
+        cnt += keys[i] > key;
+    }
+    return cnt;
+}
+
+#ifdef SEARCH_X86
+__attribute__((target("sse4.2,popcnt")))
+static int count_less_sse(const int *keys, int n, int key) {
+    __m128i k = _mm_set1_epi32(key);
+    int cnt = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+        cnt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(k, v))));
+    }
+    for (; i < n; i++) {
+        cnt += keys[i] < key;
+    }
+    return cnt;
+}
+
+__attribute__((target("sse4.2,popcnt")))
+static int count_greater_sse(const int *keys, int n, int key) {
+    __m128i k = _mm_set1_epi32(key);
+    int cnt = 0;
+    int i = 0;
+    for (; i + 4 <= n; i += 4) {
+        __m128i v = _mm_loadu_si128((const __m128i*)(keys + i));
+        cnt += __builtin_popcount(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(v, k))));
+    }
+    for (; i < n; i++) {
+        cnt += keys[i] > key;
+    }
+    return cnt;
+}
+
+__attribute__((target("avx2,popcnt")))
+static int count_less_avx2(const int *keys, int n, int key) {
+    __m256i k = _mm256_set1_epi32(key);
+    int cnt = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+        cnt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(k, v))));
+    }
+    for (; i < n; i++) {
+        cnt += keys[i] < key;
+    }
+    return cnt;
+}
+
+__attribute__((target("avx2,popcnt")))
+static int count_greater_avx2(const int *keys, int n, int key) {
+    __m256i k = _mm256_set1_epi32(key);
+    int cnt = 0;
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i v = _mm256_loadu_si256((const __m256i*)(keys + i));
+        cnt += __builtin_popcount(_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(v, k))));
+    }
+    for (; i < n; i++) {
+        cnt += keys[i] > key;
+    }
+    return cnt;
+}
+#endif
+
+static count_fn count_less = count_less_scalar;
+static count_fn count_greater = count_greater_scalar;
+static const char *kernel_name = "scalar";
+
+// pick the kernels once at load time, before any thread can search. a lazy
+// pick on first use would race between threads of a concurrent file
+__attribute__((constructor))
+static void search_init(void) {
+    count_fn less = count_less_scalar;
+    count_fn greater = count_greater_scalar;
+    const char *name = "scalar";
+#ifdef SEARCH_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt")) {
+        less = count_less_avx2;
+        greater = count_greater_avx2;
+        name = "avx2";
+    } else if (__builtin_cpu_supports("sse4.2") && __builtin_cpu_supports("popcnt")) {
+        less = count_less_sse;
+        greater = count_greater_sse;
+        name = "sse4.2";
+    }
+#endif
+    kernel_name = name;
+    count_greater = greater;
+    count_less = less;
+}
+
+int search_lower_bound(const int *keys, int n, int key) {
+    const int *base = keys;
+    while (n > SEARCH_LINEAR_MAX) {
+        int half = n / 2;
+        base = (base[half - 1] < key) ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - keys) + count_less(base, n, key);
+}
+
+int search_upper_bound(const int *keys, int n, int key) {
+    const int *base = keys;
+    while (n > SEARCH_LINEAR_MAX) {
+        int half = n / 2;
+        base = (base[half - 1] <= key) ? base + half : base;
+        n -= half;
+    }
+    return (int)(base - keys) + n - count_greater(base, n, key);
+}
+
+const char *search_kernel_name(void) {
+    return kernel_name;
+}
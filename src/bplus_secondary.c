@@ -0,0 +1,706 @@
+/**
+ * secondary indexes on attributes other than the primary key
+ * each one is a B+ tree file of its own next to the file, named after it
+ * and the attribute. its key is the value of the attribute, as the int made
+ * of the first bytes of its normalized form, and its record points to the
+ * head of a posting list: blocks of that file holding nothing but the
+ * primary keys of the records with the value. a value that many records
+ * share costs 4 bytes per record instead of a leaf entry each.
+ * values whose first bytes are equal share the key: the head block of each
+ * list holds its whole normalized value and the head of the next list
+ * under the same key, so every list holds one value only
+ */
+
+#include "bplus_internal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// records fetched from the file in one batched descent by a lookup
+#define SECONDARY_FETCH_BATCH 64
+
+struct SecondaryIndex {
+  int attr;               // attribute of the file it indexes
+  KeyCodec codec;         // that attribute alone
+  int file_desc;
+  BPlusMetaImpl *tree;    // value -> head block of its posting list
+  pthread_mutex_t lock;   // the tree is not opened concurrent, one thread at a time
+};
+
+// a block of a posting list
+typedef struct {
+  int next;         // next block of the list, -1 for the last one
+  int count;        // primary keys in this block
+  int tail;         // head block only: last block of the list
+  int total;        // head block only: primary keys in the whole list
+  int next_value;   // head block only: next list under the same key, -1 for none
+  unsigned char value[KEY_MAX_WIDTH];   // head block only: normalized value, zero padded
+  int keys[];
+} PostingBlock;
+
+#define POSTING_CAPACITY(page_size) (((page_size) - (int)sizeof(PostingBlock)) / (int)sizeof(int))
+
+// a primary key and the value it is listed under, for building a list
+typedef struct {
+  unsigned char value[KEY_MAX_WIDTH];   // normalized, zero padded
+  int key;
+} Posting;
+
+static int posting_cmp(const void *a, const void *b) {
+    const Posting *pa = a;
+    const Posting *pb = b;
+    int cmp = memcmp(pa->value, pb->value, KEY_MAX_WIDTH);
+    if (cmp != 0) return cmp;
+    return (pa->key > pb->key) - (pa->key < pb->key);
+}
+
+static int int_cmp(const void *a, const void *b) {
+    int x = *(const int*)a;
+    int y = *(const int*)b;
+    return (x > y) - (x < y);
+}
+
+static int attribute_index(const TableSchema *schema, const char *attr_name) {
+    for (int i = 0; i < schema->count; i++) {
+        if (strcmp(schema->attributes[i].name, attr_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+// fileName.attr.idx
+static char *index_path_of(const char *fileName, const char *attr_name) {
+    char *path = malloc(strlen(fileName) + strlen(attr_name) + 6);
+    if (path != NULL) {
+        sprintf(path, "%s.%s.idx", fileName, attr_name);
+    }
+    return path;
+}
+
+// normalized value of record, zero padded to KEY_MAX_WIDTH
+static void value_of(const SecondaryIndex *index, const TableSchema *schema, const Record *record,
+                     unsigned char *value) {
+    memset(value, 0, KEY_MAX_WIDTH);
+    key_normalize(&index->codec, schema, record, value);
+}
+
+// open the index file of attr, creating it empty first with create
+static SecondaryIndex *index_open(BPlusMetaImpl *meta, int attr, int create) {
+    const TableSchema *schema = &meta->schema;
+    Pager *pager = meta->rt.pager;
+    char *path = index_path_of(meta->rt.file_name, schema->attributes[attr].name);
+    SecondaryIndex *index = calloc(1, sizeof(SecondaryIndex));
+    if (path == NULL || index == NULL || key_codec_init(&index->codec, schema, attr) != 0) {
+        free(path);
+        free(index);
+        return NULL;
+    }
+    index->attr = attr;
+
+    // creating and opening the file goes to the backend unlocked, while
+    // threads of a concurrent file may be in libbf, which all files share
+    if (pager->lock) pthread_mutex_lock(pager->lock);
+    int ret = 0;
+    if (create) {
+        const AttributeSchema attrs[] = {
+            {"value", TYPE_INT, 0},
+            {"head", TYPE_INT, 0}
+        };
+        TableSchema list_schema;
+        schema_init(&list_schema, attrs, 2, "value");
+        BPlusCreateOptions create_options = {0};
+        create_options.page_size = meta->page_size;
+        // whatever an earlier index of the attribute left is out of date
+        remove(path);
+        ret = bplus_create_file_with_options(&list_schema, path, &create_options);
+    }
+    BPlusMeta *tree = NULL;
+    if (ret == 0 && pager->read_only) {
+        ret = bplus_open_file_readonly(path, &index->file_desc, &tree);
+    } else if (ret == 0) {
+        // the file is rebuilt after a crash, a filter or log would not help
+        BPlusOpenOptions open_options = {0};
+        open_options.bloom_bits_per_key = -1;
+        ret = bplus_open_file_with_options(path, &index->file_desc, &tree, &open_options);
+    }
+    free(path);
+    // and so do the index's own calls from then on
+    if (ret == 0 && meta->rt.latches && pager_make_thread_safe(((BPlusMetaImpl*)tree)->rt.pager) != 0) {
+        bplus_close_file(index->file_desc, tree);
+        ret = -1;
+    }
+    if (pager->lock) pthread_mutex_unlock(pager->lock);
+    if (ret != 0) {
+        free(index);
+        return NULL;
+    }
+    index->tree = (BPlusMetaImpl*)tree;
+    pthread_mutex_init(&index->lock, NULL);
+    return index;
+}
+
+static int index_close(SecondaryIndex *index) {
+    int ret = bplus_close_file(index->file_desc, (BPlusMeta*)index->tree);
+    pthread_mutex_destroy(&index->lock);
+    free(index);
+    return ret;
+}
+
+// a new list of value holding nothing yet, its head is left pinned in head
+static int list_create(BPlusMetaImpl *tree, const unsigned char *value, Page *head) {
+    CALL_PM(bplus_allocate_block(tree, head));
+    PostingBlock *first = (PostingBlock*)head->data;
+    first->next = -1;
+    first->count = 0;
+    first->tail = head->id;
+    first->total = 0;
+    first->next_value = -1;
+    memcpy(first->value, value, KEY_MAX_WIDTH);
+    pager_set_dirty(tree->rt.pager, head);
+    return 0;
+}
+
+// add key to the end of the list whose head is pinned in head
+static int list_append(BPlusMetaImpl *tree, Page *head, int key) {
+    Pager *pager = tree->rt.pager;
+    PostingBlock *first = (PostingBlock*)head->data;
+    Page tail_page;
+    Page *tail = head;
+    if (first->tail != head->id) {
+        CALL_PM(pager_get(pager, first->tail, &tail_page));
+        tail = &tail_page;
+    }
+    PostingBlock *last = (PostingBlock*)tail->data;
+    if (last->count == POSTING_CAPACITY(tree->page_size)) {
+        // full, the list goes on in a new block
+        Page page;
+        if (bplus_allocate_block(tree, &page) != 0) {
+            if (tail != head) pager_unpin(pager, tail);
+            return -1;
+        }
+        last->next = page.id;
+        pager_set_dirty(pager, tail);
+        if (tail != head) pager_unpin(pager, tail);
+        tail_page = page;
+        tail = &tail_page;
+        last = (PostingBlock*)page.data;
+        last->next = -1;
+        last->count = 0;
+        first->tail = page.id;
+    }
+    last->keys[last->count++] = key;
+    first->total++;
+    pager_set_dirty(pager, tail);
+    pager_set_dirty(pager, head);
+    if (tail != head) pager_unpin(pager, tail);
+    return 0;
+}
+
+// take key out of the list whose head is pinned in head, the last key of
+// the list moves into its place. 0 if it was there, 1 if not
+static int list_remove(BPlusMetaImpl *tree, Page *head, int key) {
+    Pager *pager = tree->rt.pager;
+    PostingBlock *first = (PostingBlock*)head->data;
+    int found_block = -1;
+    int found_pos = -1;
+    int before_tail = -1;
+    for (int block = head->id; block != -1; ) {
+        Page page;
+        Page *at = head;
+        if (block != head->id) {
+            CALL_PM(pager_get(pager, block, &page));
+            at = &page;
+        }
+        const PostingBlock *posting = (const PostingBlock*)at->data;
+        for (int i = 0; i < posting->count && found_block == -1; i++) {
+            if (posting->keys[i] == key) {
+                found_block = block;
+                found_pos = i;
+            }
+        }
+        if (posting->next == first->tail) before_tail = block;
+        block = posting->next;
+        if (at != head) pager_unpin(pager, at);
+    }
+    if (found_block == -1) {
+        return 1;
+    }
+
+    Page tail_page;
+    Page *tail = head;
+    if (first->tail != head->id) {
+        CALL_PM(pager_get(pager, first->tail, &tail_page));
+        tail = &tail_page;
+    }
+    PostingBlock *last = (PostingBlock*)tail->data;
+    int moved = last->keys[--last->count];
+    if (found_block == tail->id) {
+        last->keys[found_pos] = moved;
+    } else {
+        Page page;
+        Page *at = head;
+        if (found_block != head->id) {
+            if (pager_get(pager, found_block, &page) != 0) {
+                if (tail != head) pager_unpin(pager, tail);
+                return -1;
+            }
+            at = &page;
+        }
+        ((PostingBlock*)at->data)->keys[found_pos] = moved;
+        pager_set_dirty(pager, at);
+        if (at != head) pager_unpin(pager, at);
+    }
+    pager_set_dirty(pager, tail);
+    first->total--;
+    pager_set_dirty(pager, head);
+
+    int ret = 0;
+    if (tail != head && last->count == 0) {
+        // the emptied last block goes back to the free list
+        int empty = tail->id;
+        pager_unpin(pager, tail);
+        Page page;
+        Page *at = head;
+        if (before_tail != head->id) {
+            CALL_PM(pager_get(pager, before_tail, &page));
+            at = &page;
+        }
+        ((PostingBlock*)at->data)->next = -1;
+        pager_set_dirty(pager, at);
+        if (at != head) pager_unpin(pager, at);
+        first->tail = before_tail;
+        BPlusChange change;
+        bplus_change_init(&change);
+        if (bplus_free_block(tree, empty, &change) != 0) ret = -1;
+        bplus_change_log(tree, &change);
+    } else if (tail != head) {
+        pager_unpin(pager, tail);
+    }
+    return ret;
+}
+
+// head block of the list of value in head, -1 if there is none. before
+// gets the list ahead of it under the same key, -1 if it is the first, or
+// the last list under the key when value has none
+static int list_find(const SecondaryIndex *index, const unsigned char *value, int *head, int *before) {
+    Pager *pager = index->tree->rt.pager;
+    Record entry;
+    *head = -1;
+    *before = -1;
+    int key = key_prefix(value, index->codec.width);
+    if (bplus_record_find_into(index->file_desc, (BPlusMeta*)index->tree, key, &entry) != 0) {
+        return 0;
+    }
+    for (int block = entry.values[1].int_value; block != -1; ) {
+        Page page;
+        CALL_PM(pager_get(pager, block, &page));
+        const PostingBlock *first = (const PostingBlock*)page.data;
+        int same = memcmp(first->value, value, KEY_MAX_WIDTH) == 0;
+        int next = first->next_value;
+        pager_unpin(pager, &page);
+        if (same) {
+            *head = block;
+            return 0;
+        }
+        *before = block;
+        block = next;
+    }
+    return 0;
+}
+
+// point the list ahead of one under the same key to next, or when before
+// is -1 the index entry of the key, dropping it if next is -1 too
+static int list_link(SecondaryIndex *index, int key, int before, int next) {
+    BPlusMetaImpl *tree = index->tree;
+    if (before != -1) {
+        Page page;
+        CALL_PM(pager_get(tree->rt.pager, before, &page));
+        ((PostingBlock*)page.data)->next_value = next;
+        pager_set_dirty(tree->rt.pager, &page);
+        pager_unpin(tree->rt.pager, &page);
+        return 0;
+    }
+    // the index tree has no update, the entry goes and comes back
+    if (bplus_record_delete(index->file_desc, (BPlusMeta*)tree, key) != 0) {
+        return -1;
+    }
+    if (next == -1) {
+        return 0;
+    }
+    Record entry;
+    record_create(&tree->schema, &entry, key, next);
+    return bplus_record_insert(index->file_desc, (BPlusMeta*)tree, &entry) == -1 ? -1 : 0;
+}
+
+// head of the list of value, created if there is none, left pinned in head
+static int list_open(SecondaryIndex *index, const unsigned char *value, Page *head) {
+    BPlusMetaImpl *tree = index->tree;
+    Pager *pager = tree->rt.pager;
+    int head_block;
+    int before;
+    CALL_PM(list_find(index, value, &head_block, &before));
+    if (head_block != -1) {
+        return pager_get(pager, head_block, head);
+    }
+    CALL_PM(list_create(tree, value, head));
+    // a new list goes last under its key
+    int ret;
+    if (before != -1) {
+        ret = list_link(index, 0, before, head->id);
+    } else {
+        Record entry;
+        record_create(&tree->schema, &entry, key_prefix(value, index->codec.width), head->id);
+        ret = bplus_record_insert(index->file_desc, (BPlusMeta*)tree, &entry) == -1 ? -1 : 0;
+    }
+    if (ret != 0) {
+        pager_unpin(pager, head);
+    }
+    return ret;
+}
+
+// add key to the list of value, with the index locked
+static int posting_add(SecondaryIndex *index, const unsigned char *value, int key) {
+    Page head;
+    CALL_PM(list_open(index, value, &head));
+    int ret = list_append(index->tree, &head, key);
+    pager_unpin(index->tree->rt.pager, &head);
+    return ret;
+}
+
+// take key out of the list of value, with the index locked
+// a list left empty is dropped with its value
+static int posting_remove(SecondaryIndex *index, const unsigned char *value, int key) {
+    BPlusMetaImpl *tree = index->tree;
+    Pager *pager = tree->rt.pager;
+    int head_block;
+    int before;
+    CALL_PM(list_find(index, value, &head_block, &before));
+    if (head_block == -1) {
+        return 0;
+    }
+    Page head;
+    CALL_PM(pager_get(pager, head_block, &head));
+    int ret = list_remove(tree, &head, key) < 0 ? -1 : 0;
+    const PostingBlock *first = (const PostingBlock*)head.data;
+    int empty = first->total == 0;
+    int next = first->next_value;
+    pager_unpin(pager, &head);
+    if (ret == 0 && empty) {
+        if (list_link(index, key_prefix(value, index->codec.width), before, next) != 0) return -1;
+        BPlusChange change;
+        bplus_change_init(&change);
+        if (bplus_free_block(tree, head_block, &change) != 0) ret = -1;
+        bplus_change_log(tree, &change);
+    }
+    return ret;
+}
+
+// list every record of the file in a new, empty index. the records are
+// sorted by value first, so each list is written in one go and the
+// values go into the index tree in ascending order
+static int index_fill(BPlusMetaImpl *meta, SecondaryIndex *index) {
+    BPlusScan *scan = bplus_scan_open(meta->rt.pager->fd, (BPlusMeta*)meta, INT_MIN, INT_MAX);
+    if (scan == NULL) {
+        return -1;
+    }
+    Posting *postings = NULL;
+    long count = 0;
+    long capacity = 0;
+    int ret = 0;
+    Record record;
+    while (bplus_scan_next(scan, &record) == 0) {
+        if (count == capacity) {
+            long grown = capacity ? capacity * 2 : 4096;
+            Posting *items = realloc(postings, grown * sizeof(Posting));
+            if (items == NULL) {
+                ret = -1;
+                break;
+            }
+            postings = items;
+            capacity = grown;
+        }
+        value_of(index, &meta->schema, &record, postings[count].value);
+        postings[count].key = bplus_record_key(meta, &record);
+        count++;
+    }
+    bplus_scan_close(scan);
+    if (ret == 0) {
+        qsort(postings, count, sizeof(Posting), posting_cmp);
+    }
+
+    BPlusMetaImpl *tree = index->tree;
+    pthread_mutex_lock(&index->lock);
+    long i = 0;
+    while (ret == 0 && i < count) {
+        const unsigned char *value = postings[i].value;
+        Page head;
+        // the list may be there already, from an insert made while the
+        // file was read
+        if (list_open(index, value, &head) != 0) ret = -1;
+        for (; ret == 0 && i < count && memcmp(postings[i].value, value, KEY_MAX_WIDTH) == 0; i++) {
+            if (list_append(tree, &head, postings[i].key) != 0) ret = -1;
+        }
+        if (ret == 0) pager_unpin(tree->rt.pager, &head);
+    }
+    pthread_mutex_unlock(&index->lock);
+    free(postings);
+    return ret;
+}
+
+int bplus_create_secondary_index(int file_desc, BPlusMeta *metadata, const char *attr_name) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    if (meta->rt.pager->read_only) {
+        fprintf(stderr, "Error: file is open read-only\n");
+        return -1;
+    }
+    int attr = attribute_index(&meta->schema, attr_name);
+    if (attr < 0) {
+        printf("Error: no attribute %s in schema\n", attr_name);
+        return -1;
+    }
+    if (attr == meta->schema.key_index) {
+        printf("Error: %s is the primary key\n", attr_name);
+        return -1;
+    }
+    if (meta->rt.secondary[attr] != NULL) {
+        printf("Error: %s has a secondary index already\n", attr_name);
+        return -1;
+    }
+
+    SecondaryIndex *index = index_open(meta, attr, 1);
+    if (index == NULL) {
+        return -1;
+    }
+    // inserts from here on list themselves, the file is read after that
+    // so none is missed. one listed twice is only returned once
+    __atomic_store_n(&meta->rt.secondary[attr], index, __ATOMIC_RELEASE);
+    __atomic_fetch_or(&meta->secondary, 1 << attr, __ATOMIC_RELEASE);
+    if (index_fill(meta, index) != 0) {
+        return -1;
+    }
+
+    // the metadata must know of the index before the next crash, so the
+    // open after it rebuilds the index from the file
+    bplus_tree_enter(meta, 1);
+    int ret = 0;
+    if (meta->rt.wal) {
+        ret = bplus_checkpoint(meta);
+    } else if (bplus_meta_store(meta) != 0 || pager_sync(meta->rt.pager) != 0) {
+        ret = -1;
+    }
+    bplus_tree_leave(meta);
+    return ret;
+}
+
+int bplus_secondary_open(BPlusMetaImpl *meta) {
+    Pager *pager = meta->rt.pager;
+    int saved = meta->secondary_saved;
+    if (!pager->read_only && saved) {
+        // the index files miss whatever this session changes, a crash
+        // must not leave them looking current
+        meta->secondary_saved = 0;
+        if (bplus_meta_store(meta) != 0 || pager_sync(pager) != 0) return -1;
+    }
+    for (int attr = 0; attr < meta->schema.count; attr++) {
+        if (!(meta->secondary & (1 << attr))) {
+            continue;
+        }
+        const char *name = meta->schema.attributes[attr].name;
+        if (pager->read_only && !saved) {
+            printf("Error: secondary index on %s was not saved, open the file for writing to rebuild it\n",
+                   name);
+            continue;
+        }
+        SecondaryIndex *index = saved ? index_open(meta, attr, 0) : NULL;
+        if (index == NULL && !pager->read_only) {
+            // the last session did not close the file, list the records again
+            index = index_open(meta, attr, 1);
+            if (index != NULL && index_fill(meta, index) != 0) {
+                index_close(index);
+                index = NULL;
+            }
+        }
+        if (index == NULL) {
+            printf("Error: cannot open the secondary index on %s\n", name);
+            return -1;
+        }
+        meta->rt.secondary[attr] = index;
+    }
+    return 0;
+}
+
+int bplus_secondary_close(BPlusMetaImpl *meta) {
+    int ret = 0;
+    int closed = 0;
+    for (int attr = 0; attr < MAX_ATTRIBUTES; attr++) {
+        if (meta->rt.secondary[attr] == NULL) {
+            continue;
+        }
+        if (index_close(meta->rt.secondary[attr]) != 0) ret = -1;
+        meta->rt.secondary[attr] = NULL;
+        if (meta->secondary & (1 << attr)) closed |= 1 << attr;
+    }
+    if (!meta->rt.pager->read_only) {
+        meta->secondary_saved = ret == 0 && closed == meta->secondary;
+    }
+    return ret;
+}
+
+int bplus_secondary_insert(BPlusMetaImpl *meta, const Record *record) {
+    int ret = 0;
+    int key = bplus_record_key(meta, record);
+    for (int attr = 0; attr < MAX_ATTRIBUTES; attr++) {
+        SecondaryIndex *index = __atomic_load_n(&meta->rt.secondary[attr], __ATOMIC_ACQUIRE);
+        if (index == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&index->lock);
+        unsigned char value[KEY_MAX_WIDTH];
+        value_of(index, &meta->schema, record, value);
+        if (posting_add(index, value, key) != 0) ret = -1;
+        pthread_mutex_unlock(&index->lock);
+    }
+    return ret;
+}
+
+int bplus_secondary_remove(BPlusMetaImpl *meta, const Record *record) {
+    int ret = 0;
+    int key = bplus_record_key(meta, record);
+    for (int attr = 0; attr < MAX_ATTRIBUTES; attr++) {
+        SecondaryIndex *index = __atomic_load_n(&meta->rt.secondary[attr], __ATOMIC_ACQUIRE);
+        if (index == NULL) {
+            continue;
+        }
+        pthread_mutex_lock(&index->lock);
+        unsigned char value[KEY_MAX_WIDTH];
+        value_of(index, &meta->schema, record, value);
+        if (posting_remove(index, value, key) != 0) ret = -1;
+        pthread_mutex_unlock(&index->lock);
+    }
+    return ret;
+}
+
+struct BPlusSecondaryScan {
+  int file_desc;
+  const BPlusMetaImpl *meta;
+  const SecondaryIndex *index;
+  unsigned char value[KEY_MAX_WIDTH];   // normalized value asked for, zero padded
+  int *keys;                            // primary keys listed under it, ascending
+  int count;
+  int next;                             // next of keys to fetch
+  Record fetched[SECONDARY_FETCH_BATCH];
+  int found[SECONDARY_FETCH_BATCH];
+  int fetched_count;
+  int fetched_pos;
+};
+
+// copy the list of scan->value into scan->keys, with the index locked
+static int collect_keys(BPlusSecondaryScan *scan) {
+    const BPlusMetaImpl *tree = scan->index->tree;
+    Pager *pager = tree->rt.pager;
+    int block;
+    int before;
+    CALL_PM(list_find(scan->index, scan->value, &block, &before));
+    if (block == -1) {
+        return 0;
+    }
+    Page page;
+    CALL_PM(pager_get(pager, block, &page));
+    scan->keys = malloc(((const PostingBlock*)page.data)->total * sizeof(int) + 1);
+    if (scan->keys == NULL) {
+        pager_unpin(pager, &page);
+        return -1;
+    }
+    while (1) {
+        const PostingBlock *posting = (const PostingBlock*)page.data;
+        memcpy(scan->keys + scan->count, posting->keys, posting->count * sizeof(int));
+        scan->count += posting->count;
+        block = posting->next;
+        pager_unpin(pager, &page);
+        if (block == -1) break;
+        CALL_PM(pager_get(pager, block, &page));
+    }
+    return 0;
+}
+
+BPlusSecondaryScan *bplus_secondary_scan_open(int file_desc, const BPlusMeta *metadata, const char *attr_name,
+                                              const FieldValue *value) {
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    int attr = attribute_index(&meta->schema, attr_name);
+    SecondaryIndex *index = attr < 0 ? NULL : __atomic_load_n(&meta->rt.secondary[attr], __ATOMIC_ACQUIRE);
+    if (index == NULL) {
+        printf("Error: no secondary index on %s\n", attr_name);
+        return NULL;
+    }
+    BPlusSecondaryScan *scan = calloc(1, sizeof(BPlusSecondaryScan));
+    if (scan == NULL) {
+        return NULL;
+    }
+    scan->file_desc = file_desc;
+    scan->meta = meta;
+    scan->index = index;
+    Record probe;
+    memset(&probe, 0, sizeof(Record));
+    probe.values[attr] = *value;
+    value_of(index, &meta->schema, &probe, scan->value);
+
+    pthread_mutex_lock(&index->lock);
+    int ret = collect_keys(scan);
+    pthread_mutex_unlock(&index->lock);
+    if (ret != 0) {
+        bplus_secondary_scan_close(scan);
+        return NULL;
+    }
+
+    // fetched in key order the leaves are read front to back, and a key
+    // listed twice shows up next to itself
+    qsort(scan->keys, scan->count, sizeof(int), int_cmp);
+    int unique = 0;
+    for (int i = 0; i < scan->count; i++) {
+        if (unique == 0 || scan->keys[i] != scan->keys[unique - 1]) scan->keys[unique++] = scan->keys[i];
+    }
+    scan->count = unique;
+    return scan;
+}
+
+int bplus_secondary_scan_next(BPlusSecondaryScan *scan, Record *out_record) {
+    const SecondaryIndex *index = scan->index;
+    unsigned char normalized[KEY_MAX_WIDTH];
+    while (1) {
+        while (scan->fetched_pos < scan->fetched_count) {
+            int i = scan->fetched_pos++;
+            if (!scan->found[i]) {
+                continue;   // deleted since it was listed
+            }
+            // the record may have been replaced by one of another value
+            key_normalize(&index->codec, &scan->meta->schema, &scan->fetched[i], normalized);
+            if (memcmp(normalized, scan->value, index->codec.width) == 0) {
+                *out_record = scan->fetched[i];
+                return 0;
+            }
+        }
+        if (scan->next == scan->count) {
+            return -1;
+        }
+        int n = scan->count - scan->next;
+        if (n > SECONDARY_FETCH_BATCH) n = SECONDARY_FETCH_BATCH;
+        if (bplus_record_find_batch(scan->file_desc, (const BPlusMeta*)scan->meta, scan->keys + scan->next, n,
+                                    scan->fetched, scan->found) < 0) {
+            return -1;
+        }
+        scan->next += n;
+        scan->fetched_count = n;
+        scan->fetched_pos = 0;
+    }
+}
+
+void bplus_secondary_scan_close(BPlusSecondaryScan *scan) {
+    if (scan == NULL) {
+        return;
+    }
+    free(scan->keys);
+    free(scan);
+}
@@ -0,0 +1,119 @@
+/**
+ * statistics of an open file
+ * the pager counts pins, reads and dirty marks, the tree counts splits,
+ * height changes and allocated blocks in its runtime and times finds and
+ * inserts. a snapshot gathers both and works out the percentiles
+ */
+
+#include "bplus_internal.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+long latency_bucket_limit(int bucket) {
+    if (bucket < LATENCY_SUB_BUCKETS) {
+        return bucket;
+    }
+    if (bucket >= LATENCY_BUCKETS - 1) {
+        return LONG_MAX;
+    }
+    int msb = bucket / LATENCY_SUB_BUCKETS + 2;
+    long low = (long)(LATENCY_SUB_BUCKETS + bucket % LATENCY_SUB_BUCKETS) << (msb - 3);
+    return low + (1L << (msb - 3)) - 1;
+}
+
+long latency_percentile(const LatencyHistogram *histogram, double quantile) {
+    long count = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) count += histogram->buckets[i];
+    if (count == 0) {
+        return 0;
+    }
+    // rank of the operation at quantile, counted from 1
+    long rank = (long)(quantile * count);
+    if (rank < quantile * count) rank++;
+    if (rank < 1) rank = 1;
+    if (rank > count) rank = count;
+    long seen = 0;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += histogram->buckets[i];
+        if (seen >= rank) {
+            long limit = latency_bucket_limit(i);
+            return limit < histogram->max_ns ? limit : histogram->max_ns;
+        }
+    }
+    return histogram->max_ns;
+}
+
+static long load(const long *counter) {
+    return __atomic_load_n(counter, __ATOMIC_RELAXED);
+}
+
+static void latency_snapshot(const LatencyHistogram *histogram, BPlusLatency *out) {
+    out->histogram.count = load(&histogram->count);
+    out->histogram.total_ns = load(&histogram->total_ns);
+    out->histogram.max_ns = load(&histogram->max_ns);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        out->histogram.buckets[i] = load(&histogram->buckets[i]);
+    }
+    out->count = out->histogram.count;
+    out->mean_ns = out->count ? out->histogram.total_ns / out->count : 0;
+    out->max_ns = out->histogram.max_ns;
+    out->p50_ns = latency_percentile(&out->histogram, 0.5);
+    out->p99_ns = latency_percentile(&out->histogram, 0.99);
+    out->p999_ns = latency_percentile(&out->histogram, 0.999);
+}
+
+int bplus_stats_snapshot(int file_desc, const BPlusMeta *metadata, BPlusStats *stats) {
+    (void)file_desc;
+    memset(stats, 0, sizeof(BPlusStats));
+    if (!BPLUS_STATS) {
+        printf("Error: built without statistics, BPLUS_STATS is 0\n");
+        return -1;
+    }
+    const BPlusMetaImpl *meta = (const BPlusMetaImpl*)metadata;
+    const PagerStats *pager = &meta->rt.pager->stats;
+    const TreeStats *tree = &meta->rt.stats;
+    stats->enabled = 1;
+    stats->pins = load(&pager->pins);
+    stats->reads = load(&pager->reads);
+    stats->dirty_marks = load(&pager->dirty_marks);
+    stats->file_growth = load(&pager->allocations);
+    stats->blocks_allocated = load(&tree->blocks_allocated);
+    stats->bytes_allocated = stats->blocks_allocated * meta->page_size;
+    for (int level = 0; level < BPLUS_STATS_LEVELS && level < BPLUS_MAX_HEIGHT; level++) {
+        stats->splits[level] = load(&tree->splits[level]);
+    }
+    stats->height_changes = load(&tree->height_changes);
+    latency_snapshot(&tree->find, &stats->find);
+    latency_snapshot(&tree->insert, &stats->insert);
+    return 0;
+}
+
+// counters bumped while this runs may keep their old value or be lost,
+// they are not torn
+static void zero(long *counter) {
+    __atomic_store_n(counter, 0, __ATOMIC_RELAXED);
+}
+
+static void latency_reset(LatencyHistogram *histogram) {
+    zero(&histogram->count);
+    zero(&histogram->total_ns);
+    zero(&histogram->max_ns);
+    for (int i = 0; i < LATENCY_BUCKETS; i++) zero(&histogram->buckets[i]);
+}
+
+void bplus_stats_reset(int file_desc, BPlusMeta *metadata) {
+    (void)file_desc;
+    BPlusMetaImpl *meta = (BPlusMetaImpl*)metadata;
+    PagerStats *pager = &meta->rt.pager->stats;
+    TreeStats *tree = &meta->rt.stats;
+    zero(&pager->pins);
+    zero(&pager->reads);
+    zero(&pager->dirty_marks);
+    zero(&pager->allocations);
+    zero(&tree->blocks_allocated);
+    for (int level = 0; level < BPLUS_MAX_HEIGHT; level++) zero(&tree->splits[level]);
+    zero(&tree->height_changes);
+    latency_reset(&tree->find);
+    latency_reset(&tree->insert);
+}
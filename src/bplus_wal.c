@@ -0,0 +1,370 @@
+/**
+ * write-ahead log file and group commit
+ * the file is a header and then records back to back, each one a header
+ * with its length, type and checksum followed by its bytes. a crash can
+ * leave a torn record at the end, replay stops at the first bad one
+ */
+
+#include "bplus_wal.h"
+#include <errno.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WAL_MAGIC 0x4C415742   // "BWAL"
+#define WAL_INITIAL_BUFFER (64 * 1024)
+// no record is larger, a bigger length means a torn header
+#define WAL_MAX_RECORD (64 * 1024 * 1024)
+
+typedef struct {
+  unsigned int magic;
+  int page_size;
+} WalHeader;
+
+typedef struct {
+  int length;             // bytes after this header
+  int type;
+  unsigned int checksum;  // of type and bytes
+} WalRecordHeader;
+
+struct Wal {
+  int fd;
+  char *path;
+  pthread_mutex_t lock;
+  pthread_cond_t synced;
+  // records appended since the last sync started
+  char *buf;
+  long used;
+  long capacity;
+  // what the running sync writes, swapped with buf when one starts
+  char *spare;
+  long spare_capacity;
+  long start_lsn;     // lsn of the first record in the file
+  long end_lsn;       // lsn past the last appended record
+  long durable_lsn;   // the file is synced up to here
+  int syncing;        // a thread is writing and syncing
+  int failed;         // a write or sync failed, nothing is durable anymore
+  int commit_interval_ms;
+  struct timespec last_sync;
+  unsigned char *marks;  // bit per page id changed since the last truncate
+  int marks_bytes;
+};
+
+// FNV-1a, enough to tell a torn record from a whole one
+static unsigned int checksum_add(unsigned int h, const void *data, int length) {
+    const unsigned char *p = data;
+    for (int i = 0; i < length; i++) {
+        h = (h ^ p[i]) * 16777619u;
+    }
+    return h;
+}
+
+static unsigned int checksum_start(int type) {
+    return checksum_add(2166136261u, &type, sizeof(int));
+}
+
+static long file_offset(const Wal *wal, long lsn) {
+    return (long)sizeof(WalHeader) + (lsn - wal->start_lsn);
+}
+
+static int write_all(int fd, const char *data, long length, long offset) {
+    while (length > 0) {
+        ssize_t n = pwrite(fd, data, length, offset);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        data += n;
+        length -= n;
+        offset += n;
+    }
+    return 0;
+}
+
+// a new or removed log only counts once its directory entry is on disk too
+static void sync_parent(const char *path) {
+    char *copy = strdup(path);
+    if (copy == NULL) {
+        return;
+    }
+    int fd = open(dirname(copy), O_RDONLY);
+    if (fd >= 0) {
+        fsync(fd);
+        close(fd);
+    }
+    free(copy);
+}
+
+char *wal_path_of(const char *fileName) {
+    char *path = malloc(strlen(fileName) + 5);
+    if (path != NULL) {
+        strcpy(path, fileName);
+        strcat(path, ".wal");
+    }
+    return path;
+}
+
+Wal *wal_open(const char *path, int page_size, int commit_interval_ms) {
+    Wal *wal = calloc(1, sizeof(Wal));
+    if (wal == NULL) {
+        return NULL;
+    }
+    wal->path = strdup(path);
+    wal->buf = malloc(WAL_INITIAL_BUFFER);
+    wal->spare = malloc(WAL_INITIAL_BUFFER);
+    if (wal->path == NULL || wal->buf == NULL || wal->spare == NULL) {
+        goto fail;
+    }
+    wal->capacity = WAL_INITIAL_BUFFER;
+    wal->spare_capacity = WAL_INITIAL_BUFFER;
+
+    wal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (wal->fd < 0) {
+        perror(path);
+        goto fail;
+    }
+    WalHeader header = {WAL_MAGIC, page_size};
+    if (write_all(wal->fd, (const char*)&header, sizeof(header), 0) != 0 || fdatasync(wal->fd) != 0) {
+        perror(path);
+        close(wal->fd);
+        goto fail;
+    }
+    sync_parent(path);
+
+    wal->start_lsn = sizeof(WalHeader);
+    wal->end_lsn = wal->start_lsn;
+    wal->durable_lsn = wal->start_lsn;
+    wal->commit_interval_ms = commit_interval_ms;
+    clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+    pthread_mutex_init(&wal->lock, NULL);
+    pthread_cond_init(&wal->synced, NULL);
+    return wal;
+
+fail:
+    free(wal->path);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal);
+    return NULL;
+}
+
+long wal_append(Wal *wal, int type, const WalPart *parts, int nparts) {
+    WalRecordHeader header;
+    header.type = type;
+    header.length = 0;
+    header.checksum = checksum_start(type);
+    for (int i = 0; i < nparts; i++) {
+        header.length += parts[i].length;
+        header.checksum = checksum_add(header.checksum, parts[i].data, parts[i].length);
+    }
+    long total = (long)sizeof(header) + header.length;
+
+    pthread_mutex_lock(&wal->lock);
+    if (wal->used + total > wal->capacity) {
+        long capacity = wal->capacity;
+        while (capacity < wal->used + total) capacity *= 2;
+        char *grown = realloc(wal->buf, capacity);
+        if (grown == NULL) {
+            pthread_mutex_unlock(&wal->lock);
+            fprintf(stderr, "Error: out of memory for the log\n");
+            return -1;
+        }
+        wal->buf = grown;
+        wal->capacity = capacity;
+    }
+    char *p = wal->buf + wal->used;
+    memcpy(p, &header, sizeof(header));
+    p += sizeof(header);
+    for (int i = 0; i < nparts; i++) {
+        memcpy(p, parts[i].data, parts[i].length);
+        p += parts[i].length;
+    }
+    wal->used += total;
+    wal->end_lsn += total;
+    long lsn = wal->end_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+int wal_force(Wal *wal, long lsn) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->durable_lsn < lsn && !wal->failed) {
+        if (wal->syncing) {
+            // someone is syncing, it or the sync after it covers lsn
+            pthread_cond_wait(&wal->synced, &wal->lock);
+            continue;
+        }
+        // lead a sync of everything appended so far, appends go on
+        // into the other buffer while it runs
+        char *data = wal->buf;
+        long length = wal->used;
+        long from = wal->durable_lsn;
+        long to = wal->end_lsn;
+        long capacity = wal->capacity;
+        wal->buf = wal->spare;
+        wal->capacity = wal->spare_capacity;
+        wal->spare = data;
+        wal->spare_capacity = capacity;
+        wal->used = 0;
+        wal->syncing = 1;
+        pthread_mutex_unlock(&wal->lock);
+
+        int ok = write_all(wal->fd, data, length, file_offset(wal, from)) == 0 && fdatasync(wal->fd) == 0;
+        if (!ok) perror(wal->path);
+
+        pthread_mutex_lock(&wal->lock);
+        wal->syncing = 0;
+        if (ok) wal->durable_lsn = to;
+        else wal->failed = 1;
+        clock_gettime(CLOCK_MONOTONIC, &wal->last_sync);
+        pthread_cond_broadcast(&wal->synced);
+    }
+    int ret = wal->failed ? -1 : 0;
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+int wal_sync(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    long lsn = wal->end_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return wal_force(wal, lsn);
+}
+
+long wal_durable(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    long lsn = wal->durable_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return lsn;
+}
+
+int wal_commit(Wal *wal, long lsn) {
+    if (wal->commit_interval_ms <= 0) {
+        return wal_force(wal, lsn);
+    }
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    pthread_mutex_lock(&wal->lock);
+    long elapsed_ms = (now.tv_sec - wal->last_sync.tv_sec) * 1000 +
+                      (now.tv_nsec - wal->last_sync.tv_nsec) / 1000000;
+    int due = elapsed_ms >= wal->commit_interval_ms && !wal->syncing;
+    pthread_mutex_unlock(&wal->lock);
+    // records left in memory go out with the next sync that is due
+    return due ? wal_force(wal, lsn) : 0;
+}
+
+long wal_size(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    long size = wal->end_lsn - wal->start_lsn;
+    pthread_mutex_unlock(&wal->lock);
+    return size;
+}
+
+int wal_mark_page(Wal *wal, int page_id) {
+    pthread_mutex_lock(&wal->lock);
+    int byte = page_id / 8;
+    if (byte >= wal->marks_bytes) {
+        int bytes = wal->marks_bytes ? wal->marks_bytes : 64;
+        while (bytes <= byte) bytes *= 2;
+        unsigned char *grown = realloc(wal->marks, bytes);
+        if (grown == NULL) {
+            // logging the page in full again is always safe
+            pthread_mutex_unlock(&wal->lock);
+            return 1;
+        }
+        memset(grown + wal->marks_bytes, 0, bytes - wal->marks_bytes);
+        wal->marks = grown;
+        wal->marks_bytes = bytes;
+    }
+    unsigned char bit = 1u << (page_id % 8);
+    int first = (wal->marks[byte] & bit) == 0;
+    wal->marks[byte] |= bit;
+    pthread_mutex_unlock(&wal->lock);
+    return first;
+}
+
+int wal_truncate(Wal *wal) {
+    pthread_mutex_lock(&wal->lock);
+    while (wal->syncing) {
+        pthread_cond_wait(&wal->synced, &wal->lock);
+    }
+    int ret = 0;
+    if (ftruncate(wal->fd, sizeof(WalHeader)) != 0 || fdatasync(wal->fd) != 0) {
+        perror(wal->path);
+        ret = -1;
+    } else {
+        wal->used = 0;
+        wal->start_lsn = wal->end_lsn;
+        wal->durable_lsn = wal->end_lsn;
+        memset(wal->marks, 0, wal->marks_bytes);
+    }
+    pthread_mutex_unlock(&wal->lock);
+    return ret;
+}
+
+int wal_close(Wal *wal, int remove_file) {
+    int ret = close(wal->fd) == 0 ? 0 : -1;
+    if (remove_file) {
+        if (unlink(wal->path) != 0) ret = -1;
+        sync_parent(wal->path);
+    }
+    pthread_mutex_destroy(&wal->lock);
+    pthread_cond_destroy(&wal->synced);
+    free(wal->path);
+    free(wal->buf);
+    free(wal->spare);
+    free(wal->marks);
+    free(wal);
+    return ret;
+}
+
+int wal_replay(const char *path, int page_size,
+               int (*fn)(void *ctx, int type, const char *data, int length), void *ctx) {
+    FILE *f = fopen(path, "rb");
+    if (f == NULL) {
+        return errno == ENOENT ? 0 : -1;
+    }
+    WalHeader header;
+    if (fread(&header, sizeof(header), 1, f) != 1) {
+        // crashed while the log was being created, nothing in it yet
+        fclose(f);
+        return 0;
+    }
+    if (header.magic != WAL_MAGIC || header.page_size != page_size) {
+        fprintf(stderr, "Error: %s is not a log of this file\n", path);
+        fclose(f);
+        return -1;
+    }
+
+    char *data = NULL;
+    int capacity = 0;
+    int count = 0;
+    WalRecordHeader rec;
+    while (fread(&rec, sizeof(rec), 1, f) == 1) {
+        if (rec.length < 0 || rec.length > WAL_MAX_RECORD) break;
+        if (rec.length > capacity) {
+            char *grown = realloc(data, rec.length);
+            if (grown == NULL) {
+                count = -1;
+                break;
+            }
+            data = grown;
+            capacity = rec.length;
+        }
+        if (fread(data, 1, rec.length, f) != (size_t)rec.length) break;
+        if (checksum_add(checksum_start(rec.type), data, rec.length) != rec.checksum) break;
+        if (fn(ctx, rec.type, data, rec.length) != 0) {
+            count = -1;
+            break;
+        }
+        count++;
+    }
+    free(data);
+    fclose(f);
+    return count;
+}
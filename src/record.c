@@ -2,6 +2,7 @@
 #include <string.h>
 #include <stdarg.h>
 
+#include "bplus_key.h"
 #include "record.h"
 
 void schema_init(TableSchema *schema, const AttributeSchema *attrs, const int attribute_count, const char *key_attr_name) {
@@ -63,18 +64,24 @@ void record_create(const TableSchema *schema, Record* record, ...) {
 }
 
 
-int record_get_key(const TableSchema *schema, const Record *record) {
-    if (schema->key_index < 0) {
-        printf("Error: No primary key defined in schema!\n");
+int record_key(const TableSchema *schema, const Record *record, int *key) {
+    // other types than INT go through their normalized bytes, the tree
+    // orders by an int so they must fit in one. an open file keeps its
+    // codec, this is for callers without one
+    KeyCodec codec;
+    if (key_tree_codec(&codec, schema) != 0) {
         return -1;
     }
+    *key = key_tree_key(&codec, schema, record);
+    return 0;
+}
 
-    if (schema->attributes[schema->key_index].type != TYPE_INT) {
-        printf("Error: Primary key must be of type INT!\n");
+int record_get_key(const TableSchema *schema, const Record *record) {
+    int key;
+    if (record_key(schema, record, &key) != 0) {
         return -1;
     }
-
-    return record->values[schema->key_index].int_value;
+    return key;
 }
 
 void schema_print(const TableSchema *schema){
@@ -169,3 +176,100 @@ DataType record_get_value(const TableSchema *schema, const Record *record, const
     }
     return TYPE_NULL; // Attribute not found
 }
+
+// packed layout: fixed width fields, one end offset byte per CHAR field, CHAR bytes
+static int packed_fixed_size(const TableSchema *schema, int *char_count) {
+    int fixed = 0;
+    *char_count = 0;
+    for (int i = 0; i < schema->count; i++) {
+        if (schema->attributes[i].type == TYPE_CHAR) (*char_count)++;
+        else if (schema->attributes[i].type != TYPE_NULL) fixed += 4;
+    }
+    return fixed;
+}
+
+static int char_length(const AttributeSchema *attr, const FieldValue *value) {
+    int max = attr->length < MAX_STRING_LENGTH ? attr->length : MAX_STRING_LENGTH;
+    int len = 0;
+    while (len < max && value->string_value[len] != '\0') len++;
+    return len;
+}
+
+int record_packed_size(const TableSchema *schema, const Record *record) {
+    int char_count;
+    int size = packed_fixed_size(schema, &char_count) + char_count;
+    for (int i = 0; i < schema->count; i++) {
+        if (schema->attributes[i].type == TYPE_CHAR) {
+            size += char_length(&schema->attributes[i], &record->values[i]);
+        }
+    }
+    return size;
+}
+
+int schema_max_packed_size(const TableSchema *schema) {
+    int char_count;
+    int size = packed_fixed_size(schema, &char_count) + char_count;
+    for (int i = 0; i < schema->count; i++) {
+        if (schema->attributes[i].type == TYPE_CHAR) {
+            size += schema->attributes[i].length < MAX_STRING_LENGTH ? schema->attributes[i].length : MAX_STRING_LENGTH;
+        }
+    }
+    return size;
+}
+
+int record_pack(const TableSchema *schema, const Record *record, char *buf) {
+    int char_count;
+    int fixed = packed_fixed_size(schema, &char_count);
+    unsigned char *ends = (unsigned char*)buf + fixed;
+    char *chars = buf + fixed + char_count;
+    int pos = 0;   // next fixed byte
+    int var = 0;   // CHAR bytes written so far
+    int c = 0;
+    for (int i = 0; i < schema->count; i++) {
+        switch (schema->attributes[i].type) {
+            case TYPE_INT:
+            case TYPE_FLOAT:
+                memcpy(buf + pos, &record->values[i], 4);
+                pos += 4;
+                break;
+            case TYPE_CHAR: {
+                int len = char_length(&schema->attributes[i], &record->values[i]);
+                memcpy(chars + var, record->values[i].string_value, len);
+                var += len;
+                ends[c++] = (unsigned char)var;
+                break;
+            }
+            default:
+                break;
+        }
+    }
+    return fixed + char_count + var;
+}
+
+void record_unpack(const TableSchema *schema, const char *buf, Record *record) {
+    int char_count;
+    int fixed = packed_fixed_size(schema, &char_count);
+    const unsigned char *ends = (const unsigned char*)buf + fixed;
+    const char *chars = buf + fixed + char_count;
+    int pos = 0;
+    int start = 0;
+    int c = 0;
+    for (int i = 0; i < schema->count; i++) {
+        switch (schema->attributes[i].type) {
+            case TYPE_INT:
+            case TYPE_FLOAT:
+                memcpy(&record->values[i], buf + pos, 4);
+                pos += 4;
+                break;
+            case TYPE_CHAR: {
+                int len = ends[c] - start;
+                memcpy(record->values[i].string_value, chars + start, len);
+                if (len < MAX_STRING_LENGTH) record->values[i].string_value[len] = '\0';
+                start = ends[c++];
+                break;
+            }
+            default:
+                break;
+        }
+    }
+}
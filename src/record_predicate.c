@@ -0,0 +1,308 @@
+/**
+ * predicates and projections over packed records
+ * attribute names are resolved once, to where the attribute sits in the
+ * layout of record_pack: INT and FLOAT fields at fixed offsets, CHAR fields
+ * between the end offsets of the one before and their own. matching and
+ * copying out then read those bytes in place, in the leaf a scan has pinned.
+ * attributes stored as dictionary codes are compared by code for equality
+ * and looked up for everything else
+ */
+
+#include "record_predicate.h"
+#include "bplus_key.h"
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+// offsets of the attribute in a packed record, as record_pack lays it out
+typedef struct {
+  int offsets[MAX_ATTRIBUTES];   // INT/FLOAT fields
+  int slots[MAX_ATTRIBUTES];     // CHAR fields
+  int ends_at;
+  int chars_at;
+} PackedLayout;
+
+static void packed_layout(const TableSchema *schema, PackedLayout *layout) {
+    int fixed = 0;
+    int chars = 0;
+    for (int i = 0; i < schema->count; i++) {
+        layout->offsets[i] = -1;
+        layout->slots[i] = -1;
+        if (schema->attributes[i].type == TYPE_CHAR) {
+            layout->slots[i] = chars++;
+        } else if (schema->attributes[i].type != TYPE_NULL) {
+            layout->offsets[i] = fixed;
+            fixed += 4;
+        }
+    }
+    layout->ends_at = fixed;
+    layout->chars_at = fixed + chars;
+}
+
+static int attribute_index(const TableSchema *schema, const char *attr_name) {
+    for (int i = 0; i < schema->count; i++) {
+        if (strcmp(schema->attributes[i].name, attr_name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static int string_length(const FieldValue *value) {
+    return (int)strnlen(value->string_value, MAX_STRING_LENGTH);
+}
+
+// bytes of the CHAR field in slot of a packed record
+static const char *packed_chars(const char *packed, int ends_at, int chars_at, int slot, int *length) {
+    const unsigned char *ends = (const unsigned char*)packed + ends_at;
+    int start = slot == 0 ? 0 : ends[slot - 1];
+    *length = ends[slot] - start;
+    return packed + chars_at + start;
+}
+
+// strings compare as their bytes, a prefix first
+static int chars_cmp(const char *a, int a_length, const char *b, int b_length) {
+    int cmp = memcmp(a, b, a_length < b_length ? a_length : b_length);
+    return cmp != 0 ? cmp : a_length - b_length;
+}
+
+int predicate_compile(Predicate *predicate, const TableSchema *schema, const PredicateTerm *terms, int count) {
+    if (count < 0 || count > PREDICATE_MAX_TERMS) {
+        printf("Error: a predicate takes at most %d terms\n", PREDICATE_MAX_TERMS);
+        return -1;
+    }
+    PackedLayout layout;
+    packed_layout(schema, &layout);
+    predicate->count = count;
+    predicate->ends_at = layout.ends_at;
+    predicate->chars_at = layout.chars_at;
+    predicate->dictionary = NULL;
+    for (int i = 0; i < count; i++) {
+        PredicateCompiledTerm *term = &predicate->terms[i];
+        int attr = attribute_index(schema, terms[i].attr_name);
+        if (attr < 0 || schema->attributes[attr].type == TYPE_NULL) {
+            printf("Error: no attribute %s in schema\n", terms[i].attr_name);
+            return -1;
+        }
+        term->type = schema->attributes[attr].type;
+        if (terms[i].op == PRED_PREFIX && term->type != TYPE_CHAR) {
+            printf("Error: %s is not a string, it has no prefix\n", terms[i].attr_name);
+            return -1;
+        }
+        term->op = terms[i].op;
+        term->attr = attr;
+        term->offset = layout.offsets[attr];
+        term->slot = layout.slots[attr];
+        term->value = terms[i].value;
+        term->high = terms[i].high;
+        term->value_length = term->type == TYPE_CHAR ? string_length(&term->value) : 0;
+        term->high_length = term->type == TYPE_CHAR ? string_length(&term->high) : 0;
+        term->coded = 0;
+        term->code_length = 0;
+    }
+    return 0;
+}
+
+void predicate_bind(Predicate *predicate, const Dictionary *dictionary) {
+    predicate->dictionary = dictionary;
+    for (int i = 0; i < predicate->count; i++) {
+        PredicateCompiledTerm *term = &predicate->terms[i];
+        term->coded = dictionary && term->type == TYPE_CHAR && dictionary_coded(dictionary, term->attr);
+        if (term->coded && term->op == PRED_EQ) {
+            // a value without a code is stored as it is, behind the raw marker
+            term->code_length = dictionary_encode(dictionary, term->attr, term->value.string_value,
+                                                  term->value_length, term->code);
+        }
+    }
+}
+
+// value of the CHAR attribute of term in a packed record
+static const char *term_chars(const PredicateCompiledTerm *term, const Predicate *predicate, const char *packed,
+                              int *length) {
+    const char *chars = packed_chars(packed, predicate->ends_at, predicate->chars_at, term->slot, length);
+    if (term->coded) {
+        chars = dictionary_decode(predicate->dictionary, term->attr, chars, *length, length);
+    }
+    return chars;
+}
+
+// -1, 0 or 1 as the field compares with value, 2 if they do not order (NaN)
+static int term_cmp(const PredicateCompiledTerm *term, const Predicate *predicate, const char *packed,
+                    const FieldValue *value, int value_length) {
+    switch (term->type) {
+    case TYPE_INT: {
+        int field;
+        memcpy(&field, packed + term->offset, sizeof(int));
+        return (field > value->int_value) - (field < value->int_value);
+    }
+    case TYPE_FLOAT: {
+        float field;
+        memcpy(&field, packed + term->offset, sizeof(float));
+        if (field != field || value->float_value != value->float_value) return 2;
+        return (field > value->float_value) - (field < value->float_value);
+    }
+    default: {
+        int length;
+        const char *chars = term_chars(term, predicate, packed, &length);
+        int cmp = chars_cmp(chars, length, value->string_value, value_length);
+        return (cmp > 0) - (cmp < 0);
+    }
+    }
+}
+
+int predicate_match(const Predicate *predicate, const char *packed) {
+    for (int i = 0; i < predicate->count; i++) {
+        const PredicateCompiledTerm *term = &predicate->terms[i];
+        int cmp;
+        switch (term->op) {
+        case PRED_EQ:
+            if (term->coded) {
+                int length;
+                const char *field = packed_chars(packed, predicate->ends_at, predicate->chars_at, term->slot, &length);
+                if (length != term->code_length || memcmp(field, term->code, length) != 0) return 0;
+            } else if (term_cmp(term, predicate, packed, &term->value, term->value_length) != 0) {
+                return 0;
+            }
+            break;
+        case PRED_LT:
+            if (term_cmp(term, predicate, packed, &term->value, term->value_length) != -1) return 0;
+            break;
+        case PRED_GT:
+            if (term_cmp(term, predicate, packed, &term->value, term->value_length) != 1) return 0;
+            break;
+        case PRED_BETWEEN:
+            cmp = term_cmp(term, predicate, packed, &term->value, term->value_length);
+            if (cmp != 0 && cmp != 1) return 0;
+            cmp = term_cmp(term, predicate, packed, &term->high, term->high_length);
+            if (cmp != 0 && cmp != -1) return 0;
+            break;
+        case PRED_PREFIX: {
+            int length;
+            const char *chars = term_chars(term, predicate, packed, &length);
+            if (length < term->value_length || memcmp(chars, term->value.string_value, term->value_length) != 0) {
+                return 0;
+            }
+            break;
+        }
+        default:
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// key a record with value in the key attribute would have
+static int key_of(const KeyCodec *codec, const TableSchema *schema, const FieldValue *value) {
+    Record probe;
+    probe.values[schema->key_index] = *value;
+    return key_tree_key(codec, schema, &probe);
+}
+
+void predicate_key_range(const Predicate *predicate, const TableSchema *schema, int *lo, int *hi) {
+    // the schema of an open file, its key fits the tree
+    KeyCodec codec;
+    if (schema->key_index < 0 || key_codec_primary(&codec, schema) != 0 || codec.width > KEY_TREE_WIDTH) {
+        return;
+    }
+    for (int i = 0; i < predicate->count; i++) {
+        const PredicateCompiledTerm *term = &predicate->terms[i];
+        if (term->attr != schema->key_index) {
+            continue;
+        }
+        // keys order as the values do, equal values have equal keys
+        int from = INT_MIN;
+        int to = INT_MAX;
+        switch (term->op) {
+        case PRED_EQ:
+            from = to = key_of(&codec, schema, &term->value);
+            break;
+        case PRED_LT:
+            to = key_of(&codec, schema, &term->value);
+            if (to == INT_MIN) from = INT_MAX;   // nothing is below
+            else to--;
+            break;
+        case PRED_GT:
+            from = key_of(&codec, schema, &term->value);
+            if (from == INT_MAX) to = INT_MIN;
+            else from++;
+            break;
+        case PRED_BETWEEN:
+            from = key_of(&codec, schema, &term->value);
+            to = key_of(&codec, schema, &term->high);
+            break;
+        case PRED_PREFIX: {
+            // from the prefix padded with the lowest bytes to it padded
+            // with the highest
+            unsigned char normalized[KEY_MAX_WIDTH];
+            Record probe;
+            probe.values[schema->key_index] = term->value;
+            if (term->value_length > codec.width) {
+                from = INT_MAX;
+                to = INT_MIN;
+                break;
+            }
+            key_normalize(&codec, schema, &probe, normalized);
+            from = key_prefix(normalized, codec.width);
+            memset(normalized + term->value_length, 0xff, codec.width - term->value_length);
+            to = key_prefix(normalized, codec.width);
+            break;
+        }
+        default:
+            break;
+        }
+        if (from > *lo) *lo = from;
+        if (to < *hi) *hi = to;
+    }
+}
+
+int projection_compile(Projection *projection, const TableSchema *schema, const char *const *columns, int count) {
+    PackedLayout layout;
+    packed_layout(schema, &layout);
+    projection->count = 0;
+    projection->ends_at = layout.ends_at;
+    projection->chars_at = layout.chars_at;
+    projection->dictionary = NULL;
+    int total = columns ? count : schema->count;
+    if (total > MAX_ATTRIBUTES) {
+        printf("Error: a projection takes at most %d attributes\n", MAX_ATTRIBUTES);
+        return -1;
+    }
+    for (int i = 0; i < total; i++) {
+        int attr = columns ? attribute_index(schema, columns[i]) : i;
+        if (attr < 0) {
+            printf("Error: no attribute %s in schema\n", columns[i]);
+            return -1;
+        }
+        if (schema->attributes[attr].type == TYPE_NULL) {
+            continue;
+        }
+        int n = projection->count++;
+        projection->attrs[n] = attr;
+        projection->types[n] = schema->attributes[attr].type;
+        projection->offsets[n] = layout.offsets[attr];
+        projection->slots[n] = layout.slots[attr];
+    }
+    return 0;
+}
+
+void projection_bind(Projection *projection, const Dictionary *dictionary) {
+    projection->dictionary = dictionary;
+}
+
+void projection_copy(const Projection *projection, const char *packed, Record *record) {
+    for (int i = 0; i < projection->count; i++) {
+        FieldValue *field = &record->values[projection->attrs[i]];
+        if (projection->types[i] != TYPE_CHAR) {
+            memcpy(field, packed + projection->offsets[i], 4);
+            continue;
+        }
+        int length;
+        const char *chars = packed_chars(packed, projection->ends_at, projection->chars_at, projection->slots[i],
+                                         &length);
+        if (projection->dictionary && dictionary_coded(projection->dictionary, projection->attrs[i])) {
+            chars = dictionary_decode(projection->dictionary, projection->attrs[i], chars, length, &length);
+        }
+        memcpy(field->string_value, chars, length);
+        if (length < MAX_STRING_LENGTH) field->string_value[length] = '\0';
+    }
+}